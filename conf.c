@@ -23,16 +23,57 @@
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #define KIBOSH_CONF_OPT(t, p, v) { t, offsetof(struct kibosh_conf, p), v }
 
+/**
+ * The default number of FUSE worker threads to keep around.
+ */
+#define DEFAULT_MIN_THREADS 1
+
+/**
+ * The default maximum number of idle FUSE worker threads.  This is the same as the
+ * fuse_loop_mt limit.
+ */
+#define DEFAULT_MAX_IDLE_THREADS 10
+
+/**
+ * The default number of delay lane threads.
+ */
+#define DEFAULT_DELAY_THREADS 0
+
+/**
+ * The default maximum number of requests waiting for the delay lane.
+ */
+#define DEFAULT_DELAY_QUEUE_LEN 256
+
+/**
+ * The default maximum number of megabytes of unsynced writes to hold.
+ */
+#define DEFAULT_OVERLAY_MAX_MB 256
+
+/**
+ * The default maximum number of megabytes of pre-images to keep for stale reads.
+ */
+#define DEFAULT_STALE_MAX_MB 64
+
 static struct fuse_opt kibosh_command_line_options[] = {
      KIBOSH_CONF_OPT("--random-seed %d", random_seed, 0),
      KIBOSH_CONF_OPT("--pidfile %s", pidfile_path, 0),
      KIBOSH_CONF_OPT("--log %s", log_path, 0),
      KIBOSH_CONF_OPT("--target %s", target_path, 0),
      KIBOSH_CONF_OPT("--control-mode %o", control_mode, 0600),
+     KIBOSH_CONF_OPT("--min-threads %d", min_threads, 0),
+     KIBOSH_CONF_OPT("--max-threads %d", max_threads, 0),
+     KIBOSH_CONF_OPT("--max-idle-threads %d", max_idle_threads, 0),
+     KIBOSH_CONF_OPT("--cpus %s", cpus, 0),
+     KIBOSH_CONF_OPT("--delay-threads %d", delay_threads, 0),
+     KIBOSH_CONF_OPT("--delay-queue-len %d", delay_queue_len, 0),
+     KIBOSH_CONF_OPT("--control-socket %s", control_socket_path, 0),
+     KIBOSH_CONF_OPT("--overlay-max-mb %d", overlay_max_mb, 0),
+     KIBOSH_CONF_OPT("--stale-max-mb %d", stale_max_mb, 0),
      KIBOSH_CONF_OPT("-v", verbose, 1),
      KIBOSH_CONF_OPT("--verbose", verbose, 1),
      FUSE_OPT_KEY("-h", KIBOSH_CLI_GENERAL_HELP_KEY),
@@ -51,7 +92,17 @@ struct fuse_opt* get_kibosh_command_line_options(void)
 struct kibosh_conf *kibosh_conf_alloc(void)
 {
     struct kibosh_conf *conf;
-    return calloc(1, sizeof(*conf));
+
+    conf = calloc(1, sizeof(*conf));
+    if (!conf)
+        return NULL;
+    conf->min_threads = DEFAULT_MIN_THREADS;
+    conf->max_idle_threads = DEFAULT_MAX_IDLE_THREADS;
+    conf->delay_threads = DEFAULT_DELAY_THREADS;
+    conf->delay_queue_len = DEFAULT_DELAY_QUEUE_LEN;
+    conf->overlay_max_mb = DEFAULT_OVERLAY_MAX_MB;
+    conf->stale_max_mb = DEFAULT_STALE_MAX_MB;
+    return conf;
 }
 
 void kibosh_conf_free(struct kibosh_conf *conf)
@@ -60,6 +111,8 @@ void kibosh_conf_free(struct kibosh_conf *conf)
         free(conf->pidfile_path);
         free(conf->log_path);
         free(conf->target_path);
+        free(conf->cpus);
+        free(conf->control_socket_path);
         free(conf);
     }
 }
@@ -105,12 +158,58 @@ int kibosh_conf_reify(struct kibosh_conf *conf)
     if (ret < 0)
         return ret;
     ret = absolutize(&conf->target_path);
+    if (ret < 0)
+        return ret;
+    ret = absolutize(&conf->control_socket_path);
     if (ret < 0)
         return ret;
     if (!conf->target_path) {
         INFO("You must supply a target path.  Type --help for help.\n");
         return -EINVAL;
     }
+    if (conf->min_threads < 1) {
+        INFO("There must be at least one worker thread.\n");
+        return -EINVAL;
+    }
+    if (conf->max_threads < 0 ||
+            (conf->max_threads > 0 && conf->max_threads < conf->min_threads)) {
+        INFO("The maximum number of worker threads must be 0 (unlimited), or at least "
+             "the minimum number of worker threads.\n");
+        return -EINVAL;
+    }
+    if (conf->max_idle_threads < 0) {
+        INFO("The maximum number of idle worker threads cannot be negative.\n");
+        return -EINVAL;
+    }
+    if (conf->cpus) {
+        if (parse_cpu_list(conf->cpus, &conf->cpu_set) < 0) {
+            INFO("Unable to parse CPU list \"%s\".\n", conf->cpus);
+            return -EINVAL;
+        }
+    } else {
+        CPU_ZERO(&conf->cpu_set);
+    }
+    if (conf->delay_threads < 0) {
+        INFO("The number of delay threads cannot be negative.\n");
+        return -EINVAL;
+    }
+    if (conf->delay_queue_len < 1) {
+        INFO("The delay queue length must be at least 1.\n");
+        return -EINVAL;
+    }
+    if (conf->control_socket_path &&
+            strlen(conf->control_socket_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        INFO("The control socket path \"%s\" is too long.\n", conf->control_socket_path);
+        return -ENAMETOOLONG;
+    }
+    if (conf->overlay_max_mb < 1) {
+        INFO("The overlay must be allowed to hold at least 1 megabyte.\n");
+        return -EINVAL;
+    }
+    if (conf->stale_max_mb < 1) {
+        INFO("At least 1 megabyte of pre-images must be allowed for stale reads.\n");
+        return -EINVAL;
+    }
     return 0;
 }
 
@@ -127,14 +226,32 @@ char *kibosh_conf_to_str(const struct kibosh_conf *conf)
         "target_path=%s%s%s, "
         "control_mode=0%03o, "
         "random_seed=%ld, "
-        "verbose=%d"
+        "verbose=%d, "
+        "min_threads=%d, "
+        "max_threads=%d, "
+        "max_idle_threads=%d, "
+        "cpus=%s%s%s, "
+        "delay_threads=%d, "
+        "delay_queue_len=%d, "
+        "control_socket_path=%s%s%s, "
+        "overlay_max_mb=%d, "
+        "stale_max_mb=%d"
         "}",
         STR_PARAMS(conf->pidfile_path),
         STR_PARAMS(conf->log_path),
         STR_PARAMS(conf->target_path),
         conf->control_mode,
         conf->random_seed,
-        conf->verbose);
+        conf->verbose,
+        conf->min_threads,
+        conf->max_threads,
+        conf->max_idle_threads,
+        STR_PARAMS(conf->cpus),
+        conf->delay_threads,
+        conf->delay_queue_len,
+        STR_PARAMS(conf->control_socket_path),
+        conf->overlay_max_mb,
+        conf->stale_max_mb);
 }
 
 // vim: ts=4:sw=4:tw=99:et
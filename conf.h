@@ -18,6 +18,7 @@
 #define KIBOSH_CONF_H
 
 #include <fuse.h> // for fuse_opt
+#include <sched.h> // for cpu_set_t
 
 struct kibosh_conf {
     /**
@@ -50,6 +51,63 @@ struct kibosh_conf {
      * Seed for random functions.
      */
     long int random_seed;
+
+    /**
+     * The number of FUSE worker threads to start with, and to keep around when idle.
+     */
+    int min_threads;
+
+    /**
+     * The maximum number of FUSE worker threads, or 0 for no limit.  This does not include
+     * delay threads.
+     */
+    int max_threads;
+
+    /**
+     * The maximum number of idle FUSE worker threads.  Idle threads beyond this, and beyond
+     * min_threads, exit.
+     */
+    int max_idle_threads;
+
+    /**
+     * The list of CPUs to run on, such as "0-3,8", or NULL to run anywhere.  Malloced.
+     */
+    char *cpus;
+
+    /**
+     * The parsed form of cpus.  Empty if cpus is NULL.  Filled in by kibosh_conf_reify.
+     */
+    cpu_set_t cpu_set;
+
+    /**
+     * The number of threads which service requests that may hit a delay fault, or 0 to
+     * service them on the regular FUSE worker threads.
+     */
+    int delay_threads;
+
+    /**
+     * The maximum number of requests which can be waiting for a delay thread.  Once this
+     * is reached, the threads which receive further delayed requests wait for room.
+     */
+    int delay_queue_len;
+
+    /**
+     * The path of the unix domain socket to accept control connections on, or NULL if
+     * there is no control socket.  Malloced.
+     */
+    char *control_socket_path;
+
+    /**
+     * The maximum number of megabytes of unsynced writes to hold in memory for lost_write
+     * faults.  See overlay.h.
+     */
+    int overlay_max_mb;
+
+    /**
+     * The maximum number of megabytes of pre-images to keep in memory for stale_read
+     * faults.  See stale.h.
+     */
+    int stale_max_mb;
 };
 
 enum kibosh_option_ty {
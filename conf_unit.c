@@ -20,6 +20,7 @@
 #include "util.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -72,6 +73,46 @@ static int test_kibosh_conf_reify(const char *cwd)
     free(expected_pidfile);
     free(expected_log);
 
+    // Worker thread limits are checked.
+    conf->max_threads = 4;
+    conf->min_threads = 8;
+    EXPECT_INT_EQ(-EINVAL, kibosh_conf_reify(conf));
+    conf->min_threads = 2;
+    EXPECT_INT_EQ(0, kibosh_conf_reify(conf));
+
+    // The CPU list is parsed.
+    conf->cpus = strdup("1-2");
+    EXPECT_NONNULL(conf->cpus);
+    EXPECT_INT_EQ(0, kibosh_conf_reify(conf));
+    EXPECT_INT_EQ(2, CPU_COUNT(&conf->cpu_set));
+    free(conf->cpus);
+    conf->cpus = strdup("1-");
+    EXPECT_NONNULL(conf->cpus);
+    EXPECT_INT_EQ(-EINVAL, kibosh_conf_reify(conf));
+    free(conf->cpus);
+    conf->cpus = NULL;
+
+    // The control socket path must fit in a sockaddr_un.
+    conf->control_socket_path = calloc(1, PATH_MAX);
+    EXPECT_NONNULL(conf->control_socket_path);
+    memset(conf->control_socket_path, 'a', PATH_MAX - 1);
+    conf->control_socket_path[0] = '/';
+    EXPECT_INT_EQ(-ENAMETOOLONG, kibosh_conf_reify(conf));
+    free(conf->control_socket_path);
+    conf->control_socket_path = strdup("/tmp/kibosh.sock");
+    EXPECT_NONNULL(conf->control_socket_path);
+    EXPECT_INT_EQ(0, kibosh_conf_reify(conf));
+
+    // The overlay must be able to hold something.
+    conf->overlay_max_mb = 0;
+    EXPECT_INT_EQ(-EINVAL, kibosh_conf_reify(conf));
+    conf->overlay_max_mb = 1;
+    EXPECT_INT_EQ(0, kibosh_conf_reify(conf));
+    conf->stale_max_mb = 0;
+    EXPECT_INT_EQ(-EINVAL, kibosh_conf_reify(conf));
+    conf->stale_max_mb = 1;
+    EXPECT_INT_EQ(0, kibosh_conf_reify(conf));
+
     kibosh_conf_free(conf);
     return 0;
 }
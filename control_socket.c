@@ -0,0 +1,528 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "control_socket.h"
+#include "fs.h"
+#include "io.h"
+#include "log.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * The maximum number of control connections which can be open at once.
+ */
+#define MAX_CONTROL_CLIENTS 16
+
+/**
+ * The maximum length of a request line.
+ */
+#define MAX_CONTROL_LINE_LEN (64 * 1024 * 1024)
+
+/**
+ * The initial size of a connection's read buffer.
+ */
+#define CONTROL_CLIENT_BUF_LEN 4096
+
+struct control_client {
+    /**
+     * The connection fd, or -1 if this slot is unused.
+     */
+    int fd;
+
+    /**
+     * The buffer holding data which has been read, but not yet handled.
+     */
+    char *buf;
+
+    /**
+     * The number of bytes in buf.
+     */
+    size_t len;
+
+    /**
+     * The size of buf.
+     */
+    size_t cap;
+
+    /**
+     * The buffer holding responses which have not been sent yet.
+     */
+    char *out;
+
+    /**
+     * The number of bytes in out.
+     */
+    size_t out_len;
+
+    /**
+     * The number of bytes at the start of out which have already been sent.
+     */
+    size_t out_off;
+};
+
+struct control_socket_thread {
+    pthread_t pthread;
+    struct kibosh_fs *fs;
+    char *path;
+    int listen_fd;
+    int wake_fds[2];
+    struct control_client clients[MAX_CONTROL_CLIENTS];
+};
+
+/**
+ * Check whether a fault ID can be used in a request.  IDs are pasted into JSON, so
+ * they may not contain quotes, backslashes, or control characters.
+ */
+static int control_id_is_valid(const char *id)
+{
+    const char *c;
+
+    if (!id[0]) {
+        return 0;
+    }
+    for (c = id; *c; c++) {
+        if ((*c == '"') || (*c == '\\') || ((unsigned char)*c <= ' ')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static char *control_socket_error(int err)
+{
+    return dynprintf("error %d %s", err, safe_strerror(err));
+}
+
+char *control_socket_handle(struct kibosh_fs *fs, const char *line)
+{
+    struct kibosh_control_snapshot *snapshot;
+    const char *args, *space;
+    char *json = NULL, *id = NULL, *resp;
+    size_t cmd_len;
+    int ret;
+
+    space = strchr(line, ' ');
+    cmd_len = space ? (size_t)(space - line) : strlen(line);
+    args = space ? space + 1 : "";
+    if ((cmd_len == 5) && (strncmp(line, "query", cmd_len) == 0)) {
+        snapshot = kibosh_fs_snapshot_get(fs);
+        resp = dynprintf("ok %s", snapshot->json);
+        kibosh_fs_snapshot_put(snapshot);
+        return resp;
+    } else if ((cmd_len == 5) && (strncmp(line, "stats", cmd_len) == 0)) {
+        json = kibosh_fs_fault_stats(fs);
+        if (!json) {
+            return control_socket_error(ENOMEM);
+        }
+        resp = dynprintf("ok %s", json);
+        free(json);
+        return resp;
+    } else if ((cmd_len == 3) && (strncmp(line, "set", cmd_len) == 0)) {
+        ret = kibosh_fs_update_faults(fs, args);
+    } else if ((cmd_len == 3) && (strncmp(line, "add", cmd_len) == 0)) {
+        json = dynprintf("{\"ops\":[{\"op\":\"add\", \"fault\":%s}]}", args);
+        if (!json) {
+            return control_socket_error(ENOMEM);
+        }
+        ret = kibosh_fs_update_faults(fs, json);
+    } else if ((cmd_len == 6) && (strncmp(line, "remove", cmd_len) == 0)) {
+        if (!control_id_is_valid(args)) {
+            return control_socket_error(EINVAL);
+        }
+        json = dynprintf("{\"ops\":[{\"op\":\"remove\", \"id\":\"%s\"}]}", args);
+        if (!json) {
+            return control_socket_error(ENOMEM);
+        }
+        ret = kibosh_fs_update_faults(fs, json);
+    } else if ((cmd_len == 5) && (strncmp(line, "crash", cmd_len) == 0)) {
+        json = dynprintf("{\"crash\":%s}", args[0] ? args : "{}");
+        if (!json) {
+            return control_socket_error(ENOMEM);
+        }
+        ret = kibosh_fs_update_faults(fs, json);
+    } else if ((cmd_len == 6) && (strncmp(line, "update", cmd_len) == 0)) {
+        space = strchr(args, ' ');
+        if (!space) {
+            return control_socket_error(EINVAL);
+        }
+        id = strndup(args, space - args);
+        if (!id) {
+            return control_socket_error(ENOMEM);
+        }
+        if (!control_id_is_valid(id)) {
+            free(id);
+            return control_socket_error(EINVAL);
+        }
+        json = dynprintf("{\"ops\":[{\"op\":\"update\", \"id\":\"%s\", \"fault\":%s}]}",
+                         id, space + 1);
+        free(id);
+        if (!json) {
+            return control_socket_error(ENOMEM);
+        }
+        ret = kibosh_fs_update_faults(fs, json);
+    } else {
+        ret = -EINVAL;
+    }
+    free(json);
+    if (ret < 0) {
+        return control_socket_error(-ret);
+    }
+    return strdup("ok");
+}
+
+static void control_client_close(struct control_client *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    free(client->buf);
+    client->buf = NULL;
+    client->len = 0;
+    client->cap = 0;
+    free(client->out);
+    client->out = NULL;
+    client->out_len = 0;
+    client->out_off = 0;
+}
+
+/**
+ * Queue a response to be sent on a control connection.
+ *
+ * @param client    The connection.
+ * @param resp      The response, or NULL on OOM.  This will be freed.
+ *
+ * @return          0 on success; -ENOMEM on OOM.
+ */
+static int control_client_respond(struct control_client *client, char *resp)
+{
+    size_t len;
+    char *out;
+
+    if (!resp) {
+        return -ENOMEM;
+    }
+    len = strlen(resp);
+    out = realloc(client->out, client->out_len + len + 1);
+    if (!out) {
+        free(resp);
+        return -ENOMEM;
+    }
+    memcpy(out + client->out_len, resp, len);
+    out[client->out_len + len] = '\n';
+    client->out = out;
+    client->out_len += len + 1;
+    free(resp);
+    return 0;
+}
+
+/**
+ * Send as much of the queued responses on a control connection as we can without
+ * blocking.  Clients which stop reading their responses only hold up themselves.
+ *
+ * @return          0 if the connection should stay open; a negative error code otherwise.
+ */
+static int control_client_flush(struct control_client *client)
+{
+    ssize_t res;
+
+    while (client->out_off < client->out_len) {
+        res = send(client->fd, client->out + client->out_off,
+                   client->out_len - client->out_off, MSG_NOSIGNAL);
+        if (res < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+                return 0;
+            }
+            return -errno;
+        }
+        client->out_off += res;
+    }
+    free(client->out);
+    client->out = NULL;
+    client->out_len = 0;
+    client->out_off = 0;
+    return 0;
+}
+
+/**
+ * Read from a control connection, and handle any complete requests.
+ *
+ * @return          0 if the connection should stay open; a negative error code otherwise.
+ */
+static int control_client_read(struct control_socket_thread *thread,
+                               struct control_client *client)
+{
+    char *new_buf, *start, *end;
+    ssize_t res;
+    int ret;
+
+    if (client->cap - client->len < CONTROL_CLIENT_BUF_LEN) {
+        if (client->cap >= MAX_CONTROL_LINE_LEN) {
+            INFO("control_client_read: request line is too long.\n");
+            if (control_client_respond(client, control_socket_error(E2BIG)) == 0) {
+                control_client_flush(client);
+            }
+            return -E2BIG;
+        }
+        new_buf = realloc(client->buf, client->cap ? client->cap * 2 : CONTROL_CLIENT_BUF_LEN);
+        if (!new_buf) {
+            return -ENOMEM;
+        }
+        client->buf = new_buf;
+        client->cap = client->cap ? client->cap * 2 : CONTROL_CLIENT_BUF_LEN;
+    }
+    res = read(client->fd, client->buf + client->len, client->cap - client->len - 1);
+    if (res < 0) {
+        return ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -errno;
+    } else if (res == 0) {
+        return -EPIPE;
+    }
+    client->len += res;
+    client->buf[client->len] = '\0';
+    start = client->buf;
+    while ((end = memchr(start, '\n', client->len - (start - client->buf)))) {
+        *end = '\0';
+        if ((end > start) && (end[-1] == '\r')) {
+            end[-1] = '\0';
+        }
+        ret = control_client_respond(client, control_socket_handle(thread->fs, start));
+        if (ret < 0) {
+            return ret;
+        }
+        start = end + 1;
+    }
+    client->len -= (start - client->buf);
+    memmove(client->buf, start, client->len);
+    return control_client_flush(client);
+}
+
+static void control_socket_accept(struct control_socket_thread *thread)
+{
+    int i, fd;
+
+    fd = accept4(thread->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0) {
+        if (errno != EINTR) {
+            INFO("control_socket_accept: accept failed: %s (%d)\n",
+                 safe_strerror(errno), errno);
+        }
+        return;
+    }
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (thread->clients[i].fd < 0) {
+            thread->clients[i].fd = fd;
+            return;
+        }
+    }
+    INFO("control_socket_accept: too many control connections.\n");
+    close(fd);
+}
+
+static void *control_socket_thread_run(void *arg)
+{
+    struct control_socket_thread *thread = (struct control_socket_thread *)arg;
+    struct pollfd fds[MAX_CONTROL_CLIENTS + 2];
+    int client_idx[MAX_CONTROL_CLIENTS + 2];
+    int i, num_fds, ret;
+
+    INFO("control_socket_thread: listening on %s.\n", thread->path);
+    while (1) {
+        fds[0].fd = thread->wake_fds[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = thread->listen_fd;
+        fds[1].events = POLLIN;
+        num_fds = 2;
+        for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+            if (thread->clients[i].fd >= 0) {
+                // We stop reading requests from a client until it has read the
+                // responses to the earlier ones.
+                fds[num_fds].fd = thread->clients[i].fd;
+                fds[num_fds].events = thread->clients[i].out_len ? POLLOUT : POLLIN;
+                client_idx[num_fds] = i;
+                num_fds++;
+            }
+        }
+        ret = poll(fds, num_fds, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            INFO("control_socket_thread: poll failed: %s (%d)\n",
+                 safe_strerror(errno), errno);
+            break;
+        }
+        if (fds[0].revents) {
+            break;
+        }
+        for (i = 2; i < num_fds; i++) {
+            struct control_client *client = &thread->clients[client_idx[i]];
+            if (!fds[i].revents) {
+                continue;
+            }
+            if (client->out_len) {
+                ret = control_client_flush(client);
+            } else {
+                ret = control_client_read(thread, client);
+            }
+            if (ret < 0) {
+                DEBUG("control_socket_thread: closing connection: %s (%d)\n",
+                      safe_strerror(-ret), -ret);
+                control_client_close(client);
+            }
+        }
+        if (fds[1].revents & POLLIN) {
+            control_socket_accept(thread);
+        }
+    }
+    INFO("control_socket_thread: exiting.\n");
+    return NULL;
+}
+
+struct control_socket_thread *control_socket_thread_start(const char *path,
+                                                          struct kibosh_fs *fs)
+{
+    struct control_socket_thread *thread = NULL;
+    struct sockaddr_un addr;
+    mode_t old_umask;
+    int i, ret;
+
+    thread = calloc(sizeof(struct control_socket_thread), 1);
+    if (!thread) {
+        INFO("control_socket_thread_start: OOM\n");
+        goto error;
+    }
+    thread->fs = fs;
+    thread->listen_fd = -1;
+    thread->wake_fds[0] = -1;
+    thread->wake_fds[1] = -1;
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        thread->clients[i].fd = -1;
+    }
+    thread->path = strdup(path);
+    if (!thread->path) {
+        INFO("control_socket_thread_start: OOM\n");
+        goto error;
+    }
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        INFO("control_socket_thread_start: path %s is too long.\n", path);
+        goto error_free_path;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (pipe2(thread->wake_fds, O_CLOEXEC) < 0) {
+        ret = errno;
+        INFO("control_socket_thread_start: failed to create pipe: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_free_path;
+    }
+    thread->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (thread->listen_fd < 0) {
+        ret = errno;
+        INFO("control_socket_thread_start: failed to create socket: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_close_fds;
+    }
+    if ((unlink(path) < 0) && (errno != ENOENT)) {
+        ret = errno;
+        INFO("control_socket_thread_start: failed to remove old socket %s: %s (%d)\n",
+             path, safe_strerror(ret), ret);
+        goto error_close_fds;
+    }
+    // Until we chmod it, only we may connect to the socket.  Otherwise, anyone could
+    // change faults in between, since kibosh runs with a umask of 0.  This runs before
+    // FUSE services any other request, so nothing else creates files while the umask is
+    // changed.
+    old_umask = umask(077);
+    ret = bind(thread->listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(old_umask);
+    if (ret < 0) {
+        ret = errno;
+        INFO("control_socket_thread_start: failed to bind to %s: %s (%d)\n",
+             path, safe_strerror(ret), ret);
+        goto error_close_fds;
+    }
+    // The socket gets the same permissions as the control file.
+    if (chmod(path, fs->control_mode) < 0) {
+        ret = errno;
+        INFO("control_socket_thread_start: failed to chmod %s: %s (%d)\n",
+             path, safe_strerror(ret), ret);
+        goto error_unlink;
+    }
+    if (listen(thread->listen_fd, MAX_CONTROL_CLIENTS) < 0) {
+        ret = errno;
+        INFO("control_socket_thread_start: failed to listen on %s: %s (%d)\n",
+             path, safe_strerror(ret), ret);
+        goto error_unlink;
+    }
+    ret = pthread_create(&thread->pthread, NULL, control_socket_thread_run, thread);
+    if (ret) {
+        INFO("control_socket_thread_start: failed to create thread: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_unlink;
+    }
+    return thread;
+
+error_unlink:
+    unlink(path);
+error_close_fds:
+    if (thread->listen_fd >= 0) {
+        close(thread->listen_fd);
+    }
+    if (thread->wake_fds[0] >= 0) {
+        close(thread->wake_fds[0]);
+        close(thread->wake_fds[1]);
+    }
+error_free_path:
+    free(thread->path);
+error:
+    free(thread);
+    return NULL;
+}
+
+void control_socket_thread_join(struct control_socket_thread *thread)
+{
+    int i;
+
+    if (safe_write(thread->wake_fds[1], "x", 1) < 0) {
+        abort();
+    }
+    pthread_join(thread->pthread, NULL);
+    for (i = 0; i < MAX_CONTROL_CLIENTS; i++) {
+        if (thread->clients[i].fd >= 0) {
+            control_client_close(&thread->clients[i]);
+        }
+    }
+    close(thread->listen_fd);
+    close(thread->wake_fds[0]);
+    close(thread->wake_fds[1]);
+    unlink(thread->path);
+    free(thread->path);
+    free(thread);
+}
+
+// vim: ts=4:sw=4:tw=99:et
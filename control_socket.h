@@ -0,0 +1,76 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_CONTROL_SOCKET_H
+#define KIBOSH_CONTROL_SOCKET_H
+
+/*
+ * The Kibosh control socket.
+ *
+ * This is an optional unix domain socket which can be used to change faults without going
+ * through the control file.  The protocol is line-based.  Each request is a single line,
+ * and gets a single line in response.
+ *
+ *   set <json>             Replace the faults with the given control JSON.
+ *   add <fault json>       Add a fault.
+ *   remove <id>            Remove the fault with the given ID.
+ *   update <id> <json>     Change some fields of the fault with the given ID.
+ *   query                  Get the current control JSON.
+ *   stats                  Get the current faults, including how many times each one has
+ *                          been injected.
+ *   crash [<json>]         Throw away unsynced writes, as if the machine crashed.  The
+ *                          optional JSON is the body of a crash request; see overlay.h.
+ *
+ * The response is "ok", "ok <json>" for a query or stats request, or
+ * "error <code> <message>".  Changes are applied in the same way as writes to the control
+ * file.
+ */
+
+struct kibosh_fs;
+struct control_socket_thread;
+
+/**
+ * Start the control socket thread.
+ *
+ * @param path      The path to listen on.  Any existing socket at this path is removed.
+ * @param fs        The kibosh_fs to control.
+ *
+ * @return          The thread, or NULL on error.
+ */
+struct control_socket_thread *control_socket_thread_start(const char *path,
+                                                          struct kibosh_fs *fs);
+
+/**
+ * Stop the control socket thread, close all connections, and remove the socket.
+ *
+ * @param thread    The thread.
+ */
+void control_socket_thread_join(struct control_socket_thread *thread);
+
+/**
+ * Handle a single control socket request.
+ *
+ * @param fs        The kibosh_fs.
+ * @param line      The request line, without the trailing newline.
+ *
+ * @return          The dynamically allocated response line, without the trailing
+ *                  newline, or NULL on OOM.
+ */
+char *control_socket_handle(struct kibosh_fs *fs, const char *line);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
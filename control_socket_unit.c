@@ -0,0 +1,279 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "conf.h"
+#include "control_socket.h"
+#include "fault.h"
+#include "fs.h"
+#include "io.h"
+#include "log.h"
+#include "test.h"
+#include "time.h"
+#include "util.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static struct kibosh_fs *alloc_test_fs(const char *control_socket_path)
+{
+    struct kibosh_conf *conf;
+    struct kibosh_fs *fs = NULL;
+
+    conf = kibosh_conf_alloc();
+    if (!conf)
+        abort();
+    conf->target_path = strdup("/");
+    if (!conf->target_path)
+        abort();
+    if (control_socket_path) {
+        conf->control_socket_path = strdup(control_socket_path);
+        if (!conf->control_socket_path)
+            abort();
+    }
+    conf->control_mode = 0600;
+    if (kibosh_fs_alloc(&fs, conf))
+        abort();
+    kibosh_conf_free(conf);
+    return fs;
+}
+
+#define EXPECT_RESPONSE(fs, expected, line) \
+    do { \
+        char *__resp = control_socket_handle(fs, line); \
+        EXPECT_NONNULL(__resp); \
+        EXPECT_STR_EQ(expected, __resp); \
+        free(__resp); \
+    } while (0);
+
+static int test_control_socket_handle(void)
+{
+    struct kibosh_fs *fs = alloc_test_fs(NULL);
+
+    EXPECT_RESPONSE(fs, "ok {\"faults\":[]}", "query");
+    EXPECT_RESPONSE(fs, "ok", "add {\"id\":\"a\", \"type\":\"unreadable\", \"code\":5}");
+    EXPECT_RESPONSE(fs, "ok", "add {\"id\":\"b\", \"type\":\"unwritable\", \"code\":6}");
+    EXPECT_RESPONSE(fs, "ok", "update a {\"code\":7}");
+    EXPECT_RESPONSE(fs, "ok", "remove b");
+    EXPECT_RESPONSE(fs, "ok {\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+                    "\"prefix\":\"/\", \"suffix\":\"\", \"code\":7}]}", "query");
+    EXPECT_RESPONSE(fs, "ok {\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+                    "\"prefix\":\"/\", \"suffix\":\"\", \"code\":7, "
+                    "\"state\":{\"hits\":0, \"count\":-1}}]}", "stats");
+    EXPECT_RESPONSE(fs, "error 2 No such file or directory", "remove b");
+    EXPECT_RESPONSE(fs, "error 17 File exists",
+                    "add {\"id\":\"a\", \"type\":\"unreadable\", \"code\":5}");
+    EXPECT_RESPONSE(fs, "error 22 Invalid argument", "remove a\"");
+    EXPECT_RESPONSE(fs, "error 22 Invalid argument", "frobnicate");
+    EXPECT_RESPONSE(fs, "ok", "set {\"faults\":[]}");
+    EXPECT_RESPONSE(fs, "ok {\"faults\":[]}", "query");
+    EXPECT_RESPONSE(fs, "ok", "crash");
+    EXPECT_RESPONSE(fs, "ok", "crash {\"fraction\":0.5}");
+    EXPECT_RESPONSE(fs, "error 22 Invalid argument", "crash {\"fraction\":2.0}");
+    // A crash does not change the faults.
+    EXPECT_RESPONSE(fs, "ok {\"faults\":[]}", "query");
+    kibosh_fs_free(fs);
+    return 0;
+}
+
+static int test_control_snapshot(void)
+{
+    struct kibosh_fs *fs = alloc_test_fs(NULL);
+    struct kibosh_control_snapshot *snapshot;
+    struct stat st;
+
+    snapshot = kibosh_fs_snapshot_get(fs);
+    EXPECT_STR_EQ("{\"faults\":[]}", snapshot->json);
+    EXPECT_RESPONSE(fs, "ok", "add {\"id\":\"a\", \"type\":\"unreadable\", \"code\":5}");
+    // The old snapshot is not changed by the update.
+    EXPECT_STR_EQ("{\"faults\":[]}", snapshot->json);
+    kibosh_fs_snapshot_stat(fs, snapshot, &st);
+    EXPECT_INT_EQ(strlen("{\"faults\":[]}"), st.st_size);
+    kibosh_fs_snapshot_put(snapshot);
+
+    EXPECT_INT_ZERO(kibosh_fs_control_stat(fs, &st));
+    EXPECT_INT_EQ(S_IFREG | 0600, st.st_mode);
+    snapshot = kibosh_fs_snapshot_get(fs);
+    EXPECT_INT_EQ(snapshot->len, st.st_size);
+    EXPECT_INT_EQ(strlen(snapshot->json), snapshot->len);
+    kibosh_fs_snapshot_put(snapshot);
+    kibosh_fs_free(fs);
+    return 0;
+}
+
+static int test_control_may_delay(void)
+{
+    struct kibosh_fs *fs = alloc_test_fs(NULL);
+    struct kibosh_control_snapshot *snapshot;
+
+    EXPECT_INT_ZERO(kibosh_fs_may_delay(fs, "/a.log", KIBOSH_OP_READ));
+    EXPECT_RESPONSE(fs, "ok", "add {\"id\":\"a\", \"type\":\"read_delay\", "
+                    "\"suffix\":\".log\", \"delay_ms\":100, \"fraction\":1.0}");
+    EXPECT_INT_EQ(1, kibosh_fs_may_delay(fs, "/a.log", KIBOSH_OP_READ));
+    EXPECT_INT_ZERO(kibosh_fs_may_delay(fs, "/a.index", KIBOSH_OP_READ));
+    // The faults of an old snapshot stay usable for as long as it is referenced.
+    snapshot = kibosh_fs_snapshot_get(fs);
+    EXPECT_RESPONSE(fs, "ok", "remove a");
+    EXPECT_INT_ZERO(kibosh_fs_may_delay(fs, "/a.log", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(1, faults_may_delay(snapshot->faults, "/a.log", KIBOSH_OP_READ));
+    kibosh_fs_snapshot_put(snapshot);
+    kibosh_fs_free(fs);
+    return 0;
+}
+
+static int test_control_scenario(void)
+{
+    struct kibosh_fs *fs = alloc_test_fs(NULL);
+    struct kibosh_control_snapshot *snapshot;
+    int done;
+
+    EXPECT_RESPONSE(fs, "ok", "set {\"scenario\":{\"steps\":["
+                    "{\"at_ms\":0, \"faults\":[{\"type\":\"unreadable\", \"code\":5}]}, "
+                    "{\"at_ms\":20, \"ops\":[{\"op\":\"add\", \"fault\":{\"id\":\"b\", "
+                        "\"type\":\"unwritable\", \"code\":6}}]}, "
+                    "{\"at_ms\":3600000, \"faults\":[]}]}}");
+    do {
+        milli_sleep(1);
+        snapshot = kibosh_fs_snapshot_get(fs);
+        done = (strstr(snapshot->json, "unwritable") != NULL);
+        kibosh_fs_snapshot_put(snapshot);
+    } while (!done);
+    EXPECT_RESPONSE(fs, "ok {\"faults\":[{\"type\":\"unreadable\", \"prefix\":\"/\", "
+                    "\"suffix\":\"\", \"code\":5}, {\"id\":\"b\", \"type\":\"unwritable\", "
+                    "\"prefix\":\"/\", \"suffix\":\"\", \"code\":6}]}", "query");
+    EXPECT_RESPONSE(fs, "error 5 Input/output error", "set {\"scenario\":{\"steps\":["
+                    "{\"at_ms\":0, \"faults\":[{\"type\":\"bogus\"}]}]}}");
+    EXPECT_RESPONSE(fs, "ok", "set {\"scenario\":null}");
+    // Freeing the fs stops the scenario thread without waiting for the last step.
+    kibosh_fs_free(fs);
+    return 0;
+}
+
+static int test_control_socket_thread(void)
+{
+    char path[PATH_MAX], resp[256] = { 0 };
+    struct sockaddr_un addr;
+    struct kibosh_fs *fs;
+    const char *req = "add {\"id\":\"a\", \"type\":\"unreadable\", \"code\":5}\nquery\n";
+    const char *expected = "ok\nok {\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+                           "\"prefix\":\"/\", \"suffix\":\"\", \"code\":5}]}\n";
+    struct stat st;
+    size_t len = 0;
+    ssize_t res;
+    int fd;
+
+    snprintf(path, sizeof(path), "/tmp/control_socket_unit.%d.sock", getpid());
+    fs = alloc_test_fs(path);
+    fs->control_socket_thread = control_socket_thread_start(path, fs);
+    EXPECT_NONNULL(fs->control_socket_thread);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    EXPECT_INT_NONNEGATIVE(fd);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    EXPECT_POSIX_SUCC(connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    EXPECT_INT_ZERO(safe_write(fd, req, strlen(req)));
+    while (len < strlen(expected)) {
+        res = read(fd, resp + len, sizeof(resp) - len - 1);
+        EXPECT_INT_GT(res, 0);
+        len += res;
+    }
+    EXPECT_STR_EQ(expected, resp);
+    EXPECT_POSIX_SUCC(close(fd));
+    EXPECT_POSIX_SUCC(stat(path, &st));
+    EXPECT_INT_EQ(0600, st.st_mode & 0777);
+
+    kibosh_fs_free(fs);
+    EXPECT_POSIX_FAIL(access(path, F_OK), ENOENT);
+    return 0;
+}
+
+static int connect_control_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    die_if(fd < 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    die_if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0);
+    return fd;
+}
+
+static int test_control_socket_stalled_client(void)
+{
+    char path[PATH_MAX], resp[64] = { 0 };
+    struct kibosh_fs *fs;
+    const char *expected = "ok {\"faults\":[]}\n";
+    size_t i, len = 0, num = 20000;
+    char *reqs;
+    ssize_t res;
+    int fd1, fd2;
+
+    snprintf(path, sizeof(path), "/tmp/control_socket_unit.%d.sock", getpid());
+    fs = alloc_test_fs(path);
+    fs->control_socket_thread = control_socket_thread_start(path, fs);
+    EXPECT_NONNULL(fs->control_socket_thread);
+
+    // The first client sends far more requests than the responses to them can fit in
+    // the socket buffer, and never reads any of them.
+    reqs = malloc(num * 6);
+    EXPECT_NONNULL(reqs);
+    for (i = 0; i < num; i++) {
+        memcpy(reqs + (i * 6), "query\n", 6);
+    }
+    fd1 = connect_control_socket(path);
+    EXPECT_INT_ZERO(safe_write(fd1, reqs, num * 6));
+    free(reqs);
+
+    // The second client is still served.
+    fd2 = connect_control_socket(path);
+    EXPECT_INT_ZERO(safe_write(fd2, "query\n", 6));
+    while (len < strlen(expected)) {
+        res = read(fd2, resp + len, sizeof(resp) - len - 1);
+        EXPECT_INT_GT(res, 0);
+        len += res;
+    }
+    EXPECT_STR_EQ(expected, resp);
+    EXPECT_POSIX_SUCC(close(fd2));
+    EXPECT_POSIX_SUCC(close(fd1));
+
+    kibosh_fs_free(fs);
+    return 0;
+}
+
+int main(void)
+{
+    kibosh_log_init(stdout, 0);
+    EXPECT_INT_ZERO(test_control_socket_handle());
+    EXPECT_INT_ZERO(test_control_snapshot());
+    EXPECT_INT_ZERO(test_control_may_delay());
+    EXPECT_INT_ZERO(test_control_scenario());
+    EXPECT_INT_ZERO(test_control_socket_thread());
+    EXPECT_INT_ZERO(test_control_socket_stalled_client());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -15,189 +15,244 @@
  **/
 
 #include "fault.h"
-#include "json.h"
+#include "json_reader.h"
+#include "json_writer.h"
 #include "log.h"
+#include "pattern.h"
 #include "time.h"
 #include "util.h"
 
+#include <dirent.h>
 #include <errno.h>
-#include <inttypes.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-/////
-///// kibosh_fault_unreadable
-/////
-static void kibosh_fault_unreadable_free(struct kibosh_fault_unreadable *fault)
+/**
+ * Check whether a path starts with the given prefix and ends with the given suffix.
+ */
+static int path_matches(const char *path, const char *prefix, const char *suffix)
 {
-    if (fault) {
-        free(fault->prefix);
-        free(fault->suffix);
-        free(fault);
+    size_t path_len, suffix_len;
+
+    if (strncmp(path, prefix, strlen(prefix)) != 0) {
+        return 0;
+    }
+    path_len = strlen(path);
+    suffix_len = strlen(suffix);
+    if (suffix_len > path_len || strcmp(path + (path_len - suffix_len), suffix) != 0) {
+        return 0;
     }
+    return 1;
 }
 
-static struct kibosh_fault_unreadable *kibosh_fault_unreadable_parse(json_value *obj)
+/**
+ * Take one corruption from a corruption fault's count.
+ *
+ * If the count is greater than 0, we will transition to CORRUPT_DROP after 'count' tries.
+ * If the count is negative, then it is ignored.
+ *
+ * @param state     The fault state, or NULL for a standalone fault.
+ *
+ * @return          1 if the count is used up and we should drop data instead.
+ */
+static int corrupt_count_exhausted(struct kibosh_fault_state *state)
 {
-    int ret;
-    struct kibosh_fault_unreadable *fault = NULL;
-    json_value *code_obj = NULL;
-
-    fault = calloc(1, sizeof(*fault));
-    if (!fault) {
-        INFO("%s: OOM\n", __func__);
-        return NULL;
-    }
-    fault->base.type = KIBOSH_FAULT_TYPE_UNREADABLE;
-    ret = dup_json_str_value(get_child(obj, "prefix"), "/", &fault->prefix);
-    if (ret) {
-        INFO("%s: error reading \"prefix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    ret = dup_json_str_value(get_child(obj, "suffix"), "", &fault->suffix);
-    if (ret) {
-        INFO("%s: error reading \"suffix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
+    if (!state) {
+        return 0;
     }
-    code_obj = get_child(obj, "code");
-    if ((!code_obj) || (code_obj->type != json_integer)) {
-        INFO("%s: No valid \"code\" field found in fault object.\n", __func__);
-        goto error;
+    if (state->count > 0) {
+        state->count--;
+        return 0;
     }
-    fault->code = code_obj->u.integer;
-    return fault;
+    return state->count == 0;
+}
+
+static int corrupt_patches(struct kibosh_patches *patches, int lo, int size,
+                           enum buffer_corruption_type mode, double fraction);
+static int corrupt_patches_seeded(struct kibosh_patches *patches, int lo, int size,
+                                  enum buffer_corruption_type mode, double fraction,
+                                  const struct corrupt_key *key);
+
+/**
+ * Corrupt one part of an I/O buffer.
+ *
+ * @param seeded    Nonzero if the corruption is deterministic.
+ * @param seed      The seed of deterministic corruption.
+ * @param io        The operation.
+ * @param patches   The changes to the I/O buffer.
+ * @param lo        The start of the part.
+ * @param hi        The end of the part, exclusive.
+ * @param mode      The corruption mode.
+ * @param fraction  The fraction of bytes to corrupt.
+ *
+ * @return          The new length of the part.
+ */
+static int corrupt_part(int seeded, uint64_t seed, const struct kibosh_io *io,
+                        struct kibosh_patches *patches, int lo, int hi,
+                        enum buffer_corruption_type mode, double fraction)
+{
+    struct corrupt_key key;
 
-error:
-    kibosh_fault_unreadable_free(fault);
-    return NULL;
+    if (!seeded) {
+        return corrupt_patches(patches, lo, hi - lo, mode, fraction);
+    }
+    key.seed = seed;
+    key.dev = io->dev;
+    key.ino = io->ino;
+    key.offset = io->offset + lo;
+    return corrupt_patches_seeded(patches, lo, hi - lo, mode, fraction, &key);
 }
 
-static char *kibosh_fault_unreadable_unparse(struct kibosh_fault_unreadable *fault)
+/**
+ * Find the first range of a fault which ends at or after the given offset.
+ *
+ * @return          The index of the range, or the number of ranges if there is none.
+ */
+static uint32_t kibosh_fault_range_find(const struct kibosh_fault_base *fault,
+                                        uint64_t offset)
 {
-    return dynprintf("{\"type\":\"%s\", "
-                    "\"prefix\":\"%s\", "
-                    "\"suffix\":\"%s\", "
-                    "\"code\":%d}",
-                    KIBOSH_FAULT_TYPE_UNREADABLE_NAME,
-                    fault->prefix,
-                    fault->suffix,
-                    fault->code);
+    uint32_t lo = 0, hi = fault->num_ranges, mid;
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (fault->ranges[mid].end < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-static int kibosh_fault_unreadable_matches(struct kibosh_fault_unreadable *fault,
-                                           const char *path, const char *op)
+/**
+ * Find the next part of a buffer which a fault applies to.  A fault without ranges
+ * applies to the whole buffer.
+ *
+ * @param fault     The fault.
+ * @param offset    The offset in the file of the start of the buffer.
+ * @param len       The length of the buffer.
+ * @param idx       (inout) the index of the next range to look at.  Must start out as
+ *                  kibosh_fault_range_find(fault, offset).
+ * @param lo        (out param) the start of the part, as an index into the buffer.
+ * @param hi        (out param) the end of the part, exclusive.
+ *
+ * @return          1 if there was another part; 0 otherwise.
+ */
+static int kibosh_fault_next_part(const struct kibosh_fault_base *fault, uint64_t offset,
+                                  int len, uint32_t *idx, int *lo, int *hi)
 {
-    if (strcmp(op, "read") != 0) {
+    const struct kibosh_range *range;
+
+    if (len <= 0) {
         return 0;
     }
-    if (strncmp(path, fault->prefix, strlen(fault->prefix)) != 0) {
+    if (!fault->num_ranges) {
+        if (*idx > 0) {
+            return 0;
+        }
+        (*idx)++;
+        *lo = 0;
+        *hi = len;
+        return 1;
+    }
+    if (*idx >= fault->num_ranges) {
         return 0;
     }
-    if (strlen(fault->suffix) > strlen(path) ||
-        strcmp(path+(strlen(path)-strlen(fault->suffix)), fault->suffix) != 0) {
+    range = &fault->ranges[*idx];
+    if ((range->start > offset) && (range->start - offset >= (uint64_t)len)) {
         return 0;
     }
+    (*idx)++;
+    *lo = (range->start > offset) ? (int)(range->start - offset) : 0;
+    *hi = (range->end - offset >= (uint64_t)len) ? len : (int)(range->end - offset + 1);
     return 1;
 }
 
-static int kibosh_fault_unreadable_apply(struct kibosh_fault_unreadable *fault,
-                                         uint32_t *delay_ms)
+/**
+ * Check whether an error fault applies to an I/O, and if so, where.
+ *
+ * @param fault     The fault.
+ * @param io        The operation.
+ * @param len       The length of the buffer.
+ *
+ * @return          0 if the error should be returned; the number of bytes before the
+ *                  first bad range otherwise.
+ */
+static int kibosh_fault_error_start(const struct kibosh_fault_base *fault,
+                                    const struct kibosh_io *io, int len)
 {
-    *delay_ms = 0;
-    return fault->code < 0 ? fault->code : -fault->code;
+    uint32_t idx = kibosh_fault_range_find(fault, io->offset);
+    int lo, hi;
+
+    if (!fault->num_ranges) {
+        return 0;
+    }
+    if (!kibosh_fault_next_part(fault, io->offset, len, &idx, &lo, &hi)) {
+        return len;
+    }
+    return lo;
 }
 
 /////
-///// kibosh_fault_read_delay
+///// kibosh_fault_unreadable
 /////
-static void kibosh_fault_read_delay_free(struct kibosh_fault_read_delay *fault)
+static void kibosh_fault_unreadable_free(struct kibosh_fault_unreadable *fault)
 {
     if (fault) {
-        free(fault->prefix);
-        free(fault->suffix);
+        free(fault->base.prefix);
+        free(fault->base.suffix);
         free(fault);
     }
 }
 
-static struct kibosh_fault_read_delay *kibosh_fault_read_delay_parse(json_value *obj)
+static void kibosh_fault_unreadable_unparse(const struct kibosh_fault_unreadable *fault,
+                                            struct json_writer *w)
 {
-    int ret;
-    struct kibosh_fault_read_delay *fault = NULL;
-    json_value *delay_ms_obj = NULL;
-    json_value *fraction_obj = NULL;
-
-    delay_ms_obj = get_child(obj, "delay_ms");
-    if ((!delay_ms_obj) || (delay_ms_obj->type != json_integer)) {
-        INFO("%s: No valid \"delay_ms\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fraction_obj = get_child(obj, "fraction");
-    if ((!fraction_obj) || (fraction_obj->type != json_double)) {
-        INFO("%s: No valid \"fraction\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fault = calloc(1, sizeof(*fault));
-    if (!fault) {
-        INFO("%s: OOM\n", __func__);
-        return NULL;
-    }
-    fault->base.type = KIBOSH_FAULT_TYPE_READ_DELAY;
-    ret = dup_json_str_value(get_child(obj, "prefix"), "/", &fault->prefix);
-    if (ret) {
-        INFO("%s: error reading \"prefix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    ret = dup_json_str_value(get_child(obj, "suffix"), "", &fault->suffix);
-    if (ret) {
-        INFO("%s: error reading \"suffix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    fault->delay_ms = delay_ms_obj->u.integer;
-    fault->fraction = fraction_obj->u.dbl;
-    return fault;
-
-error:
-    kibosh_fault_read_delay_free(fault);
-    return NULL;
+    json_writer_int(w, "code", fault->code);
 }
 
-static char *kibosh_fault_read_delay_unparse(struct kibosh_fault_read_delay *fault)
+static int kibosh_fault_unreadable_apply(struct kibosh_fault_unreadable *fault,
+                                         const struct kibosh_io *io, int nread,
+                                         uint32_t *delay_ms)
 {
-    return dynprintf("{\"type\":\"%s\", "
-                    "\"prefix\":\"%s\", "
-                    "\"suffix\":\"%s\", "
-                    "\"delay_ms\":%"PRId32"d, "
-                    "\"fraction\":%g}",
-                    KIBOSH_FAULT_TYPE_READ_DELAY_NAME,
-                    fault->prefix,
-                    fault->suffix,
-                    fault->delay_ms,
-                    fault->fraction);
+    int good;
+
+    *delay_ms = 0;
+    // Like a disk with a bad sector, return what we can read before the bad range.
+    good = kibosh_fault_error_start(&fault->base, io, nread);
+    if (good > 0) {
+        return good;
+    }
+    return fault->code < 0 ? fault->code : -fault->code;
 }
 
-static int kibosh_fault_read_delay_matches(struct kibosh_fault_read_delay *fault,
-                                           const char *path, const char *op)
+/////
+///// kibosh_fault_read_delay
+/////
+static void kibosh_fault_read_delay_free(struct kibosh_fault_read_delay *fault)
 {
-    if (strcmp(op, "read") != 0) {
-        return 0;
-    }
-    if (strncmp(path, fault->prefix, strlen(fault->prefix)) != 0) {
-        return 0;
-    }
-    if (strlen(fault->suffix) > strlen(path) ||
-        strcmp(path+(strlen(path)-strlen(fault->suffix)), fault->suffix) != 0) {
-        return 0;
+    if (fault) {
+        free(fault->base.prefix);
+        free(fault->base.suffix);
+        free(fault);
     }
-    return (drand48() <= fault->fraction);
+}
+
+static void kibosh_fault_read_delay_unparse(const struct kibosh_fault_read_delay *fault,
+                                            struct json_writer *w)
+{
+    json_writer_int(w, "delay_ms", fault->delay_ms);
+    json_writer_double(w, "fraction", fault->fraction);
 }
 
 static void kibosh_fault_read_delay_apply(struct kibosh_fault_read_delay *fault,
@@ -212,769 +267,3969 @@ static void kibosh_fault_read_delay_apply(struct kibosh_fault_read_delay *fault,
 static void kibosh_fault_unwritable_free(struct kibosh_fault_unwritable *fault)
 {
     if (fault) {
-        free(fault->prefix);
-        free(fault->suffix);
+        free(fault->base.prefix);
+        free(fault->base.suffix);
         free(fault);
     }
 }
 
-static struct kibosh_fault_unwritable *kibosh_fault_unwritable_parse(json_value *obj)
+static void kibosh_fault_unwritable_unparse(const struct kibosh_fault_unwritable *fault,
+                                            struct json_writer *w)
 {
-    int ret;
-    struct kibosh_fault_unwritable *fault = NULL;
-    json_value *code_obj = NULL;
+    json_writer_int(w, "code", fault->code);
+}
 
-    code_obj = get_child(obj, "code");
-    if ((!code_obj) || (code_obj->type != json_integer)) {
-        INFO("%s: No valid \"code\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fault = calloc(1, sizeof(*fault));
-    if (!fault) {
-        INFO("%s: OOM\n", __func__);
-        return NULL;
-    }
-    fault->base.type = KIBOSH_FAULT_TYPE_UNWRITABLE;
-    ret = dup_json_str_value(get_child(obj, "prefix"), "/", &fault->prefix);
-    if (ret) {
-        INFO("%s: error reading \"prefix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    ret = dup_json_str_value(get_child(obj, "suffix"), "", &fault->suffix);
-    if (ret) {
-        INFO("%s: error reading \"suffix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    fault->code = code_obj->u.integer;
-    return fault;
+static int kibosh_fault_unwritable_apply(struct kibosh_fault_unwritable *fault,
+                                         const struct kibosh_io *io,
+                                         uint32_t *delay_ms, int size)
+{
+    int good;
 
-error:
-    kibosh_fault_unwritable_free(fault);
-    return NULL;
+    *delay_ms = 0;
+    good = kibosh_fault_error_start(&fault->base, io, size);
+    if (good > 0) {
+        return good;
+    }
+    return (fault->code < 0) ? fault->code : -fault->code;
 }
 
-static char *kibosh_fault_unwritable_unparse(struct kibosh_fault_unwritable *fault)
+/////
+///// kibosh_fault_write_delay
+/////
+static void kibosh_fault_write_delay_free(struct kibosh_fault_write_delay *fault)
 {
-    return dynprintf("{\"type\":\"%s\", "
-                    "\"prefix\":\"%s\", "
-                    "\"suffix\":\"%s\", "
-                    "\"code\":%d}",
-                    KIBOSH_FAULT_TYPE_UNWRITABLE_NAME,
-                    fault->prefix,
-                    fault->suffix,
-                    fault->code);
+    if (fault) {
+        free(fault->base.prefix);
+        free(fault->base.suffix);
+        free(fault);
+    }
 }
 
-static int kibosh_fault_unwritable_matches(struct kibosh_fault_unwritable *fault,
-                                           const char *path, const char *op)
+static void kibosh_fault_write_delay_unparse(const struct kibosh_fault_write_delay *fault,
+                                             struct json_writer *w)
 {
-    if (strcmp(op, "write") != 0) {
-        return 0;
-    }
-    if (strncmp(path, fault->prefix, strlen(fault->prefix)) != 0) {
-        return 0;
-    }
-    if (strlen(fault->suffix) > strlen(path) ||
-        strcmp(path+(strlen(path)-strlen(fault->suffix)), fault->suffix) != 0) {
-        return 0;
-    }
-    return 1;
+    json_writer_int(w, "delay_ms", fault->delay_ms);
+    json_writer_double(w, "fraction", fault->fraction);
 }
 
-static int kibosh_fault_unwritable_apply(struct kibosh_fault_unwritable *fault,
-                                         char **dyanmic_buf, uint32_t *delay_ms)
+static int kibosh_fault_write_delay_apply(struct kibosh_fault_write_delay *fault,
+                                          uint32_t *delay_ms, int size)
 {
-    *dyanmic_buf = NULL;
-    *delay_ms = 0;
-    return (fault->code < 0) ? fault->code : -fault->code;
+    *delay_ms = fault->delay_ms;
+    return size;
 }
 
 /////
-///// kibosh_fault_write_delay
+///// kibosh_fault_read_corrupt
 /////
-static void kibosh_fault_write_delay_free(struct kibosh_fault_write_delay *fault)
+static void kibosh_fault_read_corrupt_free(struct kibosh_fault_read_corrupt *fault)
 {
     if (fault) {
-        free(fault->prefix);
-        free(fault->suffix);
+        free(fault->base.prefix);
+        free(fault->base.suffix);
         free(fault);
     }
 }
 
-static struct kibosh_fault_write_delay *kibosh_fault_write_delay_parse(json_value *obj)
+static void kibosh_fault_read_corrupt_unparse(const struct kibosh_fault_read_corrupt *fault,
+                                              struct json_writer *w)
 {
-    int ret;
-    struct kibosh_fault_write_delay *fault = NULL;
-    json_value *delay_ms_obj = NULL;
-    json_value *fraction_obj = NULL;
-
-    delay_ms_obj = get_child(obj, "delay_ms");
-    if ((!delay_ms_obj) || (delay_ms_obj->type != json_integer)) {
-        INFO("%s: No valid \"delay_ms\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fraction_obj = get_child(obj, "fraction");
-    if ((!fraction_obj) || (fraction_obj->type != json_double)) {
-        INFO("%s: No valid \"fraction\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fault = calloc(1, sizeof(*fault));
-    if (!fault) {
-        INFO("%s: OOM\n", __func__);
-        return NULL;
+    json_writer_int(w, "mode", fault->mode);
+    json_writer_int(w, "count", fault->count);
+    json_writer_double(w, "fraction", fault->fraction);
+    if (fault->seeded) {
+        json_writer_uint(w, "seed", fault->seed);
     }
-    fault->base.type = KIBOSH_FAULT_TYPE_WRITE_DELAY;
-    ret = dup_json_str_value(get_child(obj, "prefix"), "/", &fault->prefix);
-    if (ret) {
-        INFO("%s: error reading \"prefix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
+}
+
+static int kibosh_fault_read_corrupt_apply(struct kibosh_fault_read_corrupt *fault,
+                                           const struct kibosh_io *io, char *buf, int nread,
+                                           uint32_t *delay_ms)
+{
+    enum buffer_corruption_type mode = fault->mode;
+    double fraction = fault->fraction;
+    uint32_t idx = kibosh_fault_range_find(&fault->base, io->offset);
+    struct kibosh_patches patches;
+    int lo, hi, ret;
+
+    *delay_ms = 0;
+    if (corrupt_count_exhausted(fault->base.state)) {
+        mode = CORRUPT_DROP;
+        fraction = 1.0;
     }
-    ret = dup_json_str_value(get_child(obj, "suffix"), "", &fault->suffix);
-    if (ret) {
-        INFO("%s: error reading \"suffix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
+    // The read buffer is ours, so it is corrupted in place.
+    kibosh_patches_init(&patches, buf, buf, nread);
+    while (kibosh_fault_next_part(&fault->base, io->offset, nread, &idx, &lo, &hi)) {
+        ret = corrupt_part(fault->seeded, fault->seed, io, &patches, lo, hi, mode,
+                           fraction);
+        if (ret < hi - lo) {
+            return lo + ret;
+        }
     }
-    fault->delay_ms = delay_ms_obj->u.integer;
-    fault->fraction = fraction_obj->u.dbl;
-    return fault;
-
-error:
-    kibosh_fault_write_delay_free(fault);
-    return NULL;
+    return nread;
 }
 
-static char *kibosh_fault_write_delay_unparse(struct kibosh_fault_write_delay *fault)
+/////
+///// kibosh_fault_write_corrupt
+/////
+static void kibosh_fault_write_corrupt_free(struct kibosh_fault_write_corrupt *fault)
 {
-    return dynprintf("{\"type\":\"%s\", "
-                    "\"prefix\":\"%s\", "
-                    "\"suffix\":\"%s\", "
-                    "\"delay_ms\":%"PRId32"d, "
-                    "\"fraction\":%g}",
-                    KIBOSH_FAULT_TYPE_WRITE_DELAY_NAME,
-                    fault->prefix,
-                    fault->suffix,
-                    fault->delay_ms,
-                    fault->fraction);
+    if (fault) {
+        free(fault->base.prefix);
+        free(fault->base.suffix);
+        free(fault);
+    }
 }
 
-static int kibosh_fault_write_delay_matches(struct kibosh_fault_write_delay *fault,
-                                            const char *path, const char *op)
+static void kibosh_fault_write_corrupt_unparse(const struct kibosh_fault_write_corrupt *fault,
+                                               struct json_writer *w)
 {
-    if (strcmp(op, "write") != 0) {
-        return 0;
-    }
-    if (strncmp(path, fault->prefix, strlen(fault->prefix)) != 0) {
-        return 0;
+    json_writer_int(w, "mode", fault->mode);
+    json_writer_int(w, "count", fault->count);
+    json_writer_double(w, "fraction", fault->fraction);
+    if (fault->seeded) {
+        json_writer_uint(w, "seed", fault->seed);
     }
-    if (strlen(fault->suffix) > strlen(path) ||
-        strcmp(path+(strlen(path)-strlen(fault->suffix)), fault->suffix) != 0) {
-        return 0;
-    }
-    return (drand48() <= fault->fraction);
 }
 
-static int kibosh_fault_write_delay_apply(struct kibosh_fault_write_delay *fault,
-                                          char **dyanmic_buf, uint32_t *delay_ms, int size)
+static int kibosh_fault_write_corrupt_apply(struct kibosh_fault_write_corrupt *fault,
+                    const struct kibosh_io *io, struct kibosh_patches *patches,
+                    uint32_t *delay_ms, int size)
 {
-    *dyanmic_buf = NULL;
-    *delay_ms = fault->delay_ms;
+    uint32_t idx = kibosh_fault_range_find(&fault->base, io->offset);
+    int lo, hi, ret;
+
+    *delay_ms = 0;
+    if (corrupt_count_exhausted(fault->base.state) || (fault->mode == CORRUPT_DROP)) {
+        if (!kibosh_fault_next_part(&fault->base, io->offset, size, &idx, &lo, &hi)) {
+            return size;
+        }
+        return lo + corrupt_part(fault->seeded, fault->seed, io, patches, lo, hi,
+                                 CORRUPT_DROP, 1.0);
+    }
+    ret = kibosh_patches_reserve(patches);
+    if (ret < 0) {
+        return ret;
+    }
+    // The caller's buffer is never changed.  Only the corrupted bytes are copied, into
+    // patches which are spliced into the write.
+    while (kibosh_fault_next_part(&fault->base, io->offset, size, &idx, &lo, &hi)) {
+        corrupt_part(fault->seeded, fault->seed, io, patches, lo, hi, fault->mode,
+                     fault->fraction);
+    }
     return size;
 }
 
 /////
-///// kibosh_fault_read_corrupt
+///// kibosh_fault_torn_write
 /////
-static void kibosh_fault_read_corrupt_free(struct kibosh_fault_read_corrupt *fault)
+static void kibosh_fault_torn_write_free(struct kibosh_fault_torn_write *fault)
 {
     if (fault) {
-        free(fault->prefix);
-        free(fault->suffix);
+        free(fault->base.prefix);
+        free(fault->base.suffix);
         free(fault);
     }
 }
 
-static struct kibosh_fault_read_corrupt *kibosh_fault_read_corrupt_parse(json_value *obj)
+/**
+ * Check whether a sector size can be used by a torn write fault.
+ */
+static int kibosh_torn_write_sector_size_valid(int64_t sector_size)
 {
-    int ret;
-    struct kibosh_fault_read_corrupt *fault = NULL;
-    json_value *mode_obj = NULL;
-    json_value *count_obj = NULL;
-    json_value *fraction_obj = NULL;
-
-    mode_obj = get_child(obj, "mode");
-    if ((!mode_obj) || (mode_obj->type != json_integer)) {
-        INFO("%s: No valid \"mode\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fraction_obj = get_child(obj, "fraction");
-    if ((!fraction_obj) || (fraction_obj->type != json_double)) {
-        INFO("%s: No valid \"fraction\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    count_obj = get_child(obj, "count");
-    if ((!count_obj) || (count_obj->type != json_integer)) {
-        INFO("%s: No valid \"count\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fault = calloc(1, sizeof(*fault));
-    if (!fault) {
-        INFO("%s: OOM\n", __func__);
-        return NULL;
-    }
-    fault->base.type = KIBOSH_FAULT_TYPE_READ_CORRUPT;
-    ret = dup_json_str_value(get_child(obj, "prefix"), "/", &fault->prefix);
-    if (ret) {
-        INFO("%s: error reading \"prefix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    ret = dup_json_str_value(get_child(obj, "suffix"), "", &fault->suffix);
-    if (ret) {
-        INFO("%s: error reading \"suffix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    fault->mode = mode_obj->u.integer;
-    fault->count = count_obj->u.integer;
-    fault->fraction = fraction_obj->u.dbl;
-    return fault;
+    return (sector_size >= 512) && (sector_size <= (1 << 30)) &&
+        ((sector_size & (sector_size - 1)) == 0);
+}
 
-error:
-    kibosh_fault_read_corrupt_free(fault);
-    return NULL;
+/**
+ * Check whether a mode can be used by a torn write fault.
+ */
+static int kibosh_torn_write_mode_valid(int64_t mode)
+{
+    return (mode == TORN_WRITE_PREFIX) || (mode == TORN_WRITE_SECTORS);
 }
 
-static char *kibosh_fault_read_corrupt_unparse(struct kibosh_fault_read_corrupt *fault)
+static void kibosh_fault_torn_write_unparse(const struct kibosh_fault_torn_write *fault,
+                                            struct json_writer *w)
 {
-    return dynprintf("{\"type\":\"%s\", "
-                    "\"prefix\":\"%s\", "
-                    "\"suffix\":\"%s\", "
-                    "\"mode\":%d, "
-                    "\"fraction\":%g}",
-                    KIBOSH_FAULT_TYPE_READ_CORRUPT_NAME,
-                    fault->prefix,
-                    fault->suffix,
-                    fault->mode,
-                    fault->fraction);
+    json_writer_int(w, "mode", fault->mode);
+    json_writer_double(w, "fraction", fault->fraction);
+    json_writer_uint(w, "sector_size", fault->sector_size);
+    if (fault->short_write) {
+        json_writer_bool(w, "short", 1);
+    }
 }
 
-static int kibosh_fault_read_corrupt_matches(struct kibosh_fault_read_corrupt *fault,
-                                             const char *path, const char *op)
+static int kibosh_fault_torn_write_apply(struct kibosh_fault_torn_write *fault,
+                    const struct kibosh_io *io, struct kibosh_patches *patches,
+                    uint32_t *delay_ms, int size)
 {
-    if (strcmp(op, "read") != 0) {
-        return 0;
+    uint32_t idx = kibosh_fault_range_find(&fault->base, io->offset);
+    uint32_t sector = fault->sector_size;
+    int lo, hi, start, end, lost = -1;
+
+    *delay_ms = 0;
+    // Lost sectors become holes in the write, so the old data stays on disk.  Sectors
+    // are aligned to the file, so the first and last ones may only be partly written.
+    while (kibosh_fault_next_part(&fault->base, io->offset, size, &idx, &lo, &hi)) {
+        for (start = lo; start < hi; start = end) {
+            end = start + sector - ((io->offset + start) & (sector - 1));
+            if (end > hi) {
+                end = hi;
+            }
+            if (drand48() < fault->fraction) {
+                continue;
+            }
+            if (lost < 0) {
+                lost = start;
+            }
+            if (fault->mode == TORN_WRITE_PREFIX) {
+                kibosh_patches_hole(patches, start, size);
+                goto done;
+            }
+            kibosh_patches_hole(patches, start, end);
+        }
     }
-    if (strncmp(path, fault->prefix, strlen(fault->prefix)) != 0) {
-        return 0;
+
+done:
+    if (fault->short_write && (lost >= 0) &&
+            ((patches->reported < 0) || (lost < patches->reported))) {
+        patches->reported = lost;
     }
-    if (strlen(fault->suffix) > strlen(path) ||
-        strcmp(path+(strlen(path)-strlen(fault->suffix)), fault->suffix) != 0) {
-        return 0;
+    return size;
+}
+
+/////
+///// kibosh_fault_lost_write
+/////
+static void kibosh_fault_lost_write_free(struct kibosh_fault_lost_write *fault)
+{
+    if (fault) {
+        free(fault->base.prefix);
+        free(fault->base.suffix);
+        free(fault);
     }
-    return 1;
 }
 
-static int kibosh_fault_read_corrupt_apply(struct kibosh_fault_read_corrupt *fault,
-                                           char *buf, int nread, uint32_t *delay_ms)
+static int kibosh_fault_lost_write_apply(struct kibosh_fault_lost_write *fault,
+                    const struct kibosh_io *io, struct kibosh_patches *patches,
+                    uint32_t *delay_ms, int size)
 {
+    uint32_t idx = kibosh_fault_range_find(&fault->base, io->offset);
+    int lo, hi;
+
     *delay_ms = 0;
-    // If count > 0, then we will transition to CORRUPT_DROP after 'count' tries.
-    // If count is negative, then it is ignored.
-    if (fault->count > 0) {
-        fault->count--;
-    } else if (fault->count == 0) {
-        fault->mode = CORRUPT_DROP;
-        fault->fraction = 1.0;
+    // The whole write is held if any of it is in the fault's ranges, so that the target
+    // never sees part of a write which the overlay also has.
+    if (kibosh_fault_next_part(&fault->base, io->offset, size, &idx, &lo, &hi)) {
+        patches->unsynced = 1;
+        // A lost write is never written back, even if a write_back fault also matched.
+        patches->kb_per_sec = 0;
+        patches->dirty_limit = 0;
     }
-    return corrupt_buffer(buf, nread, fault->mode, fault->fraction);
+    return size;
 }
 
 /////
-///// kibosh_fault_write_corrupt
+///// kibosh_fault_write_back
 /////
-static void kibosh_fault_write_corrupt_free(struct kibosh_fault_write_corrupt *fault)
+static void kibosh_fault_write_back_free(struct kibosh_fault_write_back *fault)
 {
     if (fault) {
-        free(fault->prefix);
-        free(fault->suffix);
+        free(fault->base.prefix);
+        free(fault->base.suffix);
         free(fault);
     }
 }
 
-static struct kibosh_fault_write_corrupt *kibosh_fault_write_corrupt_parse(json_value *obj)
+static void kibosh_fault_write_back_unparse(const struct kibosh_fault_write_back *fault,
+                                            struct json_writer *w)
 {
-    int ret;
-    struct kibosh_fault_write_corrupt *fault = NULL;
-    json_value *mode_obj = NULL;
-    json_value *count_obj = NULL;
-    json_value *fraction_obj = NULL;
-
-    mode_obj = get_child(obj, "mode");
-    if ((!mode_obj) || (mode_obj->type != json_integer)) {
-        INFO("%s: No valid \"mode\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fraction_obj = get_child(obj, "fraction");
-    if ((!fraction_obj) || (fraction_obj->type != json_double)) {
-        INFO("%s: No valid \"fraction\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    count_obj = get_child(obj, "count");
-    if ((!count_obj) || (count_obj->type != json_integer)) {
-        INFO("%s: No valid \"count\" field found in fault object.\n", __func__);
-        goto error;
-    }
-    fault = calloc(1, sizeof(*fault));
-    if (!fault) {
-        INFO("%s: OOM\n", __func__);
-        return NULL;
-    }
-    fault->base.type = KIBOSH_FAULT_TYPE_WRITE_CORRUPT;
-    ret = dup_json_str_value(get_child(obj, "prefix"), "/", &fault->prefix);
-    if (ret) {
-        INFO("%s: error reading \"prefix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
-    }
-    ret = dup_json_str_value(get_child(obj, "suffix"), "", &fault->suffix);
-    if (ret) {
-        INFO("%s: error reading \"suffix\" field: %s (%d)\n",
-             __func__, safe_strerror(ret), ret);
-        goto error;
+    json_writer_uint(w, "kb_per_sec", fault->kb_per_sec);
+    if (fault->dirty_limit_kb) {
+        json_writer_uint(w, "dirty_limit_kb", fault->dirty_limit_kb);
     }
-    fault->mode = mode_obj->u.integer;
-    fault->count = count_obj->u.integer;
-    fault->fraction = fraction_obj->u.dbl;
-    return fault;
-
-error:
-    kibosh_fault_write_corrupt_free(fault);
-    return NULL;
 }
 
-static char *kibosh_fault_write_corrupt_unparse(struct kibosh_fault_write_corrupt *fault)
+static int kibosh_fault_write_back_apply(struct kibosh_fault_write_back *fault,
+                    const struct kibosh_io *io, struct kibosh_patches *patches,
+                    uint32_t *delay_ms, int size)
 {
-    return dynprintf("{\"type\":\"%s\", "
-                    "\"prefix\":\"%s\", "
-                    "\"suffix\":\"%s\", "
-                    "\"mode\":%d, "
-                    "\"fraction\":%g}",
-                    KIBOSH_FAULT_TYPE_WRITE_CORRUPT_NAME,
-                    fault->prefix,
-                    fault->suffix,
-                    fault->mode,
-                    fault->fraction);
+    uint32_t idx = kibosh_fault_range_find(&fault->base, io->offset);
+    int lo, hi;
+
+    *delay_ms = 0;
+    // Like lost_write, the whole write is held if any of it is in the fault's ranges.
+    if ((!patches->unsynced) &&
+            kibosh_fault_next_part(&fault->base, io->offset, size, &idx, &lo, &hi)) {
+        patches->unsynced = 1;
+        patches->kb_per_sec = fault->kb_per_sec;
+        patches->dirty_limit = (uint64_t)fault->dirty_limit_kb * 1024;
+    }
+    return size;
 }
 
-static int kibosh_fault_write_corrupt_matches(struct kibosh_fault_write_corrupt *fault,
-                                              const char *path, const char *op)
+/////
+///// kibosh_fault_stale_read
+/////
+static void kibosh_fault_stale_read_free(struct kibosh_fault_stale_read *fault)
 {
-    if (strcmp(op, "write") != 0) {
-        return 0;
-    }
-    if (strncmp(path, fault->prefix, strlen(fault->prefix)) != 0) {
-        return 0;
-    }
-    if (strlen(fault->suffix) > strlen(path) ||
-        strcmp(path+(strlen(path)-strlen(fault->suffix)), fault->suffix) != 0) {
-        return 0;
+    if (fault) {
+        free(fault->base.prefix);
+        free(fault->base.suffix);
+        free(fault);
     }
-    return 1;
 }
 
-static int kibosh_fault_write_corrupt_apply(struct kibosh_fault_write_corrupt *fault,
-                    const char **buf, char **dynamic_buf, uint32_t *delay_ms, int size)
+static void kibosh_fault_stale_read_unparse(const struct kibosh_fault_stale_read *fault,
+                                            struct json_writer *w)
 {
-    char *dbuf;
+    json_writer_uint(w, "window_ms", fault->window_ms);
+}
+
+static int kibosh_fault_stale_read_apply(struct kibosh_fault_stale_read *fault,
+                    const struct kibosh_io *io, struct kibosh_patches *patches,
+                    uint32_t *delay_ms, int size)
+{
+    uint32_t idx = kibosh_fault_range_find(&fault->base, io->offset);
+    int lo, hi;
 
     *delay_ms = 0;
-    // If count > 0, then we will transition to CORRUPT_DROP after 'count' tries.
-    // If count is negative, then it is ignored.
-    if (fault->count > 0) {
-        fault->count--;
-    } else if (fault->count == 0) {
-        fault->mode = CORRUPT_DROP;
-        fault->fraction = 1.0;
-    }
-    if (fault->mode == CORRUPT_DROP) {
-        *dynamic_buf = 0;
-        return drand48() * size;
-    }
-    dbuf = malloc(size);
-    if (!dbuf) {
-        return -ENOMEM;
+    // The old contents of the whole write are kept if any of it is in the fault's ranges.
+    if (kibosh_fault_next_part(&fault->base, io->offset, size, &idx, &lo, &hi) &&
+            (fault->window_ms > patches->stale_ms)) {
+        patches->stale_ms = fault->window_ms;
     }
-    memcpy(dbuf, *buf, size);
-    *buf = dbuf;
-    *dynamic_buf = dbuf;
-    return corrupt_buffer(dbuf, size, fault->mode, fault->fraction);
+    return size;
 }
 
 /////
 ///// kibosh_fault_base 
 /////
-struct kibosh_fault_base *kibosh_fault_base_parse(json_value *obj)
-{
-    json_value *child;
 
-    child = get_child(obj, "type");
-    if (!child) {
-        INFO("%s: No \"type\" field found in root object.\n", __func__);
-        return NULL;
-    }
-    if (child->type != json_string) {
-        INFO("%s: \"type\" field was not a string.\n", __func__);
-        return NULL;
+/**
+ * Check that the time window and ramp of a fault make sense.
+ *
+ * @return          0 on success; -EINVAL otherwise.
+ */
+static int kibosh_fault_window_validate(const struct kibosh_fault_base *fault)
+{
+    if (fault->end_ms && (fault->end_ms <= fault->start_ms)) {
+        INFO("%s: \"end_ms\" must be greater than \"start_ms\".\n", __func__);
+        return -EINVAL;
     }
-    if (strcmp(child->u.string.ptr, KIBOSH_FAULT_TYPE_UNREADABLE_NAME) == 0) {
-        return (struct kibosh_fault_base *)kibosh_fault_unreadable_parse(obj);
-    } else if (strcmp(child->u.string.ptr, KIBOSH_FAULT_TYPE_READ_DELAY_NAME) == 0) {
-        return (struct kibosh_fault_base *)kibosh_fault_read_delay_parse(obj);
-    } else if (strcmp(child->u.string.ptr, KIBOSH_FAULT_TYPE_WRITE_DELAY_NAME) == 0) {
-        return (struct kibosh_fault_base *)kibosh_fault_write_delay_parse(obj);
-    } else if (strcmp(child->u.string.ptr, KIBOSH_FAULT_TYPE_UNWRITABLE_NAME) == 0) {
-        return (struct kibosh_fault_base *)kibosh_fault_unwritable_parse(obj);
-    } else if (strcmp(child->u.string.ptr, KIBOSH_FAULT_TYPE_READ_CORRUPT_NAME) == 0) {
-        return (struct kibosh_fault_base *)kibosh_fault_read_corrupt_parse(obj);
-    } else if (strcmp(child->u.string.ptr, KIBOSH_FAULT_TYPE_WRITE_CORRUPT_NAME) == 0) {
-        return (struct kibosh_fault_base *)kibosh_fault_write_corrupt_parse(obj);
+    if ((fault->ramp_from < 0.0) || (fault->ramp_from > 1.0)) {
+        INFO("%s: \"ramp_from\" must be between 0.0 and 1.0.\n", __func__);
+        return -EINVAL;
     }
-    INFO("%s: Unknown fault type \"%s\".\n", __func__, child->u.string.ptr);
-    return NULL;
+    return 0;
 }
 
-char *kibosh_fault_base_unparse(struct kibosh_fault_base *fault)
+/**
+ * Check that the burst model of a fault makes sense.
+ *
+ * @return          0 on success; -EINVAL otherwise.
+ */
+static int kibosh_fault_burst_validate(const struct kibosh_fault_base *fault)
 {
-    switch (fault->type) {
-        case KIBOSH_FAULT_TYPE_UNREADABLE:
-            return kibosh_fault_unreadable_unparse(
-                    (struct kibosh_fault_unreadable*)fault);
-        case KIBOSH_FAULT_TYPE_READ_DELAY:
-            return kibosh_fault_read_delay_unparse(
-                    (struct kibosh_fault_read_delay*)fault);
-        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
-            return kibosh_fault_write_delay_unparse(
-                    (struct kibosh_fault_write_delay*)fault);
-        case KIBOSH_FAULT_TYPE_UNWRITABLE:
-            return kibosh_fault_unwritable_unparse(
-                    (struct kibosh_fault_unwritable*)fault);
-        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
-            return kibosh_fault_read_corrupt_unparse(
-                    (struct kibosh_fault_read_corrupt*)fault);
-        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
-            return kibosh_fault_write_corrupt_unparse(
-                    (struct kibosh_fault_write_corrupt*)fault);
+    static const char * const names[] = {
+        "burst_enter", "burst_exit", "good_fraction", "bad_fraction"
+    };
+    const double vals[] = {
+        fault->burst_enter, fault->burst_exit, fault->good_fraction, fault->bad_fraction
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        if ((vals[i] < 0.0) || (vals[i] > 1.0)) {
+            INFO("%s: \"%s\" must be between 0.0 and 1.0.\n", __func__, names[i]);
+            return -EINVAL;
+        }
     }
-    return NULL;
+    return 0;
 }
 
-int kibosh_fault_matches(struct kibosh_fault_base *fault, const char *path, const char *op)
+/**
+ * The numeric fields of a match clause.
+ */
+static const struct {
+    const char *name;
+    uint32_t test;
+    size_t off;
+    size_t size;
+} KIBOSH_MATCH_FIELDS[] = {
+    { "uid", KIBOSH_MATCH_UID, offsetof(struct kibosh_fault_match, uid), 4 },
+    { "gid", KIBOSH_MATCH_GID, offsetof(struct kibosh_fault_match, gid), 4 },
+    { "pid", KIBOSH_MATCH_PID, offsetof(struct kibosh_fault_match, pid), 4 },
+    { "min_size", KIBOSH_MATCH_MIN_SIZE, offsetof(struct kibosh_fault_match, min_size), 8 },
+    { "max_size", KIBOSH_MATCH_MAX_SIZE, offsetof(struct kibosh_fault_match, max_size), 8 },
+    { "min_offset", KIBOSH_MATCH_MIN_OFFSET,
+        offsetof(struct kibosh_fault_match, min_offset), 8 },
+    { "max_offset", KIBOSH_MATCH_MAX_OFFSET,
+        offsetof(struct kibosh_fault_match, max_offset), 8 },
+};
+
+#define KIBOSH_MATCH_NUM_FIELDS (sizeof(KIBOSH_MATCH_FIELDS) / sizeof(KIBOSH_MATCH_FIELDS[0]))
+
+/**
+ * The open flags which a match clause can test.  O_SYNC includes the bits of O_DSYNC, so
+ * it comes first, so that it is written out under its own name.
+ */
+static const struct {
+    const char *name;
+    uint32_t flag;
+} KIBOSH_MATCH_OPEN_FLAGS[] = {
+    { "O_SYNC", O_SYNC },
+    { "O_DSYNC", O_DSYNC },
+    { "O_DIRECT", O_DIRECT },
+    { "O_APPEND", O_APPEND },
+};
+
+#define KIBOSH_MATCH_NUM_OPEN_FLAGS \
+    (sizeof(KIBOSH_MATCH_OPEN_FLAGS) / sizeof(KIBOSH_MATCH_OPEN_FLAGS[0]))
+
+/**
+ * Look up a numeric field of a match clause by name.
+ *
+ * @return          The index of the field, or -1 if there is no such field.
+ */
+static int kibosh_match_field_lookup(const char *name)
 {
-    switch (fault->type) {
-        case KIBOSH_FAULT_TYPE_UNREADABLE:
-            return kibosh_fault_unreadable_matches(
-                    (struct kibosh_fault_unreadable*)fault, path, op);
-        case KIBOSH_FAULT_TYPE_READ_DELAY:
-            return kibosh_fault_read_delay_matches(
-                        (struct kibosh_fault_read_delay*)fault, path, op);
-        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
-            return kibosh_fault_write_delay_matches(
-                        (struct kibosh_fault_write_delay*)fault, path, op);
-        case KIBOSH_FAULT_TYPE_UNWRITABLE:
-            return kibosh_fault_unwritable_matches(
-                        (struct kibosh_fault_unwritable*)fault, path, op);
-        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
-            return kibosh_fault_read_corrupt_matches(
-                        (struct kibosh_fault_read_corrupt*)fault, path, op);
-        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
-            return kibosh_fault_write_corrupt_matches(
-                        (struct kibosh_fault_write_corrupt*)fault, path, op);
+    size_t i;
+
+    for (i = 0; i < KIBOSH_MATCH_NUM_FIELDS; i++) {
+        if (strcmp(name, KIBOSH_MATCH_FIELDS[i].name) == 0) {
+            return i;
+        }
     }
-    return 0;
+    return -1;
 }
 
-void kibosh_fault_base_free(struct kibosh_fault_base *fault)
+/**
+ * Get a numeric field of a match clause.
+ */
+static uint64_t kibosh_fault_match_get(const struct kibosh_fault_match *match, int idx)
 {
-    if (!fault)
+    const char *ptr = (const char *)match + KIBOSH_MATCH_FIELDS[idx].off;
+
+    if (KIBOSH_MATCH_FIELDS[idx].size == 4) {
+        return *(const uint32_t *)ptr;
+    }
+    return *(const uint64_t *)ptr;
+}
+
+/**
+ * Set a numeric field of a match clause, and turn on its test.
+ *
+ * @return          0 on success; -EINVAL if the value is out of range.
+ */
+static int kibosh_fault_match_set(struct kibosh_fault_match *match, int idx, int64_t val)
+{
+    char *ptr = (char *)match + KIBOSH_MATCH_FIELDS[idx].off;
+
+    if ((val < 0) || ((KIBOSH_MATCH_FIELDS[idx].size == 4) && (val > UINT32_MAX))) {
+        INFO("%s: \"%s\" in the match clause is out of range.\n", __func__,
+             KIBOSH_MATCH_FIELDS[idx].name);
+        return -EINVAL;
+    }
+    if (KIBOSH_MATCH_FIELDS[idx].size == 4) {
+        *(uint32_t *)ptr = val;
+    } else {
+        *(uint64_t *)ptr = val;
+    }
+    match->tests |= KIBOSH_MATCH_FIELDS[idx].test;
+    return 0;
+}
+
+/**
+ * Add an open flag to a match clause, and turn on the open flags test.
+ *
+ * @return          0 on success; -EINVAL if there is no such flag.
+ */
+static int kibosh_fault_match_add_flag(struct kibosh_fault_match *match, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < KIBOSH_MATCH_NUM_OPEN_FLAGS; i++) {
+        if (strcmp(name, KIBOSH_MATCH_OPEN_FLAGS[i].name) == 0) {
+            match->flags |= KIBOSH_MATCH_OPEN_FLAGS[i].flag;
+            match->tests |= KIBOSH_MATCH_FLAGS;
+            return 0;
+        }
+    }
+    INFO("%s: unknown open flag \"%s\" in the match clause.\n", __func__, name);
+    return -EINVAL;
+}
+
+/**
+ * Check that a match clause makes sense.
+ *
+ * @return          0 on success; -EINVAL otherwise.
+ */
+static int kibosh_fault_match_validate(const struct kibosh_fault_match *match)
+{
+    uint32_t sizes = KIBOSH_MATCH_MIN_SIZE | KIBOSH_MATCH_MAX_SIZE;
+    uint32_t offsets = KIBOSH_MATCH_MIN_OFFSET | KIBOSH_MATCH_MAX_OFFSET;
+
+    if (((match->tests & sizes) == sizes) && (match->min_size > match->max_size)) {
+        INFO("%s: \"min_size\" must not be greater than \"max_size\".\n", __func__);
+        return -EINVAL;
+    }
+    if (((match->tests & offsets) == offsets) && (match->min_offset > match->max_offset)) {
+        INFO("%s: \"min_offset\" must not be greater than \"max_offset\".\n", __func__);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/**
+ * Read a match clause from a JSON reader.  The BEGIN_OBJECT token has already been read.
+ *
+ * @return          0 on success; -EIO otherwise.
+ */
+static int kibosh_fault_match_read(struct json_reader *r, struct kibosh_fault_match *match)
+{
+    enum json_token token;
+    int idx;
+
+    memset(match, 0, sizeof(*match));
+    while ((token = json_reader_next(r)) == JSON_TOKEN_KEY) {
+        if (strcmp(r->str, "flags") == 0) {
+            if (json_reader_next(r) != JSON_TOKEN_BEGIN_ARRAY) {
+                INFO("%s: \"flags\" in the match clause was not an array.\n", __func__);
+                return -EIO;
+            }
+            match->tests |= KIBOSH_MATCH_FLAGS;
+            while ((token = json_reader_next(r)) == JSON_TOKEN_STRING) {
+                if (kibosh_fault_match_add_flag(match, r->str) < 0) {
+                    return -EIO;
+                }
+            }
+            if (token != JSON_TOKEN_END_ARRAY) {
+                return -EIO;
+            }
+            continue;
+        }
+        idx = kibosh_match_field_lookup(r->str);
+        if (idx < 0) {
+            INFO("%s: unknown field \"%s\" in the match clause.\n", __func__, r->str);
+            return -EIO;
+        }
+        if (json_reader_next(r) != JSON_TOKEN_INTEGER) {
+            INFO("%s: \"%s\" in the match clause was not an integer.\n", __func__,
+                 KIBOSH_MATCH_FIELDS[idx].name);
+            return -EIO;
+        }
+        if (kibosh_fault_match_set(match, idx, r->integer) < 0) {
+            return -EIO;
+        }
+    }
+    if (token != JSON_TOKEN_END_OBJECT) {
+        return -EIO;
+    }
+    return kibosh_fault_match_validate(match) ? -EIO : 0;
+}
+
+/**
+ * Write the match clause of a fault, if it has one.
+ */
+static void kibosh_fault_match_write(const struct kibosh_fault_match *match,
+                                     struct json_writer *w)
+{
+    uint32_t flags = match->flags;
+    size_t i;
+
+    if (!match->tests) {
+        return;
+    }
+    json_writer_begin_object(w, "match");
+    for (i = 0; i < KIBOSH_MATCH_NUM_FIELDS; i++) {
+        if (match->tests & KIBOSH_MATCH_FIELDS[i].test) {
+            json_writer_uint(w, KIBOSH_MATCH_FIELDS[i].name, kibosh_fault_match_get(match, i));
+        }
+    }
+    if (match->tests & KIBOSH_MATCH_FLAGS) {
+        json_writer_begin_array(w, "flags");
+        for (i = 0; i < KIBOSH_MATCH_NUM_OPEN_FLAGS; i++) {
+            if ((flags & KIBOSH_MATCH_OPEN_FLAGS[i].flag) == KIBOSH_MATCH_OPEN_FLAGS[i].flag) {
+                json_writer_str(w, NULL, KIBOSH_MATCH_OPEN_FLAGS[i].name);
+                flags &= ~KIBOSH_MATCH_OPEN_FLAGS[i].flag;
+            }
+        }
+        json_writer_end_array(w);
+    }
+    json_writer_end_object(w);
+}
+
+/**
+ * Check whether two match clauses are the same.
+ */
+static int kibosh_fault_match_equal(const struct kibosh_fault_match *a,
+                                    const struct kibosh_fault_match *b)
+{
+    size_t i;
+
+    if ((a->tests != b->tests) || (a->flags != b->flags)) {
+        return 0;
+    }
+    for (i = 0; i < KIBOSH_MATCH_NUM_FIELDS; i++) {
+        if (kibosh_fault_match_get(a, i) != kibosh_fault_match_get(b, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Run the tests of a match clause against an I/O operation.
+ *
+ * @return          1 if the operation passes every test; 0 otherwise.
+ */
+static int kibosh_fault_match_eval(const struct kibosh_fault_match *match,
+                                   const struct kibosh_io *io)
+{
+    uint32_t tests = match->tests;
+
+    if ((tests & KIBOSH_MATCH_UID) && (io->uid != match->uid))
+        return 0;
+    if ((tests & KIBOSH_MATCH_GID) && (io->gid != match->gid))
+        return 0;
+    if ((tests & KIBOSH_MATCH_PID) && (io->pid != match->pid))
+        return 0;
+    if ((tests & KIBOSH_MATCH_MIN_SIZE) && (io->size < match->min_size))
+        return 0;
+    if ((tests & KIBOSH_MATCH_MAX_SIZE) && (io->size > match->max_size))
+        return 0;
+    if ((tests & KIBOSH_MATCH_MIN_OFFSET) && (io->offset < match->min_offset))
+        return 0;
+    if ((tests & KIBOSH_MATCH_MAX_OFFSET) && (io->offset > match->max_offset))
+        return 0;
+    if ((tests & KIBOSH_MATCH_FLAGS) &&
+            (((uint32_t)io->open_flags & match->flags) != match->flags))
+        return 0;
+    return 1;
+}
+
+/**
+ * Check whether two faults have the same pattern.
+ */
+static int kibosh_fault_pattern_equal(const struct kibosh_fault_base *a,
+                                      const struct kibosh_fault_base *b)
+{
+    if ((!a->pattern) || (!b->pattern)) {
+        return a->pattern == b->pattern;
+    }
+    return (a->pattern_type == b->pattern_type) && (strcmp(a->pattern, b->pattern) == 0);
+}
+
+static int kibosh_inode_compare(const void *a, const void *b)
+{
+    const struct kibosh_inode *x = (const struct kibosh_inode *)a;
+    const struct kibosh_inode *y = (const struct kibosh_inode *)b;
+
+    if (x->dev != y->dev) {
+        return (x->dev < y->dev) ? -1 : 1;
+    }
+    if (x->ino != y->ino) {
+        return (x->ino < y->ino) ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Sort a list of inodes and remove the duplicates.
+ *
+ * @return          The new number of inodes.
+ */
+static uint32_t kibosh_inodes_normalize(struct kibosh_inode *inodes, uint32_t num)
+{
+    uint32_t i, j = 0;
+
+    if (num == 0) {
+        return 0;
+    }
+    qsort(inodes, num, sizeof(inodes[0]), kibosh_inode_compare);
+    for (i = 1; i < num; i++) {
+        if (kibosh_inode_compare(&inodes[j], &inodes[i]) != 0) {
+            inodes[++j] = inodes[i];
+        }
+    }
+    return j + 1;
+}
+
+/**
+ * Check whether a fault targets an inode.
+ */
+static int kibosh_fault_has_inode(const struct kibosh_fault_base *fault, uint64_t dev,
+                                  uint64_t ino)
+{
+    struct kibosh_inode key = { dev, ino };
+
+    if (fault->num_inodes == 0) {
+        return 0;
+    }
+    return bsearch(&key, fault->inodes, fault->num_inodes, sizeof(key),
+                   kibosh_inode_compare) != NULL;
+}
+
+/**
+ * Write the inodes of a fault, if it is pinned or has any.
+ */
+static void kibosh_fault_inodes_write(const struct kibosh_fault_base *fault,
+                                      struct json_writer *w)
+{
+    uint32_t i;
+
+    if (fault->pin) {
+        json_writer_bool(w, "pin", 1);
+    }
+    if (!fault->has_inodes) {
+        return;
+    }
+    json_writer_begin_array(w, "inodes");
+    for (i = 0; i < fault->num_inodes; i++) {
+        json_writer_begin_object(w, NULL);
+        json_writer_uint(w, "dev", fault->inodes[i].dev);
+        json_writer_uint(w, "ino", fault->inodes[i].ino);
+        json_writer_end_object(w);
+    }
+    json_writer_end_array(w);
+}
+
+/**
+ * Check whether two faults target the same inodes.
+ */
+static int kibosh_fault_inodes_equal(const struct kibosh_fault_base *a,
+                                     const struct kibosh_fault_base *b)
+{
+    if ((a->pin != b->pin) || (a->has_inodes != b->has_inodes) ||
+            (a->num_inodes != b->num_inodes)) {
+        return 0;
+    }
+    return (a->num_inodes == 0) ||
+        (memcmp(a->inodes, b->inodes, a->num_inodes * sizeof(struct kibosh_inode)) == 0);
+}
+
+static int kibosh_range_compare(const void *a, const void *b)
+{
+    const struct kibosh_range *x = (const struct kibosh_range *)a;
+    const struct kibosh_range *y = (const struct kibosh_range *)b;
+
+    if (x->start != y->start) {
+        return (x->start < y->start) ? -1 : 1;
+    }
+    return 0;
+}
+
+/**
+ * Round a list of ranges out to whole blocks, sort it, and merge the ranges which overlap
+ * or touch.
+ *
+ * @param ranges        The ranges.
+ * @param num           The number of ranges.
+ * @param block_size    The block size, or 0 to leave the ranges as they are.
+ *
+ * @return              The new number of ranges.
+ */
+static uint32_t kibosh_ranges_normalize(struct kibosh_range *ranges, uint32_t num,
+                                        uint32_t block_size)
+{
+    uint32_t i, j = 0;
+
+    if (num == 0) {
+        return 0;
+    }
+    if (block_size) {
+        for (i = 0; i < num; i++) {
+            ranges[i].start -= ranges[i].start % block_size;
+            ranges[i].end += block_size - 1 - (ranges[i].end % block_size);
+        }
+    }
+    qsort(ranges, num, sizeof(ranges[0]), kibosh_range_compare);
+    for (i = 1; i < num; i++) {
+        if (ranges[i].start <= ranges[j].end + 1) {
+            if (ranges[i].end > ranges[j].end) {
+                ranges[j].end = ranges[i].end;
+            }
+        } else {
+            ranges[++j] = ranges[i];
+        }
+    }
+    return j + 1;
+}
+
+/**
+ * Check whether an I/O overlaps any of the ranges of a fault.
+ */
+static int kibosh_fault_overlaps(const struct kibosh_fault_base *fault, uint64_t offset,
+                                 uint64_t size)
+{
+    uint32_t idx;
+
+    if (size == 0) {
+        return 0;
+    }
+    idx = kibosh_fault_range_find(fault, offset);
+    return (idx < fault->num_ranges) && ((fault->ranges[idx].start <= offset) ||
+                                         (fault->ranges[idx].start - offset < size));
+}
+
+/**
+ * Write the block size and ranges of a fault, if it has any.
+ */
+static void kibosh_fault_ranges_write(const struct kibosh_fault_base *fault,
+                                      struct json_writer *w)
+{
+    uint32_t i;
+
+    if (fault->block_size) {
+        json_writer_uint(w, "block_size", fault->block_size);
+    }
+    if (!fault->num_ranges) {
         return;
+    }
+    json_writer_begin_array(w, "ranges");
+    for (i = 0; i < fault->num_ranges; i++) {
+        json_writer_begin_object(w, NULL);
+        json_writer_uint(w, "start", fault->ranges[i].start);
+        json_writer_uint(w, "end", fault->ranges[i].end);
+        json_writer_end_object(w);
+    }
+    json_writer_end_array(w);
+}
+
+/**
+ * Check whether two faults have the same ranges.
+ */
+static int kibosh_fault_ranges_equal(const struct kibosh_fault_base *a,
+                                     const struct kibosh_fault_base *b)
+{
+    if ((a->block_size != b->block_size) || (a->num_ranges != b->num_ranges)) {
+        return 0;
+    }
+    return (a->num_ranges == 0) ||
+        (memcmp(a->ranges, b->ranges, a->num_ranges * sizeof(struct kibosh_range)) == 0);
+}
+
+/**
+ * Check whether a path passes the prefix, suffix, and pattern of a fault.
+ */
+static int kibosh_fault_path_matches(const struct kibosh_fault_base *fault, const char *path,
+                                     size_t path_len)
+{
+    if (!path_matches(path, fault->prefix, fault->suffix)) {
+        return 0;
+    }
+    return (!fault->dfa) || pattern_matches(fault->dfa, path, path_len);
+}
+
+/**
+ * Write a fault object.
+ *
+ * @param fault         The fault.
+ * @param with_state    Nonzero if we should also write the mutable state of the fault.
+ * @param w             The JSON writer.
+ */
+static void kibosh_fault_base_write(const struct kibosh_fault_base *fault, int with_state,
+                                    struct json_writer *w)
+{
+    json_writer_begin_object(w, NULL);
+    // Put the ID first, so that it is easy to spot.
+    if (fault->id && fault->id[0]) {
+        json_writer_str(w, "id", fault->id);
+    }
+    json_writer_str(w, "type", kibosh_fault_type_name((struct kibosh_fault_base*)fault));
+    json_writer_str(w, "prefix", fault->prefix);
+    json_writer_str(w, "suffix", fault->suffix);
+    if (fault->pattern) {
+        json_writer_str(w, pattern_type_name(fault->pattern_type), fault->pattern);
+    }
     switch (fault->type) {
         case KIBOSH_FAULT_TYPE_UNREADABLE:
-            kibosh_fault_unreadable_free((struct kibosh_fault_unreadable*)fault);
+            kibosh_fault_unreadable_unparse(
+                    (const struct kibosh_fault_unreadable*)fault, w);
             break;
         case KIBOSH_FAULT_TYPE_READ_DELAY:
-            kibosh_fault_read_delay_free((struct kibosh_fault_read_delay*)fault);
+            kibosh_fault_read_delay_unparse(
+                    (const struct kibosh_fault_read_delay*)fault, w);
             break;
         case KIBOSH_FAULT_TYPE_WRITE_DELAY:
-            kibosh_fault_write_delay_free((struct kibosh_fault_write_delay*)fault);
+            kibosh_fault_write_delay_unparse(
+                    (const struct kibosh_fault_write_delay*)fault, w);
             break;
         case KIBOSH_FAULT_TYPE_UNWRITABLE:
-            kibosh_fault_unwritable_free((struct kibosh_fault_unwritable*)fault);
+            kibosh_fault_unwritable_unparse(
+                    (const struct kibosh_fault_unwritable*)fault, w);
             break;
         case KIBOSH_FAULT_TYPE_READ_CORRUPT:
-            kibosh_fault_read_corrupt_free((struct kibosh_fault_read_corrupt*)fault);
+            kibosh_fault_read_corrupt_unparse(
+                    (const struct kibosh_fault_read_corrupt*)fault, w);
             break;
         case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
-            kibosh_fault_write_corrupt_free((struct kibosh_fault_write_corrupt*)fault);
+            kibosh_fault_write_corrupt_unparse(
+                    (const struct kibosh_fault_write_corrupt*)fault, w);
+            break;
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            kibosh_fault_torn_write_unparse(
+                    (const struct kibosh_fault_torn_write*)fault, w);
+            break;
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            kibosh_fault_write_back_unparse(
+                    (const struct kibosh_fault_write_back*)fault, w);
             break;
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            kibosh_fault_stale_read_unparse(
+                    (const struct kibosh_fault_stale_read*)fault, w);
+            break;
+    }
+    // The time window and ramp are left out when they are not used.
+    if (fault->start_ms) {
+        json_writer_uint(w, "start_ms", fault->start_ms);
+    }
+    if (fault->end_ms) {
+        json_writer_uint(w, "end_ms", fault->end_ms);
+    }
+    if (fault->ramp_ms) {
+        json_writer_uint(w, "ramp_ms", fault->ramp_ms);
+    }
+    if (fault->ramp_from != 0.0) {
+        json_writer_double(w, "ramp_from", fault->ramp_from);
+    }
+    if (fault->burst_enter > 0.0) {
+        json_writer_double(w, "burst_enter", fault->burst_enter);
+        json_writer_double(w, "burst_exit", fault->burst_exit);
+        json_writer_double(w, "good_fraction", fault->good_fraction);
+        json_writer_double(w, "bad_fraction", fault->bad_fraction);
+    }
+    kibosh_fault_match_write(&fault->match, w);
+    kibosh_fault_inodes_write(fault, w);
+    kibosh_fault_ranges_write(fault, w);
+    if (with_state && fault->state) {
+        json_writer_begin_object(w, "state");
+        json_writer_uint(w, "hits", fault->state->hits);
+        json_writer_int(w, "count", fault->state->count);
+        if (fault->burst_enter > 0.0) {
+            json_writer_int(w, "burst_bad",
+                            __atomic_load_n(&fault->state->burst_bad, __ATOMIC_RELAXED));
+        }
+        json_writer_end_object(w);
     }
+    json_writer_end_object(w);
 }
 
-int faults_calloc(struct kibosh_faults **out)
+char *kibosh_fault_base_unparse(struct kibosh_fault_base *fault)
 {
-    struct kibosh_faults *faults;
+    struct json_writer w;
 
-    faults = calloc(1, sizeof(struct kibosh_faults));
-    if (!faults)
-        return -ENOMEM;
-    faults->list = calloc(1, sizeof(struct kibosh_fault_base *));
-    if (!faults->list) {
-        free(faults);
-        return -ENOMEM;
+    json_writer_init(&w);
+    kibosh_fault_base_write(fault, 0, &w);
+    return json_writer_finish(&w);
+}
+
+/**
+ * Get the operations which a fault of the given type applies to.
+ */
+static uint32_t kibosh_fault_type_ops(enum kibosh_fault_type type)
+{
+    switch (type) {
+        case KIBOSH_FAULT_TYPE_UNREADABLE:
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
+            return KIBOSH_OP_READ;
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            return KIBOSH_OP_WRITE;
     }
-    *out = faults;
     return 0;
 }
 
-const char *kibosh_fault_type_name(struct kibosh_fault_base *fault)
+/**
+ * Get the size of the fault structure for the given type.
+ */
+static size_t kibosh_fault_type_size(enum kibosh_fault_type type)
 {
-    switch (fault->type) {
+    switch (type) {
         case KIBOSH_FAULT_TYPE_UNREADABLE:
-            return KIBOSH_FAULT_TYPE_UNREADABLE_NAME;
+            return sizeof(struct kibosh_fault_unreadable);
         case KIBOSH_FAULT_TYPE_READ_DELAY:
-            return KIBOSH_FAULT_TYPE_READ_DELAY_NAME;
-        case KIBOSH_FAULT_TYPE_UNWRITABLE:
-            return KIBOSH_FAULT_TYPE_UNWRITABLE_NAME;
+            return sizeof(struct kibosh_fault_read_delay);
         case KIBOSH_FAULT_TYPE_WRITE_DELAY:
-            return KIBOSH_FAULT_TYPE_WRITE_DELAY_NAME;
+            return sizeof(struct kibosh_fault_write_delay);
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+            return sizeof(struct kibosh_fault_unwritable);
         case KIBOSH_FAULT_TYPE_READ_CORRUPT:
-            return KIBOSH_FAULT_TYPE_READ_CORRUPT_NAME;
+            return sizeof(struct kibosh_fault_read_corrupt);
         case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
-            return KIBOSH_FAULT_TYPE_WRITE_CORRUPT_NAME;
+            return sizeof(struct kibosh_fault_write_corrupt);
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            return sizeof(struct kibosh_fault_torn_write);
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            return sizeof(struct kibosh_fault_lost_write);
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            return sizeof(struct kibosh_fault_write_back);
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            return sizeof(struct kibosh_fault_stale_read);
+    }
+    return sizeof(struct kibosh_fault_base);
+}
+
+/**
+ * Check whether a fault has a time window or a ramp.
+ */
+static int kibosh_fault_is_timed(const struct kibosh_fault_base *fault)
+{
+    return fault->start_ms || fault->end_ms || fault->ramp_ms;
+}
+
+/**
+ * Get the chance that a fault fires when it matches, once any ramp is over.
+ */
+static double kibosh_fault_fraction(const struct kibosh_fault_base *fault)
+{
+    switch (fault->type) {
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+            return ((const struct kibosh_fault_read_delay*)fault)->fraction;
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            return ((const struct kibosh_fault_write_delay*)fault)->fraction;
         default:
-            return "(unknown)";
+            return 1.0;
+    }
+}
+
+/**
+ * Decide whether a fault which matches the path and operation should fire this time.
+ *
+ * @param fault     The fault.
+ * @param now_ms    The coarse monotonic time.  Only used if the fault is compiled and
+ *                  has a time window or a ramp.
+ */
+static int kibosh_fault_fires(const struct kibosh_fault_base *fault, uint64_t now_ms)
+{
+    double fraction = kibosh_fault_fraction(fault);
+    uint64_t elapsed = UINT64_MAX;
+    int sampled = 0, bad;
+
+    if (fault->state && kibosh_fault_is_timed(fault)) {
+        elapsed = (now_ms > fault->state->activated_ms) ?
+            (now_ms - fault->state->activated_ms) : 0;
+        if (elapsed < fault->start_ms) {
+            return 0;
+        }
+        if (fault->end_ms && (elapsed >= fault->end_ms)) {
+            return 0;
+        }
+        elapsed -= fault->start_ms;
+    }
+    if (fault->state && (fault->burst_enter > 0.0)) {
+        // Take one step of the Markov chain.  A racing update could lose a step, which
+        // does not matter to the model, so we do not need a compare-and-swap loop.
+        bad = __atomic_load_n(&fault->state->burst_bad, __ATOMIC_RELAXED);
+        if (bad ? (drand48() < fault->burst_exit) : (drand48() < fault->burst_enter)) {
+            bad = !bad;
+            __atomic_store_n(&fault->state->burst_bad, bad, __ATOMIC_RELAXED);
+        }
+        fraction = bad ? fault->bad_fraction : fault->good_fraction;
+        sampled = 1;
+    }
+    if (elapsed < fault->ramp_ms) {
+        fraction = fault->ramp_from +
+            ((fraction - fault->ramp_from) * elapsed) / fault->ramp_ms;
+        sampled = 1;
+    }
+    if (sampled) {
+        return drand48() < fraction;
+    }
+    switch (fault->type) {
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            return drand48() <= fraction;
+        default:
+            return 1;
+    }
+}
+
+int kibosh_fault_matches(struct kibosh_fault_base *fault, const struct kibosh_io *io)
+{
+    uint64_t now_ms = 0;
+
+    if (!(kibosh_fault_type_ops(fault->type) & io->op)) {
+        return 0;
+    }
+    if (!kibosh_fault_match_eval(&fault->match, io)) {
+        return 0;
+    }
+    if (fault->has_inodes) {
+        if (!kibosh_fault_has_inode(fault, io->dev, io->ino)) {
+            return 0;
+        }
+    } else if (!kibosh_fault_path_matches(fault, io->path, strlen(io->path))) {
+        return 0;
+    }
+    if (fault->num_ranges && !kibosh_fault_overlaps(fault, io->offset, io->size)) {
+        return 0;
+    }
+    if (fault->state && kibosh_fault_is_timed(fault)) {
+        now_ms = monotonic_coarse_ms();
+    }
+    return kibosh_fault_fires(fault, now_ms);
+}
+
+void kibosh_fault_base_free(struct kibosh_fault_base *fault)
+{
+    if (!fault)
+        return;
+    free(fault->id);
+    free(fault->pattern);
+    free(fault->dfa);
+    free(fault->inodes);
+    free(fault->ranges);
+    switch (fault->type) {
+        case KIBOSH_FAULT_TYPE_UNREADABLE:
+            kibosh_fault_unreadable_free((struct kibosh_fault_unreadable*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+            kibosh_fault_read_delay_free((struct kibosh_fault_read_delay*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            kibosh_fault_write_delay_free((struct kibosh_fault_write_delay*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+            kibosh_fault_unwritable_free((struct kibosh_fault_unwritable*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
+            kibosh_fault_read_corrupt_free((struct kibosh_fault_read_corrupt*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
+            kibosh_fault_write_corrupt_free((struct kibosh_fault_write_corrupt*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            kibosh_fault_torn_write_free((struct kibosh_fault_torn_write*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            kibosh_fault_lost_write_free((struct kibosh_fault_lost_write*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            kibosh_fault_write_back_free((struct kibosh_fault_write_back*)fault);
+            break;
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            kibosh_fault_stale_read_free((struct kibosh_fault_stale_read*)fault);
+            break;
+    }
+}
+
+int faults_calloc(struct kibosh_faults **out)
+{
+    return faults_compile(NULL, 0, out);
+}
+
+const char *kibosh_fault_type_name(struct kibosh_fault_base *fault)
+{
+    switch (fault->type) {
+        case KIBOSH_FAULT_TYPE_UNREADABLE:
+            return KIBOSH_FAULT_TYPE_UNREADABLE_NAME;
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+            return KIBOSH_FAULT_TYPE_READ_DELAY_NAME;
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+            return KIBOSH_FAULT_TYPE_UNWRITABLE_NAME;
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            return KIBOSH_FAULT_TYPE_WRITE_DELAY_NAME;
+        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
+            return KIBOSH_FAULT_TYPE_READ_CORRUPT_NAME;
+        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
+            return KIBOSH_FAULT_TYPE_WRITE_CORRUPT_NAME;
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            return KIBOSH_FAULT_TYPE_TORN_WRITE_NAME;
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            return KIBOSH_FAULT_TYPE_LOST_WRITE_NAME;
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            return KIBOSH_FAULT_TYPE_WRITE_BACK_NAME;
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            return KIBOSH_FAULT_TYPE_STALE_READ_NAME;
+        default:
+            return "(unknown)";
+    }
+}
+
+/////
+///// kibosh_faults
+/////
+#define FAULTS_ALIGN(x) (((x) + 7) & ~((size_t)7))
+
+/**
+ * Allocate the arena for a kibosh_faults structure, and set up its arrays.
+ *
+ * @param num       The number of faults.
+ * @param objs_len  The total size of the fault objects, each rounded up with FAULTS_ALIGN.
+ * @param strs_len  The total size of the string table.
+ * @param num_inodes    The total number of inodes targeted by the faults.
+ * @param objs      (out param) where the fault objects should be placed.
+ *
+ * @return          The new kibosh_faults structure, or NULL on OOM.
+ */
+static struct kibosh_faults *faults_arena_alloc(int num, size_t objs_len, size_t strs_len,
+                                                size_t num_inodes, char **objs)
+{
+    struct kibosh_faults *faults;
+    size_t len, list_off, states_off, objs_off, masks_off, slots_off, types_off, strs_off;
+    size_t num_slots = 0;
+    char *arena;
+
+    list_off = FAULTS_ALIGN(sizeof(struct kibosh_faults));
+    states_off = FAULTS_ALIGN(list_off + ((num + 1) * sizeof(struct kibosh_fault_base *)));
+    objs_off = FAULTS_ALIGN(states_off + (num * sizeof(struct kibosh_fault_state)));
+    masks_off = objs_off + objs_len;
+    // The op masks are followed by five more arrays of uint32_t: the prefix offsets, the
+    // prefix lengths, the suffix offsets, the suffix lengths, and the match tests.
+    slots_off = FAULTS_ALIGN(masks_off + (6 * num * sizeof(uint32_t)));
+    if (num_inodes > 0) {
+        // Keep the inode hash table at most half full.
+        for (num_slots = 1; num_slots < 2 * num_inodes; num_slots *= 2)
+            ;
+    }
+    types_off = slots_off + (num_slots * sizeof(struct kibosh_inode_slot));
+    strs_off = types_off + (num * sizeof(uint8_t));
+    len = strs_off + strs_len;
+    if (len > UINT32_MAX) {
+        INFO("%s: fault set is too large (%zd bytes).\n", __func__, len);
+        return NULL;
+    }
+    arena = calloc(1, len);
+    if (!arena) {
+        INFO("%s: out of memory when trying to allocate %zd bytes for %d faults.\n",
+             __func__, len, num);
+        return NULL;
+    }
+    faults = (struct kibosh_faults *)arena;
+    faults->num_faults = num;
+    faults->list = (struct kibosh_fault_base **)(arena + list_off);
+    faults->states = (struct kibosh_fault_state *)(arena + states_off);
+    faults->op_masks = (uint32_t *)(arena + masks_off);
+    faults->prefix_offs = faults->op_masks + num;
+    faults->prefix_lens = faults->prefix_offs + num;
+    faults->suffix_offs = faults->prefix_lens + num;
+    faults->suffix_lens = faults->suffix_offs + num;
+    faults->match_tests = faults->suffix_lens + num;
+    faults->inode_slots = (struct kibosh_inode_slot *)(arena + slots_off);
+    faults->num_inode_slots = num_slots;
+    faults->types = (uint8_t *)(arena + types_off);
+    faults->strs = arena + strs_off;
+    faults->created_ms = monotonic_coarse_ms();
+    faults->list[num] = NULL;
+    *objs = arena + objs_off;
+    return faults;
+}
+
+static uint32_t faults_inode_hash(uint64_t dev, uint64_t ino, uint32_t fault)
+{
+    uint64_t hash = (ino * 0x9e3779b97f4a7c15ULL) ^ (dev * 0xc2b2ae3d27d4eb4fULL) ^ fault;
+
+    hash ^= hash >> 29;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * Add an inode targeted by a fault to the inode hash table.
+ */
+static void faults_inode_insert(struct kibosh_faults *faults, int i,
+                                const struct kibosh_inode *inode)
+{
+    uint32_t mask = faults->num_inode_slots - 1;
+    uint32_t slot = faults_inode_hash(inode->dev, inode->ino, i) & mask;
+
+    while (faults->inode_slots[slot].fault) {
+        slot = (slot + 1) & mask;
+    }
+    faults->inode_slots[slot].dev = inode->dev;
+    faults->inode_slots[slot].ino = inode->ino;
+    faults->inode_slots[slot].fault = i + 1;
+}
+
+/**
+ * Check whether a compiled fault targets the inode of an I/O operation.
+ */
+static int faults_inode_matches(const struct kibosh_faults *faults, int i,
+                                const struct kibosh_io *io)
+{
+    const struct kibosh_inode_slot *s;
+    uint32_t mask = faults->num_inode_slots - 1, slot;
+
+    if (!faults->num_inode_slots) {
+        return 0;
+    }
+    slot = faults_inode_hash(io->dev, io->ino, i) & mask;
+    for (; (s = &faults->inode_slots[slot])->fault; slot = (slot + 1) & mask) {
+        if ((s->fault == (uint32_t)i + 1) && (s->dev == io->dev) && (s->ino == io->ino)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Link a fault object which has been placed in the arena into the kibosh_faults
+ * structure.  The fault's strings must already be in the string table, and its inodes
+ * and ranges must already be in the arena.
+ *
+ * @param faults        The faults.
+ * @param i             The index of the fault.
+ * @param fault         The fault object, inside the arena.
+ * @param prefix_off    The offset of the prefix in the string table.
+ * @param prefix_len    The length of the prefix.
+ * @param suffix_off    The offset of the suffix in the string table.
+ * @param suffix_len    The length of the suffix.
+ * @param id_off        The offset of the ID in the string table.
+ * @param state         The state to give the fault, or NULL to give it a fresh state.
+ */
+static void faults_arena_link(struct kibosh_faults *faults, int i,
+                              struct kibosh_fault_base *fault,
+                              uint32_t prefix_off, uint32_t prefix_len,
+                              uint32_t suffix_off, uint32_t suffix_len, uint32_t id_off,
+                              const struct kibosh_fault_state *state)
+{
+    uint32_t j;
+
+    faults->list[i] = fault;
+    faults->op_masks[i] = kibosh_fault_type_ops(fault->type);
+    faults->types[i] = fault->type;
+    faults->prefix_offs[i] = prefix_off;
+    faults->prefix_lens[i] = prefix_len;
+    faults->suffix_offs[i] = suffix_off;
+    faults->suffix_lens[i] = suffix_len;
+    faults->match_tests[i] = fault->match.tests;
+    if (fault->has_inodes) {
+        faults->match_tests[i] |= KIBOSH_MATCH_INODE;
+    }
+    if (fault->num_ranges) {
+        faults->match_tests[i] |= KIBOSH_MATCH_RANGES;
+    }
+    for (j = 0; j < fault->num_inodes; j++) {
+        faults_inode_insert(faults, i, &fault->inodes[j]);
+    }
+    fault->prefix = faults->strs + prefix_off;
+    fault->suffix = faults->strs + suffix_off;
+    fault->id = faults->strs + id_off;
+    fault->state = &faults->states[i];
+    if (kibosh_fault_is_timed(fault)) {
+        faults->timed = 1;
+    }
+    if (state) {
+        *fault->state = *state;
+        return;
+    }
+    fault->state->activated_ms = faults->created_ms;
+    if (fault->type == KIBOSH_FAULT_TYPE_READ_CORRUPT) {
+        fault->state->count = ((struct kibosh_fault_read_corrupt *)fault)->count;
+    } else if (fault->type == KIBOSH_FAULT_TYPE_WRITE_CORRUPT) {
+        fault->state->count = ((struct kibosh_fault_write_corrupt *)fault)->count;
+    } else {
+        fault->state->count = -1;
+    }
+}
+
+/**
+ * Compile a list of faults into a kibosh_faults structure.
+ *
+ * @param list      The faults to compile.
+ * @param states    If this is non-NULL, the state to give each compiled fault.  NULL
+ *                  entries mean that the fault gets a fresh state.
+ * @param num       The number of faults in the list.
+ * @param out       (out param) the dynamically allocated kibosh_faults structure.
+ *
+ * @return          0 on success; -ENOMEM on OOM.
+ */
+static int faults_compile_with_states(struct kibosh_fault_base * const *list,
+                                      const struct kibosh_fault_state * const *states,
+                                      int num, struct kibosh_faults **out)
+{
+    struct kibosh_faults *faults;
+    size_t objs_len = 0, strs_len = 0, str_off = 0, num_inodes = 0, inodes_len, ranges_len;
+    uint32_t prefix_off, prefix_len, suffix_off, suffix_len, id_off;
+    const char *id;
+    char *obj;
+    int i;
+
+    for (i = 0; i < num; i++) {
+        objs_len += FAULTS_ALIGN(kibosh_fault_type_size(list[i]->type));
+        strs_len += strlen(list[i]->prefix) + strlen(list[i]->suffix) + 3;
+        if (list[i]->id) {
+            strs_len += strlen(list[i]->id);
+        }
+        if (list[i]->dfa) {
+            objs_len += FAULTS_ALIGN(list[i]->dfa->size);
+            strs_len += strlen(list[i]->pattern) + 1;
+        }
+        objs_len += FAULTS_ALIGN(list[i]->num_inodes * sizeof(struct kibosh_inode));
+        objs_len += FAULTS_ALIGN(list[i]->num_ranges * sizeof(struct kibosh_range));
+        num_inodes += list[i]->num_inodes;
+    }
+    faults = faults_arena_alloc(num, objs_len, strs_len, num_inodes, &obj);
+    if (!faults) {
+        return -ENOMEM;
+    }
+    for (i = 0; i < num; i++) {
+        struct kibosh_fault_base *fault = (struct kibosh_fault_base *)obj;
+        size_t size = kibosh_fault_type_size(list[i]->type);
+
+        memcpy(fault, list[i], size);
+        obj += FAULTS_ALIGN(size);
+        if (list[i]->dfa) {
+            // The compiled pattern goes right after the fault object.
+            fault->dfa = (struct pattern *)obj;
+            memcpy(obj, list[i]->dfa, list[i]->dfa->size);
+            obj += FAULTS_ALIGN(list[i]->dfa->size);
+            fault->pattern = faults->strs + str_off;
+            strcpy(fault->pattern, list[i]->pattern);
+            str_off += strlen(list[i]->pattern) + 1;
+        }
+        if (list[i]->num_inodes) {
+            inodes_len = list[i]->num_inodes * sizeof(struct kibosh_inode);
+            fault->inodes = (struct kibosh_inode *)obj;
+            memcpy(obj, list[i]->inodes, inodes_len);
+            obj += FAULTS_ALIGN(inodes_len);
+        }
+        if (list[i]->num_ranges) {
+            ranges_len = list[i]->num_ranges * sizeof(struct kibosh_range);
+            fault->ranges = (struct kibosh_range *)obj;
+            memcpy(obj, list[i]->ranges, ranges_len);
+            obj += FAULTS_ALIGN(ranges_len);
+        }
+        prefix_off = str_off;
+        prefix_len = strlen(list[i]->prefix);
+        memcpy(faults->strs + str_off, list[i]->prefix, prefix_len + 1);
+        str_off += prefix_len + 1;
+        suffix_off = str_off;
+        suffix_len = strlen(list[i]->suffix);
+        memcpy(faults->strs + str_off, list[i]->suffix, suffix_len + 1);
+        str_off += suffix_len + 1;
+        id_off = str_off;
+        id = list[i]->id ? list[i]->id : "";
+        strcpy(faults->strs + str_off, id);
+        str_off += strlen(id) + 1;
+        faults_arena_link(faults, i, fault, prefix_off, prefix_len, suffix_off, suffix_len,
+                          id_off, states ? states[i] : NULL);
+    }
+    *out = faults;
+    return 0;
+}
+
+int faults_compile(struct kibosh_fault_base * const *list, int num,
+                   struct kibosh_faults **out)
+{
+    return faults_compile_with_states(list, NULL, num, out);
+}
+
+static int compare_id_ptrs(const void *a, const void *b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/**
+ * Check that no two faults in a list have the same non-empty ID.
+ *
+ * @return          0 if the IDs are unique; -EEXIST if they are not; -ENOMEM on OOM.
+ */
+static int check_unique_ids(struct kibosh_fault_base * const *list, int num)
+{
+    const char **ids;
+    int i, num_ids = 0, ret = 0;
+
+    ids = calloc(num + 1, sizeof(char *));
+    if (!ids)
+        return -ENOMEM;
+    for (i = 0; i < num; i++) {
+        if (list[i]->id && list[i]->id[0]) {
+            ids[num_ids++] = list[i]->id;
+        }
+    }
+    qsort(ids, num_ids, sizeof(char *), compare_id_ptrs);
+    for (i = 1; i < num_ids; i++) {
+        if (strcmp(ids[i - 1], ids[i]) == 0) {
+            INFO("%s: more than one fault has the ID \"%s\".\n", __func__, ids[i]);
+            ret = -EEXIST;
+            break;
+        }
+    }
+    free(ids);
+    return ret;
+}
+
+/**
+ * The fields which can appear in a fault object.
+ */
+enum fault_field {
+    FAULT_FIELD_UNKNOWN = 0,
+    FAULT_FIELD_ID,
+    FAULT_FIELD_TYPE,
+    FAULT_FIELD_PREFIX,
+    FAULT_FIELD_SUFFIX,
+    FAULT_FIELD_CODE,
+    FAULT_FIELD_DELAY_MS,
+    FAULT_FIELD_FRACTION,
+    FAULT_FIELD_MODE,
+    FAULT_FIELD_COUNT,
+    FAULT_FIELD_START_MS,
+    FAULT_FIELD_END_MS,
+    FAULT_FIELD_RAMP_MS,
+    FAULT_FIELD_RAMP_FROM,
+    FAULT_FIELD_BURST_EXIT,
+    FAULT_FIELD_BURST_ENTER,
+    FAULT_FIELD_BAD_FRACTION,
+    FAULT_FIELD_GOOD_FRACTION,
+    FAULT_FIELD_MATCH,
+    FAULT_FIELD_GLOB,
+    FAULT_FIELD_REGEX,
+    FAULT_FIELD_PIN,
+    FAULT_FIELD_INODES,
+    FAULT_FIELD_RANGES,
+    FAULT_FIELD_BLOCK_SIZE,
+    FAULT_FIELD_SEED,
+    FAULT_FIELD_SECTOR_SIZE,
+    FAULT_FIELD_SHORT,
+    FAULT_FIELD_KB_PER_SEC,
+    FAULT_FIELD_DIRTY_LIMIT_KB,
+    FAULT_FIELD_WINDOW_MS,
+};
+
+static const char * const FAULT_FIELD_NAMES[] = {
+    [FAULT_FIELD_UNKNOWN] = "(unknown)",
+    [FAULT_FIELD_ID] = "id",
+    [FAULT_FIELD_TYPE] = "type",
+    [FAULT_FIELD_PREFIX] = "prefix",
+    [FAULT_FIELD_SUFFIX] = "suffix",
+    [FAULT_FIELD_CODE] = "code",
+    [FAULT_FIELD_DELAY_MS] = "delay_ms",
+    [FAULT_FIELD_FRACTION] = "fraction",
+    [FAULT_FIELD_MODE] = "mode",
+    [FAULT_FIELD_COUNT] = "count",
+    [FAULT_FIELD_START_MS] = "start_ms",
+    [FAULT_FIELD_END_MS] = "end_ms",
+    [FAULT_FIELD_RAMP_MS] = "ramp_ms",
+    [FAULT_FIELD_RAMP_FROM] = "ramp_from",
+    [FAULT_FIELD_BURST_EXIT] = "burst_exit",
+    [FAULT_FIELD_BURST_ENTER] = "burst_enter",
+    [FAULT_FIELD_BAD_FRACTION] = "bad_fraction",
+    [FAULT_FIELD_GOOD_FRACTION] = "good_fraction",
+    [FAULT_FIELD_MATCH] = "match",
+    [FAULT_FIELD_GLOB] = "glob",
+    [FAULT_FIELD_REGEX] = "regex",
+    [FAULT_FIELD_PIN] = "pin",
+    [FAULT_FIELD_INODES] = "inodes",
+    [FAULT_FIELD_RANGES] = "ranges",
+    [FAULT_FIELD_BLOCK_SIZE] = "block_size",
+    [FAULT_FIELD_SEED] = "seed",
+    [FAULT_FIELD_SECTOR_SIZE] = "sector_size",
+    [FAULT_FIELD_SHORT] = "short",
+    [FAULT_FIELD_KB_PER_SEC] = "kb_per_sec",
+    [FAULT_FIELD_DIRTY_LIMIT_KB] = "dirty_limit_kb",
+    [FAULT_FIELD_WINDOW_MS] = "window_ms",
+};
+
+#define FAULT_FIELD_BIT(field) (1U << (field))
+
+/**
+ * Look up a fault field by name.  Every name has a distinct length and first letter, except
+ * for "block_size" and "burst_exit", which differ in their second letter.  So this takes at
+ * most one comparison.
+ */
+static enum fault_field fault_field_lookup(const char *key, size_t len)
+{
+    enum fault_field field = FAULT_FIELD_UNKNOWN;
+
+    switch (len) {
+    case 2:
+        field = FAULT_FIELD_ID;
+        break;
+    case 3:
+        field = FAULT_FIELD_PIN;
+        break;
+    case 4:
+        field = (key[0] == 't') ? FAULT_FIELD_TYPE :
+                (key[0] == 'c') ? FAULT_FIELD_CODE :
+                (key[0] == 'g') ? FAULT_FIELD_GLOB :
+                (key[0] == 's') ? FAULT_FIELD_SEED : FAULT_FIELD_MODE;
+        break;
+    case 5:
+        field = (key[0] == 'c') ? FAULT_FIELD_COUNT :
+                (key[0] == 'r') ? FAULT_FIELD_REGEX :
+                (key[0] == 's') ? FAULT_FIELD_SHORT : FAULT_FIELD_MATCH;
+        break;
+    case 6:
+        field = (key[0] == 'p') ? FAULT_FIELD_PREFIX :
+                (key[0] == 's') ? FAULT_FIELD_SUFFIX :
+                (key[0] == 'i') ? FAULT_FIELD_INODES :
+                (key[0] == 'r') ? FAULT_FIELD_RANGES : FAULT_FIELD_END_MS;
+        break;
+    case 7:
+        field = FAULT_FIELD_RAMP_MS;
+        break;
+    case 8:
+        field = (key[0] == 'd') ? FAULT_FIELD_DELAY_MS :
+                (key[0] == 'f') ? FAULT_FIELD_FRACTION : FAULT_FIELD_START_MS;
+        break;
+    case 9:
+        field = (key[0] == 'w') ? FAULT_FIELD_WINDOW_MS : FAULT_FIELD_RAMP_FROM;
+        break;
+    case 10:
+        field = (key[1] == 'l') ? FAULT_FIELD_BLOCK_SIZE :
+                (key[0] == 'k') ? FAULT_FIELD_KB_PER_SEC : FAULT_FIELD_BURST_EXIT;
+        break;
+    case 11:
+        field = (key[0] == 's') ? FAULT_FIELD_SECTOR_SIZE : FAULT_FIELD_BURST_ENTER;
+        break;
+    case 12:
+        field = FAULT_FIELD_BAD_FRACTION;
+        break;
+    case 13:
+        field = FAULT_FIELD_GOOD_FRACTION;
+        break;
+    case 14:
+        field = FAULT_FIELD_DIRTY_LIMIT_KB;
+        break;
+    default:
+        return FAULT_FIELD_UNKNOWN;
+    }
+    if (memcmp(key, FAULT_FIELD_NAMES[field], len) != 0) {
+        return FAULT_FIELD_UNKNOWN;
+    }
+    return field;
+}
+
+/**
+ * Look up a fault type by name.
+ *
+ * @return          The fault type, or -1 if there is no such type.
+ */
+static int kibosh_fault_type_lookup(const char *name)
+{
+    static const enum kibosh_fault_type types[] = {
+        KIBOSH_FAULT_TYPE_UNREADABLE,
+        KIBOSH_FAULT_TYPE_READ_DELAY,
+        KIBOSH_FAULT_TYPE_UNWRITABLE,
+        KIBOSH_FAULT_TYPE_WRITE_DELAY,
+        KIBOSH_FAULT_TYPE_READ_CORRUPT,
+        KIBOSH_FAULT_TYPE_WRITE_CORRUPT,
+        KIBOSH_FAULT_TYPE_TORN_WRITE,
+        KIBOSH_FAULT_TYPE_LOST_WRITE,
+        KIBOSH_FAULT_TYPE_WRITE_BACK,
+        KIBOSH_FAULT_TYPE_STALE_READ,
+    };
+    struct kibosh_fault_base fault;
+    size_t i;
+
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        fault.type = types[i];
+        if (strcmp(name, kibosh_fault_type_name(&fault)) == 0) {
+            return types[i];
+        }
+    }
+    return -1;
+}
+
+/**
+ * Get the fields which a fault of the given type must have.
+ */
+static uint32_t kibosh_fault_type_required_fields(enum kibosh_fault_type type)
+{
+    switch (type) {
+        case KIBOSH_FAULT_TYPE_UNREADABLE:
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+            return FAULT_FIELD_BIT(FAULT_FIELD_CODE);
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            return FAULT_FIELD_BIT(FAULT_FIELD_DELAY_MS) |
+                FAULT_FIELD_BIT(FAULT_FIELD_FRACTION);
+        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
+        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
+            return FAULT_FIELD_BIT(FAULT_FIELD_MODE) | FAULT_FIELD_BIT(FAULT_FIELD_COUNT) |
+                FAULT_FIELD_BIT(FAULT_FIELD_FRACTION);
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            return FAULT_FIELD_BIT(FAULT_FIELD_MODE) | FAULT_FIELD_BIT(FAULT_FIELD_FRACTION);
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            return 0;
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            return FAULT_FIELD_BIT(FAULT_FIELD_KB_PER_SEC);
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            return FAULT_FIELD_BIT(FAULT_FIELD_WINDOW_MS);
+    }
+    return 0;
+}
+
+/**
+ * The fields of a fault object, gathered while streaming through it.  Strings are kept
+ * as offsets into the string table of the arena.
+ */
+struct fault_fields {
+    uint32_t present;
+    enum kibosh_fault_type type;
+    int64_t code;
+    int64_t delay_ms;
+    int64_t mode;
+    int64_t count;
+    double fraction;
+    int64_t start_ms;
+    int64_t end_ms;
+    int64_t ramp_ms;
+    double ramp_from;
+    double burst_enter;
+    double burst_exit;
+    double good_fraction;
+    double bad_fraction;
+    struct kibosh_fault_match match;
+    uint32_t id_off;
+    uint32_t prefix_off;
+    uint32_t prefix_len;
+    uint32_t suffix_off;
+    uint32_t suffix_len;
+    enum pattern_type pattern_type;
+    uint32_t pattern_off;
+    int pin;
+    int has_inodes;
+    int64_t block_size;
+    int seeded;
+    uint64_t seed;
+    int64_t sector_size;
+    int short_write;
+    uint32_t kb_per_sec;
+    uint32_t dirty_limit_kb;
+    uint32_t window_ms;
+};
+
+/**
+ * Builds a kibosh_faults structure from a stream of fault objects.
+ *
+ * This is used in two passes.  In the first pass, faults is NULL, and we only add up the
+ * sizes of the fault objects and the string table.  In the second pass, the objects and
+ * strings are written directly into the arena.
+ */
+struct faults_builder {
+    /**
+     * The faults, or NULL if this is the sizing pass.
+     */
+    struct kibosh_faults *faults;
+
+    /**
+     * The number of faults so far.
+     */
+    int num;
+
+    /**
+     * Where the fault objects go, or NULL if this is the sizing pass.
+     */
+    char *objs;
+
+    /**
+     * The offset of the next fault object.
+     */
+    size_t obj_off;
+
+    /**
+     * The next offset in the string table.
+     */
+    size_t str_off;
+
+    /**
+     * Nonzero if the document sets "compose" to true.
+     */
+    int compose;
+
+    /**
+     * The compiled pattern of the fault which is being parsed, or NULL.  It is copied into
+     * the arena, right after the fault object, once the whole fault has been parsed.
+     */
+    struct pattern *dfa;
+
+    /**
+     * The inodes of the fault which is being parsed.  They are copied into the arena
+     * after the fault object and its pattern.
+     */
+    struct kibosh_inode *inodes;
+    uint32_t num_inodes;
+    uint32_t cap_inodes;
+
+    /**
+     * The total number of inodes targeted by all faults so far.
+     */
+    size_t total_inodes;
+
+    /**
+     * The ranges of the fault which is being parsed.  They are copied into the arena after
+     * the fault object, its pattern, and its inodes.
+     */
+    struct kibosh_range *ranges;
+    uint32_t num_ranges;
+    uint32_t cap_ranges;
+};
+
+/**
+ * Add a string to the string table.
+ */
+static uint32_t faults_builder_add_str(struct faults_builder *b, const char *str, size_t len)
+{
+    uint32_t off = b->str_off;
+
+    if (b->faults) {
+        memcpy(b->faults->strs + off, str, len + 1);
+    }
+    b->str_off += len + 1;
+    return off;
+}
+
+/**
+ * Read the "inodes" list of a fault into the builder.  The BEGIN_ARRAY token has already
+ * been read.
+ *
+ * @return          0 on success; -EIO if the list was invalid; -ENOMEM on OOM.
+ */
+static int faults_builder_read_inodes(struct faults_builder *b, struct json_reader *r)
+{
+    struct kibosh_inode inode, *inodes;
+    enum json_token token;
+    uint64_t *field;
+    uint32_t cap;
+    int seen;
+
+    while ((token = json_reader_next(r)) == JSON_TOKEN_BEGIN_OBJECT) {
+        seen = 0;
+        while ((token = json_reader_next(r)) == JSON_TOKEN_KEY) {
+            field = NULL;
+            if (strcmp(r->str, "dev") == 0) {
+                field = &inode.dev;
+                seen |= 1;
+            } else if (strcmp(r->str, "ino") == 0) {
+                field = &inode.ino;
+                seen |= 2;
+            }
+            token = json_reader_next(r);
+            if ((!field) || (token != JSON_TOKEN_INTEGER) || (r->integer < 0)) {
+                goto invalid;
+            }
+            *field = r->integer;
+        }
+        if ((token != JSON_TOKEN_END_OBJECT) || (seen != 3)) {
+            goto invalid;
+        }
+        if (b->num_inodes == b->cap_inodes) {
+            cap = b->cap_inodes ? (b->cap_inodes * 2) : 16;
+            inodes = realloc(b->inodes, cap * sizeof(struct kibosh_inode));
+            if (!inodes) {
+                return -ENOMEM;
+            }
+            b->inodes = inodes;
+            b->cap_inodes = cap;
+        }
+        b->inodes[b->num_inodes++] = inode;
+    }
+    if (token == JSON_TOKEN_END_ARRAY) {
+        b->num_inodes = kibosh_inodes_normalize(b->inodes, b->num_inodes);
+        return 0;
+    }
+invalid:
+    if (token != JSON_TOKEN_ERROR) {
+        INFO("%s: inode %d was not an object with a \"dev\" and an \"ino\".\n",
+             __func__, b->num_inodes);
+    }
+    return -EIO;
+}
+
+/**
+ * Read the "ranges" list of a fault into the builder.  The BEGIN_ARRAY token has already
+ * been read.  The ranges are normalized once the block size is known.
+ *
+ * @return          0 on success; -EIO if the list was invalid; -ENOMEM on OOM.
+ */
+static int faults_builder_read_ranges(struct faults_builder *b, struct json_reader *r)
+{
+    struct kibosh_range range, *ranges;
+    enum json_token token;
+    uint64_t *field;
+    uint32_t cap;
+    int seen;
+
+    while ((token = json_reader_next(r)) == JSON_TOKEN_BEGIN_OBJECT) {
+        seen = 0;
+        while ((token = json_reader_next(r)) == JSON_TOKEN_KEY) {
+            field = NULL;
+            if (strcmp(r->str, "start") == 0) {
+                field = &range.start;
+                seen |= 1;
+            } else if (strcmp(r->str, "end") == 0) {
+                field = &range.end;
+                seen |= 2;
+            }
+            token = json_reader_next(r);
+            if ((!field) || (token != JSON_TOKEN_INTEGER) || (r->integer < 0)) {
+                goto invalid;
+            }
+            *field = r->integer;
+        }
+        if ((token != JSON_TOKEN_END_OBJECT) || (seen != 3) || (range.end < range.start)) {
+            goto invalid;
+        }
+        if (b->num_ranges == b->cap_ranges) {
+            cap = b->cap_ranges ? (b->cap_ranges * 2) : 16;
+            ranges = realloc(b->ranges, cap * sizeof(struct kibosh_range));
+            if (!ranges) {
+                return -ENOMEM;
+            }
+            b->ranges = ranges;
+            b->cap_ranges = cap;
+        }
+        b->ranges[b->num_ranges++] = range;
+    }
+    if (token == JSON_TOKEN_END_ARRAY) {
+        return 0;
+    }
+invalid:
+    if (token != JSON_TOKEN_ERROR) {
+        INFO("%s: range %d was not an object with a \"start\" and an \"end\".\n",
+             __func__, b->num_ranges);
+    }
+    return -EIO;
+}
+
+/**
+ * Read the fields of a fault object into a fault_fields structure.  The BEGIN_OBJECT token
+ * has already been read.
+ *
+ * Fields which are already set in f are overwritten, so that the fields of an update
+ * operation can be layered over those of the fault which it updates.
+ *
+ * @param b         The builder.
+ * @param r         The JSON reader.
+ * @param f         The fields.
+ * @param prev      The fault which is being updated, or NULL.  Its type and ID cannot be
+ *                  changed.
+ * @param seen      (out param) the set of FAULT_FIELD_BITs which appeared in the object.
+ *
+ * @return          0 on success; -EIO if the fault object was invalid; -ENOMEM on OOM.
+ */
+static int faults_builder_read_fields(struct faults_builder *b, struct json_reader *r,
+                                      struct fault_fields *f,
+                                      const struct kibosh_fault_base *prev, uint32_t *seen)
+{
+    enum fault_field field;
+    enum json_token token;
+    int type;
+
+    *seen = 0;
+    while ((token = json_reader_next(r)) == JSON_TOKEN_KEY) {
+        field = fault_field_lookup(r->str, r->str_len);
+        if (*seen & FAULT_FIELD_BIT(field)) {
+            INFO("%s: \"%s\" field appears more than once.\n", __func__,
+                 FAULT_FIELD_NAMES[field]);
+            return -EIO;
+        }
+        token = json_reader_next(r);
+        switch (field) {
+        case FAULT_FIELD_UNKNOWN:
+            if (json_reader_skip(r, token) < 0) {
+                return -EIO;
+            }
+            continue;
+        case FAULT_FIELD_ID:
+        case FAULT_FIELD_TYPE:
+        case FAULT_FIELD_PREFIX:
+        case FAULT_FIELD_SUFFIX:
+        case FAULT_FIELD_GLOB:
+        case FAULT_FIELD_REGEX:
+            if (token != JSON_TOKEN_STRING)
+                goto invalid;
+            break;
+        case FAULT_FIELD_FRACTION:
+            if (token != JSON_TOKEN_DOUBLE)
+                goto invalid;
+            f->fraction = r->dbl;
+            break;
+        case FAULT_FIELD_RAMP_FROM:
+        case FAULT_FIELD_BURST_ENTER:
+        case FAULT_FIELD_BURST_EXIT:
+        case FAULT_FIELD_GOOD_FRACTION:
+        case FAULT_FIELD_BAD_FRACTION:
+            if (token != JSON_TOKEN_DOUBLE)
+                goto invalid;
+            break;
+        case FAULT_FIELD_START_MS:
+        case FAULT_FIELD_END_MS:
+        case FAULT_FIELD_RAMP_MS:
+            if ((token != JSON_TOKEN_INTEGER) || (r->integer < 0) ||
+                    (r->integer > UINT32_MAX))
+                goto invalid;
+            break;
+        case FAULT_FIELD_MATCH:
+            if (token != JSON_TOKEN_BEGIN_OBJECT)
+                goto invalid;
+            if (kibosh_fault_match_read(r, &f->match) < 0)
+                return -EIO;
+            break;
+        case FAULT_FIELD_PIN:
+            if (token != JSON_TOKEN_BOOLEAN)
+                goto invalid;
+            f->pin = (r->integer != 0);
+            break;
+        case FAULT_FIELD_INODES:
+            b->num_inodes = 0;
+            f->has_inodes = 0;
+            if (token == JSON_TOKEN_NULL)
+                break;
+            if (token != JSON_TOKEN_BEGIN_ARRAY)
+                goto invalid;
+            if (faults_builder_read_inodes(b, r) < 0)
+                return -EIO;
+            f->has_inodes = 1;
+            break;
+        case FAULT_FIELD_RANGES:
+            b->num_ranges = 0;
+            if (token == JSON_TOKEN_NULL)
+                break;
+            if (token != JSON_TOKEN_BEGIN_ARRAY)
+                goto invalid;
+            if (faults_builder_read_ranges(b, r) < 0)
+                return -EIO;
+            break;
+        case FAULT_FIELD_BLOCK_SIZE:
+            if ((token != JSON_TOKEN_INTEGER) || (r->integer < 0) ||
+                    (r->integer > UINT32_MAX))
+                goto invalid;
+            f->block_size = r->integer;
+            break;
+        case FAULT_FIELD_SEED:
+            f->seeded = 0;
+            if (token == JSON_TOKEN_NULL)
+                break;
+            if (token != JSON_TOKEN_INTEGER)
+                goto invalid;
+            f->seeded = 1;
+            f->seed = r->integer;
+            break;
+        case FAULT_FIELD_SECTOR_SIZE:
+            if ((token != JSON_TOKEN_INTEGER) ||
+                    (!kibosh_torn_write_sector_size_valid(r->integer)))
+                goto invalid;
+            f->sector_size = r->integer;
+            break;
+        case FAULT_FIELD_SHORT:
+            if (token != JSON_TOKEN_BOOLEAN)
+                goto invalid;
+            f->short_write = (r->integer != 0);
+            break;
+        case FAULT_FIELD_KB_PER_SEC:
+            if ((token != JSON_TOKEN_INTEGER) || (r->integer < 1) ||
+                    (r->integer > UINT32_MAX))
+                goto invalid;
+            f->kb_per_sec = r->integer;
+            break;
+        case FAULT_FIELD_DIRTY_LIMIT_KB:
+            if ((token != JSON_TOKEN_INTEGER) || (r->integer < 0) ||
+                    (r->integer > UINT32_MAX))
+                goto invalid;
+            f->dirty_limit_kb = r->integer;
+            break;
+        case FAULT_FIELD_WINDOW_MS:
+            if ((token != JSON_TOKEN_INTEGER) || (r->integer < 1) ||
+                    (r->integer > UINT32_MAX))
+                goto invalid;
+            f->window_ms = r->integer;
+            break;
+        default:
+            if (token != JSON_TOKEN_INTEGER)
+                goto invalid;
+            break;
+        }
+        switch (field) {
+        case FAULT_FIELD_ID:
+            if (prev && (strcmp(r->str, prev->id) != 0)) {
+                INFO("%s: the ID of fault \"%s\" cannot be changed.\n", __func__, prev->id);
+                return -EIO;
+            }
+            f->id_off = faults_builder_add_str(b, r->str, r->str_len);
+            break;
+        case FAULT_FIELD_TYPE:
+            type = kibosh_fault_type_lookup(r->str);
+            if (type < 0) {
+                INFO("%s: Unknown fault type \"%s\".\n", __func__, r->str);
+                return -EIO;
+            }
+            if (prev && ((enum kibosh_fault_type)type != prev->type)) {
+                INFO("%s: the type of fault \"%s\" cannot be changed.\n", __func__,
+                     prev->id);
+                return -EIO;
+            }
+            f->type = type;
+            break;
+        case FAULT_FIELD_PREFIX:
+            f->prefix_off = faults_builder_add_str(b, r->str, r->str_len);
+            f->prefix_len = r->str_len;
+            break;
+        case FAULT_FIELD_SUFFIX:
+            f->suffix_off = faults_builder_add_str(b, r->str, r->str_len);
+            f->suffix_len = r->str_len;
+            break;
+        case FAULT_FIELD_GLOB:
+        case FAULT_FIELD_REGEX:
+            if (*seen & (FAULT_FIELD_BIT(FAULT_FIELD_GLOB) |
+                         FAULT_FIELD_BIT(FAULT_FIELD_REGEX))) {
+                INFO("%s: a fault cannot have both a \"glob\" and a \"regex\".\n",
+                     __func__);
+                return -EIO;
+            }
+            // A new pattern replaces the old one, and an empty one removes it.
+            free(b->dfa);
+            b->dfa = NULL;
+            f->pattern_type = 0;
+            if (r->str_len == 0) {
+                break;
+            }
+            f->pattern_type = (field == FAULT_FIELD_GLOB) ?
+                PATTERN_TYPE_GLOB : PATTERN_TYPE_REGEX;
+            if (pattern_compile(f->pattern_type, r->str, &b->dfa) < 0) {
+                return -EIO;
+            }
+            f->pattern_off = faults_builder_add_str(b, r->str, r->str_len);
+            break;
+        case FAULT_FIELD_CODE:
+            f->code = r->integer;
+            break;
+        case FAULT_FIELD_DELAY_MS:
+            f->delay_ms = r->integer;
+            break;
+        case FAULT_FIELD_MODE:
+            f->mode = r->integer;
+            break;
+        case FAULT_FIELD_COUNT:
+            f->count = r->integer;
+            break;
+        case FAULT_FIELD_START_MS:
+            f->start_ms = r->integer;
+            break;
+        case FAULT_FIELD_END_MS:
+            f->end_ms = r->integer;
+            break;
+        case FAULT_FIELD_RAMP_MS:
+            f->ramp_ms = r->integer;
+            break;
+        case FAULT_FIELD_RAMP_FROM:
+            f->ramp_from = r->dbl;
+            break;
+        case FAULT_FIELD_BURST_ENTER:
+            f->burst_enter = r->dbl;
+            break;
+        case FAULT_FIELD_BURST_EXIT:
+            f->burst_exit = r->dbl;
+            break;
+        case FAULT_FIELD_GOOD_FRACTION:
+            f->good_fraction = r->dbl;
+            break;
+        case FAULT_FIELD_BAD_FRACTION:
+            f->bad_fraction = r->dbl;
+            break;
+        default:
+            break;
+        }
+        f->present |= FAULT_FIELD_BIT(field);
+        *seen |= FAULT_FIELD_BIT(field);
+    }
+    if (token != JSON_TOKEN_END_OBJECT) {
+        return -EIO;
+    }
+    return 0;
+
+invalid:
+    if (token != JSON_TOKEN_ERROR) {
+        INFO("%s: No valid \"%s\" field found in fault object.\n", __func__,
+             FAULT_FIELD_NAMES[field]);
+    }
+    return -EIO;
+}
+
+/**
+ * Check the fields of a fault object, fill in the defaults, and add the fault to the
+ * builder.
+ *
+ * @return          0 on success; -EIO if the fault object was invalid.
+ */
+static int faults_builder_finish_fault(struct faults_builder *b, struct fault_fields *f)
+{
+    struct kibosh_fault_base *fault, common;
+    struct pattern *dfa = NULL;
+    struct kibosh_inode *inodes = NULL;
+    struct kibosh_range *ranges = NULL;
+    uint32_t missing;
+
+    if (!(f->present & FAULT_FIELD_BIT(FAULT_FIELD_TYPE))) {
+        INFO("%s: No \"type\" field found in fault object.\n", __func__);
+        return -EIO;
+    }
+    missing = kibosh_fault_type_required_fields(f->type) & ~f->present;
+    if (missing) {
+        INFO("%s: No valid \"%s\" field found in fault object.\n", __func__,
+             FAULT_FIELD_NAMES[__builtin_ctz(missing)]);
+        return -EIO;
+    }
+    if ((f->type == KIBOSH_FAULT_TYPE_TORN_WRITE) && (!kibosh_torn_write_mode_valid(f->mode))) {
+        INFO("%s: torn_write mode %" PRId64 " is not %d or %d.\n", __func__, f->mode,
+             TORN_WRITE_PREFIX, TORN_WRITE_SECTORS);
+        return -EIO;
+    }
+    if (!(f->present & FAULT_FIELD_BIT(FAULT_FIELD_BAD_FRACTION))) {
+        f->bad_fraction = 1.0;
+    }
+    if (!(f->present & FAULT_FIELD_BIT(FAULT_FIELD_SECTOR_SIZE))) {
+        f->sector_size = KIBOSH_TORN_WRITE_SECTOR_SIZE;
+    }
+    memset(&common, 0, sizeof(common));
+    common.start_ms = f->start_ms;
+    common.end_ms = f->end_ms;
+    common.ramp_ms = f->ramp_ms;
+    common.ramp_from = f->ramp_from;
+    common.burst_enter = f->burst_enter;
+    common.burst_exit = f->burst_exit;
+    common.good_fraction = f->good_fraction;
+    common.bad_fraction = f->bad_fraction;
+    if ((kibosh_fault_window_validate(&common) < 0) ||
+            (kibosh_fault_burst_validate(&common) < 0)) {
+        return -EIO;
+    }
+    if (!(f->present & FAULT_FIELD_BIT(FAULT_FIELD_PREFIX))) {
+        f->prefix_off = faults_builder_add_str(b, "/", 1);
+        f->prefix_len = 1;
+    }
+    if (!(f->present & FAULT_FIELD_BIT(FAULT_FIELD_SUFFIX))) {
+        f->suffix_off = faults_builder_add_str(b, "", 0);
+    }
+    if (!(f->present & FAULT_FIELD_BIT(FAULT_FIELD_ID))) {
+        f->id_off = faults_builder_add_str(b, "", 0);
+    }
+    b->num_ranges = kibosh_ranges_normalize(b->ranges, b->num_ranges, f->block_size);
+    fault = (struct kibosh_fault_base *)(b->objs + b->obj_off);
+    b->obj_off += FAULTS_ALIGN(kibosh_fault_type_size(f->type));
+    if (b->dfa) {
+        dfa = (struct pattern *)(b->objs + b->obj_off);
+        b->obj_off += FAULTS_ALIGN(b->dfa->size);
+    }
+    if (b->num_inodes) {
+        inodes = (struct kibosh_inode *)(b->objs + b->obj_off);
+        b->obj_off += FAULTS_ALIGN(b->num_inodes * sizeof(struct kibosh_inode));
+        b->total_inodes += b->num_inodes;
+    }
+    if (b->num_ranges) {
+        ranges = (struct kibosh_range *)(b->objs + b->obj_off);
+        b->obj_off += FAULTS_ALIGN(b->num_ranges * sizeof(struct kibosh_range));
+    }
+    b->num++;
+    if (!b->faults) {
+        free(b->dfa);
+        b->dfa = NULL;
+        return 0;
+    }
+    // The arena was zeroed when it was allocated, so we only need to set the fields.
+    fault->type = f->type;
+    fault->start_ms = f->start_ms;
+    fault->end_ms = f->end_ms;
+    fault->ramp_ms = f->ramp_ms;
+    fault->ramp_from = f->ramp_from;
+    fault->burst_enter = f->burst_enter;
+    fault->burst_exit = f->burst_exit;
+    fault->good_fraction = f->good_fraction;
+    fault->bad_fraction = f->bad_fraction;
+    fault->match = f->match;
+    if (b->dfa) {
+        memcpy(dfa, b->dfa, b->dfa->size);
+        free(b->dfa);
+        b->dfa = NULL;
+        fault->dfa = dfa;
+        fault->pattern = b->faults->strs + f->pattern_off;
+        fault->pattern_type = f->pattern_type;
+    }
+    fault->pin = f->pin;
+    fault->has_inodes = f->has_inodes;
+    if (b->num_inodes) {
+        memcpy(inodes, b->inodes, b->num_inodes * sizeof(struct kibosh_inode));
+        fault->inodes = inodes;
+        fault->num_inodes = b->num_inodes;
+    }
+    fault->block_size = f->block_size;
+    if (b->num_ranges) {
+        memcpy(ranges, b->ranges, b->num_ranges * sizeof(struct kibosh_range));
+        fault->ranges = ranges;
+        fault->num_ranges = b->num_ranges;
+    }
+    switch (f->type) {
+        case KIBOSH_FAULT_TYPE_UNREADABLE:
+            ((struct kibosh_fault_unreadable *)fault)->code = f->code;
+            break;
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+            ((struct kibosh_fault_unwritable *)fault)->code = f->code;
+            break;
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+            ((struct kibosh_fault_read_delay *)fault)->delay_ms = f->delay_ms;
+            ((struct kibosh_fault_read_delay *)fault)->fraction = f->fraction;
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            ((struct kibosh_fault_write_delay *)fault)->delay_ms = f->delay_ms;
+            ((struct kibosh_fault_write_delay *)fault)->fraction = f->fraction;
+            break;
+        case KIBOSH_FAULT_TYPE_READ_CORRUPT:
+            ((struct kibosh_fault_read_corrupt *)fault)->mode = f->mode;
+            ((struct kibosh_fault_read_corrupt *)fault)->count = f->count;
+            ((struct kibosh_fault_read_corrupt *)fault)->fraction = f->fraction;
+            ((struct kibosh_fault_read_corrupt *)fault)->seeded = f->seeded;
+            ((struct kibosh_fault_read_corrupt *)fault)->seed = f->seed;
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
+            ((struct kibosh_fault_write_corrupt *)fault)->mode = f->mode;
+            ((struct kibosh_fault_write_corrupt *)fault)->count = f->count;
+            ((struct kibosh_fault_write_corrupt *)fault)->fraction = f->fraction;
+            ((struct kibosh_fault_write_corrupt *)fault)->seeded = f->seeded;
+            ((struct kibosh_fault_write_corrupt *)fault)->seed = f->seed;
+            break;
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            ((struct kibosh_fault_torn_write *)fault)->mode = f->mode;
+            ((struct kibosh_fault_torn_write *)fault)->fraction = f->fraction;
+            ((struct kibosh_fault_torn_write *)fault)->sector_size = f->sector_size;
+            ((struct kibosh_fault_torn_write *)fault)->short_write = f->short_write;
+            break;
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            break;
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            ((struct kibosh_fault_write_back *)fault)->kb_per_sec = f->kb_per_sec;
+            ((struct kibosh_fault_write_back *)fault)->dirty_limit_kb = f->dirty_limit_kb;
+            break;
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            ((struct kibosh_fault_stale_read *)fault)->window_ms = f->window_ms;
+            break;
+    }
+    faults_arena_link(b->faults, b->num - 1, fault, f->prefix_off, f->prefix_len,
+                      f->suffix_off, f->suffix_len, f->id_off, NULL);
+    return 0;
+}
+
+/**
+ * Parse a fault object, and add it to the builder.  The BEGIN_OBJECT token has already
+ * been read.
+ *
+ * @return          0 on success; -EIO if the fault object was invalid; -ENOMEM on OOM.
+ */
+static int faults_builder_add_fault(struct faults_builder *b, struct json_reader *r)
+{
+    struct fault_fields f;
+    uint32_t seen;
+    int ret;
+
+    memset(&f, 0, sizeof(f));
+    b->num_inodes = 0;
+    b->num_ranges = 0;
+    ret = faults_builder_read_fields(b, r, &f, NULL, &seen);
+    if (ret < 0) {
+        return ret;
+    }
+    return faults_builder_finish_fault(b, &f);
+}
+
+/**
+ * Free the buffers which a builder uses while it parses a fault.
+ */
+static void faults_builder_clear(struct faults_builder *b)
+{
+    free(b->dfa);
+    b->dfa = NULL;
+    free(b->inodes);
+    b->inodes = NULL;
+    b->cap_inodes = 0;
+    free(b->ranges);
+    b->ranges = NULL;
+    b->cap_ranges = 0;
+}
+
+/**
+ * A return code from faults_stream_pass which means that the document contains
+ * incremental operations.
+ */
+#define FAULTS_STREAM_HAS_OPS 1
+
+/**
+ * A return code from faults_stream_pass which means that the document contains a
+ * scenario.
+ */
+#define FAULTS_STREAM_HAS_SCENARIO 2
+
+/**
+ * A return code from faults_stream_pass which means that the document contains a crash
+ * request.
+ */
+#define FAULTS_STREAM_HAS_CRASH 3
+
+/**
+ * Make one pass over a control JSON document.
+ *
+ * @param str       The document.
+ * @param len       The length of the document.
+ * @param allow_ops Nonzero if the document may contain incremental operations.
+ * @param b         The builder.
+ *
+ * @return          0 on success; FAULTS_STREAM_HAS_OPS, FAULTS_STREAM_HAS_SCENARIO, or
+ *                  FAULTS_STREAM_HAS_CRASH if allow_ops was set and the document contains
+ *                  incremental operations, a scenario, or a crash request; a negative
+ *                  error code otherwise.
+ */
+static int faults_stream_pass(const char *str, size_t len, int allow_ops,
+                              struct faults_builder *b)
+{
+    struct json_reader r;
+    enum json_token token;
+    int ret = -EIO, seen_faults = 0;
+
+    json_reader_init(&r, str, len);
+    if (json_reader_next(&r) != JSON_TOKEN_BEGIN_OBJECT) {
+        INFO("%s: the root of the control JSON was not an object.\n", __func__);
+        goto done;
+    }
+    while ((token = json_reader_next(&r)) == JSON_TOKEN_KEY) {
+        if (allow_ops && (strcmp(r.str, "ops") == 0)) {
+            ret = FAULTS_STREAM_HAS_OPS;
+            goto done;
+        }
+        if (allow_ops && (strcmp(r.str, "scenario") == 0)) {
+            ret = FAULTS_STREAM_HAS_SCENARIO;
+            goto done;
+        }
+        if (allow_ops && (strcmp(r.str, "crash") == 0)) {
+            ret = FAULTS_STREAM_HAS_CRASH;
+            goto done;
+        }
+        if (strcmp(r.str, "compose") == 0) {
+            token = json_reader_next(&r);
+            if (token != JSON_TOKEN_BOOLEAN) {
+                if (token != JSON_TOKEN_ERROR) {
+                    INFO("%s: \"compose\" was not a boolean.\n", __func__);
+                }
+                goto done;
+            }
+            b->compose = (r.integer != 0);
+            continue;
+        }
+        if (strcmp(r.str, "faults") != 0) {
+            if (json_reader_skip(&r, json_reader_next(&r)) < 0)
+                goto done;
+            continue;
+        }
+        if (seen_faults) {
+            INFO("%s: \"faults\" appears more than once.\n", __func__);
+            goto done;
+        }
+        seen_faults = 1;
+        token = json_reader_next(&r);
+        if (token != JSON_TOKEN_BEGIN_ARRAY) {
+            if (token != JSON_TOKEN_ERROR) {
+                INFO("%s: \"faults\" was not an array.\n", __func__);
+            }
+            goto done;
+        }
+        while ((token = json_reader_next(&r)) == JSON_TOKEN_BEGIN_OBJECT) {
+            ret = faults_builder_add_fault(b, &r);
+            if (ret < 0)
+                goto done;
+        }
+        ret = -EIO;
+        if (token != JSON_TOKEN_END_ARRAY) {
+            if (token != JSON_TOKEN_ERROR) {
+                INFO("%s: fault %d was not an object.\n", __func__, b->num);
+            }
+            goto done;
+        }
+    }
+    if ((token != JSON_TOKEN_END_OBJECT) || (json_reader_next(&r) != JSON_TOKEN_END)) {
+        goto done;
+    }
+    ret = 0;
+done:
+    if (r.error[0]) {
+        INFO("%s: failed to parse input string of length %zd: %s\n", __func__, len,
+             r.error);
+    }
+    faults_builder_clear(b);
+    json_reader_free(&r);
+    return ret;
+}
+
+/**
+ * Parse a control JSON document which contains a full set of faults.
+ *
+ * The document is streamed through twice: once to find out how big the arena needs to
+ * be, and once to fill it in.  No intermediate representation is built.
+ *
+ * @param str       The document.
+ * @param len       The length of the document.
+ * @param allow_ops Nonzero if the document may contain incremental operations.
+ * @param out       (out param) the new dynamically allocated kibosh_faults structure.
+ *
+ * @return          0 on success; FAULTS_STREAM_HAS_OPS, FAULTS_STREAM_HAS_SCENARIO, or
+ *                  FAULTS_STREAM_HAS_CRASH if allow_ops was set and the document contains
+ *                  incremental operations, a scenario, or a crash request; a negative
+ *                  error code otherwise.
+ */
+static int faults_stream_parse(const char *str, size_t len, int allow_ops,
+                               struct kibosh_faults **out)
+{
+    struct faults_builder b;
+    struct kibosh_faults *faults;
+    char *objs;
+    int ret;
+
+    memset(&b, 0, sizeof(b));
+    ret = faults_stream_pass(str, len, allow_ops, &b);
+    if (ret != 0) {
+        return ret;
+    }
+    faults = faults_arena_alloc(b.num, b.obj_off, b.str_off, b.total_inodes, &objs);
+    if (!faults) {
+        return -ENOMEM;
+    }
+    memset(&b, 0, sizeof(b));
+    b.faults = faults;
+    b.objs = objs;
+    ret = faults_stream_pass(str, len, 0, &b);
+    if (ret == 0) {
+        ret = check_unique_ids(faults->list, faults->num_faults);
+    }
+    faults->compose = b.compose;
+    if (ret < 0) {
+        faults_free(faults);
+        return ret;
+    }
+    *out = faults;
+    return 0;
+}
+
+/**
+ * Find the index of the fault with the given ID in a list of faults.
+ */
+static int list_find_id(struct kibosh_fault_base * const *list, int num, const char *id)
+{
+    int i;
+
+    for (i = 0; i < num; i++) {
+        if (list[i]->id && (strcmp(list[i]->id, id) == 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int faults_find_id(const struct kibosh_faults *faults, const char *id)
+{
+    return list_find_id(faults->list, faults->num_faults, id);
+}
+
+/**
+ * Read the fields of a fault object from a string.
+ *
+ * @param b         The builder.
+ * @param str       The fault object.
+ * @param len       The length of the fault object.
+ * @param f         The fields.
+ * @param prev      The fault which is being updated, or NULL.
+ * @param seen      (out param) the set of FAULT_FIELD_BITs which appeared in the object.
+ *
+ * @return          0 on success; -EIO if the fault object was invalid; -ENOMEM on OOM.
+ */
+static int faults_builder_read_object(struct faults_builder *b, const char *str, size_t len,
+                                      struct fault_fields *f,
+                                      const struct kibosh_fault_base *prev, uint32_t *seen)
+{
+    struct json_reader r;
+    int ret = -EIO;
+
+    json_reader_init(&r, str, len);
+    if (json_reader_next(&r) == JSON_TOKEN_BEGIN_OBJECT) {
+        ret = faults_builder_read_fields(b, &r, f, prev, seen);
+        if ((ret == 0) && (json_reader_next(&r) != JSON_TOKEN_END)) {
+            ret = -EIO;
+        }
+    }
+    if (r.error[0]) {
+        INFO("%s: failed to parse fault object of length %zd: %s\n", __func__, len,
+             r.error);
+    }
+    json_reader_free(&r);
+    return ret;
+}
+
+/**
+ * Parse the fault object of an "add" or "update" operation into a kibosh_faults structure
+ * which holds just that fault.
+ *
+ * An update is parsed by reading back the fields of the fault which it updates, and then
+ * reading the fields of the operation over them.  So the fault goes through exactly the
+ * same checks as one in a full set of faults.
+ *
+ * @param prev      The fault which is being updated, or NULL for an "add" operation.
+ * @param str       The fault object.
+ * @param len       The length of the fault object.
+ * @param seen      (out param) the set of FAULT_FIELD_BITs which appeared in the object.
+ * @param out       (out param) the new dynamically allocated kibosh_faults structure.
+ *
+ * @return          0 on success; -EINVAL if the fault object was invalid; -ENOMEM on OOM.
+ */
+static int faults_stream_fault(const struct kibosh_fault_base *prev, const char *str,
+                               size_t len, uint32_t *seen, struct kibosh_faults **out)
+{
+    struct faults_builder b;
+    struct fault_fields f;
+    struct kibosh_faults *faults = NULL;
+    char *base = NULL, *objs = NULL;
+    uint32_t base_seen;
+    int ret = 0, pass;
+
+    if (prev) {
+        base = kibosh_fault_base_unparse((struct kibosh_fault_base *)prev);
+        if (!base) {
+            return -ENOMEM;
+        }
+    }
+    // Like faults_stream_parse, the first pass sizes the arena, and the second fills it.
+    for (pass = 0; pass < 2; pass++) {
+        memset(&b, 0, sizeof(b));
+        b.faults = faults;
+        b.objs = objs;
+        memset(&f, 0, sizeof(f));
+        if (base) {
+            ret = faults_builder_read_object(&b, base, strlen(base), &f, NULL, &base_seen);
+        }
+        if (ret == 0) {
+            ret = faults_builder_read_object(&b, str, len, &f, prev, seen);
+        }
+        if (ret == 0) {
+            ret = faults_builder_finish_fault(&b, &f);
+        }
+        faults_builder_clear(&b);
+        if (ret < 0) {
+            break;
+        }
+        if (!faults) {
+            faults = faults_arena_alloc(1, b.obj_off, b.str_off, b.total_inodes, &objs);
+            if (!faults) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+    }
+    free(base);
+    if (ret < 0) {
+        faults_free(faults);
+        return (ret == -ENOMEM) ? ret : -EINVAL;
+    }
+    *out = faults;
+    return 0;
+}
+
+/**
+ * An incremental operation, as read from the control JSON.
+ */
+struct fault_op {
+    /**
+     * The "op" field, or NULL if there was none.
+     */
+    char *name;
+
+    /**
+     * The "id" field, or NULL if there was none.
+     */
+    char *id;
+
+    /**
+     * The text of the "fault" object, or NULL if there was none.  This points into the
+     * control JSON.
+     */
+    const char *fault;
+    size_t fault_len;
+};
+
+static void fault_op_clear(struct fault_op *op)
+{
+    free(op->name);
+    free(op->id);
+    memset(op, 0, sizeof(*op));
+}
+
+/**
+ * Read an incremental operation.  The BEGIN_OBJECT token has already been read.  The
+ * "fault" object is only skipped over here, and parsed once we know what to do with it.
+ *
+ * @return          0 on success; -EINVAL if the operation was invalid; -EIO if the JSON was
+ *                  invalid; -ENOMEM on OOM.
+ */
+static int fault_op_read(struct json_reader *r, struct fault_op *op)
+{
+    enum json_token token;
+    char **field;
+
+    while ((token = json_reader_next(r)) == JSON_TOKEN_KEY) {
+        if (strcmp(r->str, "fault") == 0) {
+            token = json_reader_next(r);
+            if (token != JSON_TOKEN_BEGIN_OBJECT) {
+                if (token == JSON_TOKEN_ERROR) {
+                    return -EIO;
+                }
+                INFO("%s: \"fault\" was not an object.\n", __func__);
+                return -EINVAL;
+            }
+            op->fault = r->pos - 1;
+            if (json_reader_skip(r, token) < 0) {
+                return -EIO;
+            }
+            op->fault_len = r->pos - op->fault;
+            continue;
+        }
+        if (strcmp(r->str, "op") == 0) {
+            field = &op->name;
+        } else if (strcmp(r->str, "id") == 0) {
+            field = &op->id;
+        } else {
+            if (json_reader_skip(r, json_reader_next(r)) < 0) {
+                return -EIO;
+            }
+            continue;
+        }
+        token = json_reader_next(r);
+        if (token != JSON_TOKEN_STRING) {
+            if (json_reader_skip(r, token) < 0) {
+                return -EIO;
+            }
+            continue;
+        }
+        free(*field);
+        *field = strdup(r->str);
+        if (!*field) {
+            return -ENOMEM;
+        }
+    }
+    return (token == JSON_TOKEN_END_OBJECT) ? 0 : -EIO;
+}
+
+int faults_apply_ops(const struct kibosh_faults *faults, const char *str, size_t len,
+                     struct kibosh_faults **out)
+{
+    struct kibosh_fault_base **list = NULL;
+    const struct kibosh_fault_state **states = NULL;
+    struct kibosh_faults **owned = NULL, *one;
+    struct json_reader r;
+    struct fault_op op;
+    enum json_token token;
+    uint32_t seen;
+    int ret = -EIO, i, idx, num = faults->num_faults, max, seen_ops = 0;
+
+    *out = NULL;
+    memset(&op, 0, sizeof(op));
+    json_reader_init(&r, str, len);
+    // Every operation adds at most one fault, and an operation takes at least 2 bytes.
+    max = num + (len / 2);
+    list = calloc(max + 1, sizeof(struct kibosh_fault_base *));
+    states = calloc(max + 1, sizeof(struct kibosh_fault_state *));
+    owned = calloc(max + 1, sizeof(struct kibosh_faults *));
+    if ((!list) || (!states) || (!owned)) {
+        INFO("%s: out of memory when trying to allocate a list of %d faults.\n",
+             __func__, max);
+        ret = -ENOMEM;
+        goto done;
+    }
+    // Start with the existing faults.  We only parse the faults which are changed.
+    for (i = 0; i < num; i++) {
+        list[i] = faults->list[i];
+        states[i] = &faults->states[i];
+    }
+    if (json_reader_next(&r) != JSON_TOKEN_BEGIN_OBJECT) {
+        goto done;
+    }
+    while ((token = json_reader_next(&r)) == JSON_TOKEN_KEY) {
+        if (strcmp(r.str, "ops") != 0) {
+            if (json_reader_skip(&r, json_reader_next(&r)) < 0)
+                goto done;
+            continue;
+        }
+        if (seen_ops) {
+            INFO("%s: \"ops\" appears more than once.\n", __func__);
+            ret = -EINVAL;
+            goto done;
+        }
+        seen_ops = 1;
+        token = json_reader_next(&r);
+        if (token != JSON_TOKEN_BEGIN_ARRAY) {
+            if (token != JSON_TOKEN_ERROR) {
+                INFO("%s: \"ops\" was not an array.\n", __func__);
+                ret = -EINVAL;
+            }
+            goto done;
+        }
+        for (i = 0; (token = json_reader_next(&r)) != JSON_TOKEN_END_ARRAY; i++) {
+            if (token != JSON_TOKEN_BEGIN_OBJECT) {
+                if (token != JSON_TOKEN_ERROR) {
+                    INFO("%s: operation %d was not an object.\n", __func__, i);
+                    ret = -EINVAL;
+                }
+                goto done;
+            }
+            ret = fault_op_read(&r, &op);
+            if (ret < 0) {
+                goto done;
+            }
+            ret = -EINVAL;
+            if (!op.name) {
+                INFO("%s: No valid \"op\" field found in operation %d.\n", __func__, i);
+                goto done;
+            }
+            if (strcmp(op.name, "add") == 0) {
+                if (!op.fault) {
+                    INFO("%s: No \"fault\" field found in add operation.\n", __func__);
+                    goto done;
+                }
+                ret = faults_stream_fault(NULL, op.fault, op.fault_len, &seen, &one);
+                if (ret < 0) {
+                    goto done;
+                }
+                if (one->list[0]->id[0] && (list_find_id(list, num, one->list[0]->id) >= 0)) {
+                    INFO("%s: there is already a fault with ID \"%s\".\n", __func__,
+                         one->list[0]->id);
+                    faults_free(one);
+                    ret = -EEXIST;
+                    goto done;
+                }
+                list[num] = one->list[0];
+                states[num] = NULL;
+                owned[num] = one;
+                num++;
+                fault_op_clear(&op);
+                continue;
+            }
+            if ((!op.id) || (!op.id[0])) {
+                INFO("%s: No valid \"id\" field found in operation %d.\n", __func__, i);
+                goto done;
+            }
+            idx = list_find_id(list, num, op.id);
+            if (idx < 0) {
+                INFO("%s: there is no fault with ID \"%s\".\n", __func__, op.id);
+                ret = -ENOENT;
+                goto done;
+            }
+            if (strcmp(op.name, "remove") == 0) {
+                faults_free(owned[idx]);
+                memmove(list + idx, list + idx + 1, (num - idx - 1) * sizeof(list[0]));
+                memmove(states + idx, states + idx + 1, (num - idx - 1) * sizeof(states[0]));
+                memmove(owned + idx, owned + idx + 1, (num - idx - 1) * sizeof(owned[0]));
+                num--;
+            } else if (strcmp(op.name, "update") == 0) {
+                if (!op.fault) {
+                    INFO("%s: No \"fault\" field found in update operation.\n", __func__);
+                    goto done;
+                }
+                ret = faults_stream_fault(list[idx], op.fault, op.fault_len, &seen, &one);
+                if (ret < 0) {
+                    goto done;
+                }
+                faults_free(owned[idx]);
+                list[idx] = one->list[0];
+                owned[idx] = one;
+                // A new count starts a new countdown.
+                if (seen & FAULT_FIELD_BIT(FAULT_FIELD_COUNT)) {
+                    states[idx] = NULL;
+                }
+            } else {
+                INFO("%s: Unknown operation \"%s\".\n", __func__, op.name);
+                goto done;
+            }
+            fault_op_clear(&op);
+        }
+    }
+    ret = -EIO;
+    if ((token != JSON_TOKEN_END_OBJECT) || (json_reader_next(&r) != JSON_TOKEN_END)) {
+        goto done;
+    }
+    if (!seen_ops) {
+        INFO("%s: No \"ops\" field found.\n", __func__);
+        ret = -EINVAL;
+        goto done;
+    }
+    ret = faults_compile_with_states(list, states, num, out);
+    if (ret == 0) {
+        (*out)->compose = faults->compose;
+    }
+done:
+    if (r.error[0]) {
+        INFO("%s: failed to parse input string of length %zd: %s\n", __func__, len,
+             r.error);
+    }
+    json_reader_free(&r);
+    fault_op_clear(&op);
+    if (owned) {
+        for (i = 0; i < num; i++) {
+            faults_free(owned[i]);
+        }
+    }
+    free(list);
+    free(states);
+    free(owned);
+    return ret;
+}
+
+/**
+ * Hash the configuration of a fault: its type, ID, prefix, suffix, pattern, inodes, ranges,
+ * and type-specific fields.  The state is not included.
+ */
+static uint64_t kibosh_fault_config_hash(const struct kibosh_fault_base *fault)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *p;
+    size_t size, i;
+
+#define HASH_BYTES(ptr, len) \
+    do { \
+        p = (const unsigned char *)(ptr); \
+        for (i = 0; i < (len); i++) { \
+            hash = (hash ^ p[i]) * 1099511628211ULL; \
+        } \
+    } while (0)
+
+    HASH_BYTES(&fault->type, sizeof(fault->type));
+    HASH_BYTES(fault->id, strlen(fault->id) + 1);
+    HASH_BYTES(fault->prefix, strlen(fault->prefix) + 1);
+    HASH_BYTES(fault->suffix, strlen(fault->suffix) + 1);
+    if (fault->pattern) {
+        HASH_BYTES(&fault->pattern_type, sizeof(fault->pattern_type));
+        HASH_BYTES(fault->pattern, strlen(fault->pattern) + 1);
+    }
+    HASH_BYTES(&fault->start_ms, sizeof(fault->start_ms));
+    HASH_BYTES(&fault->end_ms, sizeof(fault->end_ms));
+    HASH_BYTES(&fault->ramp_ms, sizeof(fault->ramp_ms));
+    HASH_BYTES(&fault->ramp_from, sizeof(fault->ramp_from));
+    HASH_BYTES(&fault->burst_enter, sizeof(fault->burst_enter));
+    HASH_BYTES(&fault->burst_exit, sizeof(fault->burst_exit));
+    HASH_BYTES(&fault->good_fraction, sizeof(fault->good_fraction));
+    HASH_BYTES(&fault->bad_fraction, sizeof(fault->bad_fraction));
+    HASH_BYTES(&fault->match.tests, sizeof(fault->match.tests));
+    HASH_BYTES(&fault->pin, sizeof(fault->pin));
+    HASH_BYTES(&fault->has_inodes, sizeof(fault->has_inodes));
+    HASH_BYTES(fault->inodes, fault->num_inodes * sizeof(struct kibosh_inode));
+    HASH_BYTES(&fault->block_size, sizeof(fault->block_size));
+    HASH_BYTES(fault->ranges, fault->num_ranges * sizeof(struct kibosh_range));
+    // Compiled fault objects are zeroed before their fields are set, so the padding is
+    // always zero, and we can hash the type-specific fields as raw bytes.
+    size = kibosh_fault_type_size(fault->type);
+    HASH_BYTES(fault + 1, size - sizeof(*fault));
+#undef HASH_BYTES
+    return hash;
+}
+
+/**
+ * Check whether two compiled faults have the same configuration.
+ */
+static int kibosh_fault_config_equal(const struct kibosh_fault_base *a,
+                                     const struct kibosh_fault_base *b)
+{
+    size_t size;
+
+    if (a->type != b->type) {
+        return 0;
+    }
+    if ((strcmp(a->id, b->id) != 0) || (strcmp(a->prefix, b->prefix) != 0) ||
+            (strcmp(a->suffix, b->suffix) != 0) || (!kibosh_fault_pattern_equal(a, b))) {
+        return 0;
+    }
+    if ((a->start_ms != b->start_ms) || (a->end_ms != b->end_ms) ||
+            (a->ramp_ms != b->ramp_ms) || (a->ramp_from != b->ramp_from)) {
+        return 0;
+    }
+    if ((a->burst_enter != b->burst_enter) || (a->burst_exit != b->burst_exit) ||
+            (a->good_fraction != b->good_fraction) || (a->bad_fraction != b->bad_fraction)) {
+        return 0;
+    }
+    if ((!kibosh_fault_match_equal(&a->match, &b->match)) ||
+            (!kibosh_fault_inodes_equal(a, b)) || (!kibosh_fault_ranges_equal(a, b))) {
+        return 0;
+    }
+    size = kibosh_fault_type_size(a->type);
+    return memcmp(a + 1, b + 1, size - sizeof(*a)) == 0;
+}
+
+int faults_carry_state(const struct kibosh_faults *old, struct kibosh_faults *faults)
+{
+    uint64_t *hashes = NULL;
+    int *table = NULL, *used = NULL;
+    size_t table_size = 1, mask, slot;
+    int i, j, changed = 0;
+
+    if (old->num_faults == 0) {
+        return faults->num_faults;
+    }
+    while (table_size < 2 * (size_t)old->num_faults) {
+        table_size *= 2;
+    }
+    mask = table_size - 1;
+    hashes = malloc(old->num_faults * sizeof(uint64_t));
+    table = malloc(table_size * sizeof(int));
+    used = calloc(old->num_faults, sizeof(int));
+    if ((!hashes) || (!table) || (!used)) {
+        INFO("%s: out of memory when diffing %d faults.\n", __func__, old->num_faults);
+        changed = -ENOMEM;
+        goto done;
+    }
+    memset(table, 0xff, table_size * sizeof(int));
+    for (i = 0; i < old->num_faults; i++) {
+        hashes[i] = kibosh_fault_config_hash(old->list[i]);
+        for (slot = hashes[i] & mask; table[slot] >= 0; slot = (slot + 1) & mask) {
+        }
+        table[slot] = i;
+    }
+    for (i = 0; i < faults->num_faults; i++) {
+        uint64_t hash = kibosh_fault_config_hash(faults->list[i]);
+
+        // Identical faults are matched up in order, so each old fault is used at most once.
+        for (slot = hash & mask; (j = table[slot]) >= 0; slot = (slot + 1) & mask) {
+            if ((!used[j]) && (hashes[j] == hash) &&
+                    kibosh_fault_config_equal(old->list[j], faults->list[i])) {
+                break;
+            }
+        }
+        if (j < 0) {
+            changed++;
+            continue;
+        }
+        used[j] = 1;
+        faults->states[i] = old->states[j];
+    }
+
+done:
+    free(hashes);
+    free(table);
+    free(used);
+    return changed;
+}
+
+/**
+ * A walk over the backing filesystem, to resolve pinned faults to inodes.
+ */
+struct pin_walk {
+    /**
+     * Standalone copies of the faults which are being resolved.  Their prefixes,
+     * suffixes, and patterns still point into the original faults.
+     */
+    struct kibosh_fault_base **copies;
+
+    /**
+     * The capacity of the inode list of each copy.
+     */
+    uint32_t *caps;
+
+    /**
+     * The number of faults which are being resolved.
+     */
+    int num;
+
+    /**
+     * The path of the current file, relative to the root.
+     */
+    char path[PATH_MAX];
+};
+
+static int pin_walk_file(struct pin_walk *walk, size_t path_len, const struct stat *st)
+{
+    struct kibosh_fault_base *copy;
+    struct kibosh_inode *inodes;
+    uint32_t cap;
+    int i;
+
+    for (i = 0; i < walk->num; i++) {
+        copy = walk->copies[i];
+        if (!kibosh_fault_path_matches(copy, walk->path, path_len)) {
+            continue;
+        }
+        if (copy->num_inodes == walk->caps[i]) {
+            cap = walk->caps[i] ? (walk->caps[i] * 2) : 16;
+            inodes = realloc(copy->inodes, cap * sizeof(struct kibosh_inode));
+            if (!inodes) {
+                return -ENOMEM;
+            }
+            copy->inodes = inodes;
+            walk->caps[i] = cap;
+        }
+        copy->inodes[copy->num_inodes].dev = st->st_dev;
+        copy->inodes[copy->num_inodes].ino = st->st_ino;
+        copy->num_inodes++;
+    }
+    return 0;
+}
+
+/**
+ * Walk a directory of the backing filesystem.
+ *
+ * @param walk      The walk.  Its path is the path of the directory.
+ * @param fd        A file descriptor for the directory.  We take ownership of this.
+ * @param path_len  The length of the path of the directory.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int pin_walk_dir(struct pin_walk *walk, int fd, size_t path_len)
+{
+    struct dirent *de;
+    struct stat st;
+    size_t name_len;
+    int ret = 0, child;
+    DIR *dir;
+
+    dir = fdopendir(fd);
+    if (!dir) {
+        ret = -errno;
+        INFO("%s: fdopendir(%s) failed: error %d (%s)\n", __func__,
+             path_len ? walk->path : "/", -ret, safe_strerror(-ret));
+        close(fd);
+        return ret;
+    }
+    while ((ret == 0) && (de = readdir(dir))) {
+        if ((strcmp(de->d_name, ".") == 0) || (strcmp(de->d_name, "..") == 0)) {
+            continue;
+        }
+        name_len = strlen(de->d_name);
+        if (path_len + name_len + 2 > sizeof(walk->path)) {
+            continue;
+        }
+        walk->path[path_len] = '/';
+        memcpy(walk->path + path_len + 1, de->d_name, name_len + 1);
+        // The file may have been removed since we read the directory.
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+            continue;
+        }
+        if (S_ISREG(st.st_mode)) {
+            ret = pin_walk_file(walk, path_len + 1 + name_len, &st);
+        } else if (S_ISDIR(st.st_mode)) {
+            child = openat(dirfd(dir), de->d_name,
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child >= 0) {
+                ret = pin_walk_dir(walk, child, path_len + 1 + name_len);
+            }
+        }
+    }
+    walk->path[path_len] = '\0';
+    closedir(dir);
+    return ret;
+}
+
+/**
+ * Walk the backing filesystem, and resolve the copies of the pinned faults in a walk to
+ * the inodes of the files which they match.
+ *
+ * @param walk      The walk.
+ * @param root      The root of the backing filesystem.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int faults_resolve_walk(struct pin_walk *walk, const char *root)
+{
+    struct kibosh_fault_base *copy;
+    int i, fd, ret;
+
+    fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        ret = -errno;
+        INFO("%s: failed to open %s: error %d (%s)\n", __func__, root, -ret,
+             safe_strerror(-ret));
+        return ret;
+    }
+    ret = pin_walk_dir(walk, fd, 0);
+    if (ret < 0) {
+        return ret;
+    }
+    for (i = 0; i < walk->num; i++) {
+        copy = walk->copies[i];
+        copy->num_inodes = kibosh_inodes_normalize(copy->inodes, copy->num_inodes);
+        DEBUG("%s: pinned %s fault \"%s\" to %"PRIu32" inode(s).\n", __func__,
+              kibosh_fault_type_name(copy), copy->id, copy->num_inodes);
+    }
+    return 0;
+}
+
+/**
+ * Give a copy of a pinned fault the inodes which an identical fault in the old fault set
+ * was already resolved to.
+ *
+ * @param old       The old faults, or NULL.
+ * @param copy      The copy.  Its inodes are still unset.
+ *
+ * @return          1 if the inodes were reused; 0 if the copy still has to be resolved;
+ *                  -ENOMEM on OOM.
+ */
+static int pin_reuse(const struct kibosh_faults *old, struct kibosh_fault_base *copy)
+{
+    const struct kibosh_fault_base *prev;
+    int i;
+
+    for (i = 0; old && (i < old->num_faults); i++) {
+        prev = old->list[i];
+        if ((!prev->pin) || (!prev->has_inodes)) {
+            continue;
+        }
+        // Borrow the old inodes, so that the whole configuration can be compared.
+        copy->inodes = prev->inodes;
+        copy->num_inodes = prev->num_inodes;
+        if (!kibosh_fault_config_equal(prev, copy)) {
+            continue;
+        }
+        copy->inodes = NULL;
+        if (prev->num_inodes > 0) {
+            copy->inodes = malloc(prev->num_inodes * sizeof(struct kibosh_inode));
+            if (!copy->inodes) {
+                copy->num_inodes = 0;
+                return -ENOMEM;
+            }
+            memcpy(copy->inodes, prev->inodes,
+                   prev->num_inodes * sizeof(struct kibosh_inode));
+        }
+        return 1;
+    }
+    copy->inodes = NULL;
+    copy->num_inodes = 0;
+    return 0;
+}
+
+int faults_resolve_pins(const struct kibosh_faults *faults, const struct kibosh_faults *old,
+                        const char *root, struct kibosh_faults **out)
+{
+    struct kibosh_fault_base **list = NULL, *copy, **copies = NULL;
+    const struct kibosh_fault_state **states = NULL;
+    struct pin_walk walk;
+    int i, ret = -ENOMEM, num = faults->num_faults, num_copies = 0;
+    size_t size;
+
+    *out = NULL;
+    for (i = 0; i < num; i++) {
+        if (faults->list[i]->pin && !faults->list[i]->has_inodes) {
+            break;
+        }
+    }
+    if (i == num) {
+        return 0;
+    }
+    memset(&walk, 0, sizeof(walk));
+    list = calloc(num + 1, sizeof(struct kibosh_fault_base *));
+    states = calloc(num + 1, sizeof(struct kibosh_fault_state *));
+    copies = calloc(num, sizeof(struct kibosh_fault_base *));
+    walk.copies = calloc(num, sizeof(struct kibosh_fault_base *));
+    walk.caps = calloc(num, sizeof(uint32_t));
+    if ((!list) || (!states) || (!copies) || (!walk.copies) || (!walk.caps)) {
+        goto done;
+    }
+    for (i = 0; i < num; i++) {
+        list[i] = faults->list[i];
+        states[i] = &faults->states[i];
+        if ((!faults->list[i]->pin) || faults->list[i]->has_inodes) {
+            continue;
+        }
+        size = kibosh_fault_type_size(faults->list[i]->type);
+        copy = malloc(size);
+        if (!copy) {
+            ret = -ENOMEM;
+            goto done;
+        }
+        memcpy(copy, faults->list[i], size);
+        copy->has_inodes = 1;
+        copies[num_copies++] = copy;
+        list[i] = copy;
+        ret = pin_reuse(old, copy);
+        if (ret < 0) {
+            goto done;
+        }
+        if (ret > 0) {
+            DEBUG("%s: %s fault \"%s\" keeps its %"PRIu32" pinned inode(s).\n", __func__,
+                  kibosh_fault_type_name(copy), copy->id, copy->num_inodes);
+            continue;
+        }
+        walk.copies[walk.num++] = copy;
+    }
+    // The walk is only needed for faults which were not already resolved.
+    if (walk.num > 0) {
+        ret = faults_resolve_walk(&walk, root);
+        if (ret < 0) {
+            goto done;
+        }
+    }
+    ret = faults_compile_with_states(list, states, num, out);
+    if (ret == 0) {
+        (*out)->compose = faults->compose;
+    }
+done:
+    for (i = 0; i < num_copies; i++) {
+        free(copies[i]->inodes);
+        free(copies[i]);
+    }
+    free(copies);
+    free(walk.copies);
+    free(walk.caps);
+    free(list);
+    free(states);
+    return ret;
+}
+
+int faults_update(const struct kibosh_faults *faults, const char *str,
+                  struct kibosh_faults **out)
+{
+    int ret;
+
+    ret = faults_stream_parse(str, strlen(str), faults != NULL, out);
+    if ((ret == 0) && faults) {
+        ret = faults_carry_state(faults, *out);
+        if (ret < 0) {
+            faults_free(*out);
+            *out = NULL;
+            return ret;
+        }
+        DEBUG("%s: %d of %d fault(s) are new or changed.\n", __func__, ret,
+              (*out)->num_faults);
+        return 0;
+    }
+    if (ret == FAULTS_STREAM_HAS_SCENARIO) {
+        return FAULTS_UPDATE_SCENARIO;
+    }
+    if (ret == FAULTS_STREAM_HAS_CRASH) {
+        return FAULTS_UPDATE_CRASH;
+    }
+    if (ret != FAULTS_STREAM_HAS_OPS) {
+        return ret;
+    }
+    return faults_apply_ops(faults, str, strlen(str), out);
+}
+
+int faults_parse(const char *str, struct kibosh_faults **out)
+{
+    return faults_update(NULL, str, out);
+}
+
+/**
+ * Write a faults object.
+ *
+ * @param faults        The faults.
+ * @param with_state    Nonzero if we should also write the mutable state of each fault.
+ *
+ * @return              A dynamically allocated JSON string on success; NULL on OOM.
+ */
+static char *faults_write(const struct kibosh_faults *faults, int with_state)
+{
+    struct json_writer w;
+    int i;
+
+    json_writer_init(&w);
+    json_writer_begin_object(&w, NULL);
+    json_writer_begin_array(&w, "faults");
+    for (i = 0; i < faults->num_faults; i++) {
+        kibosh_fault_base_write(faults->list[i], with_state, &w);
+    }
+    json_writer_end_array(&w);
+    if (faults->compose) {
+        json_writer_bool(&w, "compose", 1);
+    }
+    json_writer_end_object(&w);
+    return json_writer_finish(&w);
+}
+
+char *faults_unparse(const struct kibosh_faults *faults)
+{
+    return faults_write(faults, 0);
+}
+
+char *faults_unparse_with_state(const struct kibosh_faults *faults)
+{
+    return faults_write(faults, 1);
+}
+
+/**
+ * Check whether the path matches the prefix and suffix of the fault at the given index.
+ */
+static int faults_path_matches(const struct kibosh_faults *faults, int i,
+                               const char *path, size_t path_len)
+{
+    uint32_t prefix_len = faults->prefix_lens[i];
+    uint32_t suffix_len = faults->suffix_lens[i];
+
+    if ((prefix_len > path_len) || (suffix_len > path_len)) {
+        return 0;
+    }
+    if (memcmp(path, faults->strs + faults->prefix_offs[i], prefix_len) != 0) {
+        return 0;
+    }
+    if (memcmp(path + (path_len - suffix_len),
+               faults->strs + faults->suffix_offs[i], suffix_len) != 0) {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Find the faults which fire for the given operation, in order.
+ *
+ * @param faults    The faults structure.
+ * @param io        The operation.
+ * @param idxs      (out param) the indices of the faults which fire.
+ * @param max       The most faults to find.  Once this many have fired, the rest of the
+ *                  faults are not looked at.
+ *
+ * @return          The number of faults which fire.
+ */
+static int faults_find_firing(struct kibosh_faults *faults, const struct kibosh_io *io,
+                              int *idxs, int max)
+{
+    size_t path_len = strlen(io->path);
+    uint64_t now_ms = 0;
+    uint32_t tests;
+    int i, num = 0;
+
+    // One coarse clock read covers every fault in the set.
+    if (faults->timed) {
+        now_ms = monotonic_coarse_ms();
+    }
+    for (i = 0; (i < faults->num_faults) && (num < max); i++) {
+        if (!(faults->op_masks[i] & io->op)) {
+            continue;
+        }
+        tests = faults->match_tests[i];
+        if (tests) {
+            if ((tests & KIBOSH_MATCH_INODE) && !faults_inode_matches(faults, i, io)) {
+                continue;
+            }
+            if ((tests & KIBOSH_MATCH_RANGES) &&
+                    !kibosh_fault_overlaps(faults->list[i], io->offset, io->size)) {
+                continue;
+            }
+            if (!kibosh_fault_match_eval(&faults->list[i]->match, io)) {
+                continue;
+            }
+        }
+        // Faults which target inodes do not look at the path at all.
+        if (!(tests & KIBOSH_MATCH_INODE)) {
+            if (!faults_path_matches(faults, i, io->path, path_len)) {
+                continue;
+            }
+            if (faults->list[i]->dfa &&
+                    !pattern_matches(faults->list[i]->dfa, io->path, path_len)) {
+                continue;
+            }
+        }
+        if (kibosh_fault_fires(faults->list[i], now_ms)) {
+            idxs[num++] = i;
+        }
     }
+    return num;
 }
 
-/////
-///// kibosh_faults
-/////
-static int fault_array_parse(json_value *arr, struct kibosh_faults **out)
+struct kibosh_fault_base *find_first_fault(struct kibosh_faults *faults,
+                                      const char *path, uint32_t op)
 {
-    struct kibosh_faults *faults = NULL;
-    int ret = -EIO, i, num_faults = 0;
+    struct kibosh_io io;
+    int idx;
 
-    if (arr->type != json_array) {
-        INFO("%s: \"faults\" was not an array.\n", __func__);
-        goto done;
+    memset(&io, 0, sizeof(io));
+    io.path = path;
+    io.op = op;
+    if (!faults_find_firing(faults, &io, &idx, 1)) {
+        return NULL;
     }
-    num_faults = arr->u.array.length;
+    faults->states[idx].hits++;
+    return faults->list[idx];
+}
 
-    faults = calloc(1, sizeof(*faults));
-    if (!faults) {
-        INFO("%s: out of memory when trying to allocate faults structure.\n", __func__);
-        goto done;
-    }
-    faults->list = calloc(num_faults + 1, sizeof(struct kibosh_fault_base *));
-    if (!faults->list) {
-        INFO("%s: out of memory when trying to allocate a list of %d faults.\n", __func__,
-             num_faults);
-        goto done;
-    }
-    for (i = 0; i < num_faults; i++) {
-        faults->list[i] = (struct kibosh_fault_base*)
-                kibosh_fault_base_parse(arr->u.array.values[i]);
-        if (!faults->list[i]) {
-            goto done;
-        }
+/**
+ * The most faults which are composed for a single operation.  Any more faults which
+ * match are ignored.
+ */
+#define FAULTS_COMPOSE_MAX 16
+
+/**
+ * Get the stage of the fault pipeline which a fault type belongs to.  Stages are applied
+ * in increasing order: delays, then errors, then corruptions.
+ */
+static int kibosh_fault_type_stage(enum kibosh_fault_type type)
+{
+    switch (type) {
+        case KIBOSH_FAULT_TYPE_READ_DELAY:
+        case KIBOSH_FAULT_TYPE_WRITE_DELAY:
+            return 0;
+        case KIBOSH_FAULT_TYPE_UNREADABLE:
+        case KIBOSH_FAULT_TYPE_UNWRITABLE:
+            return 1;
+        default:
+            return 2;
     }
-    ret = 0;
-done:
-    if (ret) {
-        if (faults) {
-            for (i = 0; i < num_faults; i++) {
-                kibosh_fault_base_free(faults->list[i]);
-            }
-            if (faults->list) {
-                free(faults->list);
-            }
-            free(faults);
+}
+
+/**
+ * Find the faults to apply to an operation, sorted into pipeline order.
+ *
+ * @param faults    The faults structure.
+ * @param io        The operation.
+ * @param idxs      (out param) the indices of the faults to apply.  Must have room for
+ *                  FAULTS_COMPOSE_MAX entries.
+ *
+ * @return          The number of faults to apply.
+ */
+static int faults_find_pipeline(struct kibosh_faults *faults, const struct kibosh_io *io,
+                                int *idxs)
+{
+    int num, i, j, idx;
+
+    num = faults_find_firing(faults, io, idxs,
+                             faults->compose ? FAULTS_COMPOSE_MAX : 1);
+    // An insertion sort is stable, so faults in the same stage stay in order.
+    for (i = 1; i < num; i++) {
+        idx = idxs[i];
+        for (j = i; (j > 0) && (kibosh_fault_type_stage(faults->types[idxs[j - 1]]) >
+                                kibosh_fault_type_stage(faults->types[idx])); j--) {
+            idxs[j] = idxs[j - 1];
         }
-        *out = NULL;
-        return ret;
+        idxs[j] = idx;
     }
-    *out = faults;
-    return 0;
+    return num;
 }
 
-int faults_parse(const char *str, struct kibosh_faults **out)
+int faults_apply_read(struct kibosh_faults *faults, const struct kibosh_io *io, char *buf,
+                      int nread, uint32_t *delay_ms, const char **fault_name)
 {
-    int ret = -EIO;
-    char error[json_error_max] = { 0 };
-    json_value *root = NULL, *faults;
-    json_settings settings = { 0 };
-
-    root = json_parse_ex(&settings, str, strlen(str), error);
-    if (!root) {
-        INFO("%s: failed to parse input string of length %zd: %s\n", __func__,
-             strlen(str), error);
-        goto done;
-    }
-    faults = get_child(root, "faults");
-    if (!faults) {
-        *out = calloc(1, sizeof(*faults));
-        if (!*out) {
-            ret = -ENOMEM;
-            goto done;
+    int idxs[FAULTS_COMPOSE_MAX], num, i, ret = nread;
+    uint64_t total_ms = 0;
+    uint32_t fault_delay_ms;
+
+    *fault_name = NULL;
+    num = faults_find_pipeline(faults, io, idxs);
+    for (i = 0; i < num; i++) {
+        struct kibosh_fault_base *fault = faults->list[idxs[i]];
+
+        faults->states[idxs[i]].hits++;
+        if (!*fault_name) {
+            *fault_name = kibosh_fault_type_name(fault);
         }
-        (*out)->list = calloc(1, sizeof(struct kibosh_fault_base*));
-        if (!(*out)->list) {
-            ret = -ENOMEM;
-            free(*out);
-            goto done;
+        ret = apply_read_fault(fault, io, buf, ret, &fault_delay_ms);
+        total_ms += fault_delay_ms;
+        if (ret < 0) {
+            break;
         }
-    } else {
-        ret = fault_array_parse(faults, out);
-        if (ret)
-            goto done;
-    }
-    ret = 0;
-done:
-    if (root) {
-        json_value_free(root);
     }
+    *delay_ms = (total_ms > UINT32_MAX) ? UINT32_MAX : total_ms;
     return ret;
 }
 
-char *faults_unparse(const struct kibosh_faults *faults)
+int faults_apply_write(struct kibosh_faults *faults, const struct kibosh_io *io,
+                       struct kibosh_patches *patches, int size, uint32_t *delay_ms,
+                       const char **fault_name)
 {
-    int num_faults = 0;
-    struct kibosh_fault_base **iter;
-    char **strs = NULL;
-    char *json = NULL, **ptr;
+    int idxs[FAULTS_COMPOSE_MAX], num, i, ret = size;
+    uint64_t total_ms = 0;
+    uint32_t fault_delay_ms;
 
-    for (iter = faults->list; *iter; iter++) {
-        num_faults++;
-    }
-    strs = calloc(sizeof(char*), (2 * num_faults) + 3);
-    if (!strs)
-        goto done;
-    ptr = strs;
-    *ptr = strdup("{\"faults\":[");
-    if (!(*ptr))
-        goto done;
-    ptr++;
-    for (iter = faults->list; *iter; iter++) {
-        if (iter != faults->list) {
-            *ptr = strdup(", ");
-            if (!(*ptr))
-                goto done;
-            ptr++;
-        }
-        *ptr = kibosh_fault_base_unparse(*iter);
-        if (!(*ptr))
-            goto done;
-        ptr++;
-    }
-    *ptr = strdup("]}");
-    if (!*ptr)
-        goto done;
-    ptr++;
-    *ptr = NULL;
-    json = join_strs(strs);
-    if (!json)
-        goto done;
+    *fault_name = NULL;
+    num = faults_find_pipeline(faults, io, idxs);
+    for (i = 0; i < num; i++) {
+        struct kibosh_fault_base *fault = faults->list[idxs[i]];
 
-done:
-    if (strs) {
-        for (ptr = strs; *ptr; ptr++) {
-            free(*ptr);
+        faults->states[idxs[i]].hits++;
+        if (!*fault_name) {
+            *fault_name = kibosh_fault_type_name(fault);
+        }
+        // Each fault only sees the part of the buffer which is still going to be written.
+        ret = apply_write_fault(fault, io, patches, ret, &fault_delay_ms);
+        total_ms += fault_delay_ms;
+        if (ret < 0) {
+            break;
         }
-        free(strs);
-        strs = NULL;
     }
-    return json;
+    *delay_ms = (total_ms > UINT32_MAX) ? UINT32_MAX : total_ms;
+    return ret;
 }
 
-struct kibosh_fault_base *find_first_fault(struct kibosh_faults *faults,
-                                      const char *path, const char *op)
+int faults_may_delay(const struct kibosh_faults *faults, const char *path, uint32_t op)
 {
-    struct kibosh_fault_base **iter;
+    size_t path_len = strlen(path);
+    int i;
 
-    for (iter = faults->list; *iter; iter++) {
-        struct kibosh_fault_base *fault = *iter;
-        if (kibosh_fault_matches(fault, path, op)) {
-            return fault;
+    for (i = 0; i < faults->num_faults; i++) {
+        if ((faults->types[i] != KIBOSH_FAULT_TYPE_READ_DELAY) &&
+                (faults->types[i] != KIBOSH_FAULT_TYPE_WRITE_DELAY)) {
+            continue;
+        }
+        if (!(faults->op_masks[i] & op)) {
+            continue;
+        }
+        // We do not know the inode here, so assume that it might match.
+        if ((faults->match_tests[i] & KIBOSH_MATCH_INODE) ||
+                faults_path_matches(faults, i, path, path_len)) {
+            return 1;
         }
     }
-    return NULL;
+    return 0;
 }
 
-int apply_read_fault(struct kibosh_fault_base *fault, char *buf, int nread,
-                     uint32_t *delay_ms)
+int apply_read_fault(struct kibosh_fault_base *fault, const struct kibosh_io *io, char *buf,
+                     int nread, uint32_t *delay_ms)
 {
     switch (fault->type) {
         case KIBOSH_FAULT_TYPE_UNREADABLE:
             return kibosh_fault_unreadable_apply((struct kibosh_fault_unreadable *) fault,
-                                                 delay_ms);
+                                                 io, nread, delay_ms);
         case KIBOSH_FAULT_TYPE_READ_DELAY:
             kibosh_fault_read_delay_apply((struct kibosh_fault_read_delay *) fault,
                                           delay_ms);
             return nread;
         case KIBOSH_FAULT_TYPE_READ_CORRUPT:
             return kibosh_fault_read_corrupt_apply((struct kibosh_fault_read_corrupt *) fault,
-                                                   buf, nread, delay_ms);
+                                                   io, buf, nread, delay_ms);
         default:
             *delay_ms = 0;
             return nread;
     }
 }
 
-int apply_write_fault(struct kibosh_fault_base *fault, const char **buf, char **dynamic_buf,
-                      int size, uint32_t *delay_ms)
+int apply_write_fault(struct kibosh_fault_base *fault, const struct kibosh_io *io,
+                      struct kibosh_patches *patches, int size, uint32_t *delay_ms)
 {
     switch (fault->type) {
         case KIBOSH_FAULT_TYPE_UNWRITABLE:
             return kibosh_fault_unwritable_apply((struct kibosh_fault_unwritable *) fault,
-                                                 dynamic_buf, delay_ms);
+                                                 io, delay_ms, size);
         case KIBOSH_FAULT_TYPE_WRITE_DELAY:
             return kibosh_fault_write_delay_apply((struct kibosh_fault_write_delay *) fault,
-                                                  dynamic_buf, delay_ms, size);
+                                                  delay_ms, size);
         case KIBOSH_FAULT_TYPE_WRITE_CORRUPT:
             return kibosh_fault_write_corrupt_apply(
-                    (struct kibosh_fault_write_corrupt *) fault, buf, dynamic_buf,
+                    (struct kibosh_fault_write_corrupt *) fault, io, patches,
+                    delay_ms, size);
+        case KIBOSH_FAULT_TYPE_TORN_WRITE:
+            return kibosh_fault_torn_write_apply(
+                    (struct kibosh_fault_torn_write *) fault, io, patches,
+                    delay_ms, size);
+        case KIBOSH_FAULT_TYPE_LOST_WRITE:
+            return kibosh_fault_lost_write_apply(
+                    (struct kibosh_fault_lost_write *) fault, io, patches,
+                    delay_ms, size);
+        case KIBOSH_FAULT_TYPE_WRITE_BACK:
+            return kibosh_fault_write_back_apply(
+                    (struct kibosh_fault_write_back *) fault, io, patches,
+                    delay_ms, size);
+        case KIBOSH_FAULT_TYPE_STALE_READ:
+            return kibosh_fault_stale_read_apply(
+                    (struct kibosh_fault_stale_read *) fault, io, patches,
                     delay_ms, size);
         default:
             *delay_ms = 0;
-            *dynamic_buf = NULL;
             return size;
     }
 }
 
 void faults_free(struct kibosh_faults *faults)
 {
-    struct kibosh_fault_base **iter;
+    // The faults, their strings, and their state all live in the same allocation.
+    free(faults);
+}
+
+void kibosh_patches_init(struct kibosh_patches *patches, const char *base, char *bounce,
+                         int size)
+{
+    patches->base = base;
+    patches->bounce = bounce;
+    patches->bounce_get = NULL;
+    patches->size = size;
+    patches->whole = (base == bounce);
+    patches->num = 0;
+    patches->num_holes = 0;
+    patches->reported = -1;
+    patches->unsynced = 0;
+    patches->kb_per_sec = 0;
+    patches->dirty_limit = 0;
+    patches->stale_ms = 0;
+}
 
-    for (iter = faults->list; *iter; iter++) {
-        kibosh_fault_base_free(*iter);
+int kibosh_patches_reserve(struct kibosh_patches *patches)
+{
+    if (patches->bounce) {
+        return 0;
     }
-    free(faults->list);
-    faults->list = NULL;
-    free(faults);
+    if (patches->bounce_get) {
+        patches->bounce = patches->bounce_get(patches->size);
+    }
+    return patches->bounce ? 0 : -ENOMEM;
 }
 
-int corrupt_buffer(char *buf, int size, enum buffer_corruption_type mode, double fraction)
+/**
+ * Find the first part in a sorted list which ends at or after the given offset.
+ *
+ * @return          The index of the part, or the number of parts if there is none.
+ */
+static int kibosh_patch_find(const struct kibosh_patch *list, int num, int lo)
+{
+    int l = 0, h = num, m;
+
+    while (l < h) {
+        m = l + ((h - l) / 2);
+        if (list[m].hi < lo) {
+            l = m + 1;
+        } else {
+            h = m;
+        }
+    }
+    return l;
+}
+
+/**
+ * Add a part to a sorted list, merging it with the parts which it overlaps or touches.
+ *
+ * @param list      The list.  If no parts are merged, it must have room for one more.
+ * @param num       (inout) The number of parts in the list.
+ * @param first     The first part which ends at or after lo.
+ * @param end       The first part after that which starts after hi.
+ * @param lo        The start of the new part.
+ * @param hi        The end of the new part, exclusive.
+ */
+static void kibosh_patch_add(struct kibosh_patch *list, int *num, int first, int end,
+                             int lo, int hi)
+{
+    if (end == first) {
+        memmove(&list[first + 1], &list[first], (*num - first) * sizeof(list[0]));
+        list[first].lo = lo;
+        list[first].hi = hi;
+        (*num)++;
+        return;
+    }
+    if (list[first].lo > lo) {
+        list[first].lo = lo;
+    }
+    if (list[end - 1].hi > hi) {
+        hi = list[end - 1].hi;
+    }
+    list[first].hi = hi;
+    memmove(&list[first + 1], &list[end], (*num - end) * sizeof(list[0]));
+    *num -= end - first - 1;
+}
+
+/**
+ * Copy the parts of the original buffer between lo and hi which are not already in the
+ * bounce buffer.
+ *
+ * @param first     The first patch which ends at or after lo.
+ */
+static void kibosh_patches_fill(struct kibosh_patches *patches, int first, int lo, int hi)
+{
+    const struct kibosh_patch *patch;
+    int i, pos = lo;
+
+    for (i = first; (i < patches->num) && (patches->patch[i].lo < hi); i++) {
+        patch = &patches->patch[i];
+        if (patch->lo > pos) {
+            memcpy(patches->bounce + pos, patches->base + pos, patch->lo - pos);
+        }
+        if (patch->hi > pos) {
+            pos = patch->hi;
+        }
+    }
+    if (pos < hi) {
+        memcpy(patches->bounce + pos, patches->base + pos, hi - pos);
+    }
+}
+
+char *kibosh_patches_cover(struct kibosh_patches *patches, int lo, int hi, int copy)
+{
+    struct kibosh_patch *last;
+    int first, end;
+
+    if (patches->whole || (hi <= lo)) {
+        return patches->bounce + lo;
+    }
+    // Corruption usually moves forward through the buffer, so first try to extend the
+    // last patch.
+    if (patches->num > 0) {
+        last = &patches->patch[patches->num - 1];
+        if ((last->lo <= lo) && (lo <= last->hi)) {
+            if (hi > last->hi) {
+                if (copy) {
+                    memcpy(patches->bounce + last->hi, patches->base + last->hi,
+                           hi - last->hi);
+                }
+                last->hi = hi;
+            }
+            return patches->bounce + lo;
+        }
+    }
+    first = kibosh_patch_find(patches->patch, patches->num, lo);
+    for (end = first; (end < patches->num) && (patches->patch[end].lo <= hi); end++) {
+    }
+    if ((end == first) && (patches->num == KIBOSH_MAX_PATCHES)) {
+        // There are too many patches, so copy the rest of the buffer and stop tracking them.
+        kibosh_patches_fill(patches, 0, 0, patches->size);
+        patches->whole = 1;
+        patches->num = 0;
+        return patches->bounce + lo;
+    }
+    if (copy) {
+        kibosh_patches_fill(patches, first, lo, hi);
+    }
+    kibosh_patch_add(patches->patch, &patches->num, first, end, lo, hi);
+    return patches->bounce + lo;
+}
+
+void kibosh_patches_hole(struct kibosh_patches *patches, int lo, int hi)
+{
+    struct kibosh_patch *hole = patches->hole;
+    int first, end;
+
+    if (hi <= lo) {
+        return;
+    }
+    first = kibosh_patch_find(hole, patches->num_holes, lo);
+    for (end = first; (end < patches->num_holes) && (hole[end].lo <= hi); end++) {
+    }
+    if ((end == first) && (patches->num_holes == KIBOSH_MAX_HOLES)) {
+        // Grow a neighboring hole over the part instead.
+        if (first > 0) {
+            hole[first - 1].hi = hi;
+        } else {
+            hole[0].lo = lo;
+        }
+        return;
+    }
+    kibosh_patch_add(hole, &patches->num_holes, first, end, lo, hi);
+}
+
+int kibosh_patches_next_run(const struct kibosh_patches *patches, int len, int *idx,
+                            int *lo, int *hi)
+{
+    const struct kibosh_patch *hole = patches->hole;
+    int pos = *hi;
+
+    while ((*idx < patches->num_holes) && (hole[*idx].lo <= pos)) {
+        if (hole[*idx].hi > pos) {
+            pos = hole[*idx].hi;
+        }
+        (*idx)++;
+    }
+    if (pos >= len) {
+        return 0;
+    }
+    *lo = pos;
+    *hi = ((*idx < patches->num_holes) && (hole[*idx].lo < len)) ? hole[*idx].lo : len;
+    return 1;
+}
+
+int kibosh_patches_iov(const struct kibosh_patches *patches, int lo, int hi,
+                       struct iovec *iov)
+{
+    const struct kibosh_patch *patch;
+    int i, n = 0, pos = lo, end;
+
+    if (hi <= lo) {
+        return 0;
+    }
+    if (patches->whole) {
+        iov[0].iov_base = patches->bounce + lo;
+        iov[0].iov_len = hi - lo;
+        return 1;
+    }
+    i = kibosh_patch_find(patches->patch, patches->num, lo + 1);
+    for (; (i < patches->num) && (patches->patch[i].lo < hi); i++) {
+        patch = &patches->patch[i];
+        if (patch->lo > pos) {
+            iov[n].iov_base = (char *)(uintptr_t)(patches->base + pos);
+            iov[n].iov_len = patch->lo - pos;
+            n++;
+            pos = patch->lo;
+        }
+        end = (patch->hi < hi) ? patch->hi : hi;
+        iov[n].iov_base = patches->bounce + pos;
+        iov[n].iov_len = end - pos;
+        n++;
+        pos = end;
+    }
+    if (pos < hi) {
+        iov[n].iov_base = (char *)(uintptr_t)(patches->base + pos);
+        iov[n].iov_len = hi - pos;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Get a byte of the changed buffer, so that it can be corrupted.
+ */
+static char *corrupt_byte(struct kibosh_patches *patches, int i)
+{
+    return kibosh_patches_cover(patches, i, i + 1, 1);
+}
+
+/**
+ * Get the number of bits to skip before the next one to flip.
+ *
+ * The gaps between flipped bits follow a geometric distribution, so we can sample them
+ * directly, and the cost of flipping bits only depends on how many are flipped, not on how
+ * large the buffer is.
+ *
+ * @param u         A uniform random number in (0, 1].
+ * @param log_q     log(1 - bit error rate).
+ */
+static uint64_t corrupt_bit_skip(double u, double log_q)
+{
+    double skip = floor(log(u) / log_q);
+
+    return (skip >= 0x1.0p63) ? UINT64_MAX : (uint64_t)skip;
+}
+
+/**
+ * Invert every byte of a part of a buffer.
+ */
+static void corrupt_invert(struct kibosh_patches *patches, int lo, int size)
+{
+    char *buf = kibosh_patches_cover(patches, lo, lo + size, 1);
+    int i;
+
+    for (i = 0; i < size; i++) {
+        buf[i] = ~buf[i];
+    }
+}
+
+/**
+ * Flip bits in a part of a buffer, using drand48.
+ */
+static void corrupt_flip_bits(struct kibosh_patches *patches, int lo, int size, double ber)
+{
+    uint64_t bits = (uint64_t)size * 8, pos, skip;
+    double log_q;
+
+    if (ber <= 0.0) {
+        return;
+    }
+    if (ber >= 1.0) {
+        corrupt_invert(patches, lo, size);
+        return;
+    }
+    log_q = log1p(-ber);
+    for (pos = 0; ; pos++) {
+        skip = corrupt_bit_skip(1.0 - drand48(), log_q);
+        if (skip >= bits - pos) {
+            return;
+        }
+        pos += skip;
+        *corrupt_byte(patches, lo + (pos >> 3)) ^= 1 << (pos & 7);
+    }
+}
+
+static int corrupt_patches(struct kibosh_patches *patches, int lo, int size,
+                           enum buffer_corruption_type mode, double fraction)
 {
+    char *buf;
     int i;
 
     switch(mode) {
         case CORRUPT_ZERO:
             for (i = 0; i < size; i++) {
                 if (drand48() <= fraction) {
-                    buf[i] = '\0';
+                    *corrupt_byte(patches, lo + i) = '\0';
                 }
             }
             return size;
@@ -982,20 +4237,27 @@ int corrupt_buffer(char *buf, int size, enum buffer_corruption_type mode, double
         case CORRUPT_RAND:
             for (i = 0; i < size; i++) {
                 if (drand48() <= fraction) {
-                    buf[i] = lrand48() & 0xff;
+                    *corrupt_byte(patches, lo + i) = lrand48() & 0xff;
                 }
             }
             return size;
 
+        case CORRUPT_BIT_FLIP:
+            corrupt_flip_bits(patches, lo, size, fraction);
+            return size;
+
         case CORRUPT_RAND_SEQ:
-            for (i = drand48() * size; i < size; i++) {
-                buf[i] = lrand48() & 0xff;
+            // The tail is overwritten, so it never needs to be copied.
+            i = drand48() * size;
+            buf = kibosh_patches_cover(patches, lo + i, lo + size, 0);
+            for (; i < size; i++) {
+                *buf++ = lrand48() & 0xff;
             }
             return size;
 
         case CORRUPT_ZERO_SEQ:
             i = drand48() * size;
-            memset(buf + i, 0, size - i);
+            memset(kibosh_patches_cover(patches, lo + i, lo + size, 0), 0, size - i);
             return size;
 
         case CORRUPT_DROP:
@@ -1004,4 +4266,161 @@ int corrupt_buffer(char *buf, int size, enum buffer_corruption_type mode, double
     return size;
 }
 
+int corrupt_buffer(char *buf, int size, enum buffer_corruption_type mode, double fraction)
+{
+    struct kibosh_patches patches;
+
+    kibosh_patches_init(&patches, buf, buf, size);
+    return corrupt_patches(&patches, 0, size, mode, fraction);
+}
+
+/**
+ * The finalizer of SplitMix64, which turns a counter into a well mixed random number.
+ */
+static uint64_t corrupt_mix(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Get the random number for a byte offset in a file.
+ *
+ * @param file      The key of the file, from corrupt_file_key.
+ * @param offset    The offset.
+ */
+static uint64_t corrupt_random(uint64_t file, uint64_t offset)
+{
+    return corrupt_mix(file + (offset * 0x9e3779b97f4a7c15ULL));
+}
+
+/**
+ * Combine the seed and the file into a key, so that different files are corrupted
+ * differently.
+ */
+static uint64_t corrupt_file_key(const struct corrupt_key *key)
+{
+    return corrupt_mix(key->seed ^ corrupt_mix(key->dev + 0x632be59bd9b4e019ULL) ^
+                       corrupt_mix(key->ino + 0x8cb92ba72f3d8dd7ULL));
+}
+
+/**
+ * Pick a position in a buffer for the sequential modes, from the offset of the buffer.
+ */
+static int corrupt_seeded_start(uint64_t file, uint64_t offset, int size)
+{
+    // A different stream than the per-byte numbers, so that the two are independent.
+    uint64_t r = corrupt_random(file ^ 0xd6e8feb86659fd93ULL, offset);
+
+    return (int)((r >> 11) * 0x1.0p-53 * size);
+}
+
+/**
+ * The size of the blocks of a file which deterministic bit flips are decided for.
+ */
+#define CORRUPT_FLIP_BLOCK 4096
+
+/**
+ * Flip bits in a buffer deterministically.
+ *
+ * The flips in each block of the file come from a sequence of geometric skips which is
+ * keyed by the file and the block number.  We walk the sequence of every block which
+ * overlaps the buffer, and only flip the bits which fall inside it.
+ */
+static void corrupt_flip_bits_seeded(struct kibosh_patches *patches, int lo, int size,
+                                     double ber, uint64_t file, uint64_t offset)
+{
+    uint64_t block, last, block_key, first_bit, end_bit, bit, pos, skip, n;
+    double log_q;
+
+    if ((ber <= 0.0) || (size <= 0)) {
+        return;
+    }
+    if (ber >= 1.0) {
+        corrupt_invert(patches, lo, size);
+        return;
+    }
+    log_q = log1p(-ber);
+    // The bits of the buffer, as bit positions in the file.
+    first_bit = offset * 8;
+    end_bit = (offset + size) * 8;
+    last = (offset + size - 1) / CORRUPT_FLIP_BLOCK;
+    for (block = offset / CORRUPT_FLIP_BLOCK; block <= last; block++) {
+        block_key = corrupt_mix(file ^ (block * 0xd1b54a32d192ed03ULL));
+        for (pos = 0, n = 0; ; pos++, n++) {
+            skip = corrupt_bit_skip(((corrupt_random(block_key, n) >> 11) + 1) * 0x1.0p-53,
+                                    log_q);
+            if (skip >= (CORRUPT_FLIP_BLOCK * 8) - pos) {
+                break;
+            }
+            pos += skip;
+            bit = (block * CORRUPT_FLIP_BLOCK * 8) + pos;
+            if (bit >= end_bit) {
+                break;
+            }
+            if (bit >= first_bit) {
+                bit -= first_bit;
+                *corrupt_byte(patches, lo + (bit >> 3)) ^= 1 << (bit & 7);
+            }
+        }
+    }
+}
+
+static int corrupt_patches_seeded(struct kibosh_patches *patches, int lo, int size,
+                                  enum buffer_corruption_type mode, double fraction,
+                                  const struct corrupt_key *key)
+{
+    uint64_t file = corrupt_file_key(key), r, threshold;
+    int i, all = (fraction >= 1.0);
+    char *buf;
+
+    // A byte is corrupted if its number is below the threshold.  The low byte of the
+    // number is still uniform after that, so it can be the new value.
+    threshold = (fraction <= 0.0) ? 0 : all ? UINT64_MAX : (uint64_t)(fraction * 0x1.0p64);
+    switch(mode) {
+        case CORRUPT_ZERO:
+        case CORRUPT_RAND:
+            for (i = 0; i < size; i++) {
+                r = corrupt_random(file, key->offset + i);
+                if (all || (r < threshold)) {
+                    *corrupt_byte(patches, lo + i) = (mode == CORRUPT_ZERO) ? 0 : (r & 0xff);
+                }
+            }
+            return size;
+
+        case CORRUPT_BIT_FLIP:
+            corrupt_flip_bits_seeded(patches, lo, size, fraction, file, key->offset);
+            return size;
+
+        case CORRUPT_RAND_SEQ:
+            i = corrupt_seeded_start(file, key->offset, size);
+            buf = kibosh_patches_cover(patches, lo + i, lo + size, 0);
+            for (; i < size; i++) {
+                *buf++ = corrupt_random(file, key->offset + i) & 0xff;
+            }
+            return size;
+
+        case CORRUPT_ZERO_SEQ:
+            i = corrupt_seeded_start(file, key->offset, size);
+            memset(kibosh_patches_cover(patches, lo + i, lo + size, 0), 0, size - i);
+            return size;
+
+        case CORRUPT_DROP:
+            return corrupt_seeded_start(file, key->offset, size);
+    }
+    return size;
+}
+
+int corrupt_buffer_seeded(char *buf, int size, enum buffer_corruption_type mode,
+                          double fraction, const struct corrupt_key *key)
+{
+    struct kibosh_patches patches;
+
+    kibosh_patches_init(&patches, buf, buf, size);
+    return corrupt_patches_seeded(&patches, 0, size, mode, fraction, key);
+}
+
 // vim: ts=4:sw=4:tw=99:et
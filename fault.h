@@ -17,7 +17,135 @@
 #ifndef KIBOSH_FAULT_H
 #define KIBOSH_FAULT_H
 
-#include "json.h"
+#include "pattern.h"
+
+#include <stdint.h> // for uint32_t
+#include <sys/uio.h> // for struct iovec
+
+/**
+ * The operations which a fault can apply to.  These are used as bitmasks.
+ */
+enum kibosh_op {
+    KIBOSH_OP_READ = 0x1,
+    KIBOSH_OP_WRITE = 0x2,
+};
+
+/**
+ * An I/O operation which faults are matched against.
+ */
+struct kibosh_io {
+    /**
+     * The path of the file, as it was when the file was opened.
+     */
+    const char *path;
+
+    /**
+     * The operation, a kibosh_op value.
+     */
+    uint32_t op;
+
+    /**
+     * The user, group, and process of the caller.
+     */
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+
+    /**
+     * The flags which the file was opened with.
+     */
+    int open_flags;
+
+    /**
+     * The offset of the I/O in the file.
+     */
+    uint64_t offset;
+
+    /**
+     * The size of the I/O in bytes.
+     */
+    uint64_t size;
+
+    /**
+     * The device and inode of the backing file, which stay the same when the file is
+     * renamed.  Both 0 if they are not known.
+     */
+    uint64_t dev;
+    uint64_t ino;
+};
+
+/**
+ * A backing file, identified by its device and inode numbers.
+ */
+struct kibosh_inode {
+    uint64_t dev;
+    uint64_t ino;
+};
+
+/**
+ * A range of bytes in a file.  Both ends are inclusive.
+ */
+struct kibosh_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * The tests in a match clause.  These are used as bitmasks.
+ */
+enum kibosh_match_test {
+    KIBOSH_MATCH_UID = 0x1,
+    KIBOSH_MATCH_GID = 0x2,
+    KIBOSH_MATCH_PID = 0x4,
+    KIBOSH_MATCH_MIN_SIZE = 0x8,
+    KIBOSH_MATCH_MAX_SIZE = 0x10,
+    KIBOSH_MATCH_MIN_OFFSET = 0x20,
+    KIBOSH_MATCH_MAX_OFFSET = 0x40,
+    KIBOSH_MATCH_FLAGS = 0x80,
+
+    /**
+     * Not part of a match clause.  This is set in the compiled match tests of faults which
+     * target inodes, so that they are checked without a separate pass.
+     */
+    KIBOSH_MATCH_INODE = 0x100,
+
+    /**
+     * Not part of a match clause either.  This is set for faults which only apply to some
+     * byte ranges of a file.
+     */
+    KIBOSH_MATCH_RANGES = 0x200,
+};
+
+/**
+ * A match clause, which narrows down the I/O operations which a fault applies to, beyond
+ * its path and operation.  For example:
+ *
+ *   "match":{"uid":1000, "min_size":65536, "flags":["O_DIRECT"]}
+ *
+ * Only the tests which are given are made.  Sizes and offsets are inclusive.  All of the
+ * given open flags must have been set when the file was opened.
+ */
+struct kibosh_fault_match {
+    /**
+     * The tests to make, as a bitmask of kibosh_match_test values.  0 if the fault has no
+     * match clause.  Fields for tests which are not made are always 0.
+     */
+    uint32_t tests;
+
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t pid;
+
+    /**
+     * The open flags which must all be set.
+     */
+    uint32_t flags;
+
+    uint64_t min_size;
+    uint64_t max_size;
+    uint64_t min_offset;
+    uint64_t max_offset;
+};
 
 /**
  * The type of kibosh fault.
@@ -29,6 +157,10 @@ enum kibosh_fault_type {
     KIBOSH_FAULT_TYPE_WRITE_DELAY,
     KIBOSH_FAULT_TYPE_READ_CORRUPT,
     KIBOSH_FAULT_TYPE_WRITE_CORRUPT,
+    KIBOSH_FAULT_TYPE_TORN_WRITE,
+    KIBOSH_FAULT_TYPE_LOST_WRITE,
+    KIBOSH_FAULT_TYPE_WRITE_BACK,
+    KIBOSH_FAULT_TYPE_STALE_READ,
 };
 
 /**
@@ -47,6 +179,12 @@ enum buffer_corruption_type {
      */
     CORRUPT_RAND = 1001,
 
+    /**
+     * Flip bits at random positions.  The fraction is the chance that each bit is flipped,
+     * that is, the bit error rate.
+     */
+    CORRUPT_BIT_FLIP = 1002,
+
     /**
      * Replace sequential bytes at the end of the file with zero bytes.
      */
@@ -64,28 +202,68 @@ enum buffer_corruption_type {
 };
 
 /**
- * Base class for Kibosh faults.
+ * Ways of tearing a write.
  */
-struct kibosh_fault_base {
+enum torn_write_mode {
     /**
-     * The type of fault.
+     * Persist the sectors at the start of the write, up to the first one which is lost.
      */
-    enum kibosh_fault_type type;
+    TORN_WRITE_PREFIX = 1300,
+
+    /**
+     * Persist a random subset of the sectors of the write.
+     */
+    TORN_WRITE_SECTORS = 1301,
 };
 
 /**
- * The name of the kibosh_fault_unreadable type.
+ * The mutable state of a fault which is part of a compiled kibosh_faults structure.
+ * Protected by the lock of the kibosh_fs which owns the faults.
  */
-#define KIBOSH_FAULT_TYPE_UNREADABLE_NAME "unreadable"
+struct kibosh_fault_state {
+    /**
+     * For corruption faults, the number of corruptions left before we switch to
+     * CORRUPT_DROP.  Less than 0 means never switch.
+     */
+    int count;
+
+    /**
+     * The number of times that this fault has been injected.
+     */
+    uint64_t hits;
+
+    /**
+     * The coarse monotonic time, in milliseconds, when the fault was activated.  The time
+     * window and ramp of the fault are measured from here.
+     */
+    uint64_t activated_ms;
+
+    /**
+     * For faults with a burst model, nonzero if the model is in the bad state.  Accessed
+     * atomically.
+     */
+    int burst_bad;
+};
 
 /**
- * The class for Kibosh faults that make files unreadable.
+ * Base class for Kibosh faults.
+ *
+ * Faults come in two forms.  Standalone faults are allocated one at a time, and must be
+ * freed with kibosh_fault_base_free.  Compiled faults live inside the arena
+ * of a kibosh_faults structure.  They are never modified, except through their state, and
+ * go away when the kibosh_faults structure is freed.
  */
-struct kibosh_fault_unreadable {
+struct kibosh_fault_base {
     /**
-     * The base class members.
+     * The type of fault.
      */
-    struct kibosh_fault_base base;
+    enum kibosh_fault_type type;
+
+    /**
+     * The ID of the fault, used to refer to it in incremental updates.  The empty string
+     * if the fault has no ID.  May be NULL for standalone faults which were not parsed.
+     */
+    char *id;
 
     /**
      * The path prefix, starts with '/'.
@@ -98,34 +276,160 @@ struct kibosh_fault_unreadable {
     char *suffix;
 
     /**
-     * The error code to return from read faults.
+     * The source of the glob or regular expression which the whole path must match, or
+     * NULL if there is none.  This is checked in addition to the prefix and suffix.
      */
-    int code;
+    char *pattern;
+
+    /**
+     * The type of pattern, or 0 if there is none.
+     */
+    enum pattern_type pattern_type;
+
+    /**
+     * The compiled pattern, or NULL if there is none.  For compiled faults, this lives in
+     * the arena, right after the fault object.
+     */
+    struct pattern *dfa;
+
+    /**
+     * Nonzero if the fault targets a set of inodes.  Such faults match I/O on those inodes,
+     * whatever their path is, and their prefix, suffix, and pattern are not checked.
+     */
+    int has_inodes;
+
+    /**
+     * Nonzero if the prefix, suffix, and pattern of the fault should be resolved to the
+     * inodes of the files which they match when the fault is activated.  After that, the
+     * fault has inodes, and keeps following those files when they are renamed.
+     */
+    int pin;
+
+    /**
+     * The number of inodes which the fault targets.
+     */
+    uint32_t num_inodes;
+
+    /**
+     * The inodes which the fault targets, sorted and without duplicates.  NULL if there
+     * are none.  For compiled faults, these live in the arena, after the fault object.
+     */
+    struct kibosh_inode *inodes;
+
+    /**
+     * The size of the blocks which the ranges are rounded out to, or 0 if they are not
+     * rounded.
+     */
+    uint32_t block_size;
+
+    /**
+     * The number of byte ranges which the fault applies to.  0 means that it applies to the
+     * whole file.
+     */
+    uint32_t num_ranges;
+
+    /**
+     * The byte ranges which the fault applies to, sorted, and merged where they overlap or
+     * touch.  An I/O only matches the fault if it overlaps one of them, and the fault is
+     * only applied to the parts of the I/O which do.  For compiled faults, these live in
+     * the arena, after the fault object.
+     */
+    struct kibosh_range *ranges;
+
+    /**
+     * How long after activation the fault starts being injected, in milliseconds.
+     */
+    uint32_t start_ms;
+
+    /**
+     * How long after activation the fault stops being injected, in milliseconds.  0 means
+     * never.
+     */
+    uint32_t end_ms;
+
+    /**
+     * How long the ramp lasts, in milliseconds from start_ms.  During the ramp, the chance
+     * of injecting the fault goes up linearly from ramp_from to its full value: the fraction
+     * for delay faults, and 1.0 for other faults.  0 means there is no ramp.
+     */
+    uint32_t ramp_ms;
+
+    /**
+     * The chance of injecting the fault at the start of the ramp.
+     */
+    double ramp_from;
+
+    /**
+     * The chance that a burst starts, per matching operation, when the burst model is in
+     * the good state.  0 means that the fault does not have a burst model.
+     *
+     * The burst model is a Gilbert-Elliott channel: a two-state Markov chain which moves
+     * between a good state and a bad state once per matching operation.  In each state,
+     * the fault is injected with a different chance, so that faults come in bursts rather
+     * than independently.
+     */
+    double burst_enter;
+
+    /**
+     * The chance that a burst ends, per matching operation, when the burst model is in
+     * the bad state.
+     */
+    double burst_exit;
+
+    /**
+     * The chance of injecting the fault in the good state.
+     */
+    double good_fraction;
+
+    /**
+     * The chance of injecting the fault in the bad state.
+     */
+    double bad_fraction;
+
+    /**
+     * The match clause of the fault.
+     */
+    struct kibosh_fault_match match;
+
+    /**
+     * The mutable state of the fault, or NULL if this is a standalone fault.
+     */
+    struct kibosh_fault_state *state;
 };
 
 /**
- * The name of the kibosh_fault_read_delay type.
+ * The name of the kibosh_fault_unreadable type.
  */
-#define KIBOSH_FAULT_TYPE_READ_DELAY_NAME "read_delay"
+#define KIBOSH_FAULT_TYPE_UNREADABLE_NAME "unreadable"
 
 /**
- * The class for Kibosh faults that lead to delays when reading.
+ * The class for Kibosh faults that make files unreadable.
  */
-struct kibosh_fault_read_delay {
+struct kibosh_fault_unreadable {
     /**
      * The base class members.
      */
     struct kibosh_fault_base base;
 
     /**
-     * The path prefix, starts with '/'.
+     * The error code to return from read faults.
      */
-    char *prefix;
+    int code;
+};
+
+/**
+ * The name of the kibosh_fault_read_delay type.
+ */
+#define KIBOSH_FAULT_TYPE_READ_DELAY_NAME "read_delay"
 
+/**
+ * The class for Kibosh faults that lead to delays when reading.
+ */
+struct kibosh_fault_read_delay {
     /**
-     * The path suffix, can be used to specify a file extension.
+     * The base class members.
      */
-    char *suffix;
+    struct kibosh_fault_base base;
 
     /**
      * The number of milliseconds to delay the read.
@@ -152,16 +456,6 @@ struct kibosh_fault_unwritable {
      */
     struct kibosh_fault_base base;
 
-    /**
-     * The path prefix, starts with '/'.
-     */
-    char *prefix;
-
-    /**
-     * The path suffix, can be used to specify a file extension.
-     */
-    char *suffix;
-
     /**
      * The error code to return from write faults.
      */
@@ -182,16 +476,6 @@ struct kibosh_fault_write_delay {
      */
     struct kibosh_fault_base base;
 
-    /**
-     * The path prefix, starts with '/'.
-     */
-    char *prefix;
-
-    /**
-     * The path suffix, can be used to specify a file extension.
-     */
-    char *suffix;
-
     /**
      * The number of milliseconds to delay the read.
      */
@@ -218,30 +502,31 @@ struct kibosh_fault_read_corrupt {
     struct kibosh_fault_base base;
 
     /**
-     * The path prefix, starts with '/'.
+     * The mode of read corruption.
      */
-    char *prefix;
+    enum buffer_corruption_type mode;
 
     /**
-     * The path suffix, can be used to specify a file extension.
+     * Number of corruption fault injected before switching to CORRUPT_DROP with fraction = 1.0.
+     * Less than 0 means never switch.  This is the initial value of the count in the fault
+     * state.
      */
-    char *suffix;
+    int count;
 
     /**
-     * The mode of read corruption.
+     * The fraction of bytes to be corrupted. This should be a value between 0.0 and 1.0 inclusive.
      */
-    enum buffer_corruption_type mode;
+    double fraction;
 
     /**
-     * Number of corruption fault injected before switching to unwritable fault.
-     * Less than 0 means never switch.
+     * Nonzero if the corruption is deterministic.  See corrupt_buffer_seeded.
      */
-    int count;
+    int seeded;
 
     /**
-     * The fraction of bytes to be corrupted. This should be a value between 0.0 and 1.0 inclusive.
+     * The seed of deterministic corruption.
      */
-    double fraction;
+    uint64_t seed;
 };
 
 /**
@@ -258,16 +543,6 @@ struct kibosh_fault_write_corrupt {
      */
     struct kibosh_fault_base base;
 
-    /**
-     * The path prefix, starts with '/'.
-     */
-    char *prefix;
-
-    /**
-    * The path suffix, can be used to specify a file extension.
-    */
-    char *suffix;
-
     /**
      * The mode of write corruption.
      */
@@ -275,7 +550,8 @@ struct kibosh_fault_write_corrupt {
 
     /**
      * Number of corruption fault injected before switching to CORRUPT_DROP with fraction = 1.0.
-     * Less than 0 means never switch.
+     * Less than 0 means never switch.  This is the initial value of the count in the fault
+     * state.
      */
     int count;
 
@@ -283,67 +559,292 @@ struct kibosh_fault_write_corrupt {
      * The fraction of bytes to be corrupted. This should be a value between 0.0 and 1.0 inclusive.
      */
     double fraction;
-};
 
-struct kibosh_faults {
     /**
-     * A NULL-terminated list of pointers to fault objects.
+     * Nonzero if the corruption is deterministic.  See corrupt_buffer_seeded.
      */
-    struct kibosh_fault_base **list;
+    int seeded;
+
+    /**
+     * The seed of deterministic corruption.
+     */
+    uint64_t seed;
 };
 
 /**
- * Allocate an empty Kibosh faults structure.
- *
- * @param out       (out parameter) the new Kibosh faults structure
- *
- * @return          0 on success, or the negative error code on error.
+ * The name of the kibosh_fault_torn_write type.
  */
-int faults_calloc(struct kibosh_faults **out);
+#define KIBOSH_FAULT_TYPE_TORN_WRITE_NAME "torn_write"
 
 /**
- * Return the name of the fault type.
- *
- * @return          A constant string which is the name of the fault type.
+ * The default size of the sectors which torn writes are made of.
  */
-const char *kibosh_fault_type_name(struct kibosh_fault_base *fault);
+#define KIBOSH_TORN_WRITE_SECTOR_SIZE 512
 
 /**
- * Parse a JSON string as a fault object.
- *
- * @param str       The string to parse.
- *
- * @return          the dynamically allocated kibosh_faults structure, or NULL on error.
+ * The class for Kibosh faults that only persist some of the sectors of a write, like a
+ * disk which loses power in the middle of a write.
  */
-struct kibosh_fault_base *kibosh_fault_base_parse(json_value *obj);
+struct kibosh_fault_torn_write {
+    /**
+     * The base class members.
+     */
+    struct kibosh_fault_base base;
 
-/**
- * Convert a fault object into a JSON string.
- *
- * @param fault     The fault object.
- *
- * @return          A dynamically allocated JSON string on success; NULL on OOM.
- */
+    /**
+     * How the write is torn.
+     */
+    enum torn_write_mode mode;
+
+    /**
+     * The chance that each sector is persisted.  This should be a value between 0.0 and
+     * 1.0 inclusive.
+     */
+    double fraction;
+
+    /**
+     * The size of a sector.  Sectors are aligned to the file, not to the write.  This is a
+     * power of 2, at least 512.
+     */
+    uint32_t sector_size;
+
+    /**
+     * Nonzero to report a short write, which ends where the first lost sector starts.
+     * Otherwise, the whole write is reported as successful.
+     */
+    int short_write;
+};
+
+/**
+ * The name of the kibosh_fault_lost_write type.
+ */
+#define KIBOSH_FAULT_TYPE_LOST_WRITE_NAME "lost_write"
+
+/**
+ * The class for Kibosh faults that hold writes in memory until the file is synced, like
+ * a page cache which has not been written back yet.  Held writes are lost in a crash.
+ * See overlay.h.
+ */
+struct kibosh_fault_lost_write {
+    /**
+     * The base class members.
+     */
+    struct kibosh_fault_base base;
+};
+
+/**
+ * The name of the kibosh_fault_write_back type.
+ */
+#define KIBOSH_FAULT_TYPE_WRITE_BACK_NAME "write_back"
+
+/**
+ * The class for Kibosh faults that hold writes in memory and write them back in the
+ * background, like a page cache with a slow flusher.  Held writes are lost in a crash.
+ * See overlay.h.
+ */
+struct kibosh_fault_write_back {
+    /**
+     * The base class members.
+     */
+    struct kibosh_fault_base base;
+
+    /**
+     * The rate at which held data is written back, in KiB per second.  This is at least 1.
+     */
+    uint32_t kb_per_sec;
+
+    /**
+     * The number of KiB of held write-back data above which writers wait for the flusher,
+     * or 0 for no limit.
+     */
+    uint32_t dirty_limit_kb;
+};
+
+/**
+ * The name of the kibosh_fault_stale_read type.
+ */
+#define KIBOSH_FAULT_TYPE_STALE_READ_NAME "stale_read"
+
+/**
+ * The class for Kibosh faults that make reads return the old contents of a range for a
+ * while after it is written.  These match writes, not reads.  See stale.h.
+ */
+struct kibosh_fault_stale_read {
+    /**
+     * The base class members.
+     */
+    struct kibosh_fault_base base;
+
+    /**
+     * How long reads return the old contents for, in milliseconds.  This is at least 1.
+     */
+    uint32_t window_ms;
+};
+
+/**
+ * A slot in the inode hash table of a compiled set of faults.
+ */
+struct kibosh_inode_slot {
+    uint64_t dev;
+    uint64_t ino;
+    uint32_t fault;
+};
+
+/**
+ * A compiled, immutable set of faults.
+ *
+ * The whole structure lives in a single allocation.  The per-fault fields which we look at
+ * when matching are stored as parallel arrays, so that scanning the set for a match only
+ * touches a few cache lines.  The fault objects themselves and their strings follow.
+ */
+struct kibosh_faults {
+    /**
+     * The number of faults.
+     */
+    int num_faults;
+
+    /**
+     * A NULL-terminated list of pointers to fault objects.
+     */
+    struct kibosh_fault_base **list;
+
+    /**
+     * The mutable state of each fault.
+     */
+    struct kibosh_fault_state *states;
+
+    /**
+     * The operations which each fault applies to, as a bitmask of kibosh_op values.
+     */
+    uint32_t *op_masks;
+
+    /**
+     * The type of each fault.
+     */
+    uint8_t *types;
+
+    /**
+     * The offset of each fault's prefix in strs.
+     */
+    uint32_t *prefix_offs;
+
+    /**
+     * The length of each fault's prefix.
+     */
+    uint32_t *prefix_lens;
+
+    /**
+     * The offset of each fault's suffix in strs.
+     */
+    uint32_t *suffix_offs;
+
+    /**
+     * The length of each fault's suffix.
+     */
+    uint32_t *suffix_lens;
+
+    /**
+     * The match clause tests of each fault, as a bitmask of kibosh_match_test values.
+     */
+    uint32_t *match_tests;
+
+    /**
+     * A hash table of the inodes targeted by each fault, keyed by device, inode, and fault
+     * index, so that checking whether a fault targets a file is a single lookup.  Slots
+     * with a fault of 0 are empty; other slots hold the fault index plus 1.
+     */
+    struct kibosh_inode_slot *inode_slots;
+
+    /**
+     * The number of slots in the inode hash table: a power of 2, or 0 if no fault
+     * targets inodes.
+     */
+    uint32_t num_inode_slots;
+
+    /**
+     * The NULL-terminated prefix and suffix strings of all faults.
+     */
+    char *strs;
+
+    /**
+     * The coarse monotonic time, in milliseconds, when this structure was created.  Faults
+     * with a fresh state are activated at this time.
+     */
+    uint64_t created_ms;
+
+    /**
+     * Nonzero if any fault has a time window or a ramp, so that matching needs to read the
+     * clock.
+     */
+    int timed;
+
+    /**
+     * Nonzero if every fault which fires for an operation should be applied, rather than
+     * just the first one.  Set with "compose":true in the control JSON.
+     */
+    int compose;
+};
+
+/**
+ * Allocate an empty Kibosh faults structure.
+ *
+ * @param out       (out parameter) the new Kibosh faults structure
+ *
+ * @return          0 on success, or the negative error code on error.
+ */
+int faults_calloc(struct kibosh_faults **out);
+
+/**
+ * Return the name of the fault type.
+ *
+ * @return          A constant string which is the name of the fault type.
+ */
+const char *kibosh_fault_type_name(struct kibosh_fault_base *fault);
+
+/**
+ * Convert a fault object into a JSON string.
+ *
+ * @param fault     The fault object.
+ *
+ * @return          A dynamically allocated JSON string on success; NULL on OOM.
+ */
 char *kibosh_fault_base_unparse(struct kibosh_fault_base *fault);
 
 /**
  * Check whether a given kibosh FS operation should trigger this fault.
  *
+ * The time window and ramp are only applied to compiled faults, since standalone faults
+ * have not been activated.
+ *
  * @param fault     The fault.
- * @param path      The path.
- * @param op        The operation.
+ * @param io        The operation.
  *
- * @return          1 if the fault should not be injected; 0 otherwise.
+ * @return          1 if the fault should be injected; 0 otherwise.
  */
-int kibosh_fault_matches(struct kibosh_fault_base *fault, const char *path, const char *op);
+int kibosh_fault_matches(struct kibosh_fault_base *fault, const struct kibosh_io *io);
 
 /**
- * Free the memory associated with a fault object.
+ * Free the memory associated with a standalone fault object.
  *
  * @param fault     The fault object.
  */
 void kibosh_fault_base_free(struct kibosh_fault_base *fault);
 
+/**
+ * Compile a list of faults into a kibosh_faults structure.
+ *
+ * The faults are copied, so the caller still owns them afterwards.  The state of each
+ * compiled fault is initialized from its configuration.
+ *
+ * @param list      The faults to compile.  These may be standalone or compiled faults.
+ * @param num       The number of faults in the list.
+ * @param out       (out param) the dynamically allocated kibosh_faults structure.
+ *
+ * @return          0 on success; -ENOMEM on OOM.
+ */
+int faults_compile(struct kibosh_fault_base * const *list, int num,
+                   struct kibosh_faults **out);
+
 /**
  * Parse a JSON string as a faults object.
  *
@@ -354,6 +855,119 @@ void kibosh_fault_base_free(struct kibosh_fault_base *fault);
  */
 int faults_parse(const char *str, struct kibosh_faults **out);
 
+/**
+ * Find the index of the fault with the given ID.
+ *
+ * @param faults    The faults structure.
+ * @param id        The ID to look for.  Must not be empty.
+ *
+ * @return          The index of the fault, or -1 if there is no fault with that ID.
+ */
+int faults_find_id(const struct kibosh_faults *faults, const char *id);
+
+/**
+ * Apply a list of incremental operations to a set of faults.
+ *
+ * Each operation is an object with an "op" field:
+ *   {"op":"add", "fault":{...}}                Add a new fault at the end of the list.
+ *   {"op":"remove", "id":"..."}                Remove the fault with the given ID.
+ *   {"op":"update", "id":"...", "fault":{...}} Change some fields of the fault with the
+ *                                              given ID.  Fields which are not given keep
+ *                                              their current values.
+ *
+ * Only the faults named in the operations are parsed.  Every other fault keeps its state.
+ * Updated faults keep their state too, unless their count is changed.
+ *
+ * The fault objects are parsed by the same code as a full set of faults.  An update is
+ * checked as if its fields were merged into the JSON of the fault which it updates.
+ *
+ * @param faults    The current faults.  Not modified.
+ * @param str       A control JSON document with an "ops" array of operations.
+ * @param len       The length of the document.
+ * @param out       (out param) the new dynamically allocated kibosh_faults structure.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+int faults_apply_ops(const struct kibosh_faults *faults, const char *str, size_t len,
+                     struct kibosh_faults **out);
+
+/**
+ * Carry the state of unchanged faults over from an old fault set to a new one.
+ *
+ * A fault is unchanged if the old set has a fault with the same type, ID, prefix, suffix,
+ * pattern, inodes, ranges, and type-specific fields.  Identical faults are matched up in order.
+ * Faults which are new or changed keep the fresh state that they were compiled with.
+ *
+ * @param old       The old faults.  Not modified.
+ * @param faults    The new faults.
+ *
+ * @return          The number of new or changed faults on success; -ENOMEM on OOM.
+ */
+int faults_carry_state(const struct kibosh_faults *old, struct kibosh_faults *faults);
+
+/**
+ * Resolve the pinned faults in a fault set to inodes.
+ *
+ * Every regular file under the root is checked against the prefix, suffix, and pattern of
+ * each pinned fault which does not have inodes yet.  The fault then targets the inodes of
+ * the files which matched, and keeps targeting them when they are renamed.  Files which
+ * are created later are not targeted.
+ *
+ * A pinned fault which is identical to one which the old fault set already resolved keeps
+ * the old inodes, so that the backing filesystem is only walked for new pinned faults.
+ *
+ * @param faults    The faults.  Not modified.
+ * @param old       The faults which are being replaced, or NULL.  Not modified.
+ * @param root      The root of the backing filesystem.
+ * @param out       (out param) the new dynamically allocated kibosh_faults structure, or
+ *                  NULL if no faults needed to be resolved.  Faults keep their state.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+int faults_resolve_pins(const struct kibosh_faults *faults, const struct kibosh_faults *old,
+                        const char *root, struct kibosh_faults **out);
+
+/**
+ * A return code from faults_update which means that the control JSON contains a
+ * scenario rather than a set of faults.
+ */
+#define FAULTS_UPDATE_SCENARIO 1
+
+/**
+ * A return code from faults_update which means that the control JSON contains a crash
+ * request rather than a set of faults.
+ */
+#define FAULTS_UPDATE_CRASH 2
+
+/**
+ * Parse a control JSON string and create the fault set that it describes.
+ *
+ * The string may either be a full set of faults, {"faults":[...]}, or a list of
+ * incremental operations to apply to the current set, {"ops":[...]}.  A full set of faults
+ * may also say whether its faults are composed, {"faults":[...], "compose":true}.
+ * Incremental operations keep the current setting.
+ *
+ * A full set of faults is streamed directly into the new kibosh_faults structure, without
+ * building a JSON tree.
+ *
+ * When a full set of faults replaces the current set, unchanged faults keep their state.
+ * See faults_carry_state.
+ *
+ * The string may also contain a timeline of changes, {"scenario":{...}}.  Scenarios are
+ * not handled here; see scenario.h.  Neither are crash requests, {"crash":{...}}; see
+ * overlay.h.
+ *
+ * @param faults    The current faults.  Not modified.
+ * @param str       The string to parse.
+ * @param out       (out param) the new dynamically allocated kibosh_faults structure.
+ *
+ * @return          0 on success; FAULTS_UPDATE_SCENARIO or FAULTS_UPDATE_CRASH if faults
+ *                  was non-NULL and the string contains a scenario or a crash request, in
+ *                  which case out is not set; a negative error code otherwise.
+ */
+int faults_update(const struct kibosh_faults *faults, const char *str,
+                  struct kibosh_faults **out);
+
 /**
  * Convert a faults object into a JSON string.
  *
@@ -363,48 +977,315 @@ int faults_parse(const char *str, struct kibosh_faults **out);
  */
 char *faults_unparse(const struct kibosh_faults *faults);
 
+/**
+ * Convert a faults object into a JSON string which also includes the mutable state of
+ * each fault, such as how many times it has been injected.  The state is written as a
+ * "state" object inside each fault, which is ignored when parsing.
+ *
+ * @param faults    The faults object.
+ *
+ * @return          A dynamically allocated JSON string on success; NULL on OOM.
+ */
+char *faults_unparse_with_state(const struct kibosh_faults *faults);
+
 /**
  * Find the first fault that applies to the given path and operation.
  *
+ * Nothing else is known about the operation, so match clauses see a zero size and offset,
+ * uid, gid, pid, and open flags, and faults with byte ranges never apply.
+ *
  * @param faults    The faults structure.
  * @param path      The path.
- * @param op        The operation.
+ * @param op        The operation, a kibosh_op value.
  *
  * @return          NULL if no applicable fault could be found; the fault otherwise.
  */
 struct kibosh_fault_base *find_first_fault(struct kibosh_faults *faults,
-                                           const char *path, const char *op);
+                                           const char *path, uint32_t op);
+
+/**
+ * Check whether any delay fault could apply to the given path and operation.
+ *
+ * Unlike find_first_fault, this ignores the fraction of operations which are
+ * delayed.  It is used to decide which worker lane a request belongs in.  It only
+ * reads parts of the faults structure which never change, so it does not need the
+ * fault lock.
+ *
+ * @param faults    The faults structure.
+ * @param path      The path.
+ * @param op        The operation, a kibosh_op value.
+ *
+ * @return          1 if a delay fault may apply; 0 otherwise.
+ */
+int faults_may_delay(const struct kibosh_faults *faults, const char *path, uint32_t op);
+
+/**
+ * The most patches a write buffer can have before the whole buffer is copied.
+ */
+#define KIBOSH_MAX_PATCHES 64
+
+/**
+ * The most holes a write buffer can have.
+ */
+#define KIBOSH_MAX_HOLES 256
+
+/**
+ * The most iovecs which kibosh_patches_iov can produce.
+ */
+#define KIBOSH_PATCHES_IOV_MAX ((2 * KIBOSH_MAX_PATCHES) + 1)
+
+/**
+ * A part of a write buffer which has been changed.
+ */
+struct kibosh_patch {
+    /**
+     * The start of the part.
+     */
+    int lo;
+
+    /**
+     * The end of the part, exclusive.
+     */
+    int hi;
+};
+
+/**
+ * The changes which write faults make to a buffer which we are not allowed to modify.
+ *
+ * Rather than copying the whole buffer, the changed parts are written into a bounce
+ * buffer, at the same offsets as in the original buffer.  The write is then issued with
+ * pwritev, interleaving the original buffer with the changed parts.
+ */
+struct kibosh_patches {
+    /**
+     * The original buffer.
+     */
+    const char *base;
+
+    /**
+     * The bounce buffer.  It must be at least as large as the original buffer.  NULL until
+     * a fault first needs it, if bounce_get is set.
+     */
+    char *bounce;
+
+    /**
+     * If non-NULL, gets a bounce buffer of at least the given size, or returns NULL on OOM.
+     * This lets writes which no fault changes skip getting a bounce buffer at all.
+     */
+    char *(*bounce_get)(size_t size);
+
+    /**
+     * The size of the original buffer.
+     */
+    int size;
+
+    /**
+     * Nonzero if the bounce buffer holds the whole buffer, because there were too many
+     * patches.
+     */
+    int whole;
+
+    /**
+     * The number of patches.
+     */
+    int num;
+
+    /**
+     * The parts of the bounce buffer which hold the changed buffer, sorted by offset.
+     * Patches never overlap or touch.
+     */
+    struct kibosh_patch patch[KIBOSH_MAX_PATCHES];
+
+    /**
+     * The number of holes.
+     */
+    int num_holes;
+
+    /**
+     * The parts of the buffer which are not written at all, sorted by offset.  Holes never
+     * overlap or touch.
+     */
+    struct kibosh_patch hole[KIBOSH_MAX_HOLES];
+
+    /**
+     * The number of bytes to report as written, if fewer bytes than that were written.
+     * -1 to report the number of bytes which were written.
+     */
+    int reported;
+
+    /**
+     * Nonzero if the write should be held in the overlay until the file is synced,
+     * rather than written to the target.
+     */
+    int unsynced;
+
+    /**
+     * The rate at which the overlay should write the held data back, in KiB per second, or
+     * 0 to hold it until the file is synced.
+     */
+    uint32_t kb_per_sec;
+
+    /**
+     * The number of bytes of held write-back data above which the writer waits, or 0.
+     */
+    uint64_t dirty_limit;
+
+    /**
+     * How long reads should return the old contents of the written range for, in
+     * milliseconds, or 0 if they should see the write right away.
+     */
+    uint32_t stale_ms;
+};
+
+/**
+ * Initialize a patches structure with no patches.
+ *
+ * @param patches   The structure.
+ * @param base      The original buffer.
+ * @param bounce    The bounce buffer.  This can be the same as base, to change a buffer
+ *                  in place, or NULL to get it from bounce_get when a fault first needs
+ *                  it.
+ * @param size      The size of the original buffer.
+ */
+void kibosh_patches_init(struct kibosh_patches *patches, const char *base, char *bounce,
+                         int size);
+
+/**
+ * Make sure that there is a bounce buffer, getting it from bounce_get if needed.  Faults
+ * must call this before they change the buffer.
+ *
+ * @param patches   The structure.
+ *
+ * @return          0 on success; -ENOMEM if we could not get a bounce buffer.
+ */
+int kibosh_patches_reserve(struct kibosh_patches *patches);
+
+/**
+ * Get part of the changed buffer for writing.
+ *
+ * @param patches   The structure.
+ * @param lo        The start of the part.
+ * @param hi        The end of the part, exclusive.
+ * @param copy      Nonzero to fill the part with the current contents of the buffer first.
+ *                  Zero if the caller will overwrite all of it.
+ *
+ * @return          The start of the part, in the bounce buffer.
+ */
+char *kibosh_patches_cover(struct kibosh_patches *patches, int lo, int hi, int copy);
+
+/**
+ * Leave a part of the buffer out of the write.  If there are already too many holes, the
+ * part between the new hole and the one before it is left out too.
+ *
+ * @param patches   The structure.
+ * @param lo        The start of the part.
+ * @param hi        The end of the part, exclusive.
+ */
+void kibosh_patches_hole(struct kibosh_patches *patches, int lo, int hi);
+
+/**
+ * Find the next part of the buffer which should be written, skipping holes.
+ *
+ * @param patches   The structure.
+ * @param len       The number of bytes at the start of the buffer to write.
+ * @param idx       (inout) The index of the next hole to look at.  0 at the start.
+ * @param lo        (out param) The start of the part.
+ * @param hi        (inout) The end of the part, exclusive.  0 at the start.
+ *
+ * @return          1 if there was another part; 0 otherwise.
+ */
+int kibosh_patches_next_run(const struct kibosh_patches *patches, int len, int *idx,
+                            int *lo, int *hi);
+
+/**
+ * Describe a part of the changed buffer as iovecs.
+ *
+ * @param patches   The structure.
+ * @param lo        The start of the part.
+ * @param hi        The end of the part, exclusive.
+ * @param iov       (out param) An array of at least KIBOSH_PATCHES_IOV_MAX iovecs.
+ *
+ * @return          The number of iovecs.
+ */
+int kibosh_patches_iov(const struct kibosh_patches *patches, int lo, int hi,
+                       struct iovec *iov);
 
 /**
  * Apply a fault during a read operation.
  *
+ * If the fault has byte ranges, it is only applied to the parts of the buffer which
+ * overlap them.  An error is only returned if the read starts in one of the ranges;
+ * otherwise, the read is cut short where the first range starts.
+ *
  * @param fault     The fault to apply.
+ * @param io        The operation.
  * @param buf       The read buffer.
  * @param nread     The size of the read buffer.
  * @param delay_ms  (out param) the number of milliseconds to delay.
  *
  * @return          The result to return from the read operation.
  */
-int apply_read_fault(struct kibosh_fault_base *fault, char *buf, int nread,
-                     uint32_t *delay_ms);
+int apply_read_fault(struct kibosh_fault_base *fault, const struct kibosh_io *io, char *buf,
+                     int nread, uint32_t *delay_ms);
 
 /**
- * Apply a fault during a write operation.
+ * Apply a fault during a write operation.  Byte ranges work like they do for reads.
  *
  * @param fault         The fault to apply.
- * @param buf           (inout) The write buffer.  May be changed if needed.
- * @param dynamic_buf   (output) If this function allocates a new buffer, it will be
- *                      stored here, so that the caller can free it later.
- * @param nread         The size of the write buffer.
+ * @param io            The operation.
+ * @param patches       (inout) The changes to the write buffer.  Earlier faults may
+ *                      already have changed it.
+ * @param size          The size of the write buffer.
  * @param delay_ms      (out param) the number of milliseconds to delay.
  *
  * @return              The result to return from the write operation.
  */
-int apply_write_fault(struct kibosh_fault_base *fault, const char **buf, char **dynamic_buf,
-                      int size, uint32_t *delay_ms);
+int apply_write_fault(struct kibosh_fault_base *fault, const struct kibosh_io *io,
+                      struct kibosh_patches *patches, int size, uint32_t *delay_ms);
 
 /**
- * Free a dynamically allocated kibosh_faults structure.
+ * Find and apply the faults for a read operation.
+ *
+ * Normally only the first fault which fires is applied.  If the faults are composed, every
+ * fault which fires is applied, as one pipeline: first all of the delays, which are added
+ * together into a single wait, then the first error, if any, and then all of the
+ * corruptions, in order.  Faults after an error are not applied, and do not count as hits.
+ *
+ * @param faults        The faults structure.
+ * @param io            The operation.
+ * @param buf           The read buffer.
+ * @param nread         The size of the read buffer.
+ * @param delay_ms      (out param) the number of milliseconds to delay.
+ * @param fault_name    (out param) the type name of the first fault applied, or NULL if
+ *                      no fault was applied.
+ *
+ * @return              The result to return from the read operation.
+ */
+int faults_apply_read(struct kibosh_faults *faults, const struct kibosh_io *io, char *buf,
+                      int nread, uint32_t *delay_ms, const char **fault_name);
+
+/**
+ * Find and apply the faults for a write operation.  See faults_apply_read.
+ *
+ * @param faults        The faults structure.
+ * @param io            The operation.
+ * @param patches       (inout) The changes to the write buffer.  Initialized by the
+ *                      caller with kibosh_patches_init.
+ * @param size          The size of the write buffer.
+ * @param delay_ms      (out param) the number of milliseconds to delay.
+ * @param fault_name    (out param) the type name of the first fault applied, or NULL if
+ *                      no fault was applied.
+ *
+ * @return              The result to return from the write operation: an error code, or
+ *                      the number of bytes at the start of the buffer to write.
+ */
+int faults_apply_write(struct kibosh_faults *faults, const struct kibosh_io *io,
+                       struct kibosh_patches *patches, int size, uint32_t *delay_ms,
+                       const char **fault_name);
+
+/**
+ * Free a dynamically allocated kibosh_faults structure.  This frees all of the compiled
+ * faults inside it as well.
  *
  * @param faults    The structure to free.
  */
@@ -423,6 +1304,48 @@ void faults_free(struct kibosh_faults *faults);
 int corrupt_buffer(char *buf, int size, enum buffer_corruption_type mode,
                     double fraction);
 
+/**
+ * Where a buffer which is being corrupted deterministically came from.
+ */
+struct corrupt_key {
+    /**
+     * The seed of the fault.
+     */
+    uint64_t seed;
+
+    /**
+     * The device and inode of the file.
+     */
+    uint64_t dev;
+    uint64_t ino;
+
+    /**
+     * The offset in the file of the first byte of the buffer.
+     */
+    uint64_t offset;
+};
+
+/**
+ * Corrupt a buffer deterministically.
+ *
+ * Whether each byte is corrupted, and what it is replaced with, comes from a counter-based
+ * random number generator keyed by the seed, the file, and the offset of the byte in the
+ * file.  So every read of the same byte is corrupted in the same way, like bit rot on a
+ * disk, without storing anything.  The sequential modes and CORRUPT_DROP pick where they
+ * start from the offset of the buffer, so they are stable for I/O which starts at the same
+ * offset.  Bit flips are decided for each 4 KiB block of the file at once.
+ *
+ * @param buf       The buffer.
+ * @param size      The size.
+ * @param mode      The corruption mode to use.
+ * @param fraction  The fraction of bytes to corrupt.  Only needed for certain modes.
+ * @param key       Where the buffer came from.
+ *
+ * @return          The new length to use for the buffer.
+ */
+int corrupt_buffer_seeded(char *buf, int size, enum buffer_corruption_type mode,
+                          double fraction, const struct corrupt_key *key);
+
 #endif
 
 // vim: ts=4:sw=4:tw=99:et
@@ -17,13 +17,18 @@
 #include "fault.h"
 #include "log.h"
 #include "test.h"
+#include "time.h"
 #include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static struct kibosh_fault_unreadable *kibosh_fault_unreadable_alloc(int code,
                                                                      const char *prefix)
@@ -31,11 +36,11 @@ static struct kibosh_fault_unreadable *kibosh_fault_unreadable_alloc(int code,
     struct kibosh_fault_unreadable *fault;
     fault = calloc(1, sizeof(*fault));
     fault->base.type = KIBOSH_FAULT_TYPE_UNREADABLE;
-    fault->prefix = strdup(prefix);
-    if (!fault->prefix)
+    fault->base.prefix = strdup(prefix);
+    if (!fault->base.prefix)
         abort();
-    fault->suffix = strdup("");
-    if (!fault->suffix)
+    fault->base.suffix = strdup("");
+    if (!fault->base.suffix)
         abort();
     fault->code = code;
     return fault;
@@ -45,6 +50,7 @@ static struct kibosh_faults *kibosh_faults_alloc(void *first, ...)
 {
     int i, num_faults = 1;
     void *base;
+    struct kibosh_fault_base **list;
     struct kibosh_faults *faults;
     va_list ap, ap2;
 
@@ -57,22 +63,22 @@ static struct kibosh_faults *kibosh_faults_alloc(void *first, ...)
     }
     va_end(ap);
 
-    faults = calloc(1, sizeof(*faults));
-    if (!faults)
+    list = calloc(num_faults + 1, sizeof(struct kibosh_fault_base*));
+    if (!list)
         return NULL;
-    faults->list = calloc(num_faults + 1, sizeof(struct kibosh_fault_base*));
-    if (!faults->list) {
-        free(faults);
-        return NULL;
-    }
-
-    faults->list[0] = first;;
+    list[0] = first;
     va_start(ap2, first);
     for (i = 1; i < num_faults; i++) {
         base = va_arg(ap2, void*);
-        faults->list[i] = base;
+        list[i] = base;
     }
     va_end(ap2);
+    if (faults_compile(list, num_faults, &faults))
+        faults = NULL;
+    for (i = 0; i < num_faults; i++) {
+        kibosh_fault_base_free(list[i]);
+    }
+    free(list);
     return faults;
 }
 
@@ -132,8 +138,8 @@ static int test_fault_parse(void)
     EXPECT_INT_EQ(2, unreadable->code);
     EXPECT_INT_EQ(KIBOSH_FAULT_TYPE_READ_DELAY, faults->list[2]->type);
     read_delay = (struct kibosh_fault_read_delay*)faults->list[2];
-    EXPECT_STR_EQ("/x", read_delay->prefix);
-    EXPECT_STR_EQ("", read_delay->suffix);
+    EXPECT_STR_EQ("/x", read_delay->base.prefix);
+    EXPECT_STR_EQ("", read_delay->base.suffix);
     faults_free(faults);
     return 0;
 }
@@ -150,12 +156,1540 @@ static int test_faults_parse_empty(void)
     return 0;
 }
 
+static int test_faults_may_delay(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5}, "
+                           "{\"type\":\"read_delay\", \"prefix\":\"/b\", \"suffix\":\".log\", "
+                               "\"delay_ms\":100, \"fraction\": 0.0}]}";
+    struct kibosh_faults *faults = NULL;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_EQ(0, faults_may_delay(faults, "/a/foo.log", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(1, faults_may_delay(faults, "/b/foo.log", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(0, faults_may_delay(faults, "/b/foo.index", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(0, faults_may_delay(faults, "/b/foo.log", KIBOSH_OP_WRITE));
+    faults_free(faults);
+    return 0;
+}
+
+static void make_io(struct kibosh_io *io, const char *path, uint32_t op)
+{
+    memset(io, 0, sizeof(*io));
+    io->path = path;
+    io->op = op;
+}
+
+/**
+ * Copy the start of a patched write buffer out, the way pwritev would see it.
+ */
+static void flatten_patches(const struct kibosh_patches *patches, int len, char *out)
+{
+    struct iovec iov[KIBOSH_PATCHES_IOV_MAX];
+    int i, n = kibosh_patches_iov(patches, 0, len, iov);
+
+    for (i = 0; i < n; i++) {
+        memcpy(out, iov[i].iov_base, iov[i].iov_len);
+        out += iov[i].iov_len;
+    }
+}
+
+static int test_find_first_fault(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"type\":\"unwritable\", \"prefix\":\"/a\", \"code\":5}, "
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a/b\", \"suffix\":\".log\", "
+                               "\"code\":6}, "
+                           "{\"type\":\"read_corrupt\", \"prefix\":\"/a\", \"mode\":1100, "
+                               "\"count\":1, \"fraction\":0.5}]}";
+    struct kibosh_faults *faults = NULL;
+    struct kibosh_fault_read_corrupt *read_corrupt;
+    struct kibosh_io io;
+    char buf[16] = { 0 };
+    uint32_t delay_ms;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_EQ(3, faults->num_faults);
+    EXPECT_INT_EQ(KIBOSH_FAULT_TYPE_UNWRITABLE,
+                  find_first_fault(faults, "/a/b.log", KIBOSH_OP_WRITE)->type);
+    EXPECT_INT_EQ(KIBOSH_FAULT_TYPE_UNREADABLE,
+                  find_first_fault(faults, "/a/b.log", KIBOSH_OP_READ)->type);
+    EXPECT_INT_EQ(KIBOSH_FAULT_TYPE_READ_CORRUPT,
+                  find_first_fault(faults, "/a/b.index", KIBOSH_OP_READ)->type);
+    EXPECT_NULL(find_first_fault(faults, "/c/b.log", KIBOSH_OP_READ));
+    EXPECT_NULL(find_first_fault(faults, "/", KIBOSH_OP_READ));
+
+    // Applying a corruption fault uses up its count, but not its configuration.
+    read_corrupt = (struct kibosh_fault_read_corrupt*)faults->list[2];
+    make_io(&io, "/a/b.log", KIBOSH_OP_READ);
+    EXPECT_INT_EQ(sizeof(buf), apply_read_fault(faults->list[2], &io, buf, sizeof(buf),
+                                                &delay_ms));
+    EXPECT_INT_EQ(0, faults->states[2].count);
+    EXPECT_INT_EQ(1, read_corrupt->count);
+    EXPECT_INT_EQ(CORRUPT_ZERO_SEQ, read_corrupt->mode);
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_apply_ops(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"id\":\"a\", \"type\":\"read_corrupt\", \"prefix\":\"/a\", "
+                               "\"mode\":1100, \"count\":2, \"fraction\":0.5}, "
+                           "{\"id\":\"b\", \"type\":\"unreadable\", \"prefix\":\"/b\", "
+                               "\"code\":5}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL, *faults4 = NULL;
+    struct kibosh_fault_read_corrupt *read_corrupt;
+    char buf[16] = { 0 }, *unparsed;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_EQ(0, faults_find_id(faults, "a"));
+    EXPECT_INT_EQ(1, faults_find_id(faults, "b"));
+    EXPECT_INT_EQ(-1, faults_find_id(faults, "c"));
+    make_io(&io, "/a/b.log", KIBOSH_OP_READ);
+    EXPECT_INT_EQ(sizeof(buf), apply_read_fault(faults->list[0], &io, buf, sizeof(buf),
+                                                &delay_ms));
+    EXPECT_INT_EQ(1, faults->states[0].count);
+
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":["
+            "{\"op\":\"add\", \"fault\":{\"id\":\"c\", \"type\":\"unwritable\", "
+                "\"prefix\":\"/c\", \"code\":6}}, "
+            "{\"op\":\"remove\", \"id\":\"b\"}, "
+            "{\"op\":\"update\", \"id\":\"a\", \"fault\":{\"fraction\":0.25}}]}",
+            &faults2));
+    EXPECT_INT_EQ(2, faults2->num_faults);
+    EXPECT_INT_EQ(0, faults_find_id(faults2, "a"));
+    EXPECT_INT_EQ(-1, faults_find_id(faults2, "b"));
+    EXPECT_INT_EQ(1, faults_find_id(faults2, "c"));
+    read_corrupt = (struct kibosh_fault_read_corrupt*)faults2->list[0];
+    EXPECT_INT_EQ(CORRUPT_ZERO_SEQ, read_corrupt->mode);
+    EXPECT_INT_EQ(1, faults2->states[0].count);
+    EXPECT_STR_EQ("/a", read_corrupt->base.prefix);
+    unparsed = faults_unparse(faults2);
+    EXPECT_STR_EQ("{\"faults\":["
+            "{\"id\":\"a\", \"type\":\"read_corrupt\", \"prefix\":\"/a\", \"suffix\":\"\", "
+                "\"mode\":1100, \"count\":2, \"fraction\":0.25}, "
+            "{\"id\":\"c\", \"type\":\"unwritable\", \"prefix\":\"/c\", \"suffix\":\"\", "
+                "\"code\":6}]}", unparsed);
+    free(unparsed);
+
+    // Changing the count resets the countdown.
+    EXPECT_INT_ZERO(faults_update(faults2, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"count\":7}}]}", &faults3));
+    EXPECT_INT_EQ(7, faults3->states[0].count);
+    faults_free(faults3);
+
+    EXPECT_INT_EQ(-EEXIST, faults_update(faults2, "{\"ops\":[{\"op\":\"add\", "
+            "\"fault\":{\"id\":\"c\", \"type\":\"unwritable\", \"code\":6}}]}", &faults3));
+    EXPECT_INT_EQ(-ENOENT, faults_update(faults2, "{\"ops\":[{\"op\":\"remove\", "
+            "\"id\":\"b\"}]}", &faults3));
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"type\":\"unreadable\"}}]}", &faults3));
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"id\":\"z\"}}]}", &faults3));
+    // Updates are checked in the same way as a full set of faults.
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"fraction\":1}}]}", &faults3));
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"end_ms\":5, \"start_ms\":10}}]}", &faults3));
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"add\", "
+            "\"fault\":{\"id\":\"d\", \"type\":\"unwritable\"}}]}", &faults3));
+    // Fields which are not updated keep their exact values.
+    EXPECT_INT_ZERO(faults_update(faults2, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"fraction\":0.123456789}}]}", &faults3));
+    EXPECT_INT_ZERO(faults_update(faults3, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"glob\":\"/a/*.log\"}}]}", &faults4));
+    read_corrupt = (struct kibosh_fault_read_corrupt*)faults4->list[0];
+    EXPECT_INT_EQ(1, 0.123456789 == read_corrupt->fraction);
+    EXPECT_STR_EQ("/a/*.log", read_corrupt->base.pattern);
+    faults_free(faults4);
+    faults_free(faults3);
+    EXPECT_INT_EQ(-EEXIST, faults_parse("{\"faults\":["
+            "{\"id\":\"x\", \"type\":\"unreadable\", \"code\":5}, "
+            "{\"id\":\"x\", \"type\":\"unreadable\", \"code\":6}]}", &faults3));
+    faults_free(faults2);
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_parse_field_order(void)
+{
+    const char *str = "{\"other\":[{\"x\":1}], \"faults\":["
+                           "{\"fraction\":0.5, \"count\":3, \"unknown\":{\"a\":[1, 2]}, "
+                               "\"mode\":1100, \"prefix\":\"/p\", \"type\":\"write_corrupt\"}]}";
+    struct kibosh_faults *faults = NULL;
+    struct kibosh_fault_write_corrupt *write_corrupt;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_EQ(1, faults->num_faults);
+    EXPECT_INT_EQ(KIBOSH_FAULT_TYPE_WRITE_CORRUPT, faults->list[0]->type);
+    write_corrupt = (struct kibosh_fault_write_corrupt*)faults->list[0];
+    EXPECT_INT_EQ(CORRUPT_ZERO_SEQ, write_corrupt->mode);
+    EXPECT_INT_EQ(3, write_corrupt->count);
+    EXPECT_INT_EQ(3, faults->states[0].count);
+    EXPECT_STR_EQ("/p", faults->list[0]->prefix);
+    EXPECT_STR_EQ("", faults->list[0]->suffix);
+    EXPECT_STR_EQ("", faults->list[0]->id);
+    EXPECT_NONNULL(find_first_fault(faults, "/p/q", KIBOSH_OP_WRITE));
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_parse_invalid(void)
+{
+    static const char * const invalid[] = {
+        "",
+        "[]",
+        "{\"faults\":{}}",
+        "{\"faults\":[1]}",
+        "{\"faults\":[{\"type\":\"unreadable\"}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":\"5\"}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"code\":6}]}",
+        "{\"faults\":[{\"type\":\"frobnicate\", \"code\":5}]}",
+        "{\"faults\":[{\"code\":5}]}",
+        "{\"faults\":[{\"type\":\"read_delay\", \"delay_ms\":5, \"fraction\":1}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"prefix\":7}]}",
+        "{\"faults\":[], \"faults\":[]}",
+        "{\"faults\":[]} x",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"start_ms\":-1}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"start_ms\":10, "
+            "\"end_ms\":10}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"ramp_ms\":10, "
+            "\"ramp_from\":1.5}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"burst_enter\":1.5}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"burst_enter\":0.5, "
+            "\"bad_fraction\":1}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"match\":[]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"match\":{\"uid\":-1}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"match\":{\"uid\":4294967296}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"match\":{\"user\":0}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"match\":{\"flags\":[\"O_FROB\"]}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"match\":{\"min_size\":2, \"max_size\":1}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"glob\":\"[a\"}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"regex\":\"a)\"}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"regex\":5}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"glob\":\"*\", "
+            "\"regex\":\".*\"}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"pin\":1}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"inodes\":{}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"inodes\":[{\"dev\":1}]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"inodes\":[{\"dev\":1, \"ino\":-1}]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"inodes\":[{\"dev\":1, \"ino\":2, \"gen\":3}]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"ranges\":{}}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"ranges\":[{\"start\":1}]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"ranges\":[{\"start\":2, \"end\":1}]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+            "\"ranges\":[{\"start\":-1, \"end\":1}]}]}",
+        "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, \"block_size\":-1}]}",
+        "{\"faults\":[{\"type\":\"read_corrupt\", \"mode\":1000, \"count\":1, "
+            "\"fraction\":0.5, \"seed\":0.5}]}",
+        "{\"faults\":[{\"type\":\"torn_write\", \"mode\":1300}]}",
+        "{\"faults\":[{\"type\":\"torn_write\", \"mode\":1302, \"fraction\":0.5}]}",
+        "{\"faults\":[{\"type\":\"torn_write\", \"mode\":1300, \"fraction\":0.5, "
+            "\"sector_size\":1000}]}",
+        "{\"faults\":[{\"type\":\"torn_write\", \"mode\":1300, \"fraction\":0.5, "
+            "\"short\":1}]}",
+        "{\"faults\":[{\"type\":\"write_back\"}]}",
+        "{\"faults\":[{\"type\":\"write_back\", \"kb_per_sec\":0}]}",
+        "{\"faults\":[{\"type\":\"write_back\", \"kb_per_sec\":1, "
+            "\"dirty_limit_kb\":-1}]}",
+        "{\"faults\":[{\"type\":\"stale_read\"}]}",
+        "{\"faults\":[{\"type\":\"stale_read\", \"window_ms\":0}]}",
+        NULL,
+    };
+    struct kibosh_faults *faults = NULL;
+    int i;
+
+    for (i = 0; invalid[i]; i++) {
+        EXPECT_INT_EQ(-EIO, faults_parse(invalid[i], &faults));
+    }
+    EXPECT_INT_EQ(-EEXIST, faults_parse("{\"faults\":["
+            "{\"id\":\"a\", \"type\":\"unreadable\", \"code\":5}, "
+            "{\"id\":\"a\", \"type\":\"unwritable\", \"code\":5}]}", &faults));
+    return 0;
+}
+
+static int test_faults_unparse_round_trip(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"type\":\"read_delay\", \"prefix\":\"/a \\\"b\\\\\", "
+                               "\"suffix\":\"\\n\", \"delay_ms\":100, \"fraction\":1.0}, "
+                           "{\"type\":\"write_delay\", \"prefix\":\"/\", \"suffix\":\"\", "
+                               "\"delay_ms\":5, \"fraction\":0.5}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    char *unparsed;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_STR_EQ("/a \"b\\", faults->list[0]->prefix);
+    EXPECT_STR_EQ("\n", faults->list[0]->suffix);
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    EXPECT_INT_ZERO(faults_parse(unparsed, &faults2));
+    EXPECT_INT_EQ(2, faults2->num_faults);
+    free(unparsed);
+    faults_free(faults2);
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_unparse_with_state(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"id\":\"a\", \"type\":\"unreadable\", \"prefix\":\"/a\", "
+                               "\"code\":5}]}";
+    struct kibosh_faults *faults = NULL;
+    char *unparsed;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_NONNULL(find_first_fault(faults, "/a/b", KIBOSH_OP_READ));
+    EXPECT_NONNULL(find_first_fault(faults, "/a/c", KIBOSH_OP_READ));
+    EXPECT_NULL(find_first_fault(faults, "/b", KIBOSH_OP_READ));
+    unparsed = faults_unparse_with_state(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ("{\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+                  "\"prefix\":\"/a\", \"suffix\":\"\", \"code\":5, "
+                  "\"state\":{\"hits\":2, \"count\":-1}}]}", unparsed);
+    free(unparsed);
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_update_carries_state(void)
+{
+    const char *str1 = "{\"faults\":["
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5}, "
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5}, "
+                           "{\"type\":\"unwritable\", \"prefix\":\"/b\", \"code\":5}]}";
+    const char *str2 = "{\"faults\":["
+                           "{\"type\":\"unwritable\", \"prefix\":\"/b\", \"code\":28}, "
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5}, "
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5}]}";
+    struct kibosh_faults *faults1 = NULL, *faults2 = NULL;
+
+    EXPECT_INT_ZERO(faults_parse(str1, &faults1));
+    faults1->states[0].hits = 10;
+    faults1->states[1].hits = 20;
+    faults1->states[2].hits = 30;
+    EXPECT_INT_ZERO(faults_update(faults1, str2, &faults2));
+    EXPECT_INT_EQ(3, faults2->num_faults);
+    // The unwritable fault changed its code, so it starts over.
+    EXPECT_INT_EQ(0, faults2->states[0].hits);
+    // Identical faults are matched up in order.
+    EXPECT_INT_EQ(10, faults2->states[1].hits);
+    EXPECT_INT_EQ(20, faults2->states[2].hits);
+    EXPECT_INT_EQ(1, faults_carry_state(faults1, faults2));
+    faults_free(faults1);
+    faults_free(faults2);
+    return 0;
+}
+
+static int test_find_first_fault_window(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5, "
+                               "\"start_ms\":1000, \"end_ms\":2000}, "
+                           "{\"type\":\"read_delay\", \"prefix\":\"/b\", \"delay_ms\":5, "
+                               "\"fraction\":0.5, \"ramp_ms\":100000, \"ramp_from\":0.25}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL;
+    char *unparsed;
+    uint64_t now;
+    int i, hits = 0;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_EQ(1, faults->timed);
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ("{\"faults\":[{\"type\":\"unreadable\", \"prefix\":\"/a\", "
+                  "\"suffix\":\"\", \"code\":5, \"start_ms\":1000, \"end_ms\":2000}, "
+                  "{\"type\":\"read_delay\", \"prefix\":\"/b\", \"suffix\":\"\", "
+                  "\"delay_ms\":5, \"fraction\":0.5, \"ramp_ms\":100000, "
+                  "\"ramp_from\":0.25}]}", unparsed);
+    free(unparsed);
+
+    // The window is measured from when the fault was activated.
+    now = monotonic_coarse_ms();
+    EXPECT_NULL(find_first_fault(faults, "/a", KIBOSH_OP_READ));
+    faults->states[0].activated_ms = now - 1500;
+    EXPECT_NONNULL(find_first_fault(faults, "/a", KIBOSH_OP_READ));
+    faults->states[0].activated_ms = now - 2500;
+    EXPECT_NULL(find_first_fault(faults, "/a", KIBOSH_OP_READ));
+
+    // Halfway through the ramp, the delay fires about 37.5% of the time.
+    faults->states[1].activated_ms = now - 50000;
+    for (i = 0; i < 1000; i++) {
+        if (find_first_fault(faults, "/b", KIBOSH_OP_READ)) {
+            hits++;
+        }
+    }
+    EXPECT_INT_GT(hits, 300);
+    EXPECT_INT_LT(hits, 450);
+
+    // Updating the window keeps the activation time.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"add\", \"fault\":{"
+            "\"id\":\"c\", \"type\":\"unwritable\", \"code\":5, \"end_ms\":10}}]}",
+            &faults2));
+    faults2->states[2].activated_ms = 123;
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"c\", \"fault\":{\"start_ms\":20}}]}", &faults3));
+    EXPECT_INT_ZERO(faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"c\", \"fault\":{\"start_ms\":20, \"end_ms\":30}}]}", &faults3));
+    EXPECT_INT_EQ(20, faults3->list[2]->start_ms);
+    EXPECT_INT_EQ(30, faults3->list[2]->end_ms);
+    EXPECT_INT_EQ(123, faults3->states[2].activated_ms);
+    faults_free(faults);
+    faults_free(faults2);
+    faults_free(faults3);
+    return 0;
+}
+
+static int test_find_first_fault_burst(void)
+{
+    const char *str = "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+                           "\"burst_enter\":0.05, \"burst_exit\":0.2}]}";
+    struct kibosh_faults *faults = NULL;
+    char *unparsed;
+    int i, hit, prev = 0, hits = 0, bursts = 0;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse_with_state(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ("{\"faults\":[{\"type\":\"unreadable\", \"prefix\":\"/\", "
+                  "\"suffix\":\"\", \"code\":5, \"burst_enter\":0.05, \"burst_exit\":0.2, "
+                  "\"good_fraction\":0.0, \"bad_fraction\":1.0, "
+                  "\"state\":{\"hits\":0, \"count\":-1, \"burst_bad\":0}}]}", unparsed);
+    free(unparsed);
+
+    // The model spends 0.05 / (0.05 + 0.2) = 20% of its time in the bad state, and bursts
+    // last 1 / 0.2 = 5 operations on average.  Independent faults with the same overall
+    // fraction would start about 1600 bursts in 10000 operations, rather than about 400.
+    srand48(123);
+    for (i = 0; i < 10000; i++) {
+        hit = (find_first_fault(faults, "/a", KIBOSH_OP_READ) != NULL);
+        if (hit) {
+            hits++;
+            if (!prev)
+                bursts++;
+        }
+        prev = hit;
+    }
+    EXPECT_INT_GT(hits, 1500);
+    EXPECT_INT_LT(hits, 2500);
+    EXPECT_INT_GT(bursts, 250);
+    EXPECT_INT_LT(bursts, 600);
+    faults_free(faults);
+    return 0;
+}
+
+/**
+ * Describe an operation with no caller information.
+ */
+static int test_faults_apply_composed(void)
+{
+    const char *str = "{\"faults\":["
+                           "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5}, "
+                           "{\"type\":\"read_delay\", \"prefix\":\"/a\", \"delay_ms\":100, "
+                               "\"fraction\":1.0}, "
+                           "{\"type\":\"read_delay\", \"prefix\":\"/\", \"delay_ms\":50, "
+                               "\"fraction\":1.0}, "
+                           "{\"type\":\"write_delay\", \"prefix\":\"/b\", \"delay_ms\":10, "
+                               "\"fraction\":1.0}, "
+                           "{\"type\":\"write_corrupt\", \"prefix\":\"/b\", \"mode\":1000, "
+                               "\"count\":-1, \"fraction\":1.0}, "
+                           "{\"type\":\"write_corrupt\", \"prefix\":\"/b\", \"mode\":1000, "
+                               "\"count\":-1, \"fraction\":1.0}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL;
+    char buf[16], bounce[16], *unparsed;
+    const char *wbuf = "0123456789abcdef";
+    struct kibosh_patches patches;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+    int i;
+
+    // Without compose, only the first fault which fires is applied.
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    make_io(&io, "/a/b", KIBOSH_OP_READ);
+    EXPECT_INT_EQ(-5, faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    EXPECT_INT_EQ(0, delay_ms);
+    EXPECT_STR_EQ("unreadable", fault_name);
+    make_io(&io, "/c", KIBOSH_OP_READ);
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    EXPECT_INT_EQ(50, delay_ms);
+    EXPECT_INT_EQ(1, faults->states[0].hits);
+    EXPECT_INT_EQ(0, faults->states[1].hits);
+    EXPECT_INT_EQ(1, faults->states[2].hits);
+
+    // With compose, the delays are added up, and applied before the error.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"compose\":true, \"ops\":[]}", &faults2));
+    EXPECT_INT_EQ(0, faults2->compose);
+    faults_free(faults2);
+    faults_free(faults);
+    unparsed = malloc(strlen(str) + 32);
+    EXPECT_NONNULL(unparsed);
+    sprintf(unparsed, "%.*s, \"compose\":true}", (int)strlen(str) - 1, str);
+    EXPECT_INT_ZERO(faults_parse(unparsed, &faults));
+    free(unparsed);
+    EXPECT_INT_EQ(1, faults->compose);
+    make_io(&io, "/a/b", KIBOSH_OP_READ);
+    EXPECT_INT_EQ(-5, faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    EXPECT_INT_EQ(150, delay_ms);
+    EXPECT_STR_EQ("read_delay", fault_name);
+    EXPECT_INT_EQ(1, faults->states[0].hits);
+    EXPECT_INT_EQ(1, faults->states[1].hits);
+    EXPECT_INT_EQ(1, faults->states[2].hits);
+
+    // Corruptions are applied one after another to a single set of patches.
+    make_io(&io, "/b", KIBOSH_OP_WRITE);
+    kibosh_patches_init(&patches, wbuf, bounce, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(10, delay_ms);
+    EXPECT_STR_EQ("write_delay", fault_name);
+    EXPECT_INT_EQ(1, patches.num);
+    flatten_patches(&patches, sizeof(buf), buf);
+    for (i = 0; i < (int)sizeof(buf); i++) {
+        EXPECT_INT_EQ(0, buf[i]);
+    }
+    EXPECT_INT_EQ('0', wbuf[0]);
+    EXPECT_INT_EQ(1, faults->states[4].hits);
+    EXPECT_INT_EQ(1, faults->states[5].hits);
+
+    // The setting is kept by incremental operations and written out.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"add\", "
+            "\"fault\":{\"type\":\"unwritable\", \"prefix\":\"/d\", \"code\":5}}]}",
+            &faults3));
+    EXPECT_INT_EQ(1, faults3->compose);
+    unparsed = faults_unparse(faults3);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "}], \"compose\":true}"));
+    free(unparsed);
+    faults_free(faults);
+    faults_free(faults3);
+    return 0;
+}
+
+static int test_faults_match(void)
+{
+    const char *str = "{\"faults\":[{\"id\":\"a\", \"type\":\"read_delay\", "
+        "\"prefix\":\"/a\", \"suffix\":\"\", \"delay_ms\":10, \"fraction\":1.0, "
+        "\"match\":{\"uid\":1000, \"min_size\":4096, \"max_offset\":8192, "
+        "\"flags\":[\"O_SYNC\", \"O_DIRECT\"]}}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL;
+    struct kibosh_io io;
+    char *unparsed;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    free(unparsed);
+
+    make_io(&io, "/a/b", KIBOSH_OP_READ);
+    io.uid = 1000;
+    io.size = 4096;
+    io.offset = 8192;
+    io.open_flags = O_RDONLY | O_DIRECT | O_SYNC;
+    EXPECT_NONNULL(faults->list[0]);
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults->list[0], &io));
+    io.uid = 1001;
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    io.uid = 1000;
+    io.size = 4095;
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    io.size = 1048576;
+    io.offset = 8193;
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    io.offset = 0;
+    io.open_flags = O_RDONLY | O_DIRECT | O_DSYNC;
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    io.open_flags = O_RDONLY | O_DIRECT | O_SYNC;
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults->list[0], &io));
+    // find_first_fault knows nothing about the caller, so the uid does not match.
+    EXPECT_NULL(find_first_fault(faults, "/a/b", KIBOSH_OP_READ));
+
+    // An update replaces the whole match clause.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"match\":{\"gid\":5}}}]}", &faults2));
+    EXPECT_INT_EQ(KIBOSH_MATCH_GID, faults2->match_tests[0]);
+    make_io(&io, "/a/b", KIBOSH_OP_READ);
+    io.gid = 5;
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults2->list[0], &io));
+    unparsed = faults_unparse(faults2);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "\"match\":{\"gid\":5}}"));
+    free(unparsed);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"match\":{\"flags\":[\"O_FROB\"]}}}]}", &faults3));
+
+    // A different match clause makes a different fault.
+    EXPECT_INT_EQ(1, faults_carry_state(faults, faults2));
+    EXPECT_INT_EQ(0, faults_carry_state(faults, faults));
+    faults_free(faults);
+    faults_free(faults2);
+    return 0;
+}
+
+static int test_faults_pattern(void)
+{
+    const char *str = "{\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+        "\"prefix\":\"/\", \"suffix\":\"\", \"glob\":\"/*/orders-*/0000*.index\", "
+        "\"code\":5}, {\"type\":\"unwritable\", \"prefix\":\"/\", \"suffix\":\".log\", "
+        "\"regex\":\"/(a|b)/[0-9]+\\\\.log\", \"code\":28}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL;
+    struct kibosh_fault_base *fault;
+    struct kibosh_io io;
+    char *unparsed;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    free(unparsed);
+    EXPECT_NONNULL(find_first_fault(faults, "/data/orders-3/00000000000000001234.index",
+                                    KIBOSH_OP_READ));
+    EXPECT_NULL(find_first_fault(faults, "/data/orders-3/00000000000000001234.log",
+                                 KIBOSH_OP_READ));
+    EXPECT_NULL(find_first_fault(faults, "/data/x/orders-3/0000.index", KIBOSH_OP_READ));
+    EXPECT_NONNULL(find_first_fault(faults, "/b/12.log", KIBOSH_OP_WRITE));
+    EXPECT_NULL(find_first_fault(faults, "/c/12.log", KIBOSH_OP_WRITE));
+    make_io(&io, "/a/1.log", KIBOSH_OP_WRITE);
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults->list[1], &io));
+    make_io(&io, "/a/x.log", KIBOSH_OP_WRITE);
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[1], &io));
+
+    // An update can swap a glob for a regex, and an empty pattern removes it.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"regex\":\"/x.*\"}}, {\"op\":\"add\", \"fault\":{\"id\":\"b\", "
+            "\"type\":\"read_delay\", \"delay_ms\":1, \"fraction\":1.0, "
+            "\"glob\":\"/y/*\"}}]}", &faults2));
+    EXPECT_NONNULL(find_first_fault(faults2, "/x/orders-3/0000.index", KIBOSH_OP_READ));
+    fault = find_first_fault(faults2, "/y/z", KIBOSH_OP_READ);
+    EXPECT_NONNULL(fault);
+    EXPECT_STR_EQ("b", fault->id);
+    EXPECT_NULL(find_first_fault(faults2, "/y/z/w", KIBOSH_OP_READ));
+    unparsed = faults_unparse(faults2);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "\"regex\":\"/x.*\""));
+    EXPECT_NONNULL(strstr(unparsed, "\"glob\":\"/y/*\""));
+    free(unparsed);
+    EXPECT_INT_ZERO(faults_update(faults2, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"glob\":\"\"}}]}", &faults3));
+    EXPECT_NULL(faults3->list[0]->dfa);
+    EXPECT_NONNULL(find_first_fault(faults3, "/anything", KIBOSH_OP_READ));
+    faults_free(faults3);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"regex\":\"(\"}}]}", &faults3));
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"glob\":\"*\", \"regex\":\".*\"}}]}", &faults3));
+
+    // A different pattern makes a different fault.
+    EXPECT_INT_EQ(2, faults_carry_state(faults, faults2));
+    EXPECT_INT_EQ(0, faults_carry_state(faults, faults));
+    faults_free(faults);
+    faults_free(faults2);
+    return 0;
+}
+
+/**
+ * Describe an operation on the file at the given path.
+ */
+static int make_file_io(struct kibosh_io *io, const char *dir, const char *name,
+                        uint32_t op)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), "%s%s", dir, name);
+    if (stat(path, &st) < 0) {
+        return -errno;
+    }
+    make_io(io, name, op);
+    io->dev = st.st_dev;
+    io->ino = st.st_ino;
+    return 0;
+}
+
+static int test_faults_inodes(void)
+{
+    const char *str = "{\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+        "\"prefix\":\"/\", \"suffix\":\"\", \"code\":5, \"inodes\":["
+        "{\"dev\":3, \"ino\":20}, {\"ino\":10, \"dev\":3}, {\"dev\":3, \"ino\":10}]}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    const char *fault_name;
+    uint32_t delay_ms;
+    struct kibosh_io io;
+    char *unparsed, buf[4];
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ("{\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+        "\"prefix\":\"/\", \"suffix\":\"\", \"code\":5, \"inodes\":["
+        "{\"dev\":3, \"ino\":10}, {\"dev\":3, \"ino\":20}]}]}", unparsed);
+    free(unparsed);
+    EXPECT_INT_EQ(KIBOSH_MATCH_INODE, faults->match_tests[0]);
+    make_io(&io, "/anything", KIBOSH_OP_READ);
+    io.dev = 3;
+    io.ino = 20;
+    EXPECT_INT_EQ(-5, faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults->list[0], &io));
+    io.ino = 11;
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    // Without the inode, only the delay lane assumes that the fault might match.
+    EXPECT_NULL(find_first_fault(faults, "/anything", KIBOSH_OP_READ));
+
+    // Updating the inodes replaces them, and null removes them.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"inodes\":[{\"dev\":4, \"ino\":1}]}}]}", &faults2));
+    io.dev = 4;
+    io.ino = 1;
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults2->list[0], &io));
+    EXPECT_INT_EQ(-5, faults_apply_read(faults2, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    EXPECT_INT_EQ(1, faults_carry_state(faults, faults2));
+    faults_free(faults2);
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"inodes\":null}}]}", &faults2));
+    EXPECT_INT_ZERO(faults2->match_tests[0]);
+    EXPECT_NONNULL(find_first_fault(faults2, "/anything", KIBOSH_OP_READ));
+    faults_free(faults2);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"inodes\":[{\"dev\":4}]}}]}", &faults2));
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_resolve_pins(void)
+{
+    const char *str = "{\"faults\":[{\"type\":\"unreadable\", \"code\":5, "
+        "\"suffix\":\".log\", \"pin\":true}, {\"type\":\"unwritable\", \"code\":28, "
+        "\"prefix\":\"/sub\"}], \"compose\":true}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL;
+    char const *tmp = getenv("TMPDIR");
+    char dir[PATH_MAX / 2], path[PATH_MAX], path2[PATH_MAX];
+    const char *fault_name;
+    uint32_t delay_ms;
+    struct kibosh_io io;
+    char *unparsed, buf[4];
+
+    if (!tmp)
+        tmp = "/dev/shm";
+    snprintf(dir, sizeof(dir), "%s/fault_unit.%lld.%ld", tmp, (long long)getpid(),
+             lrand48());
+    EXPECT_POSIX_SUCC(mkdir(dir, 0755));
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    EXPECT_POSIX_SUCC(mkdir(path, 0755));
+    EXPECT_INT_ZERO(do_touch2(dir, "a.log"));
+    EXPECT_INT_ZERO(do_touch2(dir, "a.index"));
+    EXPECT_INT_ZERO(do_touch2(path, "b.log"));
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_ZERO(faults_resolve_pins(faults, NULL, dir, &faults2));
+    EXPECT_NONNULL(faults2);
+    EXPECT_INT_EQ(1, faults2->compose);
+    EXPECT_INT_EQ(1, faults2->list[0]->has_inodes);
+    EXPECT_INT_EQ(2, faults2->list[0]->num_inodes);
+    EXPECT_INT_ZERO(faults2->list[1]->has_inodes);
+    unparsed = faults_unparse(faults2);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "\"pin\":true, \"inodes\":[{\"dev\":"));
+
+    // A resolved fault is not resolved again, even after a round trip through JSON.
+    EXPECT_INT_ZERO(faults_resolve_pins(faults2, NULL, dir, &faults3));
+    EXPECT_NULL(faults3);
+    EXPECT_INT_ZERO(faults_parse(unparsed, &faults3));
+    free(unparsed);
+    EXPECT_INT_ZERO(faults_carry_state(faults2, faults3));
+    faults_free(faults3);
+    EXPECT_INT_ZERO(faults_resolve_pins(faults2, NULL, dir, &faults3));
+    EXPECT_NULL(faults3);
+
+    // The pinned fault follows its files when they are renamed, and ignores new files.
+    snprintf(path, sizeof(path), "%s/sub/b.log", dir);
+    snprintf(path2, sizeof(path2), "%s/sub/b.log.deleted", dir);
+    EXPECT_POSIX_SUCC(rename(path, path2));
+    EXPECT_INT_ZERO(do_touch2(dir, "c.log"));
+    EXPECT_INT_ZERO(make_file_io(&io, dir, "/sub/b.log.deleted", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(-5, faults_apply_read(faults2, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    EXPECT_INT_ZERO(make_file_io(&io, dir, "/c.log", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults2, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    EXPECT_INT_ZERO(make_file_io(&io, dir, "/a.index", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults2, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    // Before it is resolved, a pinned fault matches by path.
+    EXPECT_INT_ZERO(make_file_io(&io, dir, "/c.log", KIBOSH_OP_READ));
+    EXPECT_INT_EQ(-5, faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+
+    EXPECT_INT_EQ(-ENOENT, faults_resolve_pins(faults, NULL, "/nonexistent/kibosh",
+                                               &faults3));
+    EXPECT_NULL(faults3);
+    // An identical fault which was already resolved lends its inodes, without a walk.
+    EXPECT_INT_ZERO(faults_resolve_pins(faults, faults2, "/nonexistent/kibosh", &faults3));
+    EXPECT_NONNULL(faults3);
+    EXPECT_INT_EQ(2, faults3->list[0]->num_inodes);
+    EXPECT_INT_ZERO(faults_carry_state(faults2, faults3));
+    faults_free(faults3);
+    faults_free(faults);
+    faults_free(faults2);
+
+    unlink(path2);
+    snprintf(path, sizeof(path), "%s/sub", dir);
+    rmdir(path);
+    snprintf(path, sizeof(path), "%s/a.log", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/a.index", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/c.log", dir);
+    unlink(path);
+    EXPECT_POSIX_SUCC(rmdir(dir));
+    return 0;
+}
+
+static int test_faults_ranges(void)
+{
+    const char *str = "{\"faults\":["
+        "{\"type\":\"unreadable\", \"prefix\":\"/a\", \"code\":5, \"ranges\":["
+            "{\"start\":20, \"end\":23}, {\"start\":8, \"end\":9}, {\"start\":10, \"end\":11}]}, "
+        "{\"type\":\"unwritable\", \"prefix\":\"/a\", \"code\":28, \"ranges\":["
+            "{\"start\":8, \"end\":11}]}, "
+        "{\"type\":\"read_corrupt\", \"prefix\":\"/b\", \"mode\":1000, \"count\":-1, "
+            "\"fraction\":1.0, \"ranges\":[{\"start\":8, \"end\":11}, "
+            "{\"start\":20, \"end\":23}]}, "
+        "{\"type\":\"write_corrupt\", \"prefix\":\"/b\", \"mode\":1000, \"count\":-1, "
+            "\"fraction\":1.0, \"ranges\":[{\"start\":30, \"end\":40}]}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    char buf[16], bounce[16], out[16], *unparsed;
+    struct kibosh_patches patches;
+    const char *fault_name;
+    uint32_t delay_ms;
+    struct kibosh_io io;
+    int i;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    // Ranges which overlap or touch are merged.
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "\"code\":5, \"ranges\":[{\"start\":8, \"end\":11}, "
+                          "{\"start\":20, \"end\":23}]}"));
+    EXPECT_INT_ZERO(faults_parse(unparsed, &faults2));
+    free(unparsed);
+    EXPECT_INT_ZERO(faults_carry_state(faults, faults2));
+    faults_free(faults2);
+    EXPECT_NULL(find_first_fault(faults, "/a", KIBOSH_OP_READ));
+
+    // A read which starts before the bad range is cut short, and one which starts in it
+    // fails.  Reads which miss the ranges are left alone.
+    make_io(&io, "/a", KIBOSH_OP_READ);
+    io.size = sizeof(buf);
+    EXPECT_INT_EQ(8, faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                       &fault_name));
+    EXPECT_STR_EQ("unreadable", fault_name);
+    io.offset = 10;
+    EXPECT_INT_EQ(-5, faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    io.offset = 24;
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    EXPECT_NULL(fault_name);
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    io.offset = 5;
+    io.size = 3;
+    EXPECT_INT_EQ(0, kibosh_fault_matches(faults->list[0], &io));
+    io.size = 4;
+    EXPECT_INT_EQ(1, kibosh_fault_matches(faults->list[0], &io));
+
+    make_io(&io, "/a", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    io.offset = 4;
+    kibosh_patches_init(&patches, buf, bounce, sizeof(buf));
+    EXPECT_INT_EQ(4, faults_apply_write(faults, &io, &patches, sizeof(buf), &delay_ms,
+                                        &fault_name));
+    EXPECT_INT_EQ(0, patches.num);
+    io.offset = 8;
+    EXPECT_INT_EQ(-28, faults_apply_write(faults, &io, &patches, sizeof(buf), &delay_ms,
+                                          &fault_name));
+
+    // Corruption only touches the parts of the buffer which overlap the ranges.
+    make_io(&io, "/b", KIBOSH_OP_READ);
+    io.size = sizeof(buf);
+    io.offset = 16;
+    memset(buf, 'x', sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    for (i = 0; i < (int)sizeof(buf); i++) {
+        EXPECT_INT_EQ(((i >= 4) && (i < 8)) ? 0 : 'x', buf[i]);
+    }
+    io.offset = 0;
+    memset(buf, 'x', sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_read(faults, &io, buf, sizeof(buf), &delay_ms,
+                                                 &fault_name));
+    for (i = 0; i < (int)sizeof(buf); i++) {
+        EXPECT_INT_EQ(((i >= 8) && (i < 12)) ? 0 : 'x', buf[i]);
+    }
+    make_io(&io, "/b", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    io.offset = 28;
+    memset(buf, 'x', sizeof(buf));
+    kibosh_patches_init(&patches, buf, bounce, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(1, patches.num);
+    flatten_patches(&patches, sizeof(buf), out);
+    for (i = 0; i < (int)sizeof(buf); i++) {
+        EXPECT_INT_EQ('x', buf[i]);
+        EXPECT_INT_EQ(((i >= 2) && (i < 13)) ? 0 : 'x', out[i]);
+    }
+
+    // Ranges are rounded out to whole blocks, whichever order the fields come in.
+    faults_free(faults);
+    EXPECT_INT_ZERO(faults_parse("{\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", "
+        "\"code\":5, \"ranges\":[{\"start\":5000, \"end\":5000}], \"block_size\":4096}]}",
+        &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ("{\"faults\":[{\"id\":\"a\", \"type\":\"unreadable\", \"prefix\":\"/\", "
+        "\"suffix\":\"\", \"code\":5, \"block_size\":4096, \"ranges\":["
+        "{\"start\":4096, \"end\":8191}]}]}", unparsed);
+    free(unparsed);
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"block_size\":16384}}]}", &faults2));
+    EXPECT_INT_EQ(1, faults2->list[0]->num_ranges);
+    EXPECT_INT_EQ(0, faults2->list[0]->ranges[0].start);
+    EXPECT_INT_EQ(16383, faults2->list[0]->ranges[0].end);
+    faults_free(faults2);
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"ranges\":null}}]}", &faults2));
+    EXPECT_INT_ZERO(faults2->list[0]->num_ranges);
+    EXPECT_INT_ZERO(faults2->match_tests[0]);
+    EXPECT_NONNULL(find_first_fault(faults2, "/a", KIBOSH_OP_READ));
+    faults_free(faults2);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"ranges\":[{\"start\":2, \"end\":1}]}}]}", &faults2));
+    faults_free(faults);
+    return 0;
+}
+
+static int test_corrupt_buffer_seeded(void)
+{
+    struct corrupt_key key = { 42, 3, 1234, 1000 };
+    char a[64], b[64], c[64];
+    int i, changed = 0;
+
+    memset(a, 'x', sizeof(a));
+    memset(b, 'x', sizeof(b));
+    EXPECT_INT_EQ(sizeof(a), corrupt_buffer_seeded(a, sizeof(a), CORRUPT_RAND, 0.5, &key));
+    // Corrupting the same bytes in two pieces gives the same result.
+    EXPECT_INT_EQ(32, corrupt_buffer_seeded(b, 32, CORRUPT_RAND, 0.5, &key));
+    key.offset += 32;
+    EXPECT_INT_EQ(32, corrupt_buffer_seeded(b + 32, 32, CORRUPT_RAND, 0.5, &key));
+    EXPECT_INT_ZERO(memcmp(a, b, sizeof(a)));
+    for (i = 0; i < (int)sizeof(a); i++) {
+        if (a[i] != 'x') {
+            changed++;
+        }
+    }
+    EXPECT_INT_GT(changed, 16);
+    EXPECT_INT_LT(changed, 48);
+
+    // Another file is corrupted differently.
+    key.offset = 1000;
+    key.ino++;
+    memset(c, 'x', sizeof(c));
+    corrupt_buffer_seeded(c, sizeof(c), CORRUPT_RAND, 0.5, &key);
+    EXPECT_INT_EQ(1, memcmp(a, c, sizeof(a)) != 0);
+
+    memset(c, 'x', sizeof(c));
+    corrupt_buffer_seeded(c, sizeof(c), CORRUPT_ZERO, 0.0, &key);
+    for (i = 0; i < (int)sizeof(c); i++) {
+        EXPECT_INT_EQ('x', c[i]);
+    }
+    corrupt_buffer_seeded(c, sizeof(c), CORRUPT_ZERO, 1.0, &key);
+    for (i = 0; i < (int)sizeof(c); i++) {
+        EXPECT_INT_EQ(0, c[i]);
+    }
+    EXPECT_INT_EQ(corrupt_buffer_seeded(c, sizeof(c), CORRUPT_DROP, 1.0, &key),
+                  corrupt_buffer_seeded(c, sizeof(c), CORRUPT_DROP, 1.0, &key));
+    return 0;
+}
+
+static int test_faults_seeded(void)
+{
+    const char *str = "{\"faults\":[{\"id\":\"a\", \"type\":\"read_corrupt\", "
+        "\"mode\":1001, \"count\":-1, \"fraction\":0.5, \"seed\":42}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    char a[64], b[64], *unparsed;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "\"fraction\":0.5, \"seed\":42}"));
+    free(unparsed);
+
+    // Every read of the same bytes is corrupted in the same way.
+    make_io(&io, "/a", KIBOSH_OP_READ);
+    io.dev = 3;
+    io.ino = 1234;
+    io.offset = 4096;
+    io.size = sizeof(a);
+    memset(a, 'x', sizeof(a));
+    memset(b, 'x', sizeof(b));
+    EXPECT_INT_EQ(sizeof(a), faults_apply_read(faults, &io, a, sizeof(a), &delay_ms,
+                                               &fault_name));
+    EXPECT_INT_EQ(sizeof(b), faults_apply_read(faults, &io, b, sizeof(b), &delay_ms,
+                                               &fault_name));
+    EXPECT_INT_ZERO(memcmp(a, b, sizeof(a)));
+
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"seed\":null}}]}", &faults2));
+    EXPECT_INT_ZERO(((struct kibosh_fault_read_corrupt *)faults2->list[0])->seeded);
+    faults_free(faults2);
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"seed\":7}}]}", &faults2));
+    EXPECT_INT_EQ(7, ((struct kibosh_fault_read_corrupt *)faults2->list[0])->seed);
+    EXPECT_INT_EQ(1, faults_carry_state(faults, faults2));
+    faults_free(faults2);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"seed\":\"7\"}}]}", &faults2));
+    faults_free(faults);
+    return 0;
+}
+
+static int count_bits(const char *buf, int size)
+{
+    int i, bits = 0;
+
+    for (i = 0; i < size; i++) {
+        bits += __builtin_popcount((unsigned char)buf[i]);
+    }
+    return bits;
+}
+
+#define BIT_FLIP_BUF_SIZE 65536
+
+static int test_corrupt_bit_flip(void)
+{
+    struct corrupt_key key = { 42, 3, 1234, 10000 };
+    char *a, *b;
+
+    a = calloc(1, BIT_FLIP_BUF_SIZE);
+    EXPECT_NONNULL(a);
+    b = calloc(1, BIT_FLIP_BUF_SIZE);
+    EXPECT_NONNULL(b);
+    EXPECT_INT_EQ(BIT_FLIP_BUF_SIZE, corrupt_buffer(a, BIT_FLIP_BUF_SIZE, CORRUPT_BIT_FLIP,
+                                                    0.0));
+    EXPECT_INT_ZERO(count_bits(a, BIT_FLIP_BUF_SIZE));
+    // 524288 bits at a bit error rate of 0.001 gives 524 flips on average.
+    corrupt_buffer(a, BIT_FLIP_BUF_SIZE, CORRUPT_BIT_FLIP, 0.001);
+    EXPECT_INT_GT(count_bits(a, BIT_FLIP_BUF_SIZE), 400);
+    EXPECT_INT_LT(count_bits(a, BIT_FLIP_BUF_SIZE), 650);
+    corrupt_buffer(b, 16, CORRUPT_BIT_FLIP, 1.0);
+    EXPECT_INT_EQ(128, count_bits(b, 16));
+
+    // Deterministic flips do not depend on how the file is split up into I/O.
+    memset(a, 0, BIT_FLIP_BUF_SIZE);
+    memset(b, 0, BIT_FLIP_BUF_SIZE);
+    corrupt_buffer_seeded(a, BIT_FLIP_BUF_SIZE, CORRUPT_BIT_FLIP, 0.001, &key);
+    EXPECT_INT_GT(count_bits(a, BIT_FLIP_BUF_SIZE), 400);
+    EXPECT_INT_LT(count_bits(a, BIT_FLIP_BUF_SIZE), 650);
+    corrupt_buffer_seeded(b, 5000, CORRUPT_BIT_FLIP, 0.001, &key);
+    key.offset += 5000;
+    corrupt_buffer_seeded(b + 5000, BIT_FLIP_BUF_SIZE - 5000, CORRUPT_BIT_FLIP, 0.001, &key);
+    EXPECT_INT_ZERO(memcmp(a, b, BIT_FLIP_BUF_SIZE));
+    free(a);
+    free(b);
+    return 0;
+}
+
+#define NUM_LARGE_FAULTS 20000
+
+static int test_faults_parse_large(void)
+{
+    char *str, *unparsed, *ptr;
+    struct kibosh_faults *faults = NULL;
+    size_t str_len = (NUM_LARGE_FAULTS * 128) + 64;
+    int i;
+
+    str = malloc(str_len);
+    EXPECT_NONNULL(str);
+    ptr = str + sprintf(str, "{\"faults\":[");
+    for (i = 0; i < NUM_LARGE_FAULTS; i++) {
+        ptr += sprintf(ptr, "%s{\"type\":\"unreadable\", \"prefix\":\"/topic-%d\", "
+                       "\"suffix\":\"\", \"code\":5}", (i == 0) ? "" : ", ", i);
+    }
+    sprintf(ptr, "]}");
+    EXPECT_INT_GT(strlen(str), 1024 * 1024);
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    EXPECT_INT_EQ(NUM_LARGE_FAULTS, faults->num_faults);
+    EXPECT_STR_EQ("/topic-19999", faults->list[NUM_LARGE_FAULTS - 1]->prefix);
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    free(unparsed);
+    faults_free(faults);
+    free(str);
+    return 0;
+}
+
+static int test_patches(void)
+{
+    const char *base = "0123456789abcdef";
+    char bounce[256], big[256], out[256];
+    struct kibosh_patches patches;
+    struct iovec iov[KIBOSH_PATCHES_IOV_MAX];
+    int i;
+
+    kibosh_patches_init(&patches, base, bounce, 16);
+    EXPECT_INT_EQ(1, kibosh_patches_iov(&patches, 0, 16, iov));
+    EXPECT_INT_EQ(1, iov[0].iov_base == base);
+    kibosh_patches_cover(&patches, 2, 4, 1)[0] = 'X';
+    kibosh_patches_cover(&patches, 8, 9, 1)[0] = 'Y';
+    EXPECT_INT_EQ(2, patches.num);
+
+    // Covering a part which overlaps patches merges them, and keeps their changes.
+    kibosh_patches_cover(&patches, 3, 9, 1);
+    EXPECT_INT_EQ(1, patches.num);
+    EXPECT_INT_EQ(2, patches.patch[0].lo);
+    EXPECT_INT_EQ(9, patches.patch[0].hi);
+    memcpy(kibosh_patches_cover(&patches, 12, 14, 0), "ZZ", 2);
+    EXPECT_INT_EQ(5, kibosh_patches_iov(&patches, 0, 16, iov));
+    EXPECT_INT_EQ(4, kibosh_patches_iov(&patches, 0, 13, iov));
+    EXPECT_INT_EQ(1, iov[3].iov_len);
+    EXPECT_INT_EQ(2, kibosh_patches_iov(&patches, 5, 10, iov));
+    EXPECT_INT_EQ(1, iov[0].iov_base == bounce + 5);
+    EXPECT_INT_EQ(4, iov[0].iov_len);
+    flatten_patches(&patches, 16, out);
+    EXPECT_INT_ZERO(memcmp("01X34567Y9abZZef", out, 16));
+    EXPECT_INT_EQ('2', base[2]);
+
+    // With too many patches, the whole buffer is copied.
+    for (i = 0; i < (int)sizeof(big); i++) {
+        big[i] = i;
+    }
+    kibosh_patches_init(&patches, big, bounce, sizeof(big));
+    for (i = 0; i <= KIBOSH_MAX_PATCHES; i++) {
+        *kibosh_patches_cover(&patches, 2 * i, (2 * i) + 1, 1) ^= 0xff;
+    }
+    EXPECT_INT_EQ(1, patches.whole);
+    EXPECT_INT_EQ(1, kibosh_patches_iov(&patches, 0, sizeof(big), iov));
+    flatten_patches(&patches, sizeof(big), out);
+    for (i = 0; i < (int)sizeof(big); i++) {
+        EXPECT_INT_EQ((char)(((i % 2) || (i > 2 * KIBOSH_MAX_PATCHES)) ? i : ~i), out[i]);
+    }
+    return 0;
+}
+
+static int test_patches_holes(void)
+{
+    static const int expected[][2] = { { 0, 2 }, { 4, 8 }, { 9, 16 } };
+    struct kibosh_patches patches;
+    char buf[1024] = { 0 };
+    int i, idx = 0, lo, hi = 0;
+
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    kibosh_patches_hole(&patches, 8, 9);
+    kibosh_patches_hole(&patches, 2, 3);
+    kibosh_patches_hole(&patches, 3, 4);
+    EXPECT_INT_EQ(2, patches.num_holes);
+    for (i = 0; kibosh_patches_next_run(&patches, 16, &idx, &lo, &hi); i++) {
+        EXPECT_INT_EQ(expected[i][0], lo);
+        EXPECT_INT_EQ(expected[i][1], hi);
+    }
+    EXPECT_INT_EQ(3, i);
+    idx = 0;
+    hi = 0;
+    EXPECT_INT_EQ(1, kibosh_patches_next_run(&patches, 6, &idx, &lo, &hi));
+    EXPECT_INT_EQ(1, kibosh_patches_next_run(&patches, 6, &idx, &lo, &hi));
+    EXPECT_INT_EQ(4, lo);
+    EXPECT_INT_EQ(6, hi);
+    EXPECT_INT_EQ(0, kibosh_patches_next_run(&patches, 6, &idx, &lo, &hi));
+
+    // With too many holes, the gaps between the last ones are left out too.
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    for (i = 0; i <= KIBOSH_MAX_HOLES; i++) {
+        kibosh_patches_hole(&patches, 2 * i, (2 * i) + 1);
+    }
+    EXPECT_INT_EQ(KIBOSH_MAX_HOLES, patches.num_holes);
+    EXPECT_INT_EQ(2 * (KIBOSH_MAX_HOLES - 1), patches.hole[KIBOSH_MAX_HOLES - 1].lo);
+    EXPECT_INT_EQ((2 * KIBOSH_MAX_HOLES) + 1, patches.hole[KIBOSH_MAX_HOLES - 1].hi);
+    return 0;
+}
+
+static int test_faults_torn_write(void)
+{
+    const char *str = "{\"faults\":[{\"type\":\"torn_write\", \"prefix\":\"/a\", "
+        "\"mode\":1301, \"fraction\":0.5, \"sector_size\":512, \"short\":true}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL, *faults3 = NULL;
+    struct kibosh_patches patches;
+    char buf[4000], *unparsed;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+    int i, idx = 0, lo, hi = 0, prev = 0, written = 0;
+
+    memset(buf, 'x', sizeof(buf));
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_NONNULL(strstr(unparsed, "\"type\":\"torn_write\", \"prefix\":\"/a\", "
+                          "\"suffix\":\"\", \"mode\":1301, \"fraction\":0.5, "
+                          "\"sector_size\":512, \"short\":true"));
+    EXPECT_INT_ZERO(faults_parse(unparsed, &faults2));
+    free(unparsed);
+    EXPECT_INT_EQ(1, faults_carry_state(faults, faults2) == 0);
+    faults_free(faults2);
+
+    // Lost sectors are aligned to the file, and the write is reported as ending at the
+    // first of them.
+    srand48(1);
+    make_io(&io, "/a", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    io.offset = 100;
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_STR_EQ("torn_write", fault_name);
+    EXPECT_INT_GT(patches.num_holes, 0);
+    EXPECT_INT_EQ(patches.hole[0].lo, patches.reported);
+    for (i = 0; i < patches.num_holes; i++) {
+        lo = patches.hole[i].lo;
+        hi = patches.hole[i].hi;
+        EXPECT_INT_EQ(1, (lo == 0) || (((io.offset + lo) % 512) == 0));
+        EXPECT_INT_EQ(1, (hi == sizeof(buf)) || (((io.offset + hi) % 512) == 0));
+    }
+    hi = 0;
+    while (kibosh_patches_next_run(&patches, sizeof(buf), &idx, &lo, &hi)) {
+        EXPECT_INT_GE(lo, prev);
+        written += hi - lo;
+        prev = hi;
+    }
+    for (i = 0; i < patches.num_holes; i++) {
+        written += patches.hole[i].hi - patches.hole[i].lo;
+    }
+    EXPECT_INT_EQ(sizeof(buf), written);
+
+    // In prefix mode, everything after the first lost sector is lost.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"add\", \"fault\":"
+        "{\"id\":\"p\", \"type\":\"torn_write\", \"prefix\":\"/b\", \"mode\":1300, "
+        "\"fraction\":0.0, \"sector_size\":4096}}]}", &faults2));
+    make_io(&io, "/b", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    io.offset = 100;
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults2, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(1, patches.num_holes);
+    EXPECT_INT_EQ(0, patches.hole[0].lo);
+    EXPECT_INT_EQ(sizeof(buf), patches.hole[0].hi);
+    EXPECT_INT_EQ(-1, patches.reported);
+    // Only the two known modes are accepted.
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults2, "{\"ops\":[{\"op\":\"update\", "
+        "\"id\":\"p\", \"fault\":{\"mode\":7}}]}", &faults3));
+    faults_free(faults2);
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_lost_write(void)
+{
+    const char *str = "{\"faults\":[{\"type\":\"lost_write\", \"prefix\":\"/a\", "
+        "\"suffix\":\"\"}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    struct kibosh_patches patches;
+    char buf[100], *unparsed;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+
+    memset(buf, 'x', sizeof(buf));
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    free(unparsed);
+
+    // The write is held, and nothing else about it changes.
+    make_io(&io, "/a", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_STR_EQ("lost_write", fault_name);
+    EXPECT_INT_EQ(1, patches.unsynced);
+    EXPECT_INT_ZERO(patches.num);
+    EXPECT_INT_ZERO(patches.num_holes);
+    make_io(&io, "/b", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_ZERO(patches.unsynced);
+
+    // Added through the parse tree.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"add\", \"fault\":"
+        "{\"id\":\"b\", \"type\":\"lost_write\", \"prefix\":\"/b\"}}]}", &faults2));
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults2, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(1, patches.unsynced);
+    faults_free(faults2);
+
+    // Crash requests are handled by the caller.
+    EXPECT_INT_EQ(FAULTS_UPDATE_CRASH, faults_update(faults, "{\"crash\":{}}", &faults2));
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_stale_read(void)
+{
+    const char *str = "{\"faults\":["
+        "{\"id\":\"a\", \"type\":\"stale_read\", \"prefix\":\"/a\", \"suffix\":\"\", "
+            "\"window_ms\":100}, "
+        "{\"id\":\"b\", \"type\":\"stale_read\", \"prefix\":\"/\", \"suffix\":\"\", "
+            "\"window_ms\":50}], \"compose\":true}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    struct kibosh_patches patches;
+    char buf[100], *unparsed;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+
+    memset(buf, 'x', sizeof(buf));
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    free(unparsed);
+
+    // The longest window of the faults which fire is used.  Nothing else changes.
+    make_io(&io, "/a", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(100, patches.stale_ms);
+    EXPECT_INT_ZERO(patches.unsynced);
+    EXPECT_INT_ZERO(patches.num);
+    make_io(&io, "/b", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(50, patches.stale_ms);
+
+    // Updated through the parse tree.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"b\", "
+            "\"fault\":{\"window_ms\":500}}]}", &faults2));
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults2, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(500, patches.stale_ms);
+    faults_free(faults2);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"b\", \"fault\":{\"window_ms\":0}}]}", &faults2));
+    faults_free(faults);
+    return 0;
+}
+
+static int test_faults_write_back(void)
+{
+    const char *str = "{\"faults\":[{\"id\":\"a\", \"type\":\"write_back\", "
+        "\"prefix\":\"/a\", \"suffix\":\"\", \"kb_per_sec\":100, \"dirty_limit_kb\":64}]}";
+    struct kibosh_faults *faults = NULL, *faults2 = NULL;
+    struct kibosh_patches patches;
+    char buf[100], *unparsed;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+
+    memset(buf, 'x', sizeof(buf));
+    EXPECT_INT_ZERO(faults_parse(str, &faults));
+    unparsed = faults_unparse(faults);
+    EXPECT_NONNULL(unparsed);
+    EXPECT_STR_EQ(str, unparsed);
+    free(unparsed);
+
+    // The write is held, and the overlay is told how to write it back.
+    make_io(&io, "/a", KIBOSH_OP_WRITE);
+    io.size = sizeof(buf);
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_STR_EQ("write_back", fault_name);
+    EXPECT_INT_EQ(1, patches.unsynced);
+    EXPECT_INT_EQ(100, patches.kb_per_sec);
+    EXPECT_INT_EQ(64 * 1024, patches.dirty_limit);
+    EXPECT_INT_ZERO(patches.num);
+
+    // Updated through the parse tree.  Without a dirty limit, it is left out.
+    EXPECT_INT_ZERO(faults_update(faults, "{\"ops\":[{\"op\":\"update\", \"id\":\"a\", "
+            "\"fault\":{\"kb_per_sec\":5, \"dirty_limit_kb\":0}}]}", &faults2));
+    unparsed = faults_unparse(faults2);
+    EXPECT_STR_EQ("{\"faults\":[{\"id\":\"a\", \"type\":\"write_back\", "
+        "\"prefix\":\"/a\", \"suffix\":\"\", \"kb_per_sec\":5}]}", unparsed);
+    free(unparsed);
+    kibosh_patches_init(&patches, buf, buf, sizeof(buf));
+    EXPECT_INT_EQ(sizeof(buf), faults_apply_write(faults2, &io, &patches, sizeof(buf),
+                                                  &delay_ms, &fault_name));
+    EXPECT_INT_EQ(1, patches.unsynced);
+    EXPECT_INT_EQ(5, patches.kb_per_sec);
+    EXPECT_INT_ZERO(patches.dirty_limit);
+    faults_free(faults2);
+    EXPECT_INT_EQ(-EINVAL, faults_update(faults, "{\"ops\":[{\"op\":\"update\", "
+            "\"id\":\"a\", \"fault\":{\"kb_per_sec\":0}}]}", &faults2));
+    faults_free(faults);
+    return 0;
+}
+
+/**
+ * The bounce buffer which get_test_bounce hands out, or NULL to fail.
+ */
+static char *test_bounce;
+
+/**
+ * The number of times get_test_bounce was called.
+ */
+static int test_bounce_gets;
+
+static char *get_test_bounce(size_t size UNUSED)
+{
+    test_bounce_gets++;
+    return test_bounce;
+}
+
+static int test_faults_patched_write(void)
+{
+    static const int modes[] = { CORRUPT_RAND, CORRUPT_BIT_FLIP, CORRUPT_ZERO_SEQ,
+                                 CORRUPT_RAND_SEQ };
+    struct kibosh_faults *faults = NULL;
+    struct kibosh_patches patches;
+    struct corrupt_key key = { 7, 0, 0, 1000 };
+    char str[256], *base, *bounce, *expected, *out;
+    const char *fault_name;
+    struct kibosh_io io;
+    uint32_t delay_ms;
+    int i, j, size = 8192;
+
+    base = malloc(size);
+    bounce = malloc(size);
+    expected = malloc(size);
+    out = malloc(size);
+    EXPECT_NONNULL(base);
+    EXPECT_NONNULL(bounce);
+    EXPECT_NONNULL(expected);
+    EXPECT_NONNULL(out);
+    for (i = 0; i < size; i++) {
+        base[i] = i * 7;
+    }
+    // A patched write puts the same bytes on disk as corrupting a copy of the buffer.
+    for (i = 0; i < (int)(sizeof(modes) / sizeof(modes[0])); i++) {
+        snprintf(str, sizeof(str), "{\"faults\":[{\"type\":\"write_corrupt\", "
+                 "\"mode\":%d, \"count\":-1, \"fraction\":0.0001, \"seed\":7}]}",
+                 modes[i]);
+        EXPECT_INT_ZERO(faults_parse(str, &faults));
+        make_io(&io, "/a", KIBOSH_OP_WRITE);
+        io.size = size;
+        io.offset = key.offset;
+        kibosh_patches_init(&patches, base, bounce, size);
+        EXPECT_INT_EQ(size, faults_apply_write(faults, &io, &patches, size, &delay_ms,
+                                               &fault_name));
+        EXPECT_INT_EQ(0, patches.whole);
+        flatten_patches(&patches, size, out);
+        memcpy(expected, base, size);
+        EXPECT_INT_EQ(size, corrupt_buffer_seeded(expected, size, modes[i], 0.0001, &key));
+        EXPECT_INT_ZERO(memcmp(expected, out, size));
+        for (j = 0; j < size; j++) {
+            EXPECT_INT_EQ((char)(j * 7), base[j]);
+        }
+        faults_free(faults);
+    }
+
+    // The bounce buffer is only gotten once a fault corrupts the write.
+    EXPECT_INT_ZERO(faults_parse("{\"faults\":[{\"type\":\"write_corrupt\", "
+                                 "\"prefix\":\"/b\", \"mode\":1000, \"count\":-1, "
+                                 "\"fraction\":0.5}]}", &faults));
+    test_bounce = bounce;
+    make_io(&io, "/a", KIBOSH_OP_WRITE);
+    io.size = size;
+    kibosh_patches_init(&patches, base, NULL, size);
+    patches.bounce_get = get_test_bounce;
+    EXPECT_INT_EQ(size, faults_apply_write(faults, &io, &patches, size, &delay_ms,
+                                           &fault_name));
+    EXPECT_NULL(patches.bounce);
+    EXPECT_INT_ZERO(test_bounce_gets);
+    make_io(&io, "/b", KIBOSH_OP_WRITE);
+    io.size = size;
+    EXPECT_INT_EQ(size, faults_apply_write(faults, &io, &patches, size, &delay_ms,
+                                           &fault_name));
+    EXPECT_INT_EQ(1, patches.bounce == bounce);
+    EXPECT_INT_EQ(1, test_bounce_gets);
+    // Running out of memory for it fails the write.
+    test_bounce = NULL;
+    kibosh_patches_init(&patches, base, NULL, size);
+    patches.bounce_get = get_test_bounce;
+    EXPECT_INT_EQ(-ENOMEM, faults_apply_write(faults, &io, &patches, size, &delay_ms,
+                                              &fault_name));
+    faults_free(faults);
+    free(base);
+    free(bounce);
+    free(expected);
+    free(out);
+    return 0;
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(test_fault_unparse());
     EXPECT_INT_ZERO(test_faults_unparse());
     EXPECT_INT_ZERO(test_fault_parse());
     EXPECT_INT_ZERO(test_faults_parse_empty());
+    EXPECT_INT_ZERO(test_faults_may_delay());
+    EXPECT_INT_ZERO(test_find_first_fault());
+    EXPECT_INT_ZERO(test_faults_apply_ops());
+    EXPECT_INT_ZERO(test_faults_parse_field_order());
+    EXPECT_INT_ZERO(test_faults_parse_invalid());
+    EXPECT_INT_ZERO(test_faults_unparse_round_trip());
+    EXPECT_INT_ZERO(test_faults_unparse_with_state());
+    EXPECT_INT_ZERO(test_faults_update_carries_state());
+    EXPECT_INT_ZERO(test_find_first_fault_window());
+    EXPECT_INT_ZERO(test_find_first_fault_burst());
+    EXPECT_INT_ZERO(test_faults_apply_composed());
+    EXPECT_INT_ZERO(test_faults_match());
+    EXPECT_INT_ZERO(test_faults_pattern());
+    EXPECT_INT_ZERO(test_faults_inodes());
+    EXPECT_INT_ZERO(test_faults_resolve_pins());
+    EXPECT_INT_ZERO(test_faults_ranges());
+    EXPECT_INT_ZERO(test_corrupt_buffer_seeded());
+    EXPECT_INT_ZERO(test_faults_seeded());
+    EXPECT_INT_ZERO(test_corrupt_bit_flip());
+    EXPECT_INT_ZERO(test_patches());
+    EXPECT_INT_ZERO(test_patches_holes());
+    EXPECT_INT_ZERO(test_faults_torn_write());
+    EXPECT_INT_ZERO(test_faults_lost_write());
+    EXPECT_INT_ZERO(test_faults_write_back());
+    EXPECT_INT_ZERO(test_faults_stale_read());
+    EXPECT_INT_ZERO(test_faults_patched_write());
+    EXPECT_INT_ZERO(test_faults_parse_large());
 
     return EXIT_SUCCESS;
 }
@@ -17,6 +17,8 @@
 #include "file.h"
 #include "fs.h"
 #include "log.h"
+#include "overlay.h"
+#include "stale.h"
 #include "time.h"
 #include "util.h"
 #include "fault.h"
@@ -28,11 +30,14 @@
 #include <fuse.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
@@ -45,6 +50,10 @@ static struct kibosh_file *kibosh_file_alloc(enum kibosh_file_type type,
         return NULL;
     file->type = type;
     file->fd = -1;
+    file->snapshot = NULL;
+    file->flags = 0;
+    file->dev = 0;
+    file->ino = 0;
     strcpy(file->path, path);
     return file;
 }
@@ -54,14 +63,24 @@ static int kibosh_open_control_file_impl(const char *path, int flags,
 {
     struct kibosh_fs *fs = fuse_get_context()->private_data;
     struct kibosh_file *file;
-
+    int ret;
+
+    if ((flags & O_ACCMODE) == O_RDONLY) {
+        file = kibosh_file_alloc(KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT, path);
+        if (!file)
+            return -ENOMEM;
+        file->snapshot = kibosh_fs_snapshot_get(fs);
+        info->fh = (uintptr_t)(void*)file;
+        return 0;
+    }
     file = kibosh_file_alloc(KIBOSH_FILE_TYPE_CONTROL, path);
     if (!file)
         return -ENOMEM;
     file->fd = kibosh_fs_accessor_fd_alloc(fs, !(flags & O_TRUNC));
     if (file->fd < 0) {
+        ret = file->fd;
         free(file);
-        return file->fd;
+        return ret;
     }
     info->fh = (uintptr_t)(void*)file;
     return 0;
@@ -74,6 +93,7 @@ static int kibosh_open_normal_file_impl(const char *path, int flags,
     int ret = 0;
     char bpath[PATH_MAX] = { 0 };
     struct kibosh_file *file = NULL;
+    struct stat st;
 
     file = kibosh_file_alloc(KIBOSH_FILE_TYPE_NORMAL, path);
     if (!file) {
@@ -84,11 +104,18 @@ static int kibosh_open_normal_file_impl(const char *path, int flags,
     // Assume that FUSE has already taken care of the umask.
     snprintf(bpath, sizeof(bpath), "%s%s", fs->root, path);
     file->fd = open(bpath, flags, mode);
+    file->flags = flags;
 
     if (file->fd < 0) {
         ret = -errno;
         goto error;
     }
+    if (fstat(file->fd, &st) < 0) {
+        ret = -errno;
+        goto error;
+    }
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
 
     // If new file is created, change the owner to actual user
     if ((flags & O_CREAT) == O_CREAT)  {
@@ -122,7 +149,8 @@ static int kibosh_open_impl(const char *path, int addflags,
         flags |= O_RDONLY;
     }
     if (strcmp(KIBOSH_CONTROL_PATH, path) == 0) {
-        type = KIBOSH_FILE_TYPE_CONTROL;
+        type = ((flags & O_ACCMODE) == O_RDONLY) ?
+            KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT : KIBOSH_FILE_TYPE_CONTROL;
         ret = kibosh_open_control_file_impl(path, flags, info);
     } else {
         type = KIBOSH_FILE_TYPE_NORMAL;
@@ -166,7 +194,9 @@ int kibosh_fgetattr(const char *path UNUSED, struct stat *stat, struct fuse_file
     struct kibosh_file *file = (struct kibosh_file*)(uintptr_t)info->fh;
     int ret = 0;
 
-    if (fstat(file->fd, stat) < 0) {
+    if (file->type == KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT) {
+        kibosh_fs_snapshot_stat(fuse_get_context()->private_data, file->snapshot, stat);
+    } else if (fstat(file->fd, stat) < 0) {
         ret = -errno;
     }
     DEBUG("kibosh_fgetattr(file->path=%s, fd=%d) = %d (%s)\n",
@@ -186,8 +216,21 @@ int kibosh_flush(const char *path UNUSED, struct fuse_file_info *info UNUSED)
 int kibosh_fsync(const char *path UNUSED, int datasync, struct fuse_file_info *info)
 {
     struct kibosh_file *file = (struct kibosh_file*)(uintptr_t)info->fh;
+    struct kibosh_fs *fs = fuse_get_context()->private_data;
     int ret = 0;
 
+    if (file->type == KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT) {
+        // Snapshots are immutable, so there is nothing to sync.
+        goto done;
+    }
+    // Unsynced writes are written back first.  Like the kernel, we report a failure to
+    // write them back from fsync.
+    if (file->type == KIBOSH_FILE_TYPE_NORMAL) {
+        ret = overlay_sync(fs->overlay, file->dev, file->ino);
+        if (ret < 0) {
+            goto done;
+        }
+    }
     if (datasync) {
         if (fdatasync(file->fd) < 0) {
             ret = -errno;
@@ -197,6 +240,7 @@ int kibosh_fsync(const char *path UNUSED, int datasync, struct fuse_file_info *i
             ret = -errno;
         }
     }
+done:
     DEBUG("kibosh_fsync(file->path=%s, file->fd=%d, datasync=%d) = %d (%s)\n",
           file->path, file->fd, datasync, -ret, safe_strerror(-ret));
     return AS_FUSE_ERR(ret);
@@ -205,10 +249,13 @@ int kibosh_fsync(const char *path UNUSED, int datasync, struct fuse_file_info *i
 int kibosh_ftruncate(const char *path UNUSED, off_t len, struct fuse_file_info *info)
 {
     struct kibosh_file *file = (struct kibosh_file*)(uintptr_t)info->fh;
+    struct kibosh_fs *fs = fuse_get_context()->private_data;
     int ret = 0;
 
     if (ftruncate(file->fd, len) < 0) {
         ret = -errno;
+    } else {
+        overlay_truncate(fs->overlay, file->dev, file->ino, len);
     }
     DEBUG("kibosh_ftruncate(path=%s, len=%"PRId64", file->fd=%d) = %d (%s)\n",
           path, (int64_t)len, file->fd, -ret, safe_strerror(-ret));
@@ -231,42 +278,105 @@ static char *printf_result_code(char *out, size_t size, int ret)
     return out;
 }
 
-int kibosh_read(const char *path UNUSED, char *buf, size_t size, off_t offset,
-                struct fuse_file_info *info)
+/**
+ * Read from a control JSON snapshot.  Faults are never injected here.
+ */
+static int kibosh_read_snapshot(struct kibosh_file *file, char *buf, size_t size,
+                                off_t offset)
+{
+    const struct kibosh_control_snapshot *snapshot = file->snapshot;
+
+    if ((offset < 0) || ((size_t)offset >= snapshot->len)) {
+        size = 0;
+    } else if (size > snapshot->len - offset) {
+        size = snapshot->len - offset;
+    }
+    if (size > 0) {
+        memcpy(buf, snapshot->json + offset, size);
+    }
+    DEBUG("kibosh_read(file->path=%s, size=%zd, offset=%" PRId64", type=%s) = %zd\n",
+          file->path, size, (int64_t)offset, kibosh_file_type_str(file->type), size);
+    return size;
+}
+
+/**
+ * Describe an I/O operation on a file, so that faults can be matched against it.
+ */
+static void kibosh_io_init(struct kibosh_io *io, const struct kibosh_file *file, uint32_t op,
+                           size_t size, off_t offset)
+{
+    struct fuse_context *ctx = fuse_get_context();
+
+    io->path = file->path;
+    io->op = op;
+    io->uid = ctx->uid;
+    io->gid = ctx->gid;
+    io->pid = ctx->pid;
+    io->open_flags = file->flags;
+    io->offset = offset;
+    io->size = size;
+    io->dev = file->dev;
+    io->ino = file->ino;
+}
+
+/**
+ * Read a range of a file from the target, stopping early only at the end of the file.
+ *
+ * @return          The number of bytes read; a negative error code otherwise.
+ */
+static int kibosh_read_target(struct kibosh_file *file, char *buf, size_t size,
+                              off_t offset)
 {
-    int ret = 0;
     size_t off = 0;
-    uint32_t uid, delay_ms = 0;
-    struct kibosh_file *file = (struct kibosh_file*)(uintptr_t)info->fh;
-    struct kibosh_fs *fs = fuse_get_context()->private_data;
-    struct kibosh_fault_base *fault;
-    const char *fault_name = NULL;
-    char scratch[32];
+    ssize_t ret;
 
-    uid = fuse_get_context()->uid;
     while (off < size) {
         ret = pread(file->fd, buf + off, size - off, offset + off);
         if (ret < 0) {
-            ret = -errno;
-            break;
+            return -errno;
         } else if (ret == 0) {
-            ret = off;
             break;
         }
         off += ret;
     }
-    if (ret <= 0) {
-        DEBUG("kibosh_read(file->path=%s, size=%zd, offset=%" PRId64", uid=%"PRId32") "
-              "= %s\n", file->path, size, (int64_t)offset, uid,
-              printf_result_code(scratch, sizeof(scratch), ret));
-        return ret;
+    return off;
+}
+
+int kibosh_read(const char *path UNUSED, char *buf, size_t size, off_t offset,
+                struct fuse_file_info *info)
+{
+    int ret = 0;
+    uint64_t gen;
+    uint32_t uid, delay_ms = 0;
+    struct kibosh_file *file = (struct kibosh_file*)(uintptr_t)info->fh;
+    struct kibosh_fs *fs = fuse_get_context()->private_data;
+    const char *fault_name = NULL;
+    struct kibosh_io io;
+    char scratch[32];
+
+    uid = fuse_get_context()->uid;
+    if (file->type == KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT) {
+        return kibosh_read_snapshot(file, buf, size, offset);
     }
+    do {
+        gen = overlay_read_begin(fs->overlay, file->dev, file->ino);
+        ret = kibosh_read_target(file, buf, size, offset);
+        // Faults never apply to the control file, and it is not in the overlay.
+        if ((ret <= 0) || (file->type == KIBOSH_FILE_TYPE_CONTROL)) {
+            DEBUG("kibosh_read(file->path=%s, size=%zd, offset=%" PRId64", uid=%"PRId32") "
+                  "= %s\n", file->path, size, (int64_t)offset, uid,
+                  printf_result_code(scratch, sizeof(scratch), ret));
+            return ret;
+        }
+        // Writes which have not been synced yet are read back from the overlay.  If any
+        // were written back while we read the target, we may have missed them, so we read
+        // it again.
+    } while (overlay_read(fs->overlay, file->dev, file->ino, gen, buf, ret, offset) < 0);
+    // Recently written ranges may still read as their old contents.
+    stale_read(fs->stale, file->dev, file->ino, buf, ret, offset);
+    kibosh_io_init(&io, file, KIBOSH_OP_READ, size, offset);
     pthread_mutex_lock(&fs->lock);
-    fault = find_first_fault(fs->faults, file->path, "read");
-    if (fault) {
-        fault_name = kibosh_fault_type_name(fault);
-        ret = apply_read_fault(fault, buf, ret, &delay_ms);
-    }
+    ret = faults_apply_read(fs->faults, &io, buf, ret, &delay_ms, &fault_name);
     pthread_mutex_unlock(&fs->lock);
     if (delay_ms > 0) {
         milli_sleep(delay_ms);
@@ -299,6 +409,10 @@ int kibosh_release(const char *path UNUSED, struct fuse_file_info *info)
     case KIBOSH_FILE_TYPE_CONTROL:
         ret = kibosh_fs_accessor_fd_release(fs, file->fd);
         break;
+    case KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT:
+        kibosh_fs_snapshot_put(file->snapshot);
+        file->snapshot = NULL;
+        break;
     }
     DEBUG("kibosh_release(file->path=%s, file->fd=%d, type=%s) = %d (%s)\n",
           file->path, file->fd, kibosh_file_type_str(file->type), -ret, safe_strerror(-ret));
@@ -307,43 +421,208 @@ int kibosh_release(const char *path UNUSED, struct fuse_file_info *info)
     return AS_FUSE_ERR(ret);
 }
 
+/**
+ * The smallest bounce buffer we allocate.  FUSE writes are at most 128 KiB by default, so
+ * each thread normally only allocates its bounce buffer once.
+ */
+#define KIBOSH_BOUNCE_MIN_SIZE (128 * 1024)
+
+/**
+ * The key of the per-thread bounce buffers.  The buffers are freed when threads exit.
+ */
+static pthread_key_t kibosh_bounce_key;
+
+static pthread_once_t kibosh_bounce_once = PTHREAD_ONCE_INIT;
+
+/**
+ * The size of this thread's bounce buffer.
+ */
+static __thread size_t kibosh_bounce_size;
+
+static void kibosh_bounce_key_create(void)
+{
+    pthread_key_create(&kibosh_bounce_key, free);
+}
+
+/**
+ * Get this thread's bounce buffer, which write faults put the bytes they change into.
+ *
+ * @param size      The minimum size of the buffer.
+ *
+ * @return          The buffer, or NULL if we ran out of memory.
+ */
+static char *kibosh_bounce_get(size_t size)
+{
+    char *bounce;
+
+    pthread_once(&kibosh_bounce_once, kibosh_bounce_key_create);
+    bounce = pthread_getspecific(kibosh_bounce_key);
+    if (bounce && (kibosh_bounce_size >= size)) {
+        return bounce;
+    }
+    free(bounce);
+    kibosh_bounce_size = 0;
+    pthread_setspecific(kibosh_bounce_key, NULL);
+    if (size < KIBOSH_BOUNCE_MIN_SIZE) {
+        size = KIBOSH_BOUNCE_MIN_SIZE;
+    }
+    bounce = malloc(size);
+    if (!bounce) {
+        return NULL;
+    }
+    if (pthread_setspecific(kibosh_bounce_key, bounce)) {
+        free(bounce);
+        return NULL;
+    }
+    kibosh_bounce_size = size;
+    return bounce;
+}
+
+/**
+ * Write all of an iovec array, continuing after short writes.
+ *
+ * @param fd        The file descriptor.
+ * @param iov       The iovecs.  These will be modified.
+ * @param iovcnt    The number of iovecs.
+ * @param offset    The offset to write at.
+ *
+ * @return          The number of bytes written, or a negative error code if nothing
+ *                  was written.
+ */
+static ssize_t kibosh_pwritev_full(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    ssize_t ret, off = 0;
+
+    while (iovcnt > 0) {
+        ret = pwritev(fd, iov, iovcnt, offset + off);
+        if (ret < 0) {
+            ret = -errno;
+            return (off > 0) ? off : ret;
+        }
+        off += ret;
+        while ((iovcnt > 0) && ((size_t)ret >= iov->iov_len)) {
+            ret -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return off;
+}
+
+/**
+ * Keep the contents of a range of a file, as the application sees them now, so that reads
+ * keep returning them for a while after the range is written.
+ *
+ * @param fs        The filesystem.
+ * @param file      The file.
+ * @param len       The length of the range.
+ * @param offset    The offset of the range.
+ * @param window_ms How long reads should return the old contents for.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int kibosh_stale_capture(struct kibosh_fs *fs, struct kibosh_file *file, size_t len,
+                                off_t offset, uint32_t window_ms)
+{
+    char *data;
+    uint64_t gen;
+    int ret;
+
+    data = malloc(len);
+    if (!data) {
+        return -ENOMEM;
+    }
+    do {
+        gen = overlay_read_begin(fs->overlay, file->dev, file->ino);
+        ret = kibosh_read_target(file, data, len, offset);
+        if (ret < 0) {
+            // Files which were opened write-only cannot be read, so their writes are
+            // never stale.
+            DEBUG("%s(file->path=%s): unable to read the old contents: %s (%d)\n",
+                  __func__, file->path, safe_strerror(-ret), -ret);
+            free(data);
+            return 0;
+        }
+    } while (overlay_read(fs->overlay, file->dev, file->ino, gen, data, ret, offset) < 0);
+    // Anything past the old end of the file did not exist before, so it is never stale.
+    return stale_add(fs->stale, file->dev, file->ino, offset, data, ret, window_ms);
+}
+
 int kibosh_write(const char *path UNUSED, const char *buf, size_t size, off_t offset,
                  struct fuse_file_info *info)
 {
-    int ret = 0;
+    int ret = 0, iovcnt, idx = 0, lo, hi = 0, len;
     uint32_t delay_ms = 0, uid = fuse_get_context()->uid;
     struct kibosh_file *file = (struct kibosh_file*)(uintptr_t)info->fh;
     struct kibosh_fs *fs = fuse_get_context()->private_data;
-    size_t off = 0;
-    char *dynamic_buf = NULL, scratch[32];
-    struct kibosh_fault_base *fault;
+    struct kibosh_patches patches;
+    struct iovec iov[KIBOSH_PATCHES_IOV_MAX];
+    char scratch[32];
     const char *fault_name = NULL;
-
-    pthread_mutex_lock(&fs->lock);
-    fault = find_first_fault(fs->faults, file->path, "write");
-    if (fault) {
-        fault_name = kibosh_fault_type_name(fault);
-        ret = apply_write_fault(fault, &buf, &dynamic_buf, size, &delay_ms);
+    struct kibosh_io io;
+
+    if (file->type == KIBOSH_FILE_TYPE_CONTROL) {
+        // Faults never apply to the control file, so that a write which clears them
+        // always takes effect.
+        iov[0].iov_base = (char *)buf;
+        iov[0].iov_len = size;
+        ret = kibosh_pwritev_full(file->fd, iov, 1, offset);
+        goto done;
     }
+    // The bounce buffer is only gotten if a fault corrupts the write.
+    kibosh_patches_init(&patches, buf, NULL, size);
+    patches.bounce_get = kibosh_bounce_get;
+    kibosh_io_init(&io, file, KIBOSH_OP_WRITE, size, offset);
+    pthread_mutex_lock(&fs->lock);
+    ret = faults_apply_write(fs->faults, &io, &patches, size, &delay_ms, &fault_name);
     pthread_mutex_unlock(&fs->lock);
+    // Composed faults can delay a write and then fail it.
+    if (delay_ms > 0) {
+        milli_sleep(delay_ms);
+    }
     if (ret < 0) {
         goto done;
     }
-    if (delay_ms > 0) {
-        milli_sleep(delay_ms);
+    len = ret;
+    if (patches.stale_ms > 0) {
+        ret = kibosh_stale_capture(fs, file, len, offset, patches.stale_ms);
+        if (ret < 0) {
+            goto done;
+        }
     }
-    while (off < size) {
-        ret = pwrite(file->fd, buf + off, size - off, offset + off);
+    // A fault may only let part of the buffer be written, as a short write, or leave holes
+    // in it.  Corrupted bytes are spliced in from the bounce buffer.  Unsynced writes are
+    // held in the overlay, and anything written to the target replaces what it holds.
+    while (kibosh_patches_next_run(&patches, len, &idx, &lo, &hi)) {
+        iovcnt = kibosh_patches_iov(&patches, lo, hi, iov);
+        if (patches.unsynced) {
+            ret = overlay_write(fs->overlay, file->dev, file->ino, file->fd, iov, iovcnt,
+                                offset + lo, patches.kb_per_sec, patches.dirty_limit);
+        } else {
+            ret = overlay_discard(fs->overlay, file->dev, file->ino, offset + lo, hi - lo);
+            if (ret == 0) {
+                ret = kibosh_pwritev_full(file->fd, iov, iovcnt, offset + lo);
+            }
+        }
         if (ret < 0) {
-            ret = -errno;
+            len = (lo > 0) ? lo : ret;
             break;
         }
-        off += ret;
+        if (ret < hi - lo) {
+            len = lo + ret;
+            break;
+        }
+    }
+    ret = len;
+    if ((ret >= 0) && (patches.reported >= 0) && (patches.reported < ret)) {
+        ret = patches.reported;
     }
-    ret = off;
 
 done:
-    free(dynamic_buf);
     if (fault_name) {
         INFO("kibosh_write(file->path=%s, size=%zd, offset=%" PRId64", uid=%"PRId32
               ", fault=%s) = %s\n", file->path, size, (int64_t)offset, uid, fault_name,
@@ -363,6 +642,8 @@ const char *kibosh_file_type_str(enum kibosh_file_type type)
         return "normal";
     case KIBOSH_FILE_TYPE_CONTROL:
         return "control";
+    case KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT:
+        return "control_snapshot";
     default:
         return "unknown";
     }
@@ -18,7 +18,7 @@
 #define KIBOSH_FILE_H
 
 #include <fuse.h>
-#include <sys/types.h> // for mode_t, dev_t
+#include <sys/types.h> // for mode_t, dev_t, ino_t
 #include <unistd.h> // for size_t
 
 int kibosh_create(const char *path, mode_t mode, struct fuse_file_info *info);
@@ -40,11 +40,19 @@ enum kibosh_file_type {
     KIBOSH_FILE_TYPE_NORMAL = 0,
 
     /**
-     * The Kibosh control file.
+     * The Kibosh control file, opened for writing.
      */
     KIBOSH_FILE_TYPE_CONTROL = 1,
+
+    /**
+     * The Kibosh control file, opened read-only.  This is served from a control JSON
+     * snapshot, and has no backing file descriptor.
+     */
+    KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT = 2,
 };
 
+struct kibosh_control_snapshot;
+
 struct kibosh_file {
     /**
      * The type of file which this is.
@@ -56,11 +64,30 @@ struct kibosh_file {
      */
     int fd;
 
+    /**
+     * The control JSON snapshot, for KIBOSH_FILE_TYPE_CONTROL_SNAPSHOT files.  NULL
+     * otherwise.
+     */
+    struct kibosh_control_snapshot *snapshot;
+
+    /**
+     * The flags which this file was opened with.  Faults can match on these.
+     */
+    int flags;
+
+    /**
+     * The device and inode of the backing file, for normal files.  Faults which target
+     * inodes use these, so they keep working when the file is renamed.  0 otherwise.
+     */
+    dev_t dev;
+    ino_t ino;
+
     /**
      * The path of this file when it was opened, as a NULL-terminated string.
      *
      * Note that if the inode is renamed, or a parent directory is renamed, this
-     * will not be updated.  This path is used to decide when to inject faults.
+     * will not be updated.  This path is used to decide when to inject faults, unless
+     * the faults target inodes.
      */
     char path[0];
 };
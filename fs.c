@@ -15,17 +15,22 @@
  **/
 
 #include "conf.h"
+#include "control_socket.h"
 #include "fault.h"
 #include "file.h"
 #include "fs.h"
 #include "io.h"
 #include "log.h"
 #include "meta.h"
+#include "overlay.h"
+#include "stale.h"
 #include "pid.h"
+#include "scenario.h"
 #include "util.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,14 +40,37 @@
 #include <unistd.h>
 
 /**
- * The length of the control buffer which we use when reading the control file JSON.
+ * The environment variable used to set the path to the pid file.
  */
-#define CONTROL_BUF_LEN 16384
+#define PIDFILE_PATH "PIDFILE_PATH"
 
 /**
- * The environment variable used to set the path to the pid file.
+ * Allocate a new control JSON snapshot with a single reference.
+ *
+ * @param json      The control JSON.  We take ownership of this.
+ * @param faults    The faults which the JSON describes.  We take ownership of these.
+ *
+ * @return          The snapshot, or NULL on OOM.  On OOM, the JSON and the faults are
+ *                  freed.
  */
-#define PIDFILE_PATH "PIDFILE_PATH"
+static struct kibosh_control_snapshot *kibosh_control_snapshot_alloc(char *json,
+                                                                     struct kibosh_faults *faults)
+{
+    struct kibosh_control_snapshot *snapshot;
+
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (!snapshot) {
+        free(json);
+        faults_free(faults);
+        return NULL;
+    }
+    snapshot->refcnt = 1;
+    snapshot->len = strlen(json);
+    clock_gettime(CLOCK_REALTIME, &snapshot->mtime);
+    snapshot->json = json;
+    snapshot->faults = faults;
+    return snapshot;
+}
 
 static int kibosh_fs_alloc_oom(struct kibosh_fs *fs)
 {
@@ -55,8 +83,7 @@ int kibosh_fs_alloc(struct kibosh_fs **out, const struct kibosh_conf *conf)
 {
     int ret;
     struct kibosh_fs *fs;
-    char *buf = NULL;
-    size_t buf_len;
+    char *json;
 
     *out = NULL;
     fs = calloc(1, sizeof(*fs));
@@ -68,7 +95,21 @@ int kibosh_fs_alloc(struct kibosh_fs **out, const struct kibosh_conf *conf)
         INFO("kibosh_fs_alloc: pthread_mutex_init failed: %s (%d)\n", safe_strerror(-ret), -ret);
         return ret;
     }
-    fs->control_fd = -1;
+    if (pthread_mutex_init(&fs->snapshot_lock, NULL)) {
+        ret = -errno;
+        pthread_mutex_destroy(&fs->lock);
+        free(fs);
+        INFO("kibosh_fs_alloc: pthread_mutex_init failed: %s (%d)\n", safe_strerror(-ret), -ret);
+        return ret;
+    }
+    if (pthread_mutex_init(&fs->update_lock, NULL)) {
+        ret = -errno;
+        pthread_mutex_destroy(&fs->snapshot_lock);
+        pthread_mutex_destroy(&fs->lock);
+        free(fs);
+        INFO("kibosh_fs_alloc: pthread_mutex_init failed: %s (%d)\n", safe_strerror(-ret), -ret);
+        return ret;
+    }
     fs->root = strdup(conf->target_path);
     if (!fs->root)
         return kibosh_fs_alloc_oom(fs);
@@ -88,14 +129,21 @@ int kibosh_fs_alloc(struct kibosh_fs **out, const struct kibosh_conf *conf)
             return ret;
         }
     }
-    fs->control_fd = memfd_create(KIBOSH_CONTROL, conf->control_mode);
-    if (fs->control_fd < 0) {
-        ret = fs->control_fd;
-        INFO("kibosh_fs_alloc: memfd_create failed: %s\n", safe_strerror(-ret));
-        kibosh_fs_free(fs);
-        return ret;
+    if (conf->control_socket_path) {
+        fs->control_socket_path = strdup(conf->control_socket_path);
+        if (!fs->control_socket_path)
+            return kibosh_fs_alloc_oom(fs);
     }
     fs->control_mode = conf->control_mode;
+    fs->control_uid = geteuid();
+    fs->control_gid = getegid();
+    fs->delay_lane = (conf->delay_threads > 0);
+    fs->overlay = overlay_alloc((uint64_t)conf->overlay_max_mb * 1024 * 1024);
+    if (!fs->overlay)
+        return kibosh_fs_alloc_oom(fs);
+    fs->stale = stale_alloc((uint64_t)conf->stale_max_mb * 1024 * 1024);
+    if (!fs->stale)
+        return kibosh_fs_alloc_oom(fs);
     ret = faults_calloc(&fs->faults);
     if (ret < 0) {
         INFO("kibosh_fs_alloc: faults_calloc failed: error %d (%s)\n",
@@ -103,43 +151,18 @@ int kibosh_fs_alloc(struct kibosh_fs **out, const struct kibosh_conf *conf)
         kibosh_fs_free(fs);
         return ret;
     }
-    fs->cur_control_json = malloc(CONTROL_BUF_LEN);
-    if (!fs->cur_control_json) {
-        ret = -ENOMEM;
-        INFO("kibosh_fs_alloc: failed to allocate cur_control_json.\n");
-        kibosh_fs_free(fs);
-        return ret;
-    }
-    fs->control_buf = malloc(CONTROL_BUF_LEN);
-    if (!fs->control_buf) {
-        ret = -ENOMEM;
-        INFO("kibosh_fs_alloc: failed to allocate control_buf.\n");
-        kibosh_fs_free(fs);
-        return ret;
-    }
-    buf = faults_unparse(fs->faults);
-    if (!buf) {
+    json = faults_unparse(fs->faults);
+    if (!json) {
         ret = -ENOMEM;
         INFO("kibosh_fs_alloc: faults_unparse: failed to unparse "
              "default faults.\n");
         kibosh_fs_free(fs);
         return ret;
     }
-    buf_len = strlen(buf);
-    if (buf_len >= CONTROL_BUF_LEN) {
-        ret = -ENAMETOOLONG;
-        INFO("kibosh_fs_alloc: faults_unparse: unparsed faults data was longer than "
-             "CONTROL_BUF_LEN (%zd versus %d)\n", buf_len, CONTROL_BUF_LEN);
-        kibosh_fs_free(fs);
-        return ret;
-    }
-    strncpy(fs->cur_control_json, buf, buf_len + 1);
-    ret = safe_write(fs->control_fd, buf, buf_len);
-    free(buf);
-    if (ret < 0) {
-        INFO("kibosh_fs_alloc: failed to write initial JSON to control file: %s\n", safe_strerror(-ret));
-        kibosh_fs_free(fs);
-        return ret;
+    fs->snapshot = kibosh_control_snapshot_alloc(json, fs->faults);
+    if (!fs->snapshot) {
+        fs->faults = NULL;
+        return kibosh_fs_alloc_oom(fs);
     }
     *out = fs;
     return 0;
@@ -153,6 +176,20 @@ void kibosh_fs_free(struct kibosh_fs *fs)
         drop_cache_thread_join(fs->drop_cache_thread);
         fs->drop_cache_thread = NULL;
     }
+    if (fs->control_socket_thread) {
+        control_socket_thread_join(fs->control_socket_thread);
+        fs->control_socket_thread = NULL;
+    }
+    // The scenario thread must be stopped after the control socket thread, which may
+    // submit scenarios to it, and before the faults are freed.
+    if (fs->scenario_thread) {
+        scenario_thread_join(fs->scenario_thread);
+        fs->scenario_thread = NULL;
+    }
+    if (fs->control_socket_path) {
+        free(fs->control_socket_path);
+        fs->control_socket_path = NULL;
+    }
     if (fs->root) {
         free(fs->root);
         fs->root = NULL;
@@ -162,28 +199,33 @@ void kibosh_fs_free(struct kibosh_fs *fs)
         free(fs->pidfile_path);
         fs->pidfile_path = NULL;
     }
-    if (fs->control_fd >= 0) {
-        close(fs->control_fd);
-        fs->control_fd = -1;
-    }
-    if (fs->faults) {
+    // Once there is a snapshot, it owns the faults.
+    if (fs->faults && !fs->snapshot) {
         faults_free(fs->faults);
-        fs->faults = NULL;
     }
-    if (fs->cur_control_json) {
-        free(fs->cur_control_json);
-        fs->cur_control_json = NULL;
+    fs->faults = NULL;
+    // Unsynced writes which are still held survive a clean shutdown.
+    if (fs->overlay) {
+        overlay_free(fs->overlay);
+        fs->overlay = NULL;
+    }
+    if (fs->stale) {
+        stale_free(fs->stale);
+        fs->stale = NULL;
     }
-    if (fs->control_buf) {
-        free(fs->control_buf);
-        fs->control_buf = NULL;
+    if (fs->snapshot) {
+        kibosh_fs_snapshot_put(fs->snapshot);
+        fs->snapshot = NULL;
     }
+    pthread_mutex_destroy(&fs->update_lock);
+    pthread_mutex_destroy(&fs->snapshot_lock);
     pthread_mutex_destroy(&fs->lock);
     free(fs);
 }
 
 int kibosh_fs_accessor_fd_alloc(struct kibosh_fs *fs, int populate)
 {
+    struct kibosh_control_snapshot *snapshot;
     int new_fd = -1, ret;
 
     new_fd = memfd_create(KIBOSH_CONTROL, fs->control_mode);
@@ -194,101 +236,298 @@ int kibosh_fs_accessor_fd_alloc(struct kibosh_fs *fs, int populate)
         goto error;
     }
     if (populate) {
-        pthread_mutex_lock(&fs->lock);
-        if (lseek(fs->control_fd, 0, SEEK_SET) < 0) {
-            ret = -errno;
-            INFO("kibosh_fs_accessor_fd_alloc: lseek(fs->control_fd, 0, SEEK_SET) "
-                 "failed: error %d (%s)\n", -ret, safe_strerror(-ret));
-            goto error_release_lock;
-        }
-        ret = duplicate_fd(new_fd, fs->control_fd);
+        snapshot = kibosh_fs_snapshot_get(fs);
+        ret = safe_write(new_fd, snapshot->json, snapshot->len);
+        kibosh_fs_snapshot_put(snapshot);
         if (ret < 0) {
-            INFO("kibosh_fs_accessor_fd_alloc: duplicate_fd failed: error %d (%s)\n",
-                 -ret, safe_strerror(-ret));
-            goto error_release_lock;
+            INFO("kibosh_fs_accessor_fd_alloc: failed to copy the control JSON: "
+                 "error %d (%s)\n", -ret, safe_strerror(-ret));
+            goto error_close_fd;
         }
-        if (lseek(new_fd, 0, SEEK_SET) < 0) {
-            ret = -errno;
-            INFO("kibosh_fs_accessor_fd_alloc: lseek(new_fd, 0, SEEK_SET) "
-                 "failed: error %d (%s)\n", -ret, safe_strerror(-ret));
-            goto error_release_lock;
-        }
-        pthread_mutex_unlock(&fs->lock);
     }
     return new_fd;
 
-error_release_lock:
-    pthread_mutex_unlock(&fs->lock);
+error_close_fd:
     close(new_fd);
 error:
     return ret;
 }
 
+struct kibosh_control_snapshot *kibosh_fs_snapshot_get(struct kibosh_fs *fs)
+{
+    struct kibosh_control_snapshot *snapshot;
+
+    pthread_mutex_lock(&fs->snapshot_lock);
+    snapshot = fs->snapshot;
+    __atomic_add_fetch(&snapshot->refcnt, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    return snapshot;
+}
+
+void kibosh_fs_snapshot_put(struct kibosh_control_snapshot *snapshot)
+{
+    if (__atomic_sub_fetch(&snapshot->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        faults_free(snapshot->faults);
+        free(snapshot->json);
+        free(snapshot);
+    }
+}
+
+void kibosh_fs_snapshot_stat(const struct kibosh_fs *fs,
+                             const struct kibosh_control_snapshot *snapshot,
+                             struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_mode = S_IFREG | fs->control_mode;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = fs->control_uid;
+    stbuf->st_gid = fs->control_gid;
+    stbuf->st_size = snapshot->len;
+    stbuf->st_blksize = 4096;
+    stbuf->st_blocks = (snapshot->len + 511) / 512;
+    stbuf->st_atim = snapshot->mtime;
+    stbuf->st_mtim = snapshot->mtime;
+    stbuf->st_ctim = snapshot->mtime;
+}
+
 int kibosh_fs_control_stat(struct kibosh_fs *fs, struct stat *stbuf)
 {
-    int ret = 0;
+    struct kibosh_control_snapshot *snapshot;
+
+    snapshot = kibosh_fs_snapshot_get(fs);
+    kibosh_fs_snapshot_stat(fs, snapshot, stbuf);
+    kibosh_fs_snapshot_put(snapshot);
+    return 0;
+}
+
+/**
+ * Install a new set of faults and a new control JSON snapshot describing them.  Must be
+ * called with the update_lock held, but not the lock.
+ *
+ * Resolving pins walks the whole backing directory, so it is done on the new faults before
+ * we take the lock.  The lock is only held to swap them in.  Faults keep firing until
+ * then, so that is also when the state of the unchanged faults is carried over.
+ *
+ * @param fs        The kibosh_fs.
+ * @param faults    The new faults.  We take ownership of this.
+ *
+ * @return          0 on success; a negative error code otherwise.  On error, the
+ *                  old faults stay in place.
+ */
+static int kibosh_fs_publish_faults(struct kibosh_fs *fs, struct kibosh_faults *faults)
+{
+    struct kibosh_control_snapshot *snapshot, *prev;
+    struct kibosh_faults *resolved = NULL;
+    char *json;
+    int ret;
 
+    // Pinned faults are activated now, so this is when they are resolved to inodes.  Only
+    // updates change the faults, and we hold the update_lock, so it is safe to read them.
+    ret = faults_resolve_pins(faults, fs->faults, fs->root, &resolved);
+    if (ret < 0) {
+        INFO("kibosh_fs_publish_faults: faults_resolve_pins failed: error %d (%s)\n",
+             -ret, safe_strerror(-ret));
+        faults_free(faults);
+        return ret;
+    }
+    if (resolved) {
+        faults_free(faults);
+        faults = resolved;
+    }
+    json = faults_unparse(faults);
+    if (!json) {
+        INFO("kibosh_fs_publish_faults: faults_unparse failed.\n");
+        faults_free(faults);
+        return -ENOMEM;
+    }
+    // Only updates change the snapshot, and we hold the update_lock, so it is safe to
+    // read it here.
+    if (strcmp(json, fs->snapshot->json) == 0) {
+        // Nothing changed, so keep the old faults, along with their state.
+        DEBUG("kibosh_fs_publish_faults: faults are unchanged.\n");
+        free(json);
+        faults_free(faults);
+        return 0;
+    }
+    snapshot = kibosh_control_snapshot_alloc(json, faults);
+    if (!snapshot) {
+        INFO("kibosh_fs_publish_faults: failed to allocate snapshot.\n");
+        return -ENOMEM;
+    }
     pthread_mutex_lock(&fs->lock);
-    if (fstat(fs->control_fd, stbuf) < 0) {
-        ret = -errno;
+    ret = faults_carry_state(fs->faults, faults);
+    if (ret < 0) {
+        pthread_mutex_unlock(&fs->lock);
+        INFO("kibosh_fs_publish_faults: faults_carry_state failed: error %d (%s)\n",
+             -ret, safe_strerror(-ret));
+        kibosh_fs_snapshot_put(snapshot);
+        return ret;
     }
+    pthread_mutex_lock(&fs->snapshot_lock);
+    prev = fs->snapshot;
+    fs->snapshot = snapshot;
+    pthread_mutex_unlock(&fs->snapshot_lock);
+    fs->faults = faults;
     pthread_mutex_unlock(&fs->lock);
-    return ret;
+    // The old faults live on until nobody is using the old snapshot.
+    kibosh_fs_snapshot_put(prev);
+    return 0;
 }
 
-static void swap_ints(int *a, int *b)
+static int kibosh_fs_apply_scenario_step(void *arg, const char *json)
 {
-    int temp;
-    temp = *a;
-    *a = *b;
-    *b = temp;
+    return kibosh_fs_update_faults((struct kibosh_fs *)arg, json);
 }
 
-int kibosh_fs_accessor_fd_release(struct kibosh_fs *fs, int fd)
+/**
+ * Hand a scenario off to the scenario thread, starting the thread if needed.  Must be
+ * called with the update_lock held.
+ *
+ * @param fs        The kibosh_fs.
+ * @param json      The control JSON containing the scenario.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int kibosh_fs_submit_scenario(struct kibosh_fs *fs, const char *json)
+{
+    struct scenario *scenario = NULL;
+    int ret;
+
+    ret = scenario_parse(json, strlen(json), &scenario);
+    if (ret < 0) {
+        return ret;
+    }
+    // The thread is started on demand, since most users never submit a scenario.  By now,
+    // FUSE has already daemonized, so the thread will not be lost in a fork.
+    if (!fs->scenario_thread) {
+        fs->scenario_thread = scenario_thread_start(kibosh_fs_apply_scenario_step, fs);
+        if (!fs->scenario_thread) {
+            scenario_free(scenario);
+            return -ENOMEM;
+        }
+    }
+    scenario_thread_submit(fs->scenario_thread, scenario);
+    return 0;
+}
+
+/**
+ * Emulate a crash, throwing away some or all of the unsynced writes.  Must be called
+ * without the lock held.  The lost extents are chosen under the lock, but the rest are
+ * written back after releasing it, so that fault lookups do not wait for the writeback.
+ *
+ * @param fs        The kibosh_fs.
+ * @param json      The control JSON containing the crash request.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int kibosh_fs_crash(struct kibosh_fs *fs, const char *json)
+{
+    struct overlay_file *files;
+    double fraction;
+    int ret;
+
+    ret = overlay_crash_parse(json, strlen(json), &fraction);
+    if (ret < 0) {
+        INFO("kibosh_fs_crash: failed to parse a crash request: error %d (%s)\n",
+             -ret, safe_strerror(-ret));
+        return ret;
+    }
+    pthread_mutex_lock(&fs->lock);
+    files = overlay_crash(fs->overlay, fraction);
+    pthread_mutex_unlock(&fs->lock);
+    overlay_crash_writeback(files);
+    return 0;
+}
+
+int kibosh_fs_update_faults(struct kibosh_fs *fs, const char *json)
 {
-    int flags, ret;
     struct kibosh_faults *faults = NULL;
+    int ret, num;
 
-    flags = fcntl(fd, F_GETFL, 0);
-    if ((flags & O_ACCMODE) == O_RDONLY) {
+    pthread_mutex_lock(&fs->update_lock);
+    // Only updates change the faults and the snapshot, and we hold the update_lock, so we
+    // can parse against them without taking the lock.  The state which is copied from the
+    // current faults here may be stale, but it is carried over again under the lock when
+    // the new faults are published.
+    if (strcmp(fs->snapshot->json, json) == 0) {
         ret = 0;
-        DEBUG("kibosh_fs_accessor_fd_release: closing read-only accessor.\n");
-        goto done_close_fd;
+        DEBUG("kibosh_fs_update_faults: control JSON was unchanged.\n");
+        goto done;
+    }
+    ret = faults_update(fs->snapshot->faults, json, &faults);
+    if (ret == FAULTS_UPDATE_SCENARIO) {
+        ret = kibosh_fs_submit_scenario(fs, json);
+        if (ret < 0) {
+            INFO("kibosh_fs_update_faults: failed to submit a scenario: error %d (%s)\n",
+                 -ret, safe_strerror(-ret));
+        }
+        goto done;
+    }
+    if (ret == FAULTS_UPDATE_CRASH) {
+        ret = kibosh_fs_crash(fs, json);
+        goto done;
+    }
+    if (ret < 0) {
+        INFO("kibosh_fs_update_faults: failed to parse %zd bytes of control JSON: "
+             "error %d (%s)\n", strlen(json), -ret, safe_strerror(-ret));
+        goto done;
+    }
+    num = faults->num_faults;
+    ret = kibosh_fs_publish_faults(fs, faults);
+    if (ret == 0) {
+        DEBUG("kibosh_fs_update_faults: successfully parsed %zd bytes of control JSON.  "
+              "There are now %d fault(s).\n", strlen(json), num);
     }
+done:
+    pthread_mutex_unlock(&fs->update_lock);
+    return ret;
+}
+
+char *kibosh_fs_fault_stats(struct kibosh_fs *fs)
+{
+    char *json;
+
     pthread_mutex_lock(&fs->lock);
+    json = faults_unparse_with_state(fs->faults);
+    pthread_mutex_unlock(&fs->lock);
+    return json;
+}
+
+int kibosh_fs_accessor_fd_release(struct kibosh_fs *fs, int fd)
+{
+    int ret;
+    char *buf = NULL;
+
     if (lseek(fd, 0, SEEK_SET) < 0) {
         ret = -errno;
         INFO("kibosh_fs_accessor_fd_release: lseek(control_fd, 0, SEEK_SET) failed: "
              "error %d (%s)\n", -ret, safe_strerror(-ret));
-        goto done_release_lock;
+        goto done_close_fd;
     }
-    ret = read_string_from_fd(fd, fs->control_buf, CONTROL_BUF_LEN);
+    ret = read_all_from_fd(fd, &buf, NULL);
     if (ret < 0) {
-        INFO("kibosh_fs_accessor_fd_release: read_string_from_fd(control_fd) failed: "
+        INFO("kibosh_fs_accessor_fd_release: read_all_from_fd(control_fd) failed: "
              "error %d (%s)\n", -ret, safe_strerror(-ret));
-        goto done_release_lock;
-    }
-    if (strcmp(fs->cur_control_json, fs->control_buf) == 0) {
-        ret = 0;
-        DEBUG("kibosh_fs_accessor_fd_release: control_buf was unchanged.\n");
-        goto done_release_lock;
-    }
-    ret = faults_parse(fs->control_buf, &faults);
-    if (ret < 0) {
-        INFO("kibosh_fs_accessor_fd_release: failed to parse '%s': error %d (%s)\n",
-                fs->control_buf, -ret, safe_strerror(-ret));
-        goto done_release_lock;
+        goto done_close_fd;
     }
-    strncpy(fs->cur_control_json, fs->control_buf, CONTROL_BUF_LEN);
-    fs->faults = faults;
-    swap_ints(&fd, &fs->control_fd);
-    INFO("kibosh_fs_accessor_fd_release: successfully parsed '%s'\n", fs->control_buf);
-    ret = 0;
-done_release_lock:
-    pthread_mutex_unlock(&fs->lock);
+    ret = kibosh_fs_update_faults(fs, buf);
 done_close_fd:
+    free(buf);
     close(fd);
     return ret;
 }
 
+int kibosh_fs_may_delay(struct kibosh_fs *fs, const char *path, uint32_t op)
+{
+    struct kibosh_control_snapshot *snapshot;
+    int ret;
+
+    // This runs on the receive thread for every read and write, so it must not wait
+    // behind the data path for the lock.  The snapshot keeps its faults alive.
+    snapshot = kibosh_fs_snapshot_get(fs);
+    ret = faults_may_delay(snapshot->faults, path, op);
+    kibosh_fs_snapshot_put(snapshot);
+    return ret;
+}
+
 // vim: ts=4:sw=4:tw=99:et
@@ -18,6 +18,9 @@
 #define KIBOSH_FS_H
 
 #include <pthread.h> // for pthread_mutex_t
+#include <stdint.h> // for uint32_t
+#include <sys/types.h> // for uid_t, gid_t
+#include <time.h> // for struct timespec
 
 #include "drop_cache.h"
 
@@ -27,9 +30,61 @@
 struct kibosh_conf;
 struct stat;
 
+/**
+ * An immutable snapshot of the control JSON.
+ *
+ * A new snapshot is created each time the faults change.  Readers of the control file
+ * hold a reference to the snapshot which was current when they opened it, so they see a
+ * consistent document no matter how many times the faults change in the meantime.
+ */
+struct kibosh_control_snapshot {
+    /**
+     * The reference count.  Accessed atomically.
+     */
+    int refcnt;
+
+    /**
+     * The length of the JSON, not including the NULL terminator.
+     */
+    size_t len;
+
+    /**
+     * The time when this snapshot was created.
+     */
+    struct timespec mtime;
+
+    /**
+     * The control JSON, as a NULL-terminated string.
+     */
+    char *json;
+
+    /**
+     * The faults which the JSON describes.  The snapshot owns them.  Without the lock,
+     * only their immutable parts may be used, as faults_may_delay does.  Their state is
+     * only changed through kibosh_fs->faults, while holding the lock.
+     */
+    struct kibosh_faults *faults;
+};
+
 struct kibosh_fs {
     struct drop_cache_thread *drop_cache_thread;
 
+    /**
+     * The control socket thread, or NULL if there is no control socket.
+     */
+    struct control_socket_thread *control_socket_thread;
+
+    /**
+     * The scenario thread, or NULL if no scenario has been submitted yet.  Protected by
+     * the lock.
+     */
+    struct scenario_thread *scenario_thread;
+
+    /**
+     * If this is non-NULL, then it is the path to the control socket.  Immutable.
+     */
+    char *control_socket_path;
+
     /**
      * The root of the pass-through filesystem.  Immutable.
      */
@@ -41,34 +96,66 @@ struct kibosh_fs {
     char *pidfile_path;
 
     /**
-     * The current control file.
+     * The mode to use on the control file.
      */
-    int control_fd;
+    int control_mode;
 
     /**
-     * The mode to use on the control file.
+     * The owner of the control file.  Immutable.
      */
-    int control_mode;
+    uid_t control_uid;
+    gid_t control_gid;
 
     /**
-     * The current set of faults.  Protected by the lock.
+     * The current set of faults.  Only changed while holding both the update_lock and the
+     * lock, so holding either one is enough to read the pointer.  Their state is protected
+     * by the lock.  These are owned by the current snapshot, so a reference to the
+     * snapshot keeps them alive.
      */
     struct kibosh_faults *faults;
 
     /**
-     * The current control JSON.
+     * The current control JSON snapshot.  Only changed while holding both the lock and
+     * the snapshot_lock, so holding either one is enough to read it.
+     */
+    struct kibosh_control_snapshot *snapshot;
+
+    /**
+     * The lock that protects the snapshot pointer.  This is only held long enough to
+     * take a reference to the snapshot, so readers of the control file never have to
+     * wait for the data path.
      */
-    char *cur_control_json;
+    pthread_mutex_t snapshot_lock;
 
     /**
-     * The buffer used to read the control fd.
+     * Nonzero if requests which may hit a delay fault are handed off to the delay lane.
+     * Immutable.
      */
-    char *control_buf;
+    int delay_lane;
 
     /**
-     * The lock that protects control_fd, faults, and control_buf.
+     * The writes which lost_write faults are holding until their files are synced.  This
+     * has its own lock.
+     */
+    struct kibosh_overlay *overlay;
+
+    /**
+     * The old contents of ranges which stale_read faults make reads return for a while
+     * after they are written.  This has its own lock.
+     */
+    struct kibosh_stale *stale;
+
+    /**
+     * The lock that protects faults.
      */
     pthread_mutex_t lock;
+
+    /**
+     * The lock that serializes updates to the faults.  It is held for the whole update,
+     * including parsing, while the lock is only held to carry over the state of the
+     * current faults and to swap in the new ones.  This is taken before the lock.
+     */
+    pthread_mutex_t update_lock;
 };
 
 /**
@@ -91,6 +178,8 @@ void kibosh_fs_free(struct kibosh_fs *fs);
 /**
  * Fill in the stat structure for the control file.
  *
+ * This does not take the fault lock.
+ *
  * @param fs        The kibosh_fs
  * @param stbuf     (out param) the stat structure.
  *
@@ -99,7 +188,35 @@ void kibosh_fs_free(struct kibosh_fs *fs);
 int kibosh_fs_control_stat(struct kibosh_fs *fs, struct stat *stbuf);
 
 /**
- * Create a new accessor file descriptor.
+ * Fill in the stat structure for a particular control JSON snapshot.
+ *
+ * @param fs        The kibosh_fs
+ * @param snapshot  The snapshot.
+ * @param stbuf     (out param) the stat structure.
+ */
+void kibosh_fs_snapshot_stat(const struct kibosh_fs *fs,
+                             const struct kibosh_control_snapshot *snapshot,
+                             struct stat *stbuf);
+
+/**
+ * Get a reference to the current control JSON snapshot.
+ *
+ * @param fs        The kibosh_fs
+ *
+ * @return          The snapshot.  It must be released with kibosh_fs_snapshot_put.
+ */
+struct kibosh_control_snapshot *kibosh_fs_snapshot_get(struct kibosh_fs *fs);
+
+/**
+ * Release a reference to a control JSON snapshot.
+ *
+ * @param snapshot  The snapshot.  It will be freed when the last reference is released.
+ */
+void kibosh_fs_snapshot_put(struct kibosh_control_snapshot *snapshot);
+
+/**
+ * Create a new accessor file descriptor.  This is used for writable opens of the
+ * control file.  Read-only opens use a snapshot instead.
  *
  * @param fs        The kibosh_fs.
  * @param populate  1 if we should copy the existing control file; 0 otherwise.
@@ -111,7 +228,9 @@ int kibosh_fs_accessor_fd_alloc(struct kibosh_fs *fs, int populate);
 /**
  * Release an accessor file descriptor.
  *
- * This will update the configured faults if necessary.
+ * This will update the configured faults if necessary.  The accessor may contain either
+ * a full set of faults or a list of incremental operations; see faults_update.  Either
+ * way, the control file is rewritten afterwards to show the full set of faults.
  *
  * @param fs        The kibosh_fs
  * @param fd        The accessor file descriptor to release.
@@ -120,6 +239,28 @@ int kibosh_fs_accessor_fd_alloc(struct kibosh_fs *fs, int populate);
  */
 int kibosh_fs_accessor_fd_release(struct kibosh_fs *fs, int fd);
 
+/**
+ * Update the configured faults from control JSON.
+ *
+ * @param fs        The kibosh_fs
+ * @param json      The control JSON.  This may contain either a full set of faults or a
+ *                  list of incremental operations; see faults_update.  It may also
+ *                  contain a scenario, which is handed off to the scenario thread; see
+ *                  scenario.h, or a crash request; see overlay.h.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+int kibosh_fs_update_faults(struct kibosh_fs *fs, const char *json);
+
+/**
+ * Get the current faults as JSON, along with the live state of each fault.
+ *
+ * @param fs        The kibosh_fs
+ *
+ * @return          A dynamically allocated JSON string, or NULL on OOM.
+ */
+char *kibosh_fs_fault_stats(struct kibosh_fs *fs);
+
 /**
  * Check if we should inject a read fault.
  *
@@ -140,6 +281,17 @@ int kibosh_fs_check_read_fault(struct kibosh_fs *fs, const char *path);
  */
 int kibosh_fs_check_write_fault(struct kibosh_fs *fs, const char *path);
 
+/**
+ * Check if a request may be delayed by a fault.
+ *
+ * @param fs        The kibosh_fs.
+ * @param path      The path being accessed.
+ * @param op        The operation, a kibosh_op value.
+ *
+ * @return          1 if a delay fault may apply; 0 otherwise.
+ */
+int kibosh_fs_may_delay(struct kibosh_fs *fs, const char *path, uint32_t op);
+
 #endif
 
 // vim: ts=4:sw=4:tw=99:et
@@ -137,6 +137,55 @@ static int clear_faults(const char *base)
     return 0;
 }
 
+static int test_large_control_file(const char *base)
+{
+    char control_path[PATH_MAX];
+    char *json, *ptr, *buf = NULL;
+    int i, fd, num_faults = 1000;
+
+    snprintf(control_path, sizeof(control_path), "%s%s", base, KIBOSH_CONTROL_PATH);
+    json = malloc(num_faults * 128);
+    EXPECT_NONNULL(json);
+    ptr = json + sprintf(json, "{\"faults\":[");
+    for (i = 0; i < num_faults; i++) {
+        ptr += sprintf(ptr, "%s{\"type\":\"unreadable\", \"prefix\":\"/nonexistent-%d\", "
+                       "\"suffix\":\"\", \"code\":5}", (i == 0) ? "" : ", ", i);
+    }
+    sprintf(ptr, "]}");
+    EXPECT_INT_GT(strlen(json), 16384);
+    EXPECT_INT_ZERO(write_string_to_file(control_path, json));
+    fd = open(control_path, O_RDONLY);
+    EXPECT_INT_NONNEGATIVE(fd);
+    EXPECT_INT_ZERO(read_all_from_fd(fd, &buf, NULL));
+    EXPECT_POSIX_SUCC(close(fd));
+    EXPECT_STR_EQ(json, buf);
+    free(buf);
+    free(json);
+    EXPECT_INT_ZERO(clear_faults(base));
+    return 0;
+}
+
+static int test_clear_lost_write_fault(const char *base)
+{
+    char buf[256], control_path[PATH_MAX], test_path[PATH_MAX + 50];
+
+    snprintf(control_path, sizeof(control_path), "%s%s", base, KIBOSH_CONTROL_PATH);
+    snprintf(test_path, sizeof(test_path), "%s/lost_file", base);
+    // With its default prefix, the fault matches the control file too.  Writes to the
+    // control file must not be held like other writes.
+    EXPECT_INT_ZERO(write_string_to_file(control_path,
+                                         "{\"faults\":[{\"type\":\"lost_write\"}]}"));
+    EXPECT_INT_ZERO(write_string_to_file(test_path, "held"));
+    EXPECT_INT_ZERO(read_string_from_file(test_path, buf, sizeof(buf)));
+    EXPECT_STR_EQ("held", buf);
+    EXPECT_INT_ZERO(clear_faults(base));
+    memset(&buf, 0, sizeof(buf));
+    EXPECT_POSIX_SUCC(read_string_from_file(control_path, buf, sizeof(buf)));
+    EXPECT_STR_EQ("{\"faults\":[]}", buf);
+    EXPECT_POSIX_SUCC(unlink(test_path));
+    return 0;
+}
+
 static int test_create_and_read_file(const char *base, int read_fault, int delay_ms)
 {
     unsigned int i;
@@ -210,6 +259,10 @@ int main(int argc, char **argv)
 
     EXPECT_INT_ZERO(test_empty_control_file(base));
 
+    EXPECT_INT_ZERO(test_large_control_file(base));
+
+    EXPECT_INT_ZERO(test_clear_lost_write_fault(base));
+
     EXPECT_INT_ZERO(test_create_and_remove_subdir(base));
 
     EXPECT_INT_ZERO(test_create_and_remove_nested(base));
@@ -94,6 +94,55 @@ int read_string_from_fd(int fd, char *buf, size_t buf_len)
     return 0;
 }
 
+/**
+ * The initial size of the buffer used by read_all_from_fd.
+ */
+#define READ_ALL_INITIAL_LEN 16384
+
+int read_all_from_fd(int fd, char **out, size_t *out_len)
+{
+    struct stat st;
+    size_t cap = READ_ALL_INITIAL_LEN, len = 0;
+    ssize_t res;
+    char *buf, *new_buf;
+
+    // Use the file size as a hint, so that we can usually read in a single pass.
+    if ((fstat(fd, &st) == 0) && (st.st_size > 0) && ((size_t)st.st_size >= cap)) {
+        cap = ((size_t)st.st_size) + 1;
+    }
+    buf = malloc(cap);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    while (1) {
+        if (len + 1 >= cap) {
+            cap *= 2;
+            new_buf = realloc(buf, cap);
+            if (!new_buf) {
+                free(buf);
+                return -ENOMEM;
+            }
+            buf = new_buf;
+        }
+        res = read(fd, buf + len, cap - len - 1);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            res = -errno;
+            free(buf);
+            return res;
+        } else if (res == 0) {
+            break;
+        }
+        len += res;
+    }
+    buf[len] = '\0';
+    *out = buf;
+    if (out_len)
+        *out_len = len;
+    return 0;
+}
+
 int read_string_from_file(const char *path, char *buf, size_t buf_len)
 {
     int fd, ret;
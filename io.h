@@ -63,6 +63,20 @@ ssize_t safe_read(int fd, void *b, size_t c);
  */
 int read_string_from_fd(int fd, char *buf, size_t buf_len);
 
+/**
+ * Read everything from the given file descriptor into a dynamically allocated,
+ * null-terminated buffer.  The buffer grows as needed, so there is no limit on the length
+ * of the data other than available memory.
+ *
+ * @param fd        The file descriptor.  Reading starts at the current offset.
+ * @param out       (out param) The dynamically allocated buffer.
+ * @param out_len   (out param) The number of bytes read, not including the terminator.
+ *                  May be NULL.
+ *
+ * @return          a negative error number on error, or 0 on success.
+ */
+int read_all_from_fd(int fd, char **out, size_t *out_len);
+
 /**
  * Read a null-terminated string from the given file path.
  *
@@ -0,0 +1,476 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "json_reader.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The initial size of the string buffer.
+ */
+#define JSON_READER_INITIAL_STR_CAP 256
+
+/**
+ * The longest number we will accept.
+ */
+#define JSON_READER_MAX_NUMBER_LEN 64
+
+void json_reader_init(struct json_reader *r, const char *buf, size_t len)
+{
+    memset(r, 0, sizeof(*r));
+    r->start = buf;
+    r->pos = buf;
+    r->end = buf + len;
+}
+
+void json_reader_free(struct json_reader *r)
+{
+    free(r->str);
+    r->str = NULL;
+    r->str_len = 0;
+    r->str_cap = 0;
+}
+
+static enum json_token json_reader_fail(struct json_reader *r, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static enum json_token json_reader_fail(struct json_reader *r, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    if (r->error[0]) {
+        return JSON_TOKEN_ERROR;
+    }
+    len = snprintf(r->error, sizeof(r->error), "at offset %zd: ", r->pos - r->start);
+    va_start(ap, fmt);
+    vsnprintf(r->error + len, sizeof(r->error) - len, fmt, ap);
+    va_end(ap);
+    r->pos = r->end;
+    return JSON_TOKEN_ERROR;
+}
+
+static void json_reader_skip_ws(struct json_reader *r)
+{
+    while ((r->pos < r->end) && ((*r->pos == ' ') || (*r->pos == '\t') ||
+                                 (*r->pos == '\n') || (*r->pos == '\r'))) {
+        r->pos++;
+    }
+}
+
+/**
+ * Append bytes to the string buffer.
+ *
+ * @return          0 on success; -1 on OOM.
+ */
+static int json_reader_str_append(struct json_reader *r, const char *str, size_t len)
+{
+    size_t cap;
+    char *buf;
+
+    if (r->str_cap - r->str_len <= len) {
+        cap = r->str_cap ? r->str_cap : JSON_READER_INITIAL_STR_CAP;
+        while (cap - r->str_len <= len) {
+            cap *= 2;
+        }
+        buf = realloc(r->str, cap);
+        if (!buf) {
+            json_reader_fail(r, "out of memory");
+            return -1;
+        }
+        r->str = buf;
+        r->str_cap = cap;
+    }
+    memcpy(r->str + r->str_len, str, len);
+    r->str_len += len;
+    r->str[r->str_len] = '\0';
+    return 0;
+}
+
+static int hex_digit(char c)
+{
+    if ((c >= '0') && (c <= '9'))
+        return c - '0';
+    if ((c >= 'a') && (c <= 'f'))
+        return c - 'a' + 10;
+    if ((c >= 'A') && (c <= 'F'))
+        return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Read the four hex digits of a \u escape.
+ *
+ * @return          The code unit, or -1 on error.
+ */
+static int json_reader_read_hex4(struct json_reader *r)
+{
+    int i, d, val = 0;
+
+    if (r->end - r->pos < 4) {
+        return -1;
+    }
+    for (i = 0; i < 4; i++) {
+        d = hex_digit(r->pos[i]);
+        if (d < 0) {
+            return -1;
+        }
+        val = (val << 4) | d;
+    }
+    r->pos += 4;
+    return val;
+}
+
+/**
+ * Handle a \u escape, whose "\u" has already been consumed.
+ */
+static int json_reader_read_unicode(struct json_reader *r)
+{
+    char utf8[4];
+    int cp, lo;
+    size_t len;
+
+    cp = json_reader_read_hex4(r);
+    if (cp < 0) {
+        json_reader_fail(r, "invalid \\u escape");
+        return -1;
+    }
+    if ((cp >= 0xd800) && (cp <= 0xdbff)) {
+        if ((r->end - r->pos < 2) || (r->pos[0] != '\\') || (r->pos[1] != 'u')) {
+            json_reader_fail(r, "unpaired surrogate");
+            return -1;
+        }
+        r->pos += 2;
+        lo = json_reader_read_hex4(r);
+        if ((lo < 0xdc00) || (lo > 0xdfff)) {
+            json_reader_fail(r, "invalid surrogate pair");
+            return -1;
+        }
+        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+    } else if ((cp >= 0xdc00) && (cp <= 0xdfff)) {
+        json_reader_fail(r, "unpaired surrogate");
+        return -1;
+    } else if (cp == 0) {
+        json_reader_fail(r, "strings may not contain NULL characters");
+        return -1;
+    }
+    if (cp < 0x80) {
+        utf8[0] = cp;
+        len = 1;
+    } else if (cp < 0x800) {
+        utf8[0] = 0xc0 | (cp >> 6);
+        utf8[1] = 0x80 | (cp & 0x3f);
+        len = 2;
+    } else if (cp < 0x10000) {
+        utf8[0] = 0xe0 | (cp >> 12);
+        utf8[1] = 0x80 | ((cp >> 6) & 0x3f);
+        utf8[2] = 0x80 | (cp & 0x3f);
+        len = 3;
+    } else {
+        utf8[0] = 0xf0 | (cp >> 18);
+        utf8[1] = 0x80 | ((cp >> 12) & 0x3f);
+        utf8[2] = 0x80 | ((cp >> 6) & 0x3f);
+        utf8[3] = 0x80 | (cp & 0x3f);
+        len = 4;
+    }
+    return json_reader_str_append(r, utf8, len);
+}
+
+/**
+ * Read a string into the string buffer.  The opening quote has already been consumed.
+ *
+ * @return          0 on success; -1 on error.
+ */
+static int json_reader_read_string(struct json_reader *r)
+{
+    const char *run;
+    char c;
+
+    r->str_len = 0;
+    if (json_reader_str_append(r, "", 0) < 0) {
+        return -1;
+    }
+    run = r->pos;
+    while (1) {
+        if (r->pos >= r->end) {
+            json_reader_fail(r, "unterminated string");
+            return -1;
+        }
+        c = *r->pos;
+        if ((c != '"') && (c != '\\') && ((unsigned char)c >= 0x20)) {
+            r->pos++;
+            continue;
+        }
+        if (json_reader_str_append(r, run, r->pos - run) < 0) {
+            return -1;
+        }
+        if (c == '"') {
+            r->pos++;
+            return 0;
+        } else if (c != '\\') {
+            json_reader_fail(r, "unescaped control character in string");
+            return -1;
+        }
+        if (r->end - r->pos < 2) {
+            json_reader_fail(r, "unterminated string");
+            return -1;
+        }
+        c = r->pos[1];
+        r->pos += 2;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            break;
+        case 'b':
+            c = '\b';
+            break;
+        case 'f':
+            c = '\f';
+            break;
+        case 'n':
+            c = '\n';
+            break;
+        case 'r':
+            c = '\r';
+            break;
+        case 't':
+            c = '\t';
+            break;
+        case 'u':
+            if (json_reader_read_unicode(r) < 0) {
+                return -1;
+            }
+            run = r->pos;
+            continue;
+        default:
+            json_reader_fail(r, "invalid escape \\%c", c);
+            return -1;
+        }
+        if (json_reader_str_append(r, &c, 1) < 0) {
+            return -1;
+        }
+        run = r->pos;
+    }
+}
+
+static enum json_token json_reader_read_number(struct json_reader *r)
+{
+    char num[JSON_READER_MAX_NUMBER_LEN + 1];
+    const char *start = r->pos;
+    int is_double = 0;
+    size_t len;
+
+    if ((r->pos < r->end) && (*r->pos == '-'))
+        r->pos++;
+    if ((r->pos >= r->end) || (*r->pos < '0') || (*r->pos > '9'))
+        return json_reader_fail(r, "invalid number");
+    if (*r->pos == '0') {
+        r->pos++;
+    } else {
+        while ((r->pos < r->end) && (*r->pos >= '0') && (*r->pos <= '9'))
+            r->pos++;
+    }
+    if ((r->pos < r->end) && (*r->pos == '.')) {
+        is_double = 1;
+        r->pos++;
+        if ((r->pos >= r->end) || (*r->pos < '0') || (*r->pos > '9'))
+            return json_reader_fail(r, "invalid number");
+        while ((r->pos < r->end) && (*r->pos >= '0') && (*r->pos <= '9'))
+            r->pos++;
+    }
+    if ((r->pos < r->end) && ((*r->pos == 'e') || (*r->pos == 'E'))) {
+        is_double = 1;
+        r->pos++;
+        if ((r->pos < r->end) && ((*r->pos == '+') || (*r->pos == '-')))
+            r->pos++;
+        if ((r->pos >= r->end) || (*r->pos < '0') || (*r->pos > '9'))
+            return json_reader_fail(r, "invalid number");
+        while ((r->pos < r->end) && (*r->pos >= '0') && (*r->pos <= '9'))
+            r->pos++;
+    }
+    len = r->pos - start;
+    if (len > JSON_READER_MAX_NUMBER_LEN) {
+        return json_reader_fail(r, "number is too long");
+    }
+    memcpy(num, start, len);
+    num[len] = '\0';
+    errno = 0;
+    if (is_double) {
+        r->dbl = strtod(num, NULL);
+        return JSON_TOKEN_DOUBLE;
+    }
+    r->integer = strtoll(num, NULL, 10);
+    if (errno) {
+        return json_reader_fail(r, "integer out of range");
+    }
+    return JSON_TOKEN_INTEGER;
+}
+
+static enum json_token json_reader_read_literal(struct json_reader *r, const char *lit,
+                                                enum json_token token)
+{
+    size_t len = strlen(lit);
+
+    if (((size_t)(r->end - r->pos) < len) || (memcmp(r->pos, lit, len) != 0)) {
+        return json_reader_fail(r, "invalid literal");
+    }
+    r->pos += len;
+    return token;
+}
+
+/**
+ * Read a value, or the beginning of one.
+ */
+static enum json_token json_reader_read_value(struct json_reader *r)
+{
+    enum json_token token;
+    char c;
+
+    if (r->pos >= r->end) {
+        return json_reader_fail(r, "unexpected end of input");
+    }
+    c = *r->pos;
+    if ((c == '{') || (c == '[')) {
+        if (r->depth >= JSON_READER_MAX_DEPTH) {
+            return json_reader_fail(r, "nested too deeply");
+        }
+        r->stack[r->depth++] = c;
+        r->pos++;
+        r->need_comma = 0;
+        return (c == '{') ? JSON_TOKEN_BEGIN_OBJECT : JSON_TOKEN_BEGIN_ARRAY;
+    }
+    if (c == '"') {
+        r->pos++;
+        if (json_reader_read_string(r) < 0) {
+            return JSON_TOKEN_ERROR;
+        }
+        token = JSON_TOKEN_STRING;
+    } else if ((c == '-') || ((c >= '0') && (c <= '9'))) {
+        token = json_reader_read_number(r);
+    } else if (c == 't') {
+        r->integer = 1;
+        token = json_reader_read_literal(r, "true", JSON_TOKEN_BOOLEAN);
+    } else if (c == 'f') {
+        r->integer = 0;
+        token = json_reader_read_literal(r, "false", JSON_TOKEN_BOOLEAN);
+    } else if (c == 'n') {
+        token = json_reader_read_literal(r, "null", JSON_TOKEN_NULL);
+    } else {
+        return json_reader_fail(r, "unexpected character '%c'", c);
+    }
+    if (token == JSON_TOKEN_ERROR) {
+        return token;
+    }
+    r->need_comma = 1;
+    if (r->depth == 0) {
+        r->done = 1;
+    }
+    return token;
+}
+
+enum json_token json_reader_next(struct json_reader *r)
+{
+    char top, c;
+
+    if (r->error[0]) {
+        return JSON_TOKEN_ERROR;
+    }
+    json_reader_skip_ws(r);
+    if (r->done) {
+        if (r->pos < r->end) {
+            return json_reader_fail(r, "unexpected data after the end of the document");
+        }
+        return JSON_TOKEN_END;
+    }
+    if (r->after_key) {
+        if ((r->pos >= r->end) || (*r->pos != ':')) {
+            return json_reader_fail(r, "expected ':'");
+        }
+        r->pos++;
+        r->after_key = 0;
+        json_reader_skip_ws(r);
+        return json_reader_read_value(r);
+    }
+    if (r->depth == 0) {
+        return json_reader_read_value(r);
+    }
+    if (r->pos >= r->end) {
+        return json_reader_fail(r, "unexpected end of input");
+    }
+    top = r->stack[r->depth - 1];
+    c = *r->pos;
+    if ((c == '}') || (c == ']')) {
+        if ((c != ((top == '{') ? '}' : ']')) || r->after_comma) {
+            return json_reader_fail(r, "unexpected '%c'", c);
+        }
+        r->pos++;
+        r->depth--;
+        r->need_comma = 1;
+        if (r->depth == 0) {
+            r->done = 1;
+        }
+        return (c == '}') ? JSON_TOKEN_END_OBJECT : JSON_TOKEN_END_ARRAY;
+    }
+    if (r->need_comma) {
+        if (c != ',') {
+            return json_reader_fail(r, "expected ','");
+        }
+        r->pos++;
+        r->need_comma = 0;
+        r->after_comma = 1;
+        json_reader_skip_ws(r);
+        return json_reader_next(r);
+    }
+    r->after_comma = 0;
+    if (top == '[') {
+        return json_reader_read_value(r);
+    }
+    if (c != '"') {
+        return json_reader_fail(r, "expected an object key");
+    }
+    r->pos++;
+    if (json_reader_read_string(r) < 0) {
+        return JSON_TOKEN_ERROR;
+    }
+    r->after_key = 1;
+    return JSON_TOKEN_KEY;
+}
+
+int json_reader_skip(struct json_reader *r, enum json_token token)
+{
+    int depth;
+
+    if (token == JSON_TOKEN_ERROR) {
+        return -1;
+    }
+    if ((token != JSON_TOKEN_BEGIN_OBJECT) && (token != JSON_TOKEN_BEGIN_ARRAY)) {
+        return 0;
+    }
+    depth = r->depth - 1;
+    while (r->depth > depth) {
+        if (json_reader_next(r) == JSON_TOKEN_ERROR) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,188 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_JSON_READER_H
+#define KIBOSH_JSON_READER_H
+
+#include <stdint.h> // for int64_t
+#include <unistd.h> // for size_t
+
+/*
+ * A streaming JSON reader.
+ *
+ * Unlike json_parse, this does not build a tree of values.  Instead, the caller pulls one
+ * token at a time with json_reader_next.  The reader checks that the tokens form a valid
+ * JSON document as it goes.  Only the most recent string is kept in memory.
+ */
+
+/**
+ * The maximum nesting depth of arrays and objects.
+ */
+#define JSON_READER_MAX_DEPTH 64
+
+enum json_token {
+    /**
+     * The input was not valid JSON, or we ran out of memory.  See json_reader::error.
+     */
+    JSON_TOKEN_ERROR = 0,
+
+    /**
+     * The end of the document.
+     */
+    JSON_TOKEN_END,
+
+    JSON_TOKEN_BEGIN_OBJECT,
+    JSON_TOKEN_END_OBJECT,
+    JSON_TOKEN_BEGIN_ARRAY,
+    JSON_TOKEN_END_ARRAY,
+
+    /**
+     * An object key.  The key is in json_reader::str.  The next token is its value.
+     */
+    JSON_TOKEN_KEY,
+
+    /**
+     * A string value.  The value is in json_reader::str.
+     */
+    JSON_TOKEN_STRING,
+
+    /**
+     * A number without a fraction or exponent.  The value is in json_reader::integer.
+     */
+    JSON_TOKEN_INTEGER,
+
+    /**
+     * A number with a fraction or exponent.  The value is in json_reader::dbl.
+     */
+    JSON_TOKEN_DOUBLE,
+
+    /**
+     * true or false.  The value is in json_reader::integer.
+     */
+    JSON_TOKEN_BOOLEAN,
+
+    JSON_TOKEN_NULL,
+};
+
+struct json_reader {
+    /**
+     * The start of the input.
+     */
+    const char *start;
+
+    /**
+     * The current position in the input.
+     */
+    const char *pos;
+
+    /**
+     * The end of the input.
+     */
+    const char *end;
+
+    /**
+     * The most recent string or key, unescaped and NULL-terminated.  Strings containing
+     * NULL characters are rejected, so str_len is always equal to strlen(str).
+     */
+    char *str;
+    size_t str_len;
+    size_t str_cap;
+
+    /**
+     * The most recent integer or boolean.
+     */
+    int64_t integer;
+
+    /**
+     * The most recent double.
+     */
+    double dbl;
+
+    /**
+     * The number of arrays and objects which we are currently inside.
+     */
+    int depth;
+
+    /**
+     * For each level of nesting, '{' or '['.
+     */
+    char stack[JSON_READER_MAX_DEPTH];
+
+    /**
+     * Nonzero if the current array or object needs a comma before the next element.
+     */
+    int need_comma;
+
+    /**
+     * Nonzero if we just read a comma.
+     */
+    int after_comma;
+
+    /**
+     * Nonzero if we just read an object key, and need a colon and a value.
+     */
+    int after_key;
+
+    /**
+     * Nonzero once we have read the whole root value.
+     */
+    int done;
+
+    /**
+     * A description of the error, if json_reader_next returned JSON_TOKEN_ERROR.
+     */
+    char error[128];
+};
+
+/**
+ * Initialize a JSON reader.
+ *
+ * @param r         The reader.
+ * @param buf       The input.  This must stay valid while the reader is in use.
+ * @param len       The length of the input.
+ */
+void json_reader_init(struct json_reader *r, const char *buf, size_t len);
+
+/**
+ * Free the memory used by a JSON reader.
+ *
+ * @param r         The reader.
+ */
+void json_reader_free(struct json_reader *r);
+
+/**
+ * Read the next token.
+ *
+ * @param r         The reader.
+ *
+ * @return          The token.  Once JSON_TOKEN_ERROR or JSON_TOKEN_END has been returned,
+ *                  it will be returned again by every later call.
+ */
+enum json_token json_reader_next(struct json_reader *r);
+
+/**
+ * Skip a value, including everything inside it if it is an array or object.
+ *
+ * @param r         The reader.
+ * @param token     The first token of the value, which has already been read.
+ *
+ * @return          0 on success; -1 on error.
+ */
+int json_reader_skip(struct json_reader *r, enum json_token token);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,127 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "json_reader.h"
+#include "test.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EXPECT_TOKEN(r, expected) \
+    EXPECT_INT_EQ(expected, json_reader_next(r))
+
+static int test_json_reader_tokens(void)
+{
+    const char *str = " {\"a\" : [1, -2.5e1, true, false, null, \"x\\\"\\u00e9\\ud83d\\ude00\"], "
+                      "\"b\":{}, \"c\":[]} ";
+    struct json_reader r;
+
+    json_reader_init(&r, str, strlen(str));
+    EXPECT_TOKEN(&r, JSON_TOKEN_BEGIN_OBJECT);
+    EXPECT_TOKEN(&r, JSON_TOKEN_KEY);
+    EXPECT_STR_EQ("a", r.str);
+    EXPECT_TOKEN(&r, JSON_TOKEN_BEGIN_ARRAY);
+    EXPECT_TOKEN(&r, JSON_TOKEN_INTEGER);
+    EXPECT_INT_EQ(1, r.integer);
+    EXPECT_TOKEN(&r, JSON_TOKEN_DOUBLE);
+    EXPECT_INT_EQ(1, r.dbl == -25.0);
+    EXPECT_TOKEN(&r, JSON_TOKEN_BOOLEAN);
+    EXPECT_INT_EQ(1, r.integer);
+    EXPECT_TOKEN(&r, JSON_TOKEN_BOOLEAN);
+    EXPECT_INT_EQ(0, r.integer);
+    EXPECT_TOKEN(&r, JSON_TOKEN_NULL);
+    EXPECT_TOKEN(&r, JSON_TOKEN_STRING);
+    EXPECT_STR_EQ("x\"\xc3\xa9\xf0\x9f\x98\x80", r.str);
+    EXPECT_INT_EQ(strlen(r.str), r.str_len);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END_ARRAY);
+    EXPECT_TOKEN(&r, JSON_TOKEN_KEY);
+    EXPECT_STR_EQ("b", r.str);
+    EXPECT_TOKEN(&r, JSON_TOKEN_BEGIN_OBJECT);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END_OBJECT);
+    EXPECT_TOKEN(&r, JSON_TOKEN_KEY);
+    EXPECT_TOKEN(&r, JSON_TOKEN_BEGIN_ARRAY);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END_ARRAY);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END_OBJECT);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END);
+    json_reader_free(&r);
+    return 0;
+}
+
+static int test_json_reader_skip(void)
+{
+    const char *str = "{\"a\":{\"b\":[1, {\"c\":2}], \"d\":\"e\"}, \"f\":3}";
+    struct json_reader r;
+
+    json_reader_init(&r, str, strlen(str));
+    EXPECT_TOKEN(&r, JSON_TOKEN_BEGIN_OBJECT);
+    EXPECT_TOKEN(&r, JSON_TOKEN_KEY);
+    EXPECT_INT_ZERO(json_reader_skip(&r, json_reader_next(&r)));
+    EXPECT_TOKEN(&r, JSON_TOKEN_KEY);
+    EXPECT_STR_EQ("f", r.str);
+    EXPECT_TOKEN(&r, JSON_TOKEN_INTEGER);
+    EXPECT_INT_EQ(3, r.integer);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END_OBJECT);
+    EXPECT_TOKEN(&r, JSON_TOKEN_END);
+    json_reader_free(&r);
+    return 0;
+}
+
+static int expect_invalid(const char *str)
+{
+    struct json_reader r;
+    enum json_token token;
+
+    json_reader_init(&r, str, strlen(str));
+    do {
+        token = json_reader_next(&r);
+    } while ((token != JSON_TOKEN_END) && (token != JSON_TOKEN_ERROR));
+    EXPECT_INT_EQ(JSON_TOKEN_ERROR, token);
+    EXPECT_INT_NONZERO(r.error[0]);
+    json_reader_free(&r);
+    return 0;
+}
+
+static int test_json_reader_invalid(void)
+{
+    EXPECT_INT_ZERO(expect_invalid(""));
+    EXPECT_INT_ZERO(expect_invalid("{"));
+    EXPECT_INT_ZERO(expect_invalid("[1,]"));
+    EXPECT_INT_ZERO(expect_invalid("[1 2]"));
+    EXPECT_INT_ZERO(expect_invalid("{\"a\" 1}"));
+    EXPECT_INT_ZERO(expect_invalid("{1:2}"));
+    EXPECT_INT_ZERO(expect_invalid("[}"));
+    EXPECT_INT_ZERO(expect_invalid("{} {}"));
+    EXPECT_INT_ZERO(expect_invalid("[01]"));
+    EXPECT_INT_ZERO(expect_invalid("[\"\\u0000\"]"));
+    EXPECT_INT_ZERO(expect_invalid("[\"\\ud83d\"]"));
+    EXPECT_INT_ZERO(expect_invalid("[\"abc"));
+    EXPECT_INT_ZERO(expect_invalid("[tru]"));
+    EXPECT_INT_ZERO(expect_invalid("[99999999999999999999]"));
+    return 0;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_json_reader_tokens());
+    EXPECT_INT_ZERO(test_json_reader_skip());
+    EXPECT_INT_ZERO(test_json_reader_invalid());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,230 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "json_writer.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The initial size of the writer buffer.
+ */
+#define JSON_WRITER_INITIAL_CAP 256
+
+void json_writer_init(struct json_writer *w)
+{
+    w->buf = NULL;
+    w->len = 0;
+    w->cap = 0;
+    w->oom = 0;
+}
+
+/**
+ * Make sure that there is room for another len bytes, plus the NULL terminator.
+ *
+ * @return          0 on success; -1 on OOM.
+ */
+static int json_writer_reserve(struct json_writer *w, size_t len)
+{
+    size_t cap;
+    char *buf;
+
+    if (w->oom) {
+        return -1;
+    }
+    if (w->cap - w->len > len) {
+        return 0;
+    }
+    cap = w->cap ? w->cap : JSON_WRITER_INITIAL_CAP;
+    while (cap - w->len <= len) {
+        cap *= 2;
+    }
+    buf = realloc(w->buf, cap);
+    if (!buf) {
+        w->oom = 1;
+        return -1;
+    }
+    w->buf = buf;
+    w->cap = cap;
+    return 0;
+}
+
+void json_writer_raw(struct json_writer *w, const char *str, size_t len)
+{
+    if (json_writer_reserve(w, len) < 0) {
+        return;
+    }
+    memcpy(w->buf + w->len, str, len);
+    w->len += len;
+    w->buf[w->len] = '\0';
+}
+
+/**
+ * Write the characters in a string, escaping them as needed, but without quotes.
+ */
+static void json_writer_escaped(struct json_writer *w, const char *str)
+{
+    const char *run = str;
+    char esc[8];
+
+    for (; *str; str++) {
+        unsigned char c = *str;
+        if ((c >= 0x20) && (c != '"') && (c != '\\')) {
+            continue;
+        }
+        json_writer_raw(w, run, str - run);
+        switch (c) {
+        case '"':
+            json_writer_raw(w, "\\\"", 2);
+            break;
+        case '\\':
+            json_writer_raw(w, "\\\\", 2);
+            break;
+        case '\n':
+            json_writer_raw(w, "\\n", 2);
+            break;
+        case '\r':
+            json_writer_raw(w, "\\r", 2);
+            break;
+        case '\t':
+            json_writer_raw(w, "\\t", 2);
+            break;
+        default:
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            json_writer_raw(w, esc, 6);
+            break;
+        }
+        run = str + 1;
+    }
+    json_writer_raw(w, run, str - run);
+}
+
+/**
+ * Write the separator that goes before a value, and the key, if there is one.
+ */
+static void json_writer_key(struct json_writer *w, const char *key)
+{
+    if ((w->len > 0) && (w->buf[w->len - 1] != '{') && (w->buf[w->len - 1] != '[')) {
+        json_writer_raw(w, ", ", 2);
+    }
+    if (key) {
+        json_writer_raw(w, "\"", 1);
+        json_writer_escaped(w, key);
+        json_writer_raw(w, "\":", 2);
+    }
+}
+
+void json_writer_begin_object(struct json_writer *w, const char *key)
+{
+    json_writer_key(w, key);
+    json_writer_raw(w, "{", 1);
+}
+
+void json_writer_end_object(struct json_writer *w)
+{
+    json_writer_raw(w, "}", 1);
+}
+
+void json_writer_begin_array(struct json_writer *w, const char *key)
+{
+    json_writer_key(w, key);
+    json_writer_raw(w, "[", 1);
+}
+
+void json_writer_end_array(struct json_writer *w)
+{
+    json_writer_raw(w, "]", 1);
+}
+
+void json_writer_str(struct json_writer *w, const char *key, const char *val)
+{
+    json_writer_key(w, key);
+    json_writer_raw(w, "\"", 1);
+    json_writer_escaped(w, val);
+    json_writer_raw(w, "\"", 1);
+}
+
+void json_writer_int(struct json_writer *w, const char *key, int64_t val)
+{
+    char num[32];
+    int len;
+
+    json_writer_key(w, key);
+    len = snprintf(num, sizeof(num), "%" PRId64, val);
+    json_writer_raw(w, num, len);
+}
+
+void json_writer_uint(struct json_writer *w, const char *key, uint64_t val)
+{
+    char num[32];
+    int len;
+
+    json_writer_key(w, key);
+    len = snprintf(num, sizeof(num), "%" PRIu64, val);
+    json_writer_raw(w, num, len);
+}
+
+void json_writer_double(struct json_writer *w, const char *key, double val)
+{
+    char num[40];
+    int len, prec;
+
+    json_writer_key(w, key);
+    // Use as few digits as we can, but enough that the same value is read back.
+    for (prec = 6; ; prec++) {
+        len = snprintf(num, sizeof(num) - 2, "%.*g", prec, val);
+        if ((prec >= 17) || (strtod(num, NULL) == val)) {
+            break;
+        }
+    }
+    if (!strpbrk(num, ".eni")) {
+        // Without this, 1.0 would be written as 1, and read back as an integer.
+        num[len++] = '.';
+        num[len++] = '0';
+    }
+    json_writer_raw(w, num, len);
+}
+
+void json_writer_bool(struct json_writer *w, const char *key, int val)
+{
+    json_writer_key(w, key);
+    if (val) {
+        json_writer_raw(w, "true", 4);
+    } else {
+        json_writer_raw(w, "false", 5);
+    }
+}
+
+char *json_writer_finish(struct json_writer *w)
+{
+    char *buf;
+
+    if ((!w->oom) && (!w->buf)) {
+        json_writer_raw(w, "", 0);
+    }
+    if (w->oom) {
+        free(w->buf);
+        buf = NULL;
+    } else {
+        buf = w->buf;
+    }
+    json_writer_init(w);
+    return buf;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,157 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_JSON_WRITER_H
+#define KIBOSH_JSON_WRITER_H
+
+#include <stdint.h> // for int64_t, uint64_t
+#include <unistd.h> // for size_t
+
+/*
+ * A JSON writer which appends to a single growable buffer.
+ *
+ * Values are separated by ", " and keys are followed by ":", which matches the format
+ * that Kibosh has always used for the control file.  If an allocation fails, the writer
+ * remembers the failure and ignores everything else until json_writer_finish is called.
+ * This means that callers only need to check for errors once, at the end.
+ */
+struct json_writer {
+    /**
+     * The buffer.  Always NULL-terminated when non-NULL.
+     */
+    char *buf;
+
+    /**
+     * The number of bytes in the buffer, not including the NULL terminator.
+     */
+    size_t len;
+
+    /**
+     * The size of the buffer.
+     */
+    size_t cap;
+
+    /**
+     * Nonzero if an allocation failed.
+     */
+    int oom;
+};
+
+/**
+ * Initialize a JSON writer.
+ *
+ * @param w         The writer.
+ */
+void json_writer_init(struct json_writer *w);
+
+/**
+ * Append raw bytes to the writer, without any escaping or separators.
+ *
+ * @param w         The writer.
+ * @param str       The bytes to append.
+ * @param len       The number of bytes to append.
+ */
+void json_writer_raw(struct json_writer *w, const char *str, size_t len);
+
+/**
+ * Begin a JSON object.
+ *
+ * @param w         The writer.
+ * @param key       The key of the object, or NULL if it is an array element or the root.
+ */
+void json_writer_begin_object(struct json_writer *w, const char *key);
+
+/**
+ * End a JSON object.
+ *
+ * @param w         The writer.
+ */
+void json_writer_end_object(struct json_writer *w);
+
+/**
+ * Begin a JSON array.
+ *
+ * @param w         The writer.
+ * @param key       The key of the array, or NULL if it is an array element or the root.
+ */
+void json_writer_begin_array(struct json_writer *w, const char *key);
+
+/**
+ * End a JSON array.
+ *
+ * @param w         The writer.
+ */
+void json_writer_end_array(struct json_writer *w);
+
+/**
+ * Write a string value, escaping it as needed.
+ *
+ * @param w         The writer.
+ * @param key       The key, or NULL if this is an array element.
+ * @param val       The NULL-terminated string.
+ */
+void json_writer_str(struct json_writer *w, const char *key, const char *val);
+
+/**
+ * Write a signed integer value.
+ *
+ * @param w         The writer.
+ * @param key       The key, or NULL if this is an array element.
+ * @param val       The value.
+ */
+void json_writer_int(struct json_writer *w, const char *key, int64_t val);
+
+/**
+ * Write an unsigned integer value.
+ *
+ * @param w         The writer.
+ * @param key       The key, or NULL if this is an array element.
+ * @param val       The value.
+ */
+void json_writer_uint(struct json_writer *w, const char *key, uint64_t val);
+
+/**
+ * Write a floating point value.  The value always contains a decimal point or exponent,
+ * so that it is parsed back as a double rather than an integer.
+ *
+ * @param w         The writer.
+ * @param key       The key, or NULL if this is an array element.
+ * @param val       The value.
+ */
+void json_writer_double(struct json_writer *w, const char *key, double val);
+
+/**
+ * Write a boolean value.
+ *
+ * @param w         The writer.
+ * @param key       The key, or NULL if this is an array element.
+ * @param val       The value.  Any nonzero value is written as true.
+ */
+void json_writer_bool(struct json_writer *w, const char *key, int val);
+
+/**
+ * Finish writing and take ownership of the buffer.
+ *
+ * @param w         The writer.  It is reinitialized afterwards.
+ *
+ * @return          The dynamically allocated JSON string, or NULL if there was an
+ *                  allocation failure.
+ */
+char *json_writer_finish(struct json_writer *w);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,127 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "json.h"
+#include "json_writer.h"
+#include "test.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int test_json_writer_empty(void)
+{
+    struct json_writer w;
+    char *str;
+
+    json_writer_init(&w);
+    str = json_writer_finish(&w);
+    EXPECT_NONNULL(str);
+    EXPECT_STR_EQ("", str);
+    free(str);
+    return 0;
+}
+
+static int test_json_writer_values(void)
+{
+    struct json_writer w;
+    char *str;
+
+    json_writer_init(&w);
+    json_writer_begin_object(&w, NULL);
+    json_writer_str(&w, "a", "b");
+    json_writer_int(&w, "i", -123);
+    json_writer_uint(&w, "u", UINT64_MAX);
+    json_writer_double(&w, "d", 0.5);
+    json_writer_double(&w, "e", 1.0);
+    json_writer_double(&w, "p", 0.123456789);
+    json_writer_bool(&w, "t", 1);
+    json_writer_bool(&w, "f", 0);
+    json_writer_begin_array(&w, "arr");
+    json_writer_int(&w, NULL, 1);
+    json_writer_begin_object(&w, NULL);
+    json_writer_end_object(&w);
+    json_writer_begin_array(&w, NULL);
+    json_writer_end_array(&w);
+    json_writer_end_array(&w);
+    json_writer_end_object(&w);
+    str = json_writer_finish(&w);
+    EXPECT_NONNULL(str);
+    EXPECT_STR_EQ("{\"a\":\"b\", \"i\":-123, \"u\":18446744073709551615, \"d\":0.5, "
+                  "\"e\":1.0, \"p\":0.123456789, \"t\":true, \"f\":false, "
+                  "\"arr\":[1, {}, []]}", str);
+    free(str);
+    return 0;
+}
+
+static int test_json_writer_escape(void)
+{
+    const char *val = "quote\" backslash\\ newline\n tab\t bell\a end";
+    struct json_writer w;
+    json_value *root;
+    char *str;
+
+    json_writer_init(&w);
+    json_writer_begin_object(&w, NULL);
+    json_writer_str(&w, "k\"", val);
+    json_writer_end_object(&w);
+    str = json_writer_finish(&w);
+    EXPECT_NONNULL(str);
+    EXPECT_STR_EQ("{\"k\\\"\":\"quote\\\" backslash\\\\ newline\\n tab\\t "
+                  "bell\\u0007 end\"}", str);
+    root = json_parse(str, strlen(str));
+    EXPECT_NONNULL(root);
+    EXPECT_INT_EQ(json_object, root->type);
+    EXPECT_INT_EQ(1, root->u.object.length);
+    EXPECT_STR_EQ("k\"", root->u.object.values[0].name);
+    EXPECT_STR_EQ(val, root->u.object.values[0].value->u.string.ptr);
+    json_value_free(root);
+    free(str);
+    return 0;
+}
+
+static int test_json_writer_large(void)
+{
+    struct json_writer w;
+    char *str;
+    int i;
+
+    json_writer_init(&w);
+    json_writer_begin_array(&w, NULL);
+    for (i = 0; i < 100000; i++) {
+        json_writer_int(&w, NULL, i);
+    }
+    json_writer_end_array(&w);
+    str = json_writer_finish(&w);
+    EXPECT_NONNULL(str);
+    EXPECT_INT_EQ(w.len, 0);
+    EXPECT_INT_ZERO(strncmp("[0, 1, 2, ", str, 10));
+    EXPECT_INT_ZERO(strcmp(", 99999]", str + strlen(str) - 8));
+    free(str);
+    return 0;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_json_writer_empty());
+    EXPECT_INT_ZERO(test_json_writer_values());
+    EXPECT_INT_ZERO(test_json_writer_escape());
+    EXPECT_INT_ZERO(test_json_writer_large());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,633 @@
+/**
+ * Copyright 2017 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "conf.h"
+#include "fault.h"
+#include "file.h"
+#include "fs.h"
+#include "log.h"
+#include "loop.h"
+#include "util.h"
+
+#include <errno.h>
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <linux/fuse.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * A request waiting in a lane.
+ */
+struct kibosh_lane_req {
+    /**
+     * The next request in the queue, or NULL.
+     */
+    struct kibosh_lane_req *next;
+
+    /**
+     * The channel which the request arrived on.
+     */
+    struct fuse_chan *ch;
+
+    /**
+     * The size of the request data.
+     */
+    size_t size;
+
+    /**
+     * A copy of the raw request.
+     */
+    char data[0];
+};
+
+/**
+ * A bounded pool of threads with its own request queue.
+ */
+struct kibosh_lane {
+    /**
+     * The FUSE session.  Immutable.
+     */
+    struct fuse_session *se;
+
+    /**
+     * The number of threads in the lane.  Immutable.
+     */
+    int num_threads;
+
+    /**
+     * The lane threads.  Immutable.
+     */
+    pthread_t *threads;
+
+    /**
+     * The CPUs to run lane threads on, or NULL to run them anywhere.  Immutable.
+     */
+    const cpu_set_t *cpus;
+
+    /**
+     * The maximum number of queued requests.  Immutable.
+     */
+    int max_queue_len;
+
+    /**
+     * The lock which protects the fields below.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The condition variable which lane threads wait on.
+     */
+    pthread_cond_t cond;
+
+    /**
+     * The condition variable which submitters wait on while the queue is full.
+     */
+    pthread_cond_t space_cond;
+
+    /**
+     * The first queued request, or NULL if the queue is empty.
+     */
+    struct kibosh_lane_req *head;
+
+    /**
+     * The last queued request, or NULL if the queue is empty.
+     */
+    struct kibosh_lane_req *tail;
+
+    /**
+     * The number of queued requests, including those which are being copied in.
+     */
+    int queue_len;
+
+    /**
+     * Zero once the lane threads should exit.
+     */
+    int should_run;
+};
+
+/**
+ * A FUSE worker thread.
+ */
+struct kibosh_worker {
+    struct kibosh_worker *prev;
+    struct kibosh_worker *next;
+    pthread_t thread;
+    struct kibosh_loop *loop;
+    size_t bufsize;
+    char *buf;
+};
+
+struct kibosh_loop {
+    /**
+     * The FUSE session.
+     */
+    struct fuse_session *se;
+
+    /**
+     * The FUSE channel.
+     */
+    struct fuse_chan *ch;
+
+    /**
+     * The kibosh_fs.
+     */
+    struct kibosh_fs *fs;
+
+    /**
+     * The number of workers to start with and keep around when idle.
+     */
+    int min_threads;
+
+    /**
+     * The maximum number of workers, or 0 for no limit.
+     */
+    int max_threads;
+
+    /**
+     * The maximum number of idle workers above min_threads.
+     */
+    int max_idle_threads;
+
+    /**
+     * The CPUs to run workers on, or NULL to run them anywhere.
+     */
+    const cpu_set_t *cpus;
+
+    /**
+     * The lock which protects the worker list and counts.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The head of the circular list of workers.
+     */
+    struct kibosh_worker workers;
+
+    /**
+     * The number of workers.
+     */
+    int num_workers;
+
+    /**
+     * The number of workers which are waiting for a request.
+     */
+    int num_avail;
+
+    /**
+     * Posted by a worker when it notices that the session has exited.
+     */
+    sem_t finish;
+
+    /**
+     * Nonzero once the workers should exit.
+     */
+    int exit;
+
+    /**
+     * -1 if the loop hit an error; 0 otherwise.
+     */
+    int error;
+
+    /**
+     * The lane for requests which may hit a delay fault.
+     */
+    struct kibosh_lane delay;
+};
+
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg,
+                        const cpu_set_t *cpus)
+{
+    sigset_t oldset, newset;
+    pthread_attr_t attr;
+    int ret;
+
+    ret = pthread_attr_init(&attr);
+    if (ret) {
+        return ret;
+    }
+    if (cpus) {
+        ret = pthread_attr_setaffinity_np(&attr, sizeof(*cpus), cpus);
+        if (ret) {
+            pthread_attr_destroy(&attr);
+            return ret;
+        }
+    }
+    // Leave signal handling to the main thread, the same as fuse_loop_mt does.
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    ret = pthread_create(thread, &attr, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/////
+///// kibosh_lane
+/////
+static void *kibosh_lane_run(void *arg)
+{
+    struct kibosh_lane *lane = arg;
+    struct kibosh_lane_req *req;
+
+    pthread_mutex_lock(&lane->lock);
+    while (1) {
+        while (lane->should_run && !lane->head) {
+            pthread_cond_wait(&lane->cond, &lane->lock);
+        }
+        if (!lane->should_run) {
+            break;
+        }
+        req = lane->head;
+        lane->head = req->next;
+        if (!lane->head) {
+            lane->tail = NULL;
+        }
+        lane->queue_len--;
+        pthread_cond_signal(&lane->space_cond);
+        pthread_mutex_unlock(&lane->lock);
+        {
+            struct fuse_buf fbuf = { .mem = req->data, .size = req->size };
+            fuse_session_process_buf(lane->se, &fbuf, req->ch);
+        }
+        free(req);
+        pthread_mutex_lock(&lane->lock);
+    }
+    pthread_mutex_unlock(&lane->lock);
+    return NULL;
+}
+
+static void kibosh_lane_stop(struct kibosh_lane *lane)
+{
+    struct kibosh_lane_req *req;
+    int i;
+
+    if (!lane->threads) {
+        return;
+    }
+    pthread_mutex_lock(&lane->lock);
+    lane->should_run = 0;
+    pthread_cond_broadcast(&lane->cond);
+    pthread_cond_broadcast(&lane->space_cond);
+    pthread_mutex_unlock(&lane->lock);
+    for (i = 0; i < lane->num_threads; i++) {
+        pthread_join(lane->threads[i], NULL);
+    }
+    // The session is gone, so there is nobody to reply to.  Drop anything still queued.
+    while (lane->head) {
+        req = lane->head;
+        lane->head = req->next;
+        free(req);
+    }
+    lane->tail = NULL;
+    pthread_cond_destroy(&lane->space_cond);
+    pthread_cond_destroy(&lane->cond);
+    pthread_mutex_destroy(&lane->lock);
+    free(lane->threads);
+    lane->threads = NULL;
+}
+
+static int kibosh_lane_start(struct kibosh_lane *lane, struct fuse_session *se,
+                             int num_threads, int max_queue_len, const cpu_set_t *cpus)
+{
+    int i, ret;
+
+    lane->se = se;
+    lane->cpus = cpus;
+    lane->max_queue_len = max_queue_len;
+    lane->should_run = 1;
+    lane->threads = calloc(num_threads, sizeof(pthread_t));
+    if (!lane->threads) {
+        INFO("kibosh_lane_start: OOM\n");
+        return -ENOMEM;
+    }
+    pthread_mutex_init(&lane->lock, NULL);
+    pthread_cond_init(&lane->cond, NULL);
+    pthread_cond_init(&lane->space_cond, NULL);
+    for (i = 0; i < num_threads; i++) {
+        ret = start_thread(&lane->threads[i], kibosh_lane_run, lane, lane->cpus);
+        if (ret) {
+            INFO("kibosh_lane_start: failed to create thread: %s (%d)\n",
+                 safe_strerror(ret), ret);
+            kibosh_lane_stop(lane);
+            return -ret;
+        }
+        lane->num_threads++;
+    }
+    return 0;
+}
+
+/**
+ * Queue a request on a lane.  If the queue is full, wait for room.
+ *
+ * @param lane      The lane.
+ * @param fbuf      The request.  It will be copied.
+ * @param ch        The channel the request arrived on.
+ *
+ * @return          0 on success; -ESHUTDOWN if the lane is stopping; -ENOMEM on OOM.
+ */
+static int kibosh_lane_submit(struct kibosh_lane *lane, const struct fuse_buf *fbuf,
+                              struct fuse_chan *ch)
+{
+    struct kibosh_lane_req *req;
+
+    pthread_mutex_lock(&lane->lock);
+    while (lane->should_run && (lane->queue_len >= lane->max_queue_len)) {
+        pthread_cond_wait(&lane->space_cond, &lane->lock);
+    }
+    if (!lane->should_run) {
+        pthread_mutex_unlock(&lane->lock);
+        return -ESHUTDOWN;
+    }
+    lane->queue_len++;
+    pthread_mutex_unlock(&lane->lock);
+
+    req = malloc(sizeof(*req) + fbuf->size);
+    if (!req) {
+        pthread_mutex_lock(&lane->lock);
+        lane->queue_len--;
+        pthread_cond_signal(&lane->space_cond);
+        pthread_mutex_unlock(&lane->lock);
+        return -ENOMEM;
+    }
+    req->next = NULL;
+    req->ch = ch;
+    req->size = fbuf->size;
+    memcpy(req->data, fbuf->mem, fbuf->size);
+
+    pthread_mutex_lock(&lane->lock);
+    if (lane->tail) {
+        lane->tail->next = req;
+    } else {
+        lane->head = req;
+    }
+    lane->tail = req;
+    pthread_cond_signal(&lane->cond);
+    pthread_mutex_unlock(&lane->lock);
+    return 0;
+}
+
+/////
+///// kibosh_loop
+/////
+
+/**
+ * Check whether a request may hit a delay fault.
+ *
+ * @param loop      The loop.
+ * @param fbuf      The raw request.
+ *
+ * @return          1 if the request belongs in the delay lane; 0 otherwise.
+ */
+static int kibosh_loop_may_delay(struct kibosh_loop *loop, const struct fuse_buf *fbuf)
+{
+    const struct fuse_in_header *in = fbuf->mem;
+    const struct kibosh_file *file;
+    uint32_t op;
+    uint64_t fh;
+
+    if ((fbuf->flags & FUSE_BUF_IS_FD) || (fbuf->size < sizeof(*in))) {
+        return 0;
+    }
+    if (in->opcode == FUSE_READ) {
+        op = KIBOSH_OP_READ;
+    } else if (in->opcode == FUSE_WRITE) {
+        op = KIBOSH_OP_WRITE;
+    } else {
+        return 0;
+    }
+    // The file handle is the first field of both fuse_read_in and fuse_write_in, in every
+    // protocol version.  Our high-level callbacks get it back unchanged in info->fh.
+    if (fbuf->size < sizeof(*in) + sizeof(fh)) {
+        return 0;
+    }
+    memcpy(&fh, in + 1, sizeof(fh));
+    file = (const struct kibosh_file *)(uintptr_t)fh;
+    if (!file || file->type != KIBOSH_FILE_TYPE_NORMAL) {
+        return 0;
+    }
+    return kibosh_fs_may_delay(loop->fs, file->path, op);
+}
+
+static void kibosh_loop_dispatch(struct kibosh_loop *loop, const struct fuse_buf *fbuf,
+                                 struct fuse_chan *ch)
+{
+    int ret;
+
+    if (loop->delay.num_threads > 0 && kibosh_loop_may_delay(loop, fbuf)) {
+        // If the delay lane is backed up, this worker waits for room rather than sleeping
+        // through the delay itself.  Other workers keep receiving in the meantime, and once
+        // all of them are waiting, the kernel holds further requests back.
+        ret = kibosh_lane_submit(&loop->delay, fbuf, ch);
+        if (ret == 0) {
+            return;
+        }
+        DEBUG("kibosh_loop_dispatch: unable to queue on the delay lane: %s (%d); "
+              "processing request inline.\n", safe_strerror(-ret), -ret);
+    }
+    fuse_session_process_buf(loop->se, fbuf, ch);
+}
+
+static void kibosh_worker_unlink(struct kibosh_worker *w)
+{
+    w->prev->next = w->next;
+    w->next->prev = w->prev;
+}
+
+static void *kibosh_worker_run(void *arg);
+
+/**
+ * Start a new worker.  Must be called with the loop lock held.
+ */
+static int kibosh_worker_start(struct kibosh_loop *loop)
+{
+    struct kibosh_worker *w;
+    int ret;
+
+    w = calloc(1, sizeof(*w));
+    if (!w) {
+        INFO("kibosh_worker_start: OOM\n");
+        return -ENOMEM;
+    }
+    w->loop = loop;
+    w->bufsize = fuse_chan_bufsize(loop->ch);
+    w->buf = malloc(w->bufsize);
+    if (!w->buf) {
+        INFO("kibosh_worker_start: OOM\n");
+        free(w);
+        return -ENOMEM;
+    }
+    ret = start_thread(&w->thread, kibosh_worker_run, w, loop->cpus);
+    if (ret) {
+        INFO("kibosh_worker_start: failed to create thread: %s (%d)\n",
+             safe_strerror(ret), ret);
+        free(w->buf);
+        free(w);
+        return -ret;
+    }
+    w->prev = &loop->workers;
+    w->next = loop->workers.next;
+    w->next->prev = w;
+    loop->workers.next = w;
+    loop->num_workers++;
+    loop->num_avail++;
+    return 0;
+}
+
+static void *kibosh_worker_run(void *arg)
+{
+    struct kibosh_worker *w = arg;
+    struct kibosh_loop *loop = w->loop;
+
+    while (!fuse_session_exited(loop->se)) {
+        struct fuse_chan *ch = loop->ch;
+        struct fuse_buf fbuf = { .mem = w->buf, .size = w->bufsize };
+        int res;
+
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        res = fuse_session_receive_buf(loop->se, &fbuf, &ch);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        if (res == -EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            if (res < 0) {
+                fuse_session_exit(loop->se);
+                loop->error = -1;
+            }
+            break;
+        }
+
+        pthread_mutex_lock(&loop->lock);
+        if (loop->exit) {
+            pthread_mutex_unlock(&loop->lock);
+            return NULL;
+        }
+        loop->num_avail--;
+        if ((loop->num_avail == 0) &&
+                ((loop->max_threads == 0) || (loop->num_workers < loop->max_threads))) {
+            kibosh_worker_start(loop);
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        kibosh_loop_dispatch(loop, &fbuf, ch);
+
+        pthread_mutex_lock(&loop->lock);
+        loop->num_avail++;
+        if ((loop->num_avail > loop->max_idle_threads) &&
+                (loop->num_workers > loop->min_threads)) {
+            if (loop->exit) {
+                pthread_mutex_unlock(&loop->lock);
+                return NULL;
+            }
+            kibosh_worker_unlink(w);
+            loop->num_avail--;
+            loop->num_workers--;
+            pthread_mutex_unlock(&loop->lock);
+            pthread_detach(w->thread);
+            free(w->buf);
+            free(w);
+            return NULL;
+        }
+        pthread_mutex_unlock(&loop->lock);
+    }
+    sem_post(&loop->finish);
+    return NULL;
+}
+
+int kibosh_loop_run(struct fuse *fuse, struct kibosh_fs *fs, const struct kibosh_conf *conf)
+{
+    struct kibosh_loop loop;
+    struct kibosh_worker *w;
+    int i, ret;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.se = fuse_get_session(fuse);
+    loop.ch = fuse_session_next_chan(loop.se, NULL);
+    loop.fs = fs;
+    loop.min_threads = conf->min_threads;
+    loop.max_threads = conf->max_threads;
+    loop.max_idle_threads = conf->max_idle_threads;
+    if (CPU_COUNT(&conf->cpu_set) > 0) {
+        loop.cpus = &conf->cpu_set;
+    }
+    loop.workers.prev = &loop.workers;
+    loop.workers.next = &loop.workers;
+    pthread_mutex_init(&loop.lock, NULL);
+    sem_init(&loop.finish, 0, 0);
+
+    if (fuse_start_cleanup_thread(fuse)) {
+        INFO("kibosh_loop_run: failed to start the FUSE cleanup thread.\n");
+        loop.error = -1;
+        goto done;
+    }
+    if (conf->delay_threads > 0) {
+        ret = kibosh_lane_start(&loop.delay, loop.se, conf->delay_threads,
+                                conf->delay_queue_len, loop.cpus);
+        if (ret) {
+            loop.error = -1;
+            goto done_stop_cleanup;
+        }
+    }
+    pthread_mutex_lock(&loop.lock);
+    for (i = 0, ret = 0; (i < loop.min_threads) && (ret == 0); i++) {
+        ret = kibosh_worker_start(&loop);
+    }
+    pthread_mutex_unlock(&loop.lock);
+    if (ret) {
+        loop.error = -1;
+        fuse_session_exit(loop.se);
+        goto done_join_workers;
+    }
+    INFO("kibosh_loop_run: started %d worker thread(s), %d delay thread(s), and a delay "
+         "queue length of %d.\n", loop.min_threads, conf->delay_threads,
+         conf->delay_queue_len);
+
+    // Signals are handled on this thread.  They will interrupt sem_wait.
+    while (!fuse_session_exited(loop.se)) {
+        sem_wait(&loop.finish);
+    }
+
+done_join_workers:
+    pthread_mutex_lock(&loop.lock);
+    for (w = loop.workers.next; w != &loop.workers; w = w->next) {
+        pthread_cancel(w->thread);
+    }
+    loop.exit = 1;
+    pthread_mutex_unlock(&loop.lock);
+    while (loop.workers.next != &loop.workers) {
+        w = loop.workers.next;
+        pthread_join(w->thread, NULL);
+        kibosh_worker_unlink(w);
+        free(w->buf);
+        free(w);
+    }
+    kibosh_lane_stop(&loop.delay);
+done_stop_cleanup:
+    fuse_stop_cleanup_thread(fuse);
+done:
+    fuse_session_reset(loop.se);
+    sem_destroy(&loop.finish);
+    pthread_mutex_destroy(&loop.lock);
+    return loop.error;
+}
+
+// vim: ts=4:sw=4:tw=99:et
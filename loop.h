@@ -0,0 +1,49 @@
+/**
+ * Copyright 2017 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_LOOP_H
+#define KIBOSH_LOOP_H
+
+/*
+ * The Kibosh FUSE event loop.
+ *
+ * This is a replacement for fuse_loop_mt.  Like fuse_loop_mt, it runs a pool of worker
+ * threads which read requests from the FUSE channel and process them.  Unlike
+ * fuse_loop_mt, requests are classified as soon as they are received.  Reads and writes
+ * which may hit a delay fault are handed off to a separate, bounded pool of threads, the
+ * delay lane.  This keeps injected latency from starving the control file and I/O to
+ * files which are not faulted.
+ */
+
+struct fuse;
+struct kibosh_conf;
+struct kibosh_fs;
+
+/**
+ * Run the multi-threaded FUSE event loop until the filesystem is unmounted or the
+ * session is told to exit.
+ *
+ * @param fuse      The FUSE handle.
+ * @param fs        The kibosh_fs.
+ * @param conf      The configuration to use.
+ *
+ * @return          0 on success; -1 on error.
+ */
+int kibosh_loop_run(struct fuse *fuse, struct kibosh_fs *fs, const struct kibosh_conf *conf);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
@@ -15,9 +15,11 @@
  **/
 
 #include "conf.h"
+#include "control_socket.h"
 #include "file.h"
 #include "fs.h"
 #include "log.h"
+#include "loop.h"
 #include "meta.h"
 #include "signal.h"
 #include "time.h"
@@ -79,6 +81,27 @@ static void kibosh_usage(const char *argv0)
 "                            Defaults to 0600.\n"
 "    --random-seed <seed>    The seed for random generator.\n"
 "                            Defaults to current time.\n"
+"    --min-threads <n>       The number of worker threads to start with and to keep\n"
+"                            around when idle.  Defaults to 1.\n"
+"    --max-threads <n>       The maximum number of worker threads, not counting\n"
+"                            delay threads.  Defaults to 0 (unlimited).\n"
+"    --max-idle-threads <n>  The number of idle worker threads beyond --min-threads\n"
+"                            that are kept around.  Defaults to 10.\n"
+"    --cpus <list>           Run worker and delay threads only on the given CPUs,\n"
+"                            for example 0-3,8.\n"
+"    --delay-threads <n>     The number of threads which service reads and writes\n"
+"                            that may hit a delay fault.  0 services them on the\n"
+"                            regular worker threads.  Defaults to 0.  Splice reads\n"
+"                            are turned off when this is set.\n"
+"    --delay-queue-len <n>   The maximum number of requests waiting for a delay\n"
+"                            thread.  Defaults to 256.\n"
+"    --control-socket <path> Also accept fault changes on a unix domain socket at\n"
+"                            the given path.\n"
+"    --overlay-max-mb <n>    The maximum number of megabytes of unsynced writes\n"
+"                            which lost_write faults hold in memory.  Defaults\n"
+"                            to 256.\n"
+"    --stale-max-mb <n>      The maximum number of megabytes of old data which\n"
+"                            stale_read faults keep in memory.  Defaults to 64.\n"
 "    -v/--verbose            Turn on verbose logging.\n\n"
 "    -h/--help               This help text.\n\n"
 "    --fuse-help             Get help about possible FUSE options.\n"
@@ -109,8 +132,10 @@ static int kibosh_process_option(void *data UNUSED, const char *arg UNUSED,
 
 int main(int argc, char *argv[])
 {
-    int i, ret = EXIT_FAILURE;
+    int i, multithreaded, ret = EXIT_FAILURE;
     struct kibosh_fs *fs = NULL;
+    struct fuse *fuse = NULL;
+    char *mountpoint = NULL;
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct kibosh_conf *conf = NULL;
     FILE *log_file = NULL;
@@ -220,7 +245,23 @@ int main(int argc, char *argv[])
     srand48(conf->random_seed);
     INFO("kibosh_main: random seed is set to %ld.\n", conf->random_seed);
 
-    ret = fuse_main(args.argc, args.argv, &kibosh_oper, fs);
+    /*
+     * This is what fuse_main does, except that we run our own multi-threaded loop, which
+     * keeps delayed requests from tying up the threads that other requests need.
+     */
+    fuse = fuse_setup(args.argc, args.argv, &kibosh_oper, sizeof(kibosh_oper),
+                      &mountpoint, &multithreaded, fs);
+    if (!fuse) {
+        INFO("kibosh_main: fuse_setup failed.\n");
+        goto done;
+    }
+    if (multithreaded) {
+        ret = kibosh_loop_run(fuse, fs, conf);
+    } else {
+        ret = fuse_loop(fuse);
+    }
+    fuse_teardown(fuse, mountpoint);
+    ret = (ret == -1) ? EXIT_FAILURE : EXIT_SUCCESS;
 
 done:
     fuse_opt_free_args(&args);
@@ -241,13 +282,24 @@ static void *kibosh_init(struct fuse_conn_info *conn)
         FUSE_CAP_ATOMIC_O_TRUNC	|
         FUSE_CAP_BIG_WRITES	|
         FUSE_CAP_SPLICE_WRITE |
-        FUSE_CAP_SPLICE_MOVE |
-        FUSE_CAP_SPLICE_READ;
+        FUSE_CAP_SPLICE_MOVE;
+    // The delay lane needs to look at each request header when it arrives, which we
+    // can't do if the request is left sitting in a pipe.
+    if (!fs->delay_lane) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
     fs->drop_cache_thread = drop_cache_thread_start(DROP_CACHES_PATH, 1);
     if (!fs->drop_cache_thread) {
         INFO("kibosh_init: failed to create drop_cache_thread.  Exiting\n");
         abort();
     }
+    if (fs->control_socket_path) {
+        fs->control_socket_thread = control_socket_thread_start(fs->control_socket_path, fs);
+        if (!fs->control_socket_thread) {
+            INFO("kibosh_init: failed to create control_socket_thread.  Exiting\n");
+            abort();
+        }
+    }
     return fs;
 }
 
@@ -18,6 +18,7 @@
 #include "fs.h"
 #include "log.h"
 #include "meta.h"
+#include "overlay.h"
 #include "util.h"
 
 #include <ctype.h>
@@ -473,11 +474,14 @@ int kibosh_truncate(const char *path, off_t off)
 {
     struct kibosh_fs *fs = fuse_get_context()->private_data;
     char bpath[PATH_MAX];
+    struct stat st;
     int ret = 0;
 
     snprintf(bpath, sizeof(bpath), "%s%s", fs->root, path);
     if (truncate(bpath, off) < 0) {
         ret = -errno;
+    } else if (stat(bpath, &st) == 0) {
+        overlay_truncate(fs->overlay, st.st_dev, st.st_ino, off);
     }
     DEBUG("kibosh_truncate(path=%s, bpath=%s, off=%"PRId64") = %d (%s)\n",
           path, bpath, (int64_t)off, -ret, safe_strerror(-ret));
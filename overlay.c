@@ -0,0 +1,1136 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "json_reader.h"
+#include "log.h"
+#include "overlay.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * The number of buckets in the file hash table.  Must be a power of 2.
+ */
+#define OVERLAY_BUCKETS 1024
+
+/**
+ * The largest extent which we grow by appending to it.  Sequential writes are merged into
+ * extents of up to this size, so that a log being appended to does not turn into one
+ * extent per write.
+ */
+#define OVERLAY_EXTENT_MAX (1024 * 1024)
+
+/**
+ * The most that the flusher or a sync writes back at a time.  They hold the lock while they
+ * write, and drop it in between, so this bounds how long reads and writes of the overlay
+ * wait for them.  Writers
+ * which fill the overlay hand the writeback to the flusher for the same reason.
+ */
+#define OVERLAY_FLUSH_CHUNK (64 * 1024)
+
+/**
+ * A range of a file which is held in the overlay.
+ */
+struct overlay_extent {
+    /**
+     * The offset in the file.
+     */
+    off_t offset;
+
+    /**
+     * The number of bytes of data.
+     */
+    size_t len;
+
+    /**
+     * The number of bytes allocated for data.
+     */
+    size_t cap;
+
+    /**
+     * The data.
+     */
+    char *data;
+};
+
+/**
+ * A file which has data held in the overlay.
+ */
+struct overlay_file {
+    uint64_t dev;
+    uint64_t ino;
+
+    /**
+     * Our own writable file descriptor for the file.
+     */
+    int fd;
+
+    /**
+     * The size which the file has at least on the target.
+     */
+    off_t size;
+
+    /**
+     * The number of bytes of data held for this file.
+     */
+    uint64_t bytes;
+
+    /**
+     * Nonzero if the flusher writes this file back.  Otherwise, its data is held until
+     * the file is synced.
+     */
+    int write_back;
+
+    /**
+     * The rate at which the flusher writes this file back, in KiB per second.  This is set
+     * by the most recent write-back write to the file.
+     */
+    uint32_t kb_per_sec;
+
+    /**
+     * Nonzero if the overlay was full, so the flusher writes this file back right away,
+     * without waiting for its rate.
+     */
+    int spill;
+
+    /**
+     * The number of extents.
+     */
+    int num;
+
+    /**
+     * The number of extents which there is room for.
+     */
+    int cap;
+
+    /**
+     * The extents, sorted by offset.  Extents never overlap.
+     */
+    struct overlay_extent *ext;
+
+    /**
+     * The next file in the same hash bucket.
+     */
+    struct overlay_file *hash_next;
+
+    /**
+     * The neighbors of this file in the list of files, which is sorted by when the files
+     * started having data held.
+     */
+    struct overlay_file *prev;
+    struct overlay_file *next;
+};
+
+struct kibosh_overlay {
+    /**
+     * The lock which protects everything else.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The number of bytes of data held.  Only changed while holding the lock, but read
+     * without it to skip the lock when nothing is held.
+     */
+    uint64_t bytes;
+
+    /**
+     * The maximum number of bytes of data held.  Immutable.
+     */
+    uint64_t max_bytes;
+
+    /**
+     * The number of bytes of data held for files which the flusher writes back.
+     */
+    uint64_t write_back_bytes;
+
+    /**
+     * The number of writers waiting for the flusher to bring the write-back data under
+     * their dirty limit, or the data held under the maximum.
+     */
+    int waiters;
+
+    /**
+     * Signalled when there is new write-back data, and when the flusher should exit.
+     * Uses the monotonic clock.
+     */
+    pthread_cond_t flush_cond;
+
+    /**
+     * Signalled when data stops being held, for writers which are waiting.
+     */
+    pthread_cond_t drain_cond;
+
+    /**
+     * Nonzero if the flusher thread was started.
+     */
+    int flusher_started;
+
+    /**
+     * Nonzero until the flusher thread should exit.
+     */
+    int should_run;
+
+    /**
+     * The flusher thread.
+     */
+    pthread_t flusher;
+
+    /**
+     * The files which have data held, with the one which has been waiting the longest
+     * first.
+     */
+    struct overlay_file *oldest;
+    struct overlay_file *newest;
+
+    /**
+     * The file hash table.
+     */
+    struct overlay_file *buckets[OVERLAY_BUCKETS];
+
+    /**
+     * For each hash bucket, the number of times that held data of a file in the bucket was
+     * written back to the target and stopped being held.  Only changed while holding the
+     * lock, after the data was written but before it stops being held, and read without it
+     * by overlay_read_begin.
+     * These outlive the files, so that a reader notices even when the file was freed.
+     */
+    uint64_t gens[OVERLAY_BUCKETS];
+};
+
+static void overlay_bytes_add(struct kibosh_overlay *ov, struct overlay_file *of,
+                              int64_t delta)
+{
+    __atomic_store_n(&ov->bytes, ov->bytes + delta, __ATOMIC_RELEASE);
+    of->bytes += delta;
+    if (of->write_back) {
+        ov->write_back_bytes += delta;
+    }
+    if ((delta < 0) && (ov->waiters > 0)) {
+        pthread_cond_broadcast(&ov->drain_cond);
+    }
+}
+
+static int overlay_empty(const struct kibosh_overlay *ov)
+{
+    return __atomic_load_n(&ov->bytes, __ATOMIC_ACQUIRE) == 0;
+}
+
+static struct overlay_file **overlay_bucket(struct kibosh_overlay *ov, uint64_t dev,
+                                            uint64_t ino)
+{
+    return &ov->buckets[((dev * 31) + ino) & (OVERLAY_BUCKETS - 1)];
+}
+
+static uint64_t *overlay_gen(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino)
+{
+    return &ov->gens[((dev * 31) + ino) & (OVERLAY_BUCKETS - 1)];
+}
+
+/**
+ * Note that held data of a file was written back and is about to stop being held, so that
+ * readers which read the target before that look again.  Must be called with the lock held.
+ */
+static void overlay_gen_bump(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino)
+{
+    __atomic_add_fetch(overlay_gen(ov, dev, ino), 1, __ATOMIC_RELEASE);
+}
+
+static struct overlay_file *overlay_file_find(struct kibosh_overlay *ov, uint64_t dev,
+                                              uint64_t ino)
+{
+    struct overlay_file *of;
+
+    for (of = *overlay_bucket(ov, dev, ino); of; of = of->hash_next) {
+        if ((of->dev == dev) && (of->ino == ino)) {
+            return of;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Start holding data for a file.
+ *
+ * @param ov        The overlay.
+ * @param dev       The device of the file.
+ * @param ino       The inode of the file.
+ * @param fd        A writable file descriptor for the file, which we will duplicate.
+ * @param out       (out param) the new file.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int overlay_file_alloc(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino,
+                              int fd, struct overlay_file **out)
+{
+    struct overlay_file *of, **bucket;
+    struct stat st;
+    int ret;
+
+    of = calloc(1, sizeof(*of));
+    if (!of) {
+        return -ENOMEM;
+    }
+    of->dev = dev;
+    of->ino = ino;
+    of->fd = dup(fd);
+    if (of->fd < 0) {
+        ret = -errno;
+        free(of);
+        return ret;
+    }
+    if (fstat(of->fd, &st) < 0) {
+        ret = -errno;
+        close(of->fd);
+        free(of);
+        return ret;
+    }
+    of->size = st.st_size;
+    bucket = overlay_bucket(ov, dev, ino);
+    of->hash_next = *bucket;
+    *bucket = of;
+    of->prev = ov->newest;
+    if (ov->newest) {
+        ov->newest->next = of;
+    } else {
+        ov->oldest = of;
+    }
+    ov->newest = of;
+    *out = of;
+    return 0;
+}
+
+/**
+ * Stop holding data for a file, without freeing it.  Its data no longer counts towards
+ * the bytes held, and it can no longer be found.
+ */
+static void overlay_file_unlink(struct kibosh_overlay *ov, struct overlay_file *of)
+{
+    struct overlay_file **link;
+
+    for (link = overlay_bucket(ov, of->dev, of->ino); *link != of;
+            link = &(*link)->hash_next) {
+    }
+    *link = of->hash_next;
+    if (of->prev) {
+        of->prev->next = of->next;
+    } else {
+        ov->oldest = of->next;
+    }
+    if (of->next) {
+        of->next->prev = of->prev;
+    } else {
+        ov->newest = of->prev;
+    }
+    of->hash_next = NULL;
+    of->prev = NULL;
+    of->next = NULL;
+    overlay_bytes_add(ov, of, -(int64_t)of->bytes);
+}
+
+/**
+ * Free a file which has been unlinked.  Any data which it still has is thrown away.
+ */
+static void overlay_file_destroy(struct overlay_file *of)
+{
+    int i;
+
+    for (i = 0; i < of->num; i++) {
+        free(of->ext[i].data);
+    }
+    free(of->ext);
+    close(of->fd);
+    free(of);
+}
+
+/**
+ * Stop holding data for a file, and free it.  Any data which is still held is thrown
+ * away.
+ */
+static void overlay_file_free(struct kibosh_overlay *ov, struct overlay_file *of)
+{
+    overlay_file_unlink(ov, of);
+    overlay_file_destroy(of);
+}
+
+/**
+ * Find the first extent which ends after an offset.
+ *
+ * @return          The index of the extent, or of->num if there is none.
+ */
+static int overlay_extent_find(const struct overlay_file *of, off_t offset)
+{
+    int lo = 0, hi = of->num, mid;
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (of->ext[mid].offset + (off_t)of->ext[mid].len <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Make room for a new extent, and move the extents from idx onwards out of its way.
+ *
+ * @return          The new extent, or NULL on OOM.
+ */
+static struct overlay_extent *overlay_extent_insert(struct overlay_file *of, int idx)
+{
+    struct overlay_extent *ext;
+    int cap;
+
+    if (of->num == of->cap) {
+        cap = of->cap ? (of->cap * 2) : 4;
+        ext = realloc(of->ext, cap * sizeof(struct overlay_extent));
+        if (!ext) {
+            return NULL;
+        }
+        of->ext = ext;
+        of->cap = cap;
+    }
+    memmove(&of->ext[idx + 1], &of->ext[idx], (of->num - idx) * sizeof(struct overlay_extent));
+    of->num++;
+    memset(&of->ext[idx], 0, sizeof(struct overlay_extent));
+    return &of->ext[idx];
+}
+
+/**
+ * Forget the held data for a range of a file.
+ *
+ * @param ov        The overlay.
+ * @param of        The file.
+ * @param lo        The start of the range.
+ * @param hi        The end of the range, exclusive.
+ *
+ * @return          0 on success; -ENOMEM if an extent had to be split and we ran out of
+ *                  memory.  Nothing is changed on error.
+ */
+static int overlay_file_punch(struct kibosh_overlay *ov, struct overlay_file *of, off_t lo,
+                              off_t hi)
+{
+    struct overlay_extent *e, *tail;
+    char *data;
+    off_t end;
+    int i = overlay_extent_find(of, lo);
+
+    while ((i < of->num) && (of->ext[i].offset < hi)) {
+        e = &of->ext[i];
+        end = e->offset + e->len;
+        if (e->offset < lo) {
+            if (end > hi) {
+                // The range is in the middle of the extent, so split it in two.
+                data = malloc(end - hi);
+                if (!data) {
+                    return -ENOMEM;
+                }
+                memcpy(data, e->data + (hi - e->offset), end - hi);
+                tail = overlay_extent_insert(of, i + 1);
+                if (!tail) {
+                    free(data);
+                    return -ENOMEM;
+                }
+                e = &of->ext[i];
+                tail->offset = hi;
+                tail->len = end - hi;
+                tail->cap = end - hi;
+                tail->data = data;
+                overlay_bytes_add(ov, of, -(hi - lo));
+                e->len = lo - e->offset;
+                return 0;
+            }
+            overlay_bytes_add(ov, of, -(end - lo));
+            e->len = lo - e->offset;
+            i++;
+        } else if (end > hi) {
+            overlay_bytes_add(ov, of, -(hi - e->offset));
+            memmove(e->data, e->data + (hi - e->offset), end - hi);
+            e->len = end - hi;
+            e->offset = hi;
+            return 0;
+        } else {
+            overlay_bytes_add(ov, of, -(int64_t)e->len);
+            free(e->data);
+            memmove(e, e + 1, (of->num - i - 1) * sizeof(struct overlay_extent));
+            of->num--;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copy data out of an iovec array.
+ */
+static void overlay_copy_iov(char *dst, const struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+}
+
+/**
+ * Write a buffer to a file, continuing after short writes.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int overlay_pwrite_full(int fd, const char *buf, size_t len, off_t offset)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = pwrite(fd, buf, len, offset);
+        if (ret < 0) {
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+/**
+ * Write the data of a file which has been unlinked back to the target, and free it.
+ * This does not need the lock.
+ *
+ * @param of        The file.  This will be freed.
+ *
+ * @return          0 on success; the first error we hit otherwise.
+ */
+static int overlay_file_writeback(struct overlay_file *of)
+{
+    struct overlay_extent *e;
+    int i, ret, first = 0;
+
+    for (i = 0; i < of->num; i++) {
+        e = &of->ext[i];
+        ret = overlay_pwrite_full(of->fd, e->data, e->len, e->offset);
+        if ((ret < 0) && (first == 0)) {
+            INFO("%s: failed to write back %zd bytes at offset %" PRId64 " of inode %"
+                 PRIu64 ": error %d (%s)\n", __func__, e->len, (int64_t)e->offset,
+                 of->ino, -ret, safe_strerror(-ret));
+            first = ret;
+        }
+    }
+    overlay_file_destroy(of);
+    return first;
+}
+
+/**
+ * Write the start of a held extent of a file back to the target, and stop holding it.
+ * Must be called with the lock held.
+ *
+ * @param ov        The overlay.
+ * @param of        The file.  This is freed if nothing is held for it afterwards.
+ * @param idx       The index of the extent.
+ * @param len       (out param) the number of bytes which stopped being held.
+ *
+ * @return          0 on success; a negative error code if the data could not be written.
+ *                  It is no longer held either way.
+ */
+static int overlay_file_flush_chunk(struct kibosh_overlay *ov, struct overlay_file *of,
+                                    int idx, size_t *len)
+{
+    struct overlay_extent *e = &of->ext[idx];
+    int ret;
+
+    if (of->num == 0) {
+        // Everything which was held for this file was overwritten on the target.
+        *len = 0;
+        overlay_file_free(ov, of);
+        return 0;
+    }
+    *len = (e->len > OVERLAY_FLUSH_CHUNK) ? OVERLAY_FLUSH_CHUNK : e->len;
+    ret = overlay_pwrite_full(of->fd, e->data, *len, e->offset);
+    if (ret < 0) {
+        INFO("%s: failed to write back %zd bytes at offset %" PRId64 " of inode %" PRIu64
+             ": error %d (%s)\n", __func__, *len, (int64_t)e->offset, of->ino, -ret,
+             safe_strerror(-ret));
+    }
+    overlay_gen_bump(ov, of->dev, of->ino);
+    // Cutting off the start of an extent never splits it, so this cannot fail.
+    overlay_file_punch(ov, of, e->offset, e->offset + *len);
+    if (of->num == 0) {
+        overlay_file_free(ov, of);
+    }
+    return ret;
+}
+
+/**
+ * Make sure that a file is at least a given size on the target.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int overlay_file_extend(struct overlay_file *of, off_t size)
+{
+    struct stat st;
+
+    if (size <= of->size) {
+        return 0;
+    }
+    // The file may have grown through other writes since we last looked.
+    if (fstat(of->fd, &st) < 0) {
+        return -errno;
+    }
+    if ((st.st_size < size) && (ftruncate(of->fd, size) < 0)) {
+        return -errno;
+    }
+    of->size = (st.st_size > size) ? st.st_size : size;
+    return 0;
+}
+
+static uint64_t overlay_now_ns(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        abort();
+    }
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + ts.tv_nsec;
+}
+
+/**
+ * Find the file which the flusher should write back next.  Files are spilled oldest
+ * first, so a spilled file is always found before any file which is not.
+ */
+static struct overlay_file *overlay_next_write_back(struct kibosh_overlay *ov)
+{
+    struct overlay_file *of;
+
+    for (of = ov->oldest; of; of = of->next) {
+        if (of->write_back || of->spill) {
+            return of;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * The flusher thread.  It writes back the files which have been waiting the longest, a
+ * chunk at a time.  After each chunk, it waits for as long as the rate of the file which
+ * it came from allows.  Files which were spilled because the overlay was full are written
+ * back without waiting.
+ */
+static void *overlay_flusher_run(void *arg)
+{
+    struct kibosh_overlay *ov = (struct kibosh_overlay *)arg;
+    struct overlay_file *of;
+    struct timespec deadline;
+    uint64_t now, next = 0, interval;
+    uint32_t kb_per_sec;
+    size_t len;
+    int spill;
+
+    INFO("overlay_flusher: starting.\n");
+    pthread_mutex_lock(&ov->lock);
+    while (ov->should_run) {
+        of = overlay_next_write_back(ov);
+        if (!of) {
+            pthread_cond_wait(&ov->flush_cond, &ov->lock);
+            continue;
+        }
+        if (of->num == 0) {
+            // Everything which was held for this file was overwritten on the target.
+            overlay_file_free(ov, of);
+            continue;
+        }
+        now = overlay_now_ns();
+        if (!of->spill && (now < next)) {
+            // We check again after waking up, since the data may have been synced or
+            // thrown away in the meantime, or we may have been asked to exit.
+            deadline.tv_sec = next / 1000000000ULL;
+            deadline.tv_nsec = next % 1000000000ULL;
+            pthread_cond_timedwait(&ov->flush_cond, &ov->lock, &deadline);
+            continue;
+        }
+        spill = of->spill;
+        kb_per_sec = of->kb_per_sec;
+        overlay_file_flush_chunk(ov, of, 0, &len);
+        if (!spill) {
+            // After falling behind, we catch up by at most one chunk, so that an idle
+            // flusher does not write a burst.
+            interval = (len * 1000000000ULL) / ((uint64_t)kb_per_sec * 1024);
+            if (next + interval < now) {
+                next = now;
+            }
+            next += interval;
+        }
+    }
+    pthread_mutex_unlock(&ov->lock);
+    INFO("overlay_flusher: exiting.\n");
+    return NULL;
+}
+
+/**
+ * Start the flusher thread, if it is not running yet.  It is started on demand, since most
+ * users never need it.  Must be called with the lock held.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int overlay_flusher_start(struct kibosh_overlay *ov)
+{
+    int ret;
+
+    if (ov->flusher_started) {
+        return 0;
+    }
+    ret = pthread_create(&ov->flusher, NULL, overlay_flusher_run, ov);
+    if (ret) {
+        INFO("%s: failed to create the flusher thread: %s (%d)\n", __func__,
+             safe_strerror(ret), ret);
+        return -ret;
+    }
+    ov->flusher_started = 1;
+    return 0;
+}
+
+/**
+ * Hand the files which have been waiting the longest to the flusher, until the rest fit
+ * under the maximum, and wait for it to write them back.  Must be called with the lock
+ * held.
+ */
+static void overlay_spill(struct kibosh_overlay *ov)
+{
+    struct overlay_file *of;
+    uint64_t excess;
+    size_t len;
+
+    if (ov->bytes <= ov->max_bytes) {
+        return;
+    }
+    if (overlay_flusher_start(ov) < 0) {
+        // Without a flusher, write back the oldest files ourselves.
+        while ((ov->bytes > ov->max_bytes) && ov->oldest) {
+            overlay_file_flush_chunk(ov, ov->oldest, 0, &len);
+        }
+        return;
+    }
+    excess = ov->bytes - ov->max_bytes;
+    for (of = ov->oldest; of && (excess > 0); of = of->next) {
+        if (!of->spill) {
+            DEBUG("%s: the overlay is full, so writing back inode %" PRIu64 ".\n",
+                  __func__, of->ino);
+            of->spill = 1;
+        }
+        excess = (of->bytes < excess) ? (excess - of->bytes) : 0;
+    }
+    pthread_cond_signal(&ov->flush_cond);
+    while (ov->should_run && (ov->bytes > ov->max_bytes)) {
+        ov->waiters++;
+        pthread_cond_wait(&ov->drain_cond, &ov->lock);
+        ov->waiters--;
+    }
+}
+
+struct kibosh_overlay *overlay_alloc(uint64_t max_bytes)
+{
+    struct kibosh_overlay *ov;
+    pthread_condattr_t attr;
+
+    ov = calloc(1, sizeof(*ov));
+    if (!ov) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&ov->lock, NULL)) {
+        goto error_free;
+    }
+    if (pthread_condattr_init(&attr)) {
+        goto error_mutex_destroy;
+    }
+    if (pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+            pthread_cond_init(&ov->flush_cond, &attr)) {
+        pthread_condattr_destroy(&attr);
+        goto error_mutex_destroy;
+    }
+    pthread_condattr_destroy(&attr);
+    if (pthread_cond_init(&ov->drain_cond, NULL)) {
+        goto error_flush_cond_destroy;
+    }
+    ov->max_bytes = max_bytes;
+    ov->should_run = 1;
+    return ov;
+
+error_flush_cond_destroy:
+    pthread_cond_destroy(&ov->flush_cond);
+error_mutex_destroy:
+    pthread_mutex_destroy(&ov->lock);
+error_free:
+    free(ov);
+    return NULL;
+}
+
+void overlay_free(struct kibosh_overlay *ov)
+{
+    struct overlay_file *of;
+
+    if (!ov) {
+        return;
+    }
+    pthread_mutex_lock(&ov->lock);
+    ov->should_run = 0;
+    pthread_cond_broadcast(&ov->flush_cond);
+    pthread_cond_broadcast(&ov->drain_cond);
+    pthread_mutex_unlock(&ov->lock);
+    if (ov->flusher_started) {
+        pthread_join(ov->flusher, NULL);
+    }
+    while (ov->oldest) {
+        of = ov->oldest;
+        overlay_file_unlink(ov, of);
+        overlay_file_writeback(of);
+    }
+    pthread_cond_destroy(&ov->drain_cond);
+    pthread_cond_destroy(&ov->flush_cond);
+    pthread_mutex_destroy(&ov->lock);
+    free(ov);
+}
+
+uint64_t overlay_bytes(const struct kibosh_overlay *ov)
+{
+    return __atomic_load_n(&ov->bytes, __ATOMIC_RELAXED);
+}
+
+int overlay_write(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, int fd,
+                  const struct iovec *iov, int iovcnt, off_t offset, uint32_t kb_per_sec,
+                  uint64_t dirty_limit)
+{
+    struct overlay_file *of;
+    struct overlay_extent *e;
+    size_t len = 0, cap;
+    off_t end;
+    char *data;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    end = offset + len;
+    pthread_mutex_lock(&ov->lock);
+    of = overlay_file_find(ov, dev, ino);
+    if (!of) {
+        ret = overlay_file_alloc(ov, dev, ino, fd, &of);
+        if (ret < 0) {
+            goto done;
+        }
+    }
+    if (kb_per_sec) {
+        ret = overlay_flusher_start(ov);
+        if (ret < 0) {
+            goto done;
+        }
+        if (!of->write_back) {
+            of->write_back = 1;
+            ov->write_back_bytes += of->bytes;
+        }
+        of->kb_per_sec = kb_per_sec;
+        pthread_cond_signal(&ov->flush_cond);
+    }
+    ret = overlay_file_extend(of, end);
+    if (ret < 0) {
+        goto done;
+    }
+    i = overlay_extent_find(of, offset);
+    if ((i < of->num) && (of->ext[i].offset <= offset) &&
+            (of->ext[i].offset + (off_t)of->ext[i].len >= end)) {
+        // Rewriting data which is already held.
+        overlay_copy_iov(of->ext[i].data + (offset - of->ext[i].offset), iov, iovcnt);
+        ret = len;
+        goto done;
+    }
+    ret = overlay_file_punch(ov, of, offset, end);
+    if (ret < 0) {
+        goto done;
+    }
+    i = overlay_extent_find(of, offset);
+    e = (i > 0) ? &of->ext[i - 1] : NULL;
+    if (e && (e->offset + (off_t)e->len == offset) && (e->len + len <= OVERLAY_EXTENT_MAX)) {
+        // Appending to the extent before this write.
+        if (e->len + len > e->cap) {
+            cap = e->cap * 2;
+            if (cap < e->len + len) {
+                cap = e->len + len;
+            } else if (cap > OVERLAY_EXTENT_MAX) {
+                cap = OVERLAY_EXTENT_MAX;
+            }
+            data = realloc(e->data, cap);
+            if (!data) {
+                ret = -ENOMEM;
+                goto done;
+            }
+            e->data = data;
+            e->cap = cap;
+        }
+    } else {
+        data = malloc(len);
+        if (!data) {
+            ret = -ENOMEM;
+            goto done;
+        }
+        e = overlay_extent_insert(of, i);
+        if (!e) {
+            free(data);
+            ret = -ENOMEM;
+            goto done;
+        }
+        e->offset = offset;
+        e->cap = len;
+        e->data = data;
+    }
+    overlay_copy_iov(e->data + e->len, iov, iovcnt);
+    e->len += len;
+    overlay_bytes_add(ov, of, len);
+    ret = len;
+    // When the overlay is full, whole files are written back, starting with the one which
+    // has been waiting the longest.
+    overlay_spill(ov);
+    // Like balance_dirty_pages, writers wait for the flusher once too much is dirty.
+    while (dirty_limit && ov->should_run && (ov->write_back_bytes > dirty_limit)) {
+        ov->waiters++;
+        pthread_cond_wait(&ov->drain_cond, &ov->lock);
+        ov->waiters--;
+    }
+done:
+    pthread_mutex_unlock(&ov->lock);
+    return ret;
+}
+
+uint64_t overlay_read_begin(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino)
+{
+    return __atomic_load_n(overlay_gen(ov, dev, ino), __ATOMIC_ACQUIRE);
+}
+
+int overlay_read(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, uint64_t gen,
+                 char *buf, size_t len, off_t offset)
+{
+    struct overlay_file *of;
+    struct overlay_extent *e;
+    off_t lo, hi, end = offset + len;
+    int i, ret;
+
+    if (overlay_empty(ov)) {
+        return (overlay_read_begin(ov, dev, ino) == gen) ? 0 : -EAGAIN;
+    }
+    pthread_mutex_lock(&ov->lock);
+    of = overlay_file_find(ov, dev, ino);
+    if (of) {
+        for (i = overlay_extent_find(of, offset);
+                (i < of->num) && (of->ext[i].offset < end); i++) {
+            e = &of->ext[i];
+            lo = (e->offset > offset) ? e->offset : offset;
+            hi = e->offset + (off_t)e->len;
+            if (hi > end) {
+                hi = end;
+            }
+            memcpy(buf + (lo - offset), e->data + (lo - e->offset), hi - lo);
+        }
+    }
+    // If data was written back since the target was read, the caller may have read the
+    // target before the data got there, and we no longer hold it.
+    ret = (*overlay_gen(ov, dev, ino) == gen) ? 0 : -EAGAIN;
+    pthread_mutex_unlock(&ov->lock);
+    return ret;
+}
+
+int overlay_sync(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino)
+{
+    struct overlay_file *of;
+    off_t pos = 0, end = 0;
+    size_t len;
+    int i, ret = 0, err;
+
+    if (overlay_empty(ov)) {
+        return 0;
+    }
+    pthread_mutex_lock(&ov->lock);
+    of = overlay_file_find(ov, dev, ino);
+    if (of && (of->num > 0)) {
+        end = of->ext[of->num - 1].offset + (off_t)of->ext[of->num - 1].len;
+    }
+    // We drop the lock between chunks, so that syncing a file does not hold up reads and
+    // writes of every other file.  Whatever is written in the meantime below where we got
+    // to came after the sync started, so we do not have to write it back, and by stopping
+    // at the old end, we finish even while the file keeps being appended to.
+    while ((pos < end) && (of = overlay_file_find(ov, dev, ino))) {
+        i = overlay_extent_find(of, pos);
+        if (i == of->num) {
+            break;
+        }
+        pos = of->ext[i].offset;
+        err = overlay_file_flush_chunk(ov, of, i, &len);
+        if ((err < 0) && (ret == 0)) {
+            ret = err;
+        }
+        pos += len;
+        pthread_mutex_unlock(&ov->lock);
+        pthread_mutex_lock(&ov->lock);
+    }
+    pthread_mutex_unlock(&ov->lock);
+    return ret;
+}
+
+int overlay_discard(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, off_t offset,
+                    size_t len)
+{
+    struct overlay_file *of;
+    int ret = 0;
+
+    if (overlay_empty(ov)) {
+        return 0;
+    }
+    pthread_mutex_lock(&ov->lock);
+    of = overlay_file_find(ov, dev, ino);
+    if (of) {
+        ret = overlay_file_punch(ov, of, offset, offset + len);
+    }
+    pthread_mutex_unlock(&ov->lock);
+    return ret;
+}
+
+void overlay_truncate(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, off_t len)
+{
+    struct overlay_file *of;
+
+    if (overlay_empty(ov)) {
+        return;
+    }
+    pthread_mutex_lock(&ov->lock);
+    of = overlay_file_find(ov, dev, ino);
+    if (of) {
+        // Cutting off the end of the file never splits an extent, so this cannot fail.
+        overlay_file_punch(ov, of, len, INT64_MAX);
+        of->size = len;
+    }
+    pthread_mutex_unlock(&ov->lock);
+}
+
+int overlay_crash_parse(const char *str, size_t len, double *fraction)
+{
+    struct json_reader r;
+    enum json_token token;
+    int ret = -EIO;
+
+    *fraction = 1.0;
+    json_reader_init(&r, str, len);
+    if (json_reader_next(&r) != JSON_TOKEN_BEGIN_OBJECT) {
+        INFO("%s: the root of the control JSON was not an object.\n", __func__);
+        goto done;
+    }
+    while ((token = json_reader_next(&r)) == JSON_TOKEN_KEY) {
+        if (strcmp(r.str, "crash") != 0) {
+            if (json_reader_skip(&r, json_reader_next(&r)) < 0)
+                goto done;
+            continue;
+        }
+        if (json_reader_next(&r) != JSON_TOKEN_BEGIN_OBJECT) {
+            INFO("%s: \"crash\" was not an object.\n", __func__);
+            goto done;
+        }
+        while ((token = json_reader_next(&r)) == JSON_TOKEN_KEY) {
+            if (strcmp(r.str, "fraction") != 0) {
+                if (json_reader_skip(&r, json_reader_next(&r)) < 0)
+                    goto done;
+                continue;
+            }
+            token = json_reader_next(&r);
+            if (token == JSON_TOKEN_DOUBLE) {
+                *fraction = r.dbl;
+            } else if (token == JSON_TOKEN_INTEGER) {
+                *fraction = r.integer;
+            } else {
+                INFO("%s: \"fraction\" was not a number.\n", __func__);
+                goto done;
+            }
+            if ((*fraction < 0.0) || (*fraction > 1.0)) {
+                INFO("%s: \"fraction\" must be between 0.0 and 1.0.\n", __func__);
+                ret = -EINVAL;
+                goto done;
+            }
+        }
+        if (token != JSON_TOKEN_END_OBJECT)
+            goto done;
+    }
+    if ((token != JSON_TOKEN_END_OBJECT) || (json_reader_next(&r) != JSON_TOKEN_END)) {
+        goto done;
+    }
+    ret = 0;
+done:
+    if (r.error[0]) {
+        INFO("%s: failed to parse input string of length %zd: %s\n", __func__, len,
+             r.error);
+    }
+    json_reader_free(&r);
+    return ret;
+}
+
+struct overlay_file *overlay_crash(struct kibosh_overlay *ov, double fraction)
+{
+    struct overlay_file *of, *head = NULL, **tail = &head;
+    int files = 0, extents = 0, i, j, lost = 0;
+    uint64_t bytes;
+
+    pthread_mutex_lock(&ov->lock);
+    bytes = ov->bytes;
+    while (ov->oldest) {
+        of = ov->oldest;
+        overlay_file_unlink(ov, of);
+        files++;
+        extents += of->num;
+        for (i = 0, j = 0; i < of->num; i++) {
+            if ((fraction > 0) && (drand48() < fraction)) {
+                lost++;
+                free(of->ext[i].data);
+                continue;
+            }
+            of->ext[j++] = of->ext[i];
+        }
+        of->num = j;
+        *tail = of;
+        tail = &of->next;
+    }
+    pthread_mutex_unlock(&ov->lock);
+    INFO("%s: lost %d of %d unsynced extent(s) in %d file(s), holding %" PRIu64
+         " byte(s) in total.\n", __func__, lost, extents, files, bytes);
+    return head;
+}
+
+void overlay_crash_writeback(struct overlay_file *files)
+{
+    struct overlay_file *of;
+
+    while (files) {
+        of = files;
+        files = of->next;
+        overlay_file_writeback(of);
+    }
+}
+
+// vim: ts=4:sw=4:tw=99:et
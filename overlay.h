@@ -0,0 +1,209 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_OVERLAY_H
+#define KIBOSH_OVERLAY_H
+
+#include <stdint.h> // for uint64_t
+#include <sys/types.h> // for off_t
+#include <sys/uio.h> // for struct iovec
+
+/*
+ * The unsynced write overlay.
+ *
+ * Writes which hit a lost_write fault are not written to the target.  Instead, they are
+ * held here, in memory, until the file is synced.  Reads of the file see the held data, so
+ * the application cannot tell the difference, until a crash is requested:
+ *
+ *   {"crash":{"fraction":0.5}}
+ *
+ * A crash throws away each held extent with the given chance, which defaults to 1.0, and
+ * writes the rest to the target, as if the machine lost power with some of its page cache
+ * written back.  The writeback happens after the locks are released, so that the rest of
+ * the filesystem does not wait for it.  File sizes are changed on the target right away,
+ * so a file which was extended by lost writes has zeroes where the lost data was.
+ *
+ * The overlay holds at most a configured number of bytes.  When it is full, the file which
+ * has been waiting the longest is handed to the flusher thread, which writes it back to the
+ * target right away, like the kernel's own writeback of old dirty pages.  The writer waits
+ * for it, without holding the lock.
+ *
+ * Writes which hit a write_back fault are held in the same way, but a flusher thread also
+ * writes them back in the background, oldest file first, at the rate which the fault set
+ * for each file.  Writers which find more write-back data held than their dirty limit wait
+ * for the flusher, like Linux writers throttled in balance_dirty_pages.
+ */
+
+struct kibosh_overlay;
+struct overlay_file;
+
+/**
+ * Allocate a new overlay.
+ *
+ * @param max_bytes     The maximum number of bytes of data to hold.
+ *
+ * @return              The overlay, or NULL on OOM.
+ */
+struct kibosh_overlay *overlay_alloc(uint64_t max_bytes);
+
+/**
+ * Free an overlay.  The flusher thread is stopped, and any data which is still held is
+ * written back, as if every file had been synced.
+ *
+ * @param ov            The overlay.
+ */
+void overlay_free(struct kibosh_overlay *ov);
+
+/**
+ * Get the number of bytes of data held in the overlay.
+ *
+ * @param ov            The overlay.
+ *
+ * @return              The number of bytes.
+ */
+uint64_t overlay_bytes(const struct kibosh_overlay *ov);
+
+/**
+ * Hold a write in the overlay.
+ *
+ * If the write goes past the end of the file, the file is extended on the target.
+ *
+ * @param ov            The overlay.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ * @param fd            A writable file descriptor for the file.  The overlay keeps its own
+ *                      duplicate of the first one it is given, to write the data back.
+ * @param iov           The data to write.
+ * @param iovcnt        The number of iovecs.
+ * @param offset        The offset to write at.
+ * @param kb_per_sec    The rate at which the flusher should write the file back, in KiB
+ *                      per second, or 0 to hold the data until the file is synced.  This
+ *                      sets the rate for the whole file.
+ * @param dirty_limit   If nonzero, wait until no more than this many bytes of write-back
+ *                      data are held before returning.
+ *
+ * @return              The number of bytes held, or a negative error code.
+ */
+int overlay_write(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, int fd,
+                  const struct iovec *iov, int iovcnt, off_t offset, uint32_t kb_per_sec,
+                  uint64_t dirty_limit);
+
+/**
+ * Start reading a file from the target.  Held data may be written back to the target and
+ * stop being held while the target is read, so the result has to be passed to overlay_read.
+ *
+ * @param ov            The overlay.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ *
+ * @return              The generation to pass to overlay_read.
+ */
+uint64_t overlay_read_begin(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino);
+
+/**
+ * Copy any held data for a range of a file over data which was read from the target.
+ *
+ * @param ov            The overlay.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ * @param gen           What overlay_read_begin returned before the target was read.
+ * @param buf           The data which was read.
+ * @param len           The length of the data.
+ * @param offset        The offset it was read from.
+ *
+ * @return              0 on success; -EAGAIN if held data of the file was written back
+ *                      since overlay_read_begin, in which case the target has to be read
+ *                      again.
+ */
+int overlay_read(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, uint64_t gen,
+                 char *buf, size_t len, off_t offset);
+
+/**
+ * Write all of the held data for a file back to the target.  The caller still has to
+ * sync the file itself.  This is done a chunk at a time, so that reads and writes of other
+ * files go ahead in the meantime.  Data written to the file while this runs may still be
+ * held afterwards.
+ *
+ * @param ov            The overlay.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ *
+ * @return              0 on success; the first error we hit otherwise.  The data is no
+ *                      longer held either way.
+ */
+int overlay_sync(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino);
+
+/**
+ * Forget held data for a range of a file, because newer data has been written directly to
+ * the target.
+ *
+ * @param ov            The overlay.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ * @param offset        The start of the range.
+ * @param len           The length of the range.
+ *
+ * @return              0 on success; a negative error code otherwise.
+ */
+int overlay_discard(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, off_t offset,
+                    size_t len);
+
+/**
+ * Forget held data past the new end of a truncated file.
+ *
+ * @param ov            The overlay.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ * @param len           The new length of the file.
+ */
+void overlay_truncate(struct kibosh_overlay *ov, uint64_t dev, uint64_t ino, off_t len);
+
+/**
+ * Parse a crash request.
+ *
+ * @param str           The control JSON, {"crash":{...}}.
+ * @param len           The length of the control JSON.
+ * @param fraction      (out param) the chance that each held extent is lost.
+ *
+ * @return              0 on success; a negative error code otherwise.
+ */
+int overlay_crash_parse(const char *str, size_t len, double *fraction);
+
+/**
+ * Emulate a crash.  Each held extent is thrown away with the given chance, and the rest
+ * are detached from the overlay, to be written back to the target by
+ * overlay_crash_writeback.  Afterwards, nothing is held.
+ *
+ * This uses drand48, so the caller must hold the fault lock.
+ *
+ * @param ov            The overlay.
+ * @param fraction      The chance that each extent is lost, between 0.0 and 1.0.
+ *
+ * @return              The detached files, or NULL if nothing was held.
+ */
+struct overlay_file *overlay_crash(struct kibosh_overlay *ov, double fraction);
+
+/**
+ * Write the files which a crash detached back to the target, and free them.  This does
+ * not take any locks, so that the fault lock can be released before the writeback.
+ *
+ * @param files         The files returned by overlay_crash.
+ */
+void overlay_crash_writeback(struct overlay_file *files);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
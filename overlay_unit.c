@@ -0,0 +1,369 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "log.h"
+#include "overlay.h"
+#include "test.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Create a temporary file with the given contents.
+ *
+ * @param contents  The contents.
+ * @param st        (out param) the stat of the file.
+ *
+ * @return          A read-write file descriptor for the file, which has already been
+ *                  unlinked.
+ */
+static int make_file(const char *contents, struct stat *st)
+{
+    char path[4096];
+    char const *tmp = getenv("TMPDIR");
+    int fd;
+
+    if (!tmp)
+        tmp = "/dev/shm";
+    snprintf(path, sizeof(path), "%s/overlay_unit.%lld.%ld", tmp, (long long)getpid(),
+             lrand48());
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    die_if(fd < 0);
+    die_if(unlink(path) < 0);
+    die_unless(pwrite(fd, contents, strlen(contents), 0) == (ssize_t)strlen(contents));
+    die_if(fstat(fd, st) < 0);
+    return fd;
+}
+
+static int hold_back(struct kibosh_overlay *ov, int fd, const struct stat *st,
+                     const char *str, off_t offset, uint32_t kb_per_sec, uint64_t dirty_limit)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void *)str;
+    iov.iov_len = strlen(str);
+    return overlay_write(ov, st->st_dev, st->st_ino, fd, &iov, 1, offset, kb_per_sec,
+                         dirty_limit);
+}
+
+static int hold(struct kibosh_overlay *ov, int fd, const struct stat *st, const char *str,
+                off_t offset)
+{
+    return hold_back(ov, fd, st, str, offset, 0, 0);
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    die_if(clock_gettime(CLOCK_MONOTONIC, &ts) < 0);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+/**
+ * Wait for the overlay to hold no more than the given number of bytes.
+ */
+static void wait_for_bytes(struct kibosh_overlay *ov, uint64_t bytes)
+{
+    uint64_t deadline = now_ms() + 60000;
+
+    while (overlay_bytes(ov) > bytes) {
+        die_if(now_ms() > deadline);
+        usleep(1000);
+    }
+}
+
+/**
+ * Read a whole file as the application sees it.  Zeroes are shown as '.'.
+ */
+static const char *read_file(struct kibosh_overlay *ov, int fd, const struct stat *st,
+                             char *buf, size_t buf_len)
+{
+    ssize_t i, len;
+    uint64_t gen = 0;
+
+    memset(buf, 0, buf_len);
+    if (ov) {
+        gen = overlay_read_begin(ov, st->st_dev, st->st_ino);
+    }
+    len = pread(fd, buf, buf_len - 1, 0);
+    die_if(len < 0);
+    if (ov) {
+        die_unless(overlay_read(ov, st->st_dev, st->st_ino, gen, buf, len, 0) == 0);
+    }
+    for (i = 0; i < len; i++) {
+        if (buf[i] == '\0') {
+            buf[i] = '.';
+        }
+    }
+    return buf;
+}
+
+static int test_overlay_write_read(void)
+{
+    struct kibosh_overlay *ov;
+    struct stat st;
+    char buf[64];
+    uint64_t gen;
+    int fd;
+
+    ov = overlay_alloc(1024 * 1024);
+    EXPECT_NONNULL(ov);
+    fd = make_file("0123456789", &st);
+    EXPECT_INT_EQ(3, hold(ov, fd, &st, "abc", 2));
+    // Appending to held data and overwriting it.
+    EXPECT_INT_EQ(3, hold(ov, fd, &st, "def", 5));
+    EXPECT_INT_EQ(2, hold(ov, fd, &st, "XY", 4));
+    EXPECT_INT_EQ(1, hold(ov, fd, &st, "Z", 3));
+    EXPECT_INT_EQ(6, overlay_bytes(ov));
+    // Writing past the end of the file extends it on the target.
+    EXPECT_INT_EQ(2, hold(ov, fd, &st, "zz", 14));
+    EXPECT_INT_EQ(2, hold(ov, fd, &st, "yy", 12));
+    EXPECT_INT_EQ(10, overlay_bytes(ov));
+    EXPECT_STR_EQ("01aZXYef89..yyzz", read_file(ov, fd, &st, buf, sizeof(buf)));
+    EXPECT_STR_EQ("0123456789......", read_file(NULL, fd, &st, buf, sizeof(buf)));
+    // Data written directly to the target replaces what is held.
+    EXPECT_INT_ZERO(overlay_discard(ov, st.st_dev, st.st_ino, 4, 1));
+    EXPECT_INT_EQ(9, overlay_bytes(ov));
+    EXPECT_STR_EQ("01aZ4Yef89..yyzz", read_file(ov, fd, &st, buf, sizeof(buf)));
+    EXPECT_INT_ZERO(overlay_discard(ov, st.st_dev, st.st_ino, 0, 3));
+    EXPECT_STR_EQ("012Z4Yef89..yyzz", read_file(ov, fd, &st, buf, sizeof(buf)));
+    // A read of the target which raced with writing the held data back has to be retried.
+    gen = overlay_read_begin(ov, st.st_dev, st.st_ino);
+    EXPECT_INT_ZERO(overlay_sync(ov, st.st_dev, st.st_ino));
+    EXPECT_INT_ZERO(overlay_bytes(ov));
+    EXPECT_INT_EQ(-EAGAIN, overlay_read(ov, st.st_dev, st.st_ino, gen, buf, 10, 0));
+    EXPECT_STR_EQ("012Z4Yef89..yyzz", read_file(NULL, fd, &st, buf, sizeof(buf)));
+    EXPECT_INT_ZERO(overlay_sync(ov, st.st_dev, st.st_ino));
+    close(fd);
+    overlay_free(ov);
+    return 0;
+}
+
+static int test_overlay_truncate(void)
+{
+    struct kibosh_overlay *ov;
+    struct stat st;
+    char buf[64];
+    int fd;
+
+    ov = overlay_alloc(1024 * 1024);
+    EXPECT_NONNULL(ov);
+    fd = make_file("0123456789", &st);
+    EXPECT_INT_EQ(4, hold(ov, fd, &st, "abcd", 1));
+    EXPECT_INT_EQ(2, hold(ov, fd, &st, "ef", 7));
+    EXPECT_INT_ZERO(ftruncate(fd, 3));
+    overlay_truncate(ov, st.st_dev, st.st_ino, 3);
+    EXPECT_INT_EQ(2, overlay_bytes(ov));
+    EXPECT_STR_EQ("0ab", read_file(ov, fd, &st, buf, sizeof(buf)));
+    // A later write past the end extends the file again, with zeroes in between.
+    EXPECT_INT_EQ(1, hold(ov, fd, &st, "g", 5));
+    EXPECT_STR_EQ("0ab..g", read_file(ov, fd, &st, buf, sizeof(buf)));
+    // Freeing the overlay writes everything back.
+    overlay_free(ov);
+    EXPECT_STR_EQ("0ab..g", read_file(NULL, fd, &st, buf, sizeof(buf)));
+    close(fd);
+    return 0;
+}
+
+static int test_overlay_crash(void)
+{
+    struct kibosh_overlay *ov;
+    struct overlay_file *files;
+    struct stat st1, st2;
+    char buf[64];
+    int fd1, fd2;
+
+    ov = overlay_alloc(1024 * 1024);
+    EXPECT_NONNULL(ov);
+    fd1 = make_file("0123456789", &st1);
+    fd2 = make_file("abcdef", &st2);
+    EXPECT_INT_EQ(3, hold(ov, fd1, &st1, "xyz", 2));
+    EXPECT_INT_EQ(3, hold(ov, fd1, &st1, "XYZ", 11));
+    EXPECT_INT_EQ(2, hold(ov, fd2, &st2, "QR", 0));
+    overlay_crash_writeback(overlay_crash(ov, 1.0));
+    EXPECT_INT_ZERO(overlay_bytes(ov));
+    // The lost data is gone, but the file size was already changed.
+    EXPECT_STR_EQ("0123456789....", read_file(ov, fd1, &st1, buf, sizeof(buf)));
+    EXPECT_STR_EQ("abcdef", read_file(ov, fd2, &st2, buf, sizeof(buf)));
+    // Nothing is lost when the fraction is 0.
+    EXPECT_INT_EQ(3, hold(ov, fd1, &st1, "xyz", 2));
+    EXPECT_INT_EQ(2, hold(ov, fd2, &st2, "QR", 0));
+    files = overlay_crash(ov, 0.0);
+    // Nothing is held once the files are detached, but they are written back afterwards.
+    EXPECT_INT_ZERO(overlay_bytes(ov));
+    EXPECT_STR_EQ("0123456789....", read_file(NULL, fd1, &st1, buf, sizeof(buf)));
+    overlay_crash_writeback(files);
+    EXPECT_STR_EQ("01xyz56789....", read_file(NULL, fd1, &st1, buf, sizeof(buf)));
+    EXPECT_STR_EQ("QRcdef", read_file(NULL, fd2, &st2, buf, sizeof(buf)));
+    close(fd1);
+    close(fd2);
+    overlay_free(ov);
+    return 0;
+}
+
+static int test_overlay_spill(void)
+{
+    struct kibosh_overlay *ov;
+    struct stat st1, st2;
+    char buf[64];
+    int fd1, fd2;
+
+    ov = overlay_alloc(8);
+    EXPECT_NONNULL(ov);
+    fd1 = make_file("0123456789", &st1);
+    fd2 = make_file("abcdef", &st2);
+    EXPECT_INT_EQ(5, hold(ov, fd1, &st1, "vwxyz", 0));
+    EXPECT_INT_EQ(5, overlay_bytes(ov));
+    // The overlay is full, so the file which has waited the longest is written back.
+    EXPECT_INT_EQ(4, hold(ov, fd2, &st2, "QRST", 0));
+    EXPECT_INT_EQ(4, overlay_bytes(ov));
+    overlay_crash_writeback(overlay_crash(ov, 1.0));
+    EXPECT_STR_EQ("vwxyz56789", read_file(NULL, fd1, &st1, buf, sizeof(buf)));
+    EXPECT_STR_EQ("abcdef", read_file(NULL, fd2, &st2, buf, sizeof(buf)));
+    close(fd1);
+    close(fd2);
+    overlay_free(ov);
+    return 0;
+}
+
+static int test_overlay_sync_chunks(void)
+{
+    struct kibosh_overlay *ov;
+    struct stat st;
+    size_t i, len = 200 * 1024;
+    char *data, *buf;
+    int fd;
+
+    ov = overlay_alloc(1024 * 1024);
+    EXPECT_NONNULL(ov);
+    fd = make_file("0123456789", &st);
+    data = malloc(len + 1);
+    buf = malloc(len);
+    EXPECT_NONNULL(data);
+    EXPECT_NONNULL(buf);
+    for (i = 0; i < len; i++) {
+        data[i] = 'a' + (i % 26);
+    }
+    data[len] = '\0';
+    // More than one chunk is held, so the sync writes it back a chunk at a time.
+    EXPECT_INT_EQ((int)len, hold(ov, fd, &st, data, 5));
+    EXPECT_INT_EQ(2, hold(ov, fd, &st, "XY", len + 10));
+    EXPECT_INT_ZERO(overlay_sync(ov, st.st_dev, st.st_ino));
+    EXPECT_INT_ZERO(overlay_bytes(ov));
+    EXPECT_INT_EQ((int)len, pread(fd, buf, len, 5));
+    EXPECT_INT_ZERO(memcmp(data, buf, len));
+    EXPECT_INT_EQ(2, pread(fd, buf, len, len + 10));
+    EXPECT_INT_ZERO(memcmp("XY", buf, 2));
+    free(buf);
+    free(data);
+    close(fd);
+    overlay_free(ov);
+    return 0;
+}
+
+static int test_overlay_write_back(void)
+{
+    struct kibosh_overlay *ov;
+    struct stat st1, st2;
+    char buf[8192], data[1025];
+    uint64_t start;
+    int fd1, fd2;
+
+    ov = overlay_alloc(1024 * 1024);
+    EXPECT_NONNULL(ov);
+    fd1 = make_file("0123456789", &st1);
+    fd2 = make_file("abcdef", &st2);
+    // Write-back data is flushed in the background, but other held data is not.
+    EXPECT_INT_EQ(2, hold(ov, fd2, &st2, "QR", 0));
+    EXPECT_INT_EQ(3, hold_back(ov, fd1, &st1, "xyz", 2, 1024, 0));
+    wait_for_bytes(ov, 2);
+    EXPECT_STR_EQ("01xyz56789", read_file(NULL, fd1, &st1, buf, sizeof(buf)));
+    EXPECT_STR_EQ("abcdef", read_file(NULL, fd2, &st2, buf, sizeof(buf)));
+    EXPECT_INT_ZERO(overlay_sync(ov, st2.st_dev, st2.st_ino));
+
+    memset(data, 'w', sizeof(data) - 1);
+    data[sizeof(data) - 1] = '\0';
+
+    // Each file keeps its own rate, so a slow file held later does not slow down a fast
+    // one.
+    start = now_ms();
+    EXPECT_INT_EQ(1024, hold_back(ov, fd1, &st1, data, 0, 1024, 0));
+    EXPECT_INT_EQ(1024, hold_back(ov, fd1, &st1, data, 2048, 1024, 0));
+    EXPECT_INT_EQ(1024, hold_back(ov, fd1, &st1, data, 4096, 1024, 0));
+    EXPECT_INT_EQ(1024, hold_back(ov, fd2, &st2, data, 0, 10, 0));
+    wait_for_bytes(ov, 1024);
+    EXPECT_INT_GT(100, now_ms() - start);
+    EXPECT_INT_ZERO(overlay_sync(ov, st2.st_dev, st2.st_ino));
+
+    // The flusher keeps to its rate.  At 10 KiB per second, the last of three 1 KiB
+    // extents is written back 200 ms after the first.
+    start = now_ms();
+    EXPECT_INT_EQ(1024, hold_back(ov, fd1, &st1, data, 0, 10, 0));
+    EXPECT_INT_EQ(1024, hold_back(ov, fd1, &st1, data, 2048, 10, 0));
+    EXPECT_INT_EQ(1024, hold_back(ov, fd1, &st1, data, 4096, 10, 0));
+    wait_for_bytes(ov, 0);
+    EXPECT_INT_GE(now_ms() - start, 150);
+
+    // A writer over its dirty limit waits for the flusher.
+    EXPECT_INT_EQ(1024, hold_back(ov, fd2, &st2, data, 0, 1024, 1));
+    EXPECT_INT_ZERO(overlay_bytes(ov));
+    EXPECT_INT_EQ(1024, strspn(read_file(NULL, fd2, &st2, buf, sizeof(buf)), "w"));
+    close(fd1);
+    close(fd2);
+    overlay_free(ov);
+    return 0;
+}
+
+static int test_overlay_crash_parse(void)
+{
+    double fraction;
+
+#define CRASH_PARSE(str) overlay_crash_parse(str, strlen(str), &fraction)
+    EXPECT_INT_ZERO(CRASH_PARSE("{\"crash\":{}}"));
+    EXPECT_INT_EQ(1, fraction == 1.0);
+    EXPECT_INT_ZERO(CRASH_PARSE("{\"crash\":{\"fraction\":0.25}}"));
+    EXPECT_INT_EQ(1, fraction == 0.25);
+    EXPECT_INT_ZERO(CRASH_PARSE("{\"crash\":{\"fraction\":0}}"));
+    EXPECT_INT_EQ(1, fraction == 0.0);
+    EXPECT_INT_EQ(-EINVAL, CRASH_PARSE("{\"crash\":{\"fraction\":1.5}}"));
+    EXPECT_INT_EQ(-EIO, CRASH_PARSE("{\"crash\":{\"fraction\":\"all\"}}"));
+    EXPECT_INT_EQ(-EIO, CRASH_PARSE("{\"crash\":true}"));
+    EXPECT_INT_EQ(-EIO, CRASH_PARSE("{\"crash\":{}"));
+#undef CRASH_PARSE
+    return 0;
+}
+
+int main(void)
+{
+    kibosh_log_init(stdout, 0);
+    EXPECT_INT_ZERO(test_overlay_write_read());
+    EXPECT_INT_ZERO(test_overlay_truncate());
+    EXPECT_INT_ZERO(test_overlay_crash());
+    EXPECT_INT_ZERO(test_overlay_spill());
+    EXPECT_INT_ZERO(test_overlay_sync_chunks());
+    EXPECT_INT_ZERO(test_overlay_write_back());
+    EXPECT_INT_ZERO(test_overlay_crash_parse());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,684 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "log.h"
+#include "pattern.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The longest pattern source that we accept.
+ */
+#define PATTERN_MAX_SRC 1024
+
+/**
+ * The deepest nesting of groups that we accept.
+ */
+#define PATTERN_MAX_DEPTH 32
+
+/**
+ * A state of the NFA.  Each state has at most one edge on a set of bytes, and at most two
+ * epsilon edges.
+ */
+struct nfa_state {
+    /**
+     * The bytes which the set edge is taken on.
+     */
+    uint8_t set[32];
+
+    /**
+     * The target of the set edge, or -1 if there is none.
+     */
+    int set_out;
+
+    /**
+     * The targets of the epsilon edges, or -1.
+     */
+    int eps[2];
+};
+
+/**
+ * A piece of the NFA with one way in and one way out.  The end state has no edges yet.
+ */
+struct nfa_frag {
+    int start;
+    int end;
+};
+
+struct pattern_parser {
+    /**
+     * The type of pattern.
+     */
+    enum pattern_type type;
+
+    /**
+     * The pattern source.
+     */
+    const char *src;
+
+    /**
+     * The next character to parse.
+     */
+    const char *pos;
+
+    /**
+     * The number of groups which we are inside.
+     */
+    int depth;
+
+    /**
+     * The NFA states.
+     */
+    struct nfa_state *states;
+    int num_states;
+    int cap_states;
+};
+
+#define SET_HAS(set, b) ((set)[(b) >> 3] & (1 << ((b) & 7)))
+#define SET_ADD(set, b) ((set)[(b) >> 3] |= (1 << ((b) & 7)))
+
+static int nfa_new_state(struct pattern_parser *p)
+{
+    struct nfa_state *states;
+    int cap;
+
+    if (p->num_states == p->cap_states) {
+        cap = p->cap_states ? (p->cap_states * 2) : 64;
+        states = realloc(p->states, cap * sizeof(struct nfa_state));
+        if (!states) {
+            return -ENOMEM;
+        }
+        p->states = states;
+        p->cap_states = cap;
+    }
+    memset(&p->states[p->num_states], 0, sizeof(struct nfa_state));
+    p->states[p->num_states].set_out = -1;
+    p->states[p->num_states].eps[0] = -1;
+    p->states[p->num_states].eps[1] = -1;
+    return p->num_states++;
+}
+
+static void nfa_add_eps(struct pattern_parser *p, int from, int to)
+{
+    struct nfa_state *state = &p->states[from];
+
+    if (state->eps[0] < 0) {
+        state->eps[0] = to;
+    } else {
+        state->eps[1] = to;
+    }
+}
+
+/**
+ * Make a fragment which matches nothing at all, that is, the empty string.
+ */
+static int frag_empty(struct pattern_parser *p, struct nfa_frag *f)
+{
+    int s = nfa_new_state(p);
+
+    if (s < 0)
+        return s;
+    f->start = s;
+    f->end = s;
+    return 0;
+}
+
+/**
+ * Make a fragment which matches one byte in a set.
+ */
+static int frag_set(struct pattern_parser *p, const uint8_t *set, struct nfa_frag *f)
+{
+    int start, end;
+
+    start = nfa_new_state(p);
+    if (start < 0)
+        return start;
+    end = nfa_new_state(p);
+    if (end < 0)
+        return end;
+    memcpy(p->states[start].set, set, sizeof(p->states[start].set));
+    p->states[start].set_out = end;
+    f->start = start;
+    f->end = end;
+    return 0;
+}
+
+static int frag_byte(struct pattern_parser *p, uint8_t b, struct nfa_frag *f)
+{
+    uint8_t set[32];
+
+    memset(set, 0, sizeof(set));
+    SET_ADD(set, b);
+    return frag_set(p, set, f);
+}
+
+/**
+ * Make a fragment which matches any byte, except for '/' if slash is 0.
+ */
+static int frag_any(struct pattern_parser *p, int slash, struct nfa_frag *f)
+{
+    uint8_t set[32];
+
+    memset(set, 0xff, sizeof(set));
+    if (!slash) {
+        set['/' >> 3] &= ~(1 << ('/' & 7));
+    }
+    return frag_set(p, set, f);
+}
+
+static void frag_concat(struct pattern_parser *p, struct nfa_frag *f, const struct nfa_frag *g)
+{
+    nfa_add_eps(p, f->end, g->start);
+    f->end = g->end;
+}
+
+static int frag_alt(struct pattern_parser *p, struct nfa_frag *f, const struct nfa_frag *g)
+{
+    int start, end;
+
+    start = nfa_new_state(p);
+    if (start < 0)
+        return start;
+    end = nfa_new_state(p);
+    if (end < 0)
+        return end;
+    nfa_add_eps(p, start, f->start);
+    nfa_add_eps(p, start, g->start);
+    nfa_add_eps(p, f->end, end);
+    nfa_add_eps(p, g->end, end);
+    f->start = start;
+    f->end = end;
+    return 0;
+}
+
+/**
+ * Repeat a fragment.
+ *
+ * @param op        '*' for zero or more times, '+' for one or more times, or '?' for zero
+ *                  or one times.
+ */
+static int frag_repeat(struct pattern_parser *p, struct nfa_frag *f, char op)
+{
+    int start = f->start, end;
+
+    if (op != '+') {
+        start = nfa_new_state(p);
+        if (start < 0)
+            return start;
+    }
+    end = nfa_new_state(p);
+    if (end < 0)
+        return end;
+    if (op != '+') {
+        nfa_add_eps(p, start, f->start);
+        nfa_add_eps(p, start, end);
+    }
+    if (op != '?') {
+        nfa_add_eps(p, f->end, f->start);
+    }
+    nfa_add_eps(p, f->end, end);
+    f->start = start;
+    f->end = end;
+    return 0;
+}
+
+static int parse_error(struct pattern_parser *p, const char *what)
+{
+    INFO("%s: invalid %s \"%s\" at offset %d: %s\n", __func__,
+         pattern_type_name(p->type), p->src, (int)(p->pos - p->src), what);
+    return -EINVAL;
+}
+
+/**
+ * Parse a set of bytes.  The opening bracket has already been read.
+ */
+static int parse_set(struct pattern_parser *p, struct nfa_frag *f)
+{
+    uint8_t set[32];
+    int negate = 0, first = 1, lo, hi, b;
+    size_t i;
+
+    memset(set, 0, sizeof(set));
+    if ((*p->pos == '^') || ((p->type == PATTERN_TYPE_GLOB) && (*p->pos == '!'))) {
+        negate = 1;
+        p->pos++;
+    }
+    while (1) {
+        lo = (uint8_t)*p->pos;
+        if (!lo) {
+            return parse_error(p, "unterminated set");
+        }
+        p->pos++;
+        if ((lo == ']') && (!first)) {
+            break;
+        }
+        first = 0;
+        if (lo == '\\') {
+            lo = (uint8_t)*p->pos++;
+            if (!lo) {
+                return parse_error(p, "trailing backslash");
+            }
+        }
+        hi = lo;
+        if ((p->pos[0] == '-') && p->pos[1] && (p->pos[1] != ']')) {
+            p->pos++;
+            hi = (uint8_t)*p->pos++;
+            if (hi == '\\') {
+                hi = (uint8_t)*p->pos++;
+                if (!hi) {
+                    return parse_error(p, "trailing backslash");
+                }
+            }
+            if (hi < lo) {
+                return parse_error(p, "backwards range");
+            }
+        }
+        for (b = lo; b <= hi; b++) {
+            SET_ADD(set, b);
+        }
+    }
+    if (negate) {
+        for (i = 0; i < sizeof(set); i++) {
+            set[i] = ~set[i];
+        }
+    }
+    if (p->type == PATTERN_TYPE_GLOB) {
+        set['/' >> 3] &= ~(1 << ('/' & 7));
+    }
+    return frag_set(p, set, f);
+}
+
+static int parse_glob(struct pattern_parser *p, struct nfa_frag *f)
+{
+    struct nfa_frag g;
+    int ret, c;
+
+    ret = frag_empty(p, f);
+    while ((ret == 0) && (c = (uint8_t)*p->pos++)) {
+        switch (c) {
+        case '*':
+            if (*p->pos == '*') {
+                p->pos++;
+                ret = frag_any(p, 1, &g);
+            } else {
+                ret = frag_any(p, 0, &g);
+            }
+            if (ret == 0)
+                ret = frag_repeat(p, &g, '*');
+            break;
+        case '?':
+            ret = frag_any(p, 0, &g);
+            break;
+        case '[':
+            ret = parse_set(p, &g);
+            break;
+        case '\\':
+            c = (uint8_t)*p->pos++;
+            if (!c) {
+                return parse_error(p, "trailing backslash");
+            }
+            ret = frag_byte(p, c, &g);
+            break;
+        default:
+            ret = frag_byte(p, c, &g);
+            break;
+        }
+        if (ret == 0)
+            frag_concat(p, f, &g);
+    }
+    return ret;
+}
+
+static int parse_regex_alt(struct pattern_parser *p, struct nfa_frag *f);
+
+static int parse_regex_atom(struct pattern_parser *p, struct nfa_frag *f)
+{
+    int ret, c = (uint8_t)*p->pos++;
+
+    switch (c) {
+    case '(':
+        if (++p->depth > PATTERN_MAX_DEPTH) {
+            return parse_error(p, "groups are nested too deeply");
+        }
+        ret = parse_regex_alt(p, f);
+        if (ret)
+            return ret;
+        if (*p->pos != ')') {
+            return parse_error(p, "missing ')'");
+        }
+        p->pos++;
+        p->depth--;
+        return 0;
+    case '[':
+        return parse_set(p, f);
+    case '.':
+        return frag_any(p, 1, f);
+    case '*':
+    case '+':
+    case '?':
+        p->pos--;
+        return parse_error(p, "nothing to repeat");
+    case '\\':
+        c = (uint8_t)*p->pos++;
+        if (!c) {
+            return parse_error(p, "trailing backslash");
+        }
+        return frag_byte(p, c, f);
+    default:
+        return frag_byte(p, c, f);
+    }
+}
+
+static int parse_regex_concat(struct pattern_parser *p, struct nfa_frag *f)
+{
+    struct nfa_frag g;
+    int ret;
+
+    ret = frag_empty(p, f);
+    while ((ret == 0) && *p->pos && (*p->pos != '|') && (*p->pos != ')')) {
+        ret = parse_regex_atom(p, &g);
+        while ((ret == 0) && ((*p->pos == '*') || (*p->pos == '+') || (*p->pos == '?'))) {
+            ret = frag_repeat(p, &g, *p->pos++);
+        }
+        if (ret == 0)
+            frag_concat(p, f, &g);
+    }
+    return ret;
+}
+
+static int parse_regex_alt(struct pattern_parser *p, struct nfa_frag *f)
+{
+    struct nfa_frag g;
+    int ret;
+
+    ret = parse_regex_concat(p, f);
+    while ((ret == 0) && (*p->pos == '|')) {
+        p->pos++;
+        ret = parse_regex_concat(p, &g);
+        if (ret == 0)
+            ret = frag_alt(p, f, &g);
+    }
+    return ret;
+}
+
+/**
+ * Split the bytes into classes, so that two bytes are in the same class if every set edge
+ * of the NFA either has both of them or neither of them.
+ *
+ * @return          The number of classes.
+ */
+static int nfa_byte_classes(const struct pattern_parser *p, uint8_t *classes)
+{
+    int remap[512];
+    int i, b, num = 1, key;
+
+    memset(classes, 0, 256);
+    for (i = 0; i < p->num_states; i++) {
+        if (p->states[i].set_out < 0) {
+            continue;
+        }
+        memset(remap, 0xff, sizeof(remap));
+        num = 0;
+        for (b = 0; b < 256; b++) {
+            key = (classes[b] * 2) + (SET_HAS(p->states[i].set, b) ? 1 : 0);
+            if (remap[key] < 0) {
+                remap[key] = num++;
+            }
+            classes[b] = remap[key];
+        }
+    }
+    return num;
+}
+
+/**
+ * Add every state which can be reached through epsilon edges to a set of NFA states.
+ */
+static void nfa_closure(const struct pattern_parser *p, uint64_t *set, int *stack)
+{
+    int i, top = 0, s, e, t;
+
+    for (i = 0; i < p->num_states; i++) {
+        if (set[i / 64] & (1ULL << (i % 64))) {
+            stack[top++] = i;
+        }
+    }
+    while (top > 0) {
+        s = stack[--top];
+        for (e = 0; e < 2; e++) {
+            t = p->states[s].eps[e];
+            if ((t >= 0) && !(set[t / 64] & (1ULL << (t % 64)))) {
+                set[t / 64] |= (1ULL << (t % 64));
+                stack[top++] = t;
+            }
+        }
+    }
+}
+
+/**
+ * The DFA, while it is being built by subset construction.
+ */
+struct dfa_builder {
+    /**
+     * The number of uint64_t words in each set of NFA states.
+     */
+    int words;
+
+    /**
+     * The set of NFA states of each DFA state.
+     */
+    uint64_t *sets;
+
+    /**
+     * A hash table of DFA state indices, keyed by their sets.  -1 for empty slots.
+     */
+    int *table;
+
+    int num;
+    int cap;
+};
+
+#define DFA_TABLE_SIZE (2 * PATTERN_MAX_STATES)
+
+static uint32_t dfa_set_hash(const uint64_t *set, int words)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+
+    for (i = 0; i < words; i++) {
+        hash = (hash ^ set[i]) * 1099511628211ULL;
+    }
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+/**
+ * Find the DFA state for a set of NFA states, adding a new one if needed.
+ *
+ * @return          The index of the DFA state; -E2BIG or -ENOMEM on error.
+ */
+static int dfa_find_or_add(struct dfa_builder *d, const uint64_t *set)
+{
+    size_t set_size = d->words * sizeof(uint64_t);
+    uint32_t slot = dfa_set_hash(set, d->words) & (DFA_TABLE_SIZE - 1);
+    uint64_t *sets;
+    int idx, cap;
+
+    for (; (idx = d->table[slot]) >= 0; slot = (slot + 1) & (DFA_TABLE_SIZE - 1)) {
+        if (memcmp(d->sets + ((size_t)idx * d->words), set, set_size) == 0) {
+            return idx;
+        }
+    }
+    if (d->num >= PATTERN_MAX_STATES) {
+        return -E2BIG;
+    }
+    if (d->num == d->cap) {
+        cap = d->cap * 2;
+        sets = realloc(d->sets, cap * set_size);
+        if (!sets) {
+            return -ENOMEM;
+        }
+        d->sets = sets;
+        d->cap = cap;
+    }
+    memcpy(d->sets + ((size_t)d->num * d->words), set, set_size);
+    d->table[slot] = d->num;
+    return d->num++;
+}
+
+int pattern_compile(enum pattern_type type, const char *src, struct pattern **out)
+{
+    struct pattern_parser p;
+    struct dfa_builder d;
+    struct nfa_frag frag;
+    struct pattern *pattern = NULL;
+    uint8_t classes[256], *accept = NULL;
+    uint16_t *next = NULL;
+    uint64_t *set = NULL;
+    int *stack = NULL, reps[256];
+    int ret, num_classes, i, c, s, w, target;
+    size_t accept_len, size;
+
+    *out = NULL;
+    memset(&p, 0, sizeof(p));
+    memset(&d, 0, sizeof(d));
+    p.type = type;
+    p.src = src;
+    p.pos = src;
+    if (strlen(src) > PATTERN_MAX_SRC) {
+        INFO("%s: %s \"%.32s...\" is longer than %d bytes.\n", __func__,
+             pattern_type_name(type), src, PATTERN_MAX_SRC);
+        return -EINVAL;
+    }
+    if (type == PATTERN_TYPE_GLOB) {
+        ret = parse_glob(&p, &frag);
+    } else {
+        ret = parse_regex_alt(&p, &frag);
+        if ((ret == 0) && *p.pos) {
+            ret = parse_error(&p, "unmatched ')'");
+        }
+    }
+    if (ret)
+        goto done;
+    num_classes = nfa_byte_classes(&p, classes);
+    // Pick the lowest byte in each class to stand for the class.
+    for (i = 255; i >= 0; i--) {
+        reps[classes[i]] = i;
+    }
+    // Subset construction.  State 0 is the dead state, which has no NFA states.
+    d.words = (p.num_states + 63) / 64;
+    d.cap = 64;
+    d.sets = calloc(d.cap, d.words * sizeof(uint64_t));
+    d.table = malloc(DFA_TABLE_SIZE * sizeof(int));
+    set = calloc(d.words, sizeof(uint64_t));
+    stack = malloc(p.num_states * sizeof(int));
+    next = malloc(PATTERN_MAX_STATES * num_classes * sizeof(uint16_t));
+    accept = calloc(PATTERN_MAX_STATES, 1);
+    if ((!d.sets) || (!d.table) || (!set) || (!stack) || (!next) || (!accept)) {
+        ret = -ENOMEM;
+        goto done;
+    }
+    memset(d.table, 0xff, DFA_TABLE_SIZE * sizeof(int));
+    dfa_find_or_add(&d, set);
+    set[frag.start / 64] |= 1ULL << (frag.start % 64);
+    nfa_closure(&p, set, stack);
+    dfa_find_or_add(&d, set);
+    for (c = 0; c < num_classes; c++) {
+        next[c] = 0;
+    }
+    for (i = 1; i < d.num; i++) {
+        const uint64_t *cur;
+
+        for (c = 0; c < num_classes; c++) {
+            memset(set, 0, d.words * sizeof(uint64_t));
+            cur = d.sets + ((size_t)i * d.words);
+            for (w = 0; w < d.words; w++) {
+                uint64_t bits = cur[w];
+
+                while (bits) {
+                    s = (w * 64) + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    target = p.states[s].set_out;
+                    if ((target >= 0) && SET_HAS(p.states[s].set, reps[c])) {
+                        set[target / 64] |= 1ULL << (target % 64);
+                    }
+                }
+            }
+            nfa_closure(&p, set, stack);
+            ret = dfa_find_or_add(&d, set);
+            if (ret < 0) {
+                if (ret == -E2BIG) {
+                    INFO("%s: %s \"%s\" needs more than %d states.\n", __func__,
+                         pattern_type_name(type), src, PATTERN_MAX_STATES);
+                }
+                goto done;
+            }
+            next[(i * num_classes) + c] = ret;
+        }
+        cur = d.sets + ((size_t)i * d.words);
+        accept[i] = (cur[frag.end / 64] & (1ULL << (frag.end % 64))) ? 1 : 0;
+    }
+    accept_len = (d.num + 1) & ~1;
+    size = sizeof(struct pattern) + accept_len + (d.num * num_classes * sizeof(uint16_t));
+    pattern = calloc(1, size);
+    if (!pattern) {
+        ret = -ENOMEM;
+        goto done;
+    }
+    pattern->size = size;
+    pattern->num_states = d.num;
+    pattern->num_classes = num_classes;
+    memcpy(pattern->classes, classes, sizeof(classes));
+    memcpy(pattern->data, accept, d.num);
+    memcpy(pattern->data + accept_len, next, d.num * num_classes * sizeof(uint16_t));
+    *out = pattern;
+    ret = 0;
+
+done:
+    free(p.states);
+    free(d.sets);
+    free(d.table);
+    free(set);
+    free(stack);
+    free(next);
+    free(accept);
+    return ret;
+}
+
+int pattern_matches(const struct pattern *pattern, const char *str, size_t len)
+{
+    const uint8_t *accept = pattern->data;
+    const uint16_t *next = (const uint16_t *)
+        (pattern->data + ((pattern->num_states + 1) & ~1));
+    uint32_t state = 1, num_classes = pattern->num_classes;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        state = next[(state * num_classes) + pattern->classes[(uint8_t)str[i]]];
+        if (!state) {
+            return 0;
+        }
+    }
+    return accept[state];
+}
+
+const char *pattern_type_name(enum pattern_type type)
+{
+    return (type == PATTERN_TYPE_GLOB) ? "glob" : "regex";
+}
+
+// vim: ts=4:sw=4:tw=99:et
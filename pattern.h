@@ -0,0 +1,118 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_PATTERN_H
+#define KIBOSH_PATTERN_H
+
+#include <stdint.h> // for uint32_t
+#include <unistd.h> // for size_t
+
+/*
+ * Path patterns.
+ *
+ * A pattern is compiled into a DFA once, when the fault which uses it is parsed.  Matching
+ * a path is then a single scan over its bytes, with one table lookup per byte, no matter
+ * how complex the pattern is.  Patterns always match the whole path.
+ *
+ * Globs support:
+ *   *          Any run of bytes other than '/'.
+ *   **         Any run of bytes, including '/'.
+ *   ?          Any byte other than '/'.
+ *   [abc]      A byte in the set.  Ranges like [a-z] and negation with [!...] or [^...]
+ *              are supported.  Sets never match '/'.
+ *   \c         The byte c.
+ *
+ * Regular expressions support literals, '.', sets, escapes, grouping with (), alternation
+ * with |, and the *, +, and ? operators.
+ */
+
+enum pattern_type {
+    PATTERN_TYPE_GLOB = 1,
+    PATTERN_TYPE_REGEX = 2,
+};
+
+/**
+ * A compiled pattern.  The whole DFA lives in one block of memory, so it can be copied with
+ * memcpy.
+ */
+struct pattern {
+    /**
+     * The total size of the compiled pattern in bytes, including this header.
+     */
+    uint32_t size;
+
+    /**
+     * The number of DFA states.  State 0 is the dead state, and state 1 is the start
+     * state.
+     */
+    uint16_t num_states;
+
+    /**
+     * The number of byte classes.  Bytes in the same class are never told apart by the
+     * pattern, so they share a column of the transition table.
+     */
+    uint16_t num_classes;
+
+    /**
+     * The class of each byte.
+     */
+    uint8_t classes[256];
+
+    /**
+     * Nonzero for each state which accepts, rounded up to an even number of bytes, and
+     * then the transition table, num_states rows of num_classes uint16_t entries.
+     */
+    uint8_t data[0];
+};
+
+/**
+ * The most DFA states that a pattern may compile into.
+ */
+#define PATTERN_MAX_STATES 4096
+
+/**
+ * Compile a pattern.
+ *
+ * @param type      The type of pattern.
+ * @param src       The pattern source.
+ * @param out       (out param) the dynamically allocated compiled pattern.
+ *
+ * @return          0 on success; -EINVAL if the pattern is not valid; -E2BIG if it would
+ *                  need more than PATTERN_MAX_STATES states; -ENOMEM on OOM.
+ */
+int pattern_compile(enum pattern_type type, const char *src, struct pattern **out);
+
+/**
+ * Check whether a string matches a compiled pattern.
+ *
+ * @param pattern   The compiled pattern.
+ * @param str       The string.
+ * @param len       The length of the string.
+ *
+ * @return          1 if the whole string matches; 0 otherwise.
+ */
+int pattern_matches(const struct pattern *pattern, const char *str, size_t len);
+
+/**
+ * Get the name of a pattern type.
+ *
+ * @return          "glob" or "regex".
+ */
+const char *pattern_type_name(enum pattern_type type);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
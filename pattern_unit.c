@@ -0,0 +1,144 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "pattern.h"
+#include "test.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int matches(enum pattern_type type, const char *src, const char *str)
+{
+    struct pattern *pattern = NULL;
+    int ret;
+
+    ret = pattern_compile(type, src, &pattern);
+    if (ret) {
+        fprintf(stderr, "failed to compile %s \"%s\": %d\n",
+                pattern_type_name(type), src, ret);
+        return ret;
+    }
+    ret = pattern_matches(pattern, str, strlen(str));
+    free(pattern);
+    return ret;
+}
+
+static int test_glob(void)
+{
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "", ""));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "", "a"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/foo", "/foo"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/foo", "/foo/bar"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/foo", "/fo"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/*.log", "/a.log"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/*.log", "/.log"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/*.log", "/a/b.log"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/**.log", "/a/b.log"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/*/orders-*/0000*.index",
+                             "/data/orders-3/00000000000000001234.index"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/*/orders-*/0000*.index",
+                             "/data/orders-3/00000000000000001234.log"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/*/orders-*/0000*.index",
+                             "/data/x/orders-3/0000.index"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/file?", "/file1"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/file?", "/file"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/a?b", "/a/b"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/[a-c]x", "/bx"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/[a-c]x", "/dx"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/[!a-c]x", "/dx"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/[!a-c]x", "/ax"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/a[!b]c", "/a/c"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/[]]", "/]"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_GLOB, "/\\*", "/*"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_GLOB, "/\\*", "/a"));
+    return 0;
+}
+
+static int test_regex(void)
+{
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "", ""));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/foo", "/foo"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_REGEX, "/foo", "/foo/"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/a.c", "/abc"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/a.c", "/a/c"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/ab*c", "/ac"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/ab*c", "/abbbc"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_REGEX, "/ab+c", "/ac"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/ab+c", "/abc"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/ab?c", "/ac"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_REGEX, "/ab?c", "/abbc"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/(foo|bar)/[0-9]+\\.log",
+                             "/bar/123.log"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_REGEX, "/(foo|bar)/[0-9]+\\.log",
+                             "/baz/123.log"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_REGEX, "/(foo|bar)/[0-9]+\\.log",
+                             "/foo/12a.log"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "(a|)*b", "aab"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "/[^/]*", "/abc"));
+    EXPECT_INT_EQ(0, matches(PATTERN_TYPE_REGEX, "/[^/]*", "/a/c"));
+    EXPECT_INT_EQ(1, matches(PATTERN_TYPE_REGEX, "(x|y)|z", "z"));
+    return 0;
+}
+
+static int test_pattern_compile_invalid(void)
+{
+    static const char * const globs[] = { "[abc", "\\", "[b-a]", "[\\", NULL };
+    static const char * const regexes[] = { "(a", "a)", "*a", "a|+", "[", "\\",
+        "((((((((((((((((((((((((((((((((((a))))))))))))))))))))))))))))))))))", NULL };
+    struct pattern *pattern = NULL;
+    int i;
+
+    for (i = 0; globs[i]; i++) {
+        EXPECT_INT_EQ(-EINVAL, pattern_compile(PATTERN_TYPE_GLOB, globs[i], &pattern));
+        EXPECT_NULL(pattern);
+    }
+    for (i = 0; regexes[i]; i++) {
+        EXPECT_INT_EQ(-EINVAL, pattern_compile(PATTERN_TYPE_REGEX, regexes[i], &pattern));
+        EXPECT_NULL(pattern);
+    }
+    // (a|b)*a(a|b)^n needs 2^(n+1) states as a DFA.
+    EXPECT_INT_EQ(-E2BIG, pattern_compile(PATTERN_TYPE_REGEX,
+        "(a|b)*a(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)(a|b)", &pattern));
+    EXPECT_NULL(pattern);
+    return 0;
+}
+
+static int test_pattern_size(void)
+{
+    struct pattern *pattern = NULL;
+
+    EXPECT_INT_ZERO(pattern_compile(PATTERN_TYPE_GLOB, "/*/orders-*/0000*.index", &pattern));
+    // Bytes which the glob never tells apart share one class.
+    EXPECT_INT_LT(pattern->num_classes, 16);
+    EXPECT_INT_EQ(sizeof(struct pattern) + ((pattern->num_states + 1) & ~1) +
+                  (pattern->num_states * pattern->num_classes * sizeof(uint16_t)),
+                  pattern->size);
+    free(pattern);
+    return 0;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_glob());
+    EXPECT_INT_ZERO(test_regex());
+    EXPECT_INT_ZERO(test_pattern_compile_invalid());
+    EXPECT_INT_ZERO(test_pattern_size());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,430 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "fault.h"
+#include "json_reader.h"
+#include "log.h"
+#include "scenario.h"
+#include "time.h"
+#include "util.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct scenario_thread {
+    pthread_t pthread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    scenario_apply_fn_t apply;
+    void *arg;
+    int should_run;
+
+    /**
+     * Nonzero if a scenario has been submitted, but the thread has not picked it up yet.
+     */
+    int has_pending;
+
+    /**
+     * The scenario which has been submitted, or NULL to cancel the current one.
+     */
+    struct scenario *pending;
+
+    /**
+     * The time when the pending scenario was submitted.
+     */
+    struct timespec pending_start;
+};
+
+void scenario_free(struct scenario *scenario)
+{
+    int i;
+
+    if (!scenario)
+        return;
+    for (i = 0; i < scenario->num_steps; i++) {
+        free(scenario->steps[i].json);
+    }
+    free(scenario->steps);
+    free(scenario);
+}
+
+/**
+ * Parse one step of a scenario.  The step's opening brace has already been read.
+ *
+ * @param r         The reader.
+ * @param idx       The index of the step, for log messages.
+ * @param step      (out param) the step.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+static int scenario_parse_step(struct json_reader *r, int idx, struct scenario_step *step)
+{
+    enum json_token token;
+    const char *key = NULL, *val = NULL;
+    struct kibosh_faults *faults = NULL;
+    size_t val_len = 0, json_len;
+    int has_at = 0, compose = 0, ret;
+
+    while ((token = json_reader_next(r)) == JSON_TOKEN_KEY) {
+        if (strcmp(r->str, "at_ms") == 0) {
+            token = json_reader_next(r);
+            if ((token != JSON_TOKEN_INTEGER) || (r->integer < 0)) {
+                INFO("%s: \"at_ms\" of step %d was not a non-negative integer.\n",
+                     __func__, idx);
+                return -EIO;
+            }
+            step->at_ms = r->integer;
+            has_at = 1;
+        } else if (strcmp(r->str, "compose") == 0) {
+            if (json_reader_next(r) != JSON_TOKEN_BOOLEAN) {
+                INFO("%s: \"compose\" of step %d was not a boolean.\n", __func__, idx);
+                return -EIO;
+            }
+            compose = (r->integer != 0);
+        } else if ((strcmp(r->str, "faults") == 0) || (strcmp(r->str, "ops") == 0)) {
+            if (key) {
+                INFO("%s: step %d has more than one of \"faults\" and \"ops\".\n",
+                     __func__, idx);
+                return -EIO;
+            }
+            key = (r->str[0] == 'f') ? "faults" : "ops";
+            token = json_reader_next(r);
+            if (token != JSON_TOKEN_BEGIN_ARRAY) {
+                INFO("%s: \"%s\" of step %d was not an array.\n", __func__, key, idx);
+                return -EIO;
+            }
+            // The reader is just past the opening bracket.  We copy the array verbatim,
+            // rather than rebuilding it token by token.
+            val = r->pos - 1;
+            if (json_reader_skip(r, token) < 0) {
+                return -EIO;
+            }
+            val_len = r->pos - val;
+        } else if (json_reader_skip(r, json_reader_next(r)) < 0) {
+            return -EIO;
+        }
+    }
+    if (token != JSON_TOKEN_END_OBJECT) {
+        return -EIO;
+    }
+    if ((!has_at) || (!key)) {
+        INFO("%s: step %d must have \"at_ms\", and either \"faults\" or \"ops\".\n",
+             __func__, idx);
+        return -EIO;
+    }
+    if (compose && (key[0] != 'f')) {
+        INFO("%s: step %d sets \"compose\", but does not have \"faults\".\n",
+             __func__, idx);
+        return -EIO;
+    }
+    json_len = strlen(key) + val_len + 6 + (compose ? 16 : 0);
+    step->json = malloc(json_len);
+    if (!step->json) {
+        return -ENOMEM;
+    }
+    snprintf(step->json, json_len, "{\"%s\":%.*s%s}", key, (int)val_len, val,
+             compose ? ", \"compose\":true" : "");
+    if (key[0] == 'f') {
+        ret = faults_parse(step->json, &faults);
+        if (ret < 0) {
+            INFO("%s: the faults of step %d are not valid: error %d (%s)\n",
+                 __func__, idx, -ret, safe_strerror(-ret));
+            return ret;
+        }
+        faults_free(faults);
+    }
+    return 0;
+}
+
+/**
+ * Parse the steps array of a scenario.  The opening bracket has already been read.
+ */
+static int scenario_parse_steps(struct json_reader *r, struct scenario *scenario)
+{
+    enum json_token token;
+    struct scenario_step *steps, step;
+    int cap = 0, ret, i, j;
+
+    while ((token = json_reader_next(r)) == JSON_TOKEN_BEGIN_OBJECT) {
+        if (scenario->num_steps == cap) {
+            cap = cap ? (cap * 2) : 8;
+            steps = realloc(scenario->steps, cap * sizeof(struct scenario_step));
+            if (!steps) {
+                return -ENOMEM;
+            }
+            scenario->steps = steps;
+        }
+        memset(&step, 0, sizeof(step));
+        ret = scenario_parse_step(r, scenario->num_steps, &step);
+        if (ret < 0) {
+            free(step.json);
+            return ret;
+        }
+        // Keep the steps sorted by time.  Steps with the same time stay in the order that
+        // they were given.  Scenarios are short, so an insertion sort is fine.
+        for (i = scenario->num_steps; i > 0; i--) {
+            if (scenario->steps[i - 1].at_ms <= step.at_ms)
+                break;
+        }
+        for (j = scenario->num_steps; j > i; j--) {
+            scenario->steps[j] = scenario->steps[j - 1];
+        }
+        scenario->steps[i] = step;
+        scenario->num_steps++;
+    }
+    if (token != JSON_TOKEN_END_ARRAY) {
+        if (token != JSON_TOKEN_ERROR) {
+            INFO("%s: step %d was not an object.\n", __func__, scenario->num_steps);
+        }
+        return -EIO;
+    }
+    return 0;
+}
+
+int scenario_parse(const char *str, size_t len, struct scenario **out)
+{
+    struct json_reader r;
+    enum json_token token;
+    struct scenario *scenario = NULL;
+    int ret = -EIO, seen_scenario = 0;
+
+    json_reader_init(&r, str, len);
+    if (json_reader_next(&r) != JSON_TOKEN_BEGIN_OBJECT) {
+        INFO("%s: the root of the control JSON was not an object.\n", __func__);
+        goto error;
+    }
+    while ((token = json_reader_next(&r)) == JSON_TOKEN_KEY) {
+        if (strcmp(r.str, "scenario") != 0) {
+            if (json_reader_skip(&r, json_reader_next(&r)) < 0)
+                goto error;
+            continue;
+        }
+        if (seen_scenario) {
+            INFO("%s: \"scenario\" appears more than once.\n", __func__);
+            goto error;
+        }
+        seen_scenario = 1;
+        token = json_reader_next(&r);
+        if (token == JSON_TOKEN_NULL) {
+            continue;
+        }
+        if (token != JSON_TOKEN_BEGIN_OBJECT) {
+            INFO("%s: \"scenario\" was not an object.\n", __func__);
+            goto error;
+        }
+        scenario = calloc(1, sizeof(*scenario));
+        if (!scenario) {
+            ret = -ENOMEM;
+            goto error;
+        }
+        while ((token = json_reader_next(&r)) == JSON_TOKEN_KEY) {
+            if (strcmp(r.str, "steps") != 0) {
+                if (json_reader_skip(&r, json_reader_next(&r)) < 0)
+                    goto error;
+                continue;
+            }
+            if (json_reader_next(&r) != JSON_TOKEN_BEGIN_ARRAY) {
+                INFO("%s: \"steps\" was not an array.\n", __func__);
+                goto error;
+            }
+            ret = scenario_parse_steps(&r, scenario);
+            if (ret < 0)
+                goto error;
+            ret = -EIO;
+        }
+        if (token != JSON_TOKEN_END_OBJECT)
+            goto error;
+    }
+    if ((token != JSON_TOKEN_END_OBJECT) || (json_reader_next(&r) != JSON_TOKEN_END)) {
+        goto error;
+    }
+    if (!seen_scenario) {
+        INFO("%s: the control JSON does not contain a scenario.\n", __func__);
+        goto error;
+    }
+    json_reader_free(&r);
+    *out = scenario;
+    return 0;
+
+error:
+    if (r.error[0]) {
+        INFO("%s: failed to parse input string of length %zd: %s\n", __func__, len,
+             r.error);
+    }
+    json_reader_free(&r);
+    scenario_free(scenario);
+    return ret;
+}
+
+static void *scenario_thread_run(void *arg)
+{
+    struct scenario_thread *thread = (struct scenario_thread *)arg;
+    struct scenario *scenario = NULL;
+    struct scenario_step *step;
+    struct timespec start, deadline, now;
+    int next = 0, ret;
+
+    INFO("scenario_thread: starting.\n");
+    pthread_mutex_lock(&thread->lock);
+    while (thread->should_run) {
+        if (thread->has_pending) {
+            if (scenario && (next < scenario->num_steps)) {
+                INFO("scenario_thread: cancelling the current scenario with %d of %d "
+                     "step(s) left.\n", scenario->num_steps - next, scenario->num_steps);
+            }
+            scenario_free(scenario);
+            scenario = thread->pending;
+            start = thread->pending_start;
+            thread->pending = NULL;
+            thread->has_pending = 0;
+            next = 0;
+            if (scenario) {
+                INFO("scenario_thread: starting a scenario with %d step(s).\n",
+                     scenario->num_steps);
+            }
+        }
+        if ((!scenario) || (next >= scenario->num_steps)) {
+            scenario_free(scenario);
+            scenario = NULL;
+            pthread_cond_wait(&thread->cond, &thread->lock);
+            continue;
+        }
+        step = &scenario->steps[next];
+        deadline = start;
+        timespec_add_ms(&deadline, step->at_ms);
+        if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+            abort();
+        }
+        if ((now.tv_sec < deadline.tv_sec) ||
+                ((now.tv_sec == deadline.tv_sec) && (now.tv_nsec < deadline.tv_nsec))) {
+            // We check again after waking up, since we may have been woken up early by a
+            // new scenario, or by a request to stop.
+            pthread_cond_timedwait(&thread->cond, &thread->lock, &deadline);
+            continue;
+        }
+        next++;
+        // The scenario is only ever freed by this thread, so the step stays valid while
+        // we apply it without the lock.
+        pthread_mutex_unlock(&thread->lock);
+        ret = thread->apply(thread->arg, step->json);
+        if (ret < 0) {
+            INFO("scenario_thread: failed to apply step %d at %" PRIu64 " ms: "
+                 "error %d (%s)\n", next - 1, step->at_ms, -ret, safe_strerror(-ret));
+        } else {
+            DEBUG("scenario_thread: applied step %d at %" PRIu64 " ms, %" PRIu64
+                  " ms late.\n", next - 1, step->at_ms,
+                  timespec_to_ms(&now) - timespec_to_ms(&deadline));
+        }
+        pthread_mutex_lock(&thread->lock);
+    }
+    pthread_mutex_unlock(&thread->lock);
+    scenario_free(scenario);
+    INFO("scenario_thread: exiting.\n");
+    return NULL;
+}
+
+struct scenario_thread *scenario_thread_start(scenario_apply_fn_t apply, void *arg)
+{
+    struct scenario_thread *thread = NULL;
+    pthread_condattr_t attr;
+    int ret;
+
+    thread = calloc(sizeof(struct scenario_thread), 1);
+    if (!thread) {
+        INFO("scenario_thread_start: OOM\n");
+        goto error;
+    }
+    thread->should_run = 1;
+    thread->apply = apply;
+    thread->arg = arg;
+    ret = pthread_mutex_init(&thread->lock, NULL);
+    if (ret) {
+        INFO("scenario_thread_start: failed to create lock: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error;
+    }
+    ret = pthread_condattr_init(&attr);
+    if (ret) {
+        INFO("scenario_thread_start: failed to create condattr: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_mutex_destroy;
+    }
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (ret) {
+        INFO("scenario_thread_start: failed to set cond clock: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_condattr_destroy;
+    }
+    ret = pthread_cond_init(&thread->cond, &attr);
+    if (ret) {
+        INFO("scenario_thread_start: failed to create cond: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_condattr_destroy;
+    }
+    ret = pthread_create(&thread->pthread, NULL, scenario_thread_run, thread);
+    if (ret) {
+        INFO("scenario_thread_start: failed to create thread: %s (%d)\n",
+             safe_strerror(ret), ret);
+        goto error_cond_destroy;
+    }
+    pthread_condattr_destroy(&attr);
+    return thread;
+
+error_cond_destroy:
+    pthread_cond_destroy(&thread->cond);
+error_condattr_destroy:
+    pthread_condattr_destroy(&attr);
+error_mutex_destroy:
+    pthread_mutex_destroy(&thread->lock);
+error:
+    free(thread);
+    return NULL;
+}
+
+void scenario_thread_submit(struct scenario_thread *thread, struct scenario *scenario)
+{
+    struct timespec start;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &start)) {
+        abort();
+    }
+    pthread_mutex_lock(&thread->lock);
+    scenario_free(thread->pending);
+    thread->pending = scenario;
+    thread->pending_start = start;
+    thread->has_pending = 1;
+    pthread_cond_signal(&thread->cond);
+    pthread_mutex_unlock(&thread->lock);
+}
+
+void scenario_thread_join(struct scenario_thread *thread)
+{
+    pthread_mutex_lock(&thread->lock);
+    thread->should_run = 0;
+    pthread_cond_signal(&thread->cond);
+    pthread_mutex_unlock(&thread->lock);
+    pthread_join(thread->pthread, NULL);
+    pthread_cond_destroy(&thread->cond);
+    pthread_mutex_destroy(&thread->lock);
+    scenario_free(thread->pending);
+    free(thread);
+}
+
+// vim: ts=4:sw=4:tw=99:et
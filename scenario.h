@@ -0,0 +1,137 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_SCENARIO_H
+#define KIBOSH_SCENARIO_H
+
+#include <stdint.h> // for uint64_t
+#include <unistd.h> // for size_t
+
+/*
+ * Kibosh scenarios.
+ *
+ * A scenario is a timeline of changes to the faults, which Kibosh applies by itself at the
+ * right times.  For example:
+ *
+ *   {"scenario":{"steps":[
+ *       {"at_ms":0, "faults":[{"type":"write_delay", "prefix":"", "delay_ms":100,
+ *                   "fraction":1.0}]},
+ *       {"at_ms":30000, "ops":[{"op":"add", "fault":{"type":"unwritable", ...}}]},
+ *       {"at_ms":45000, "faults":[]}]}}
+ *
+ * Each step has a time, in milliseconds since the scenario was submitted, and either a
+ * full set of faults or a list of incremental operations.  A step with a full set of
+ * faults may also have "compose":true.  Steps are applied in order of time, and steps with
+ * the same time are applied in the order that they were given.
+ *
+ * Submitting a new scenario cancels the old one.  {"scenario":null} cancels the current
+ * scenario without starting a new one.  Faults which were put in place by a cancelled
+ * scenario stay in place.
+ */
+
+/**
+ * One step in a scenario.
+ */
+struct scenario_step {
+    /**
+     * The time to apply this step, in milliseconds since the scenario was submitted.
+     */
+    uint64_t at_ms;
+
+    /**
+     * The control JSON to apply: {"faults":[...]} or {"ops":[...]}.
+     */
+    char *json;
+};
+
+struct scenario {
+    /**
+     * The number of steps.
+     */
+    int num_steps;
+
+    /**
+     * The steps, sorted by time.
+     */
+    struct scenario_step *steps;
+};
+
+/**
+ * A function which applies a step of a scenario.
+ *
+ * @param arg       The argument given to scenario_thread_start.
+ * @param json      The control JSON of the step.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+typedef int (*scenario_apply_fn_t)(void *arg, const char *json);
+
+struct scenario_thread;
+
+/**
+ * Parse a control JSON document which contains a scenario.
+ *
+ * Steps which contain a full set of faults are checked here, so that a bad step is
+ * reported when the scenario is submitted rather than when the step is reached.
+ * Incremental operations depend on the faults which are in place when they are applied, so
+ * they can only be checked then.
+ *
+ * @param str       The document.
+ * @param len       The length of the document.
+ * @param out       (out param) the new dynamically allocated scenario, or NULL if the
+ *                  document cancels the current scenario.
+ *
+ * @return          0 on success; a negative error code otherwise.
+ */
+int scenario_parse(const char *str, size_t len, struct scenario **out);
+
+/**
+ * Free a scenario.
+ *
+ * @param scenario  The scenario, or NULL.
+ */
+void scenario_free(struct scenario *scenario);
+
+/**
+ * Create and start the scenario thread.
+ *
+ * @param apply     The function to call to apply each step.  This is not called with any
+ *                  scenario thread locks held.
+ * @param arg       The argument to pass to the apply function.
+ *
+ * @return          The thread on success; NULL otherwise.
+ */
+struct scenario_thread *scenario_thread_start(scenario_apply_fn_t apply, void *arg);
+
+/**
+ * Submit a scenario to the scenario thread, cancelling any scenario which is in progress.
+ *
+ * @param thread    The thread.
+ * @param scenario  The scenario to run, or NULL to just cancel the current one.  We take
+ *                  ownership of this.
+ */
+void scenario_thread_submit(struct scenario_thread *thread, struct scenario *scenario);
+
+/**
+ * Stop and join the scenario thread.  Any scenario in progress is cancelled.
+ *
+ * @param thread    The thread.
+ */
+void scenario_thread_join(struct scenario_thread *thread);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
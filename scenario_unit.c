@@ -0,0 +1,192 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "scenario.h"
+#include "test.h"
+#include "time.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_APPLIED 8
+
+struct applied {
+    pthread_mutex_t lock;
+    struct timespec start;
+    int num;
+    char *json[MAX_APPLIED];
+    uint64_t elapsed_ms[MAX_APPLIED];
+};
+
+static int record_step(void *arg, const char *json)
+{
+    struct applied *applied = (struct applied *)arg;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&applied->lock);
+    if (applied->num < MAX_APPLIED) {
+        applied->json[applied->num] = strdup(json);
+        applied->elapsed_ms[applied->num] = timespec_to_ms(&now) -
+            timespec_to_ms(&applied->start);
+        applied->num++;
+    }
+    pthread_mutex_unlock(&applied->lock);
+    return 0;
+}
+
+static int test_scenario_parse(void)
+{
+    const char *str = "{\"scenario\":{\"steps\":["
+        "{\"at_ms\":45000, \"faults\":[]}, "
+        "{\"faults\":[{\"type\":\"write_delay\", \"prefix\":\"\", \"delay_ms\":100, "
+            "\"fraction\":1.0}], \"at_ms\":0}, "
+        "{\"at_ms\":30000, \"ops\":[{\"op\":\"remove\", \"id\":\"a\"}]}, "
+        "{\"at_ms\":30000, \"ops\":[ ]}, "
+        "{\"compose\":true, \"at_ms\":60000, \"faults\":[]}]}}";
+    struct scenario *scenario = NULL;
+
+    EXPECT_INT_ZERO(scenario_parse(str, strlen(str), &scenario));
+    EXPECT_NONNULL(scenario);
+    EXPECT_INT_EQ(5, scenario->num_steps);
+    EXPECT_INT_EQ(0, scenario->steps[0].at_ms);
+    EXPECT_STR_EQ("{\"faults\":[{\"type\":\"write_delay\", \"prefix\":\"\", "
+                  "\"delay_ms\":100, \"fraction\":1.0}]}", scenario->steps[0].json);
+    EXPECT_INT_EQ(30000, scenario->steps[1].at_ms);
+    EXPECT_STR_EQ("{\"ops\":[{\"op\":\"remove\", \"id\":\"a\"}]}",
+                  scenario->steps[1].json);
+    EXPECT_INT_EQ(30000, scenario->steps[2].at_ms);
+    EXPECT_STR_EQ("{\"ops\":[ ]}", scenario->steps[2].json);
+    EXPECT_INT_EQ(45000, scenario->steps[3].at_ms);
+    EXPECT_STR_EQ("{\"faults\":[]}", scenario->steps[3].json);
+    EXPECT_INT_EQ(60000, scenario->steps[4].at_ms);
+    EXPECT_STR_EQ("{\"faults\":[], \"compose\":true}", scenario->steps[4].json);
+    scenario_free(scenario);
+
+    scenario = (struct scenario *)1;
+    EXPECT_INT_ZERO(scenario_parse("{\"scenario\":null}", 17, &scenario));
+    EXPECT_NULL(scenario);
+    return 0;
+}
+
+static int test_scenario_parse_invalid(void)
+{
+    static const char * const strs[] = {
+        "{\"faults\":[]}",
+        "{\"scenario\":[]}",
+        "{\"scenario\":{\"steps\":[{\"faults\":[]}]}}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":-1, \"faults\":[]}]}}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":0}]}}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":0, \"faults\":[], \"ops\":[]}]}}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":0, \"faults\":[{\"type\":\"bogus\"}]}]}}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":0, \"faults\":[]}]}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":0, \"ops\":[], \"compose\":true}]}}",
+        "{\"scenario\":{\"steps\":[{\"at_ms\":0, \"faults\":[], \"compose\":1}]}}",
+        NULL,
+    };
+    struct scenario *scenario = NULL;
+    int i;
+
+    for (i = 0; strs[i]; i++) {
+        EXPECT_INT_EQ(-EIO, scenario_parse(strs[i], strlen(strs[i]), &scenario));
+        EXPECT_NULL(scenario);
+    }
+    return 0;
+}
+
+static int test_scenario_thread_applies_steps_in_order(void)
+{
+    const char *str = "{\"scenario\":{\"steps\":["
+        "{\"at_ms\":100, \"faults\":[]}, "
+        "{\"at_ms\":0, \"ops\":[]}, "
+        "{\"at_ms\":50, \"faults\":[{\"type\":\"unreadable\", \"code\":5}]}]}}";
+    struct applied applied;
+    struct scenario_thread *thread;
+    struct scenario *scenario = NULL;
+    int i, num;
+
+    memset(&applied, 0, sizeof(applied));
+    EXPECT_INT_ZERO(pthread_mutex_init(&applied.lock, NULL));
+    thread = scenario_thread_start(record_step, &applied);
+    EXPECT_NONNULL(thread);
+    EXPECT_INT_ZERO(scenario_parse(str, strlen(str), &scenario));
+    clock_gettime(CLOCK_MONOTONIC, &applied.start);
+    scenario_thread_submit(thread, scenario);
+    do {
+        milli_sleep(1);
+        pthread_mutex_lock(&applied.lock);
+        num = applied.num;
+        pthread_mutex_unlock(&applied.lock);
+    } while (num < 3);
+    scenario_thread_join(thread);
+    EXPECT_INT_EQ(3, applied.num);
+    EXPECT_STR_EQ("{\"ops\":[]}", applied.json[0]);
+    EXPECT_STR_EQ("{\"faults\":[{\"type\":\"unreadable\", \"code\":5}]}", applied.json[1]);
+    EXPECT_INT_GE(applied.elapsed_ms[1], 50);
+    EXPECT_STR_EQ("{\"faults\":[]}", applied.json[2]);
+    EXPECT_INT_GE(applied.elapsed_ms[2], 100);
+    for (i = 0; i < applied.num; i++) {
+        free(applied.json[i]);
+    }
+    pthread_mutex_destroy(&applied.lock);
+    return 0;
+}
+
+static int test_scenario_thread_cancel(void)
+{
+    const char *str = "{\"scenario\":{\"steps\":["
+        "{\"at_ms\":0, \"faults\":[]}, "
+        "{\"at_ms\":3600000, \"ops\":[]}]}}";
+    struct applied applied;
+    struct scenario_thread *thread;
+    struct scenario *scenario = NULL;
+    int num;
+
+    memset(&applied, 0, sizeof(applied));
+    EXPECT_INT_ZERO(pthread_mutex_init(&applied.lock, NULL));
+    thread = scenario_thread_start(record_step, &applied);
+    EXPECT_NONNULL(thread);
+    EXPECT_INT_ZERO(scenario_parse(str, strlen(str), &scenario));
+    scenario_thread_submit(thread, scenario);
+    do {
+        milli_sleep(1);
+        pthread_mutex_lock(&applied.lock);
+        num = applied.num;
+        pthread_mutex_unlock(&applied.lock);
+    } while (num < 1);
+    scenario_thread_submit(thread, NULL);
+    // Joining must not wait for the step which is an hour away.
+    scenario_thread_join(thread);
+    EXPECT_INT_EQ(1, applied.num);
+    EXPECT_STR_EQ("{\"faults\":[]}", applied.json[0]);
+    free(applied.json[0]);
+    pthread_mutex_destroy(&applied.lock);
+    return 0;
+}
+
+int main(void)
+{
+    EXPECT_INT_ZERO(test_scenario_parse());
+    EXPECT_INT_ZERO(test_scenario_parse_invalid());
+    EXPECT_INT_ZERO(test_scenario_thread_applies_steps_in_order());
+    EXPECT_INT_ZERO(test_scenario_thread_cancel());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
@@ -0,0 +1,475 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "log.h"
+#include "stale.h"
+#include "time.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * The number of buckets in the file hash table.  Must be a power of 2.
+ */
+#define STALE_BUCKETS 1024
+
+/**
+ * The old contents of a range of a file.
+ */
+struct stale_entry {
+    /**
+     * The file which this is the old contents of.
+     */
+    struct stale_file *file;
+
+    /**
+     * The offset in the file.
+     */
+    off_t offset;
+
+    /**
+     * The number of bytes of data.
+     */
+    size_t len;
+
+    /**
+     * The monotonic time in milliseconds at which reads stop returning this.
+     */
+    uint64_t expires_ms;
+
+    /**
+     * The order in which entries were added.  Where pre-images overlap, the one which
+     * was added first wins.
+     */
+    uint64_t seq;
+
+    /**
+     * The data.
+     */
+    char *data;
+
+    /**
+     * The neighbors of this entry in the list of all entries.
+     */
+    struct stale_entry *prev;
+    struct stale_entry *next;
+};
+
+/**
+ * The entries of a file.
+ */
+struct stale_file {
+    uint64_t dev;
+    uint64_t ino;
+
+    /**
+     * The next file in the hash bucket.
+     */
+    struct stale_file *hash_next;
+
+    /**
+     * The entries, sorted by offset, and then by seq.  The entries in use are
+     * ents[start] to ents[start + num - 1].  Entries usually expire from the front,
+     * which then only moves start.
+     */
+    struct stale_entry **ents;
+    int start;
+    int num;
+    int cap;
+
+    /**
+     * The length of the longest entry the file has had.  No entry which starts more than
+     * this before a range can overlap it.
+     */
+    size_t max_len;
+};
+
+struct kibosh_stale {
+    /**
+     * The lock which protects everything else.
+     */
+    pthread_mutex_t lock;
+
+    /**
+     * The number of bytes of data kept.  Only changed while holding the lock, but read
+     * without it to skip the lock when nothing is kept.
+     */
+    uint64_t bytes;
+
+    /**
+     * The maximum number of bytes of data kept.  Immutable.
+     */
+    uint64_t max_bytes;
+
+    /**
+     * The seq of the next entry.
+     */
+    uint64_t next_seq;
+
+    /**
+     * All of the entries, sorted by when they expire, soonest first.
+     */
+    struct stale_entry *first;
+    struct stale_entry *last;
+
+    /**
+     * The entries which a read overlaps, sorted newest first.  Kept around between reads.
+     */
+    struct stale_entry **scratch;
+    int scratch_cap;
+
+    /**
+     * The file hash table.
+     */
+    struct stale_file *buckets[STALE_BUCKETS];
+};
+
+static struct stale_file **stale_bucket(struct kibosh_stale *st, uint64_t dev,
+                                        uint64_t ino)
+{
+    return &st->buckets[((dev * 31) + ino) & (STALE_BUCKETS - 1)];
+}
+
+static struct stale_file *stale_file_find(struct kibosh_stale *st, uint64_t dev,
+                                          uint64_t ino)
+{
+    struct stale_file *sf;
+
+    for (sf = *stale_bucket(st, dev, ino); sf; sf = sf->hash_next) {
+        if ((sf->dev == dev) && (sf->ino == ino)) {
+            return sf;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Find the entries of a file, creating them if there are none.
+ *
+ * @return          The entries, or NULL on OOM.
+ */
+static struct stale_file *stale_file_get(struct kibosh_stale *st, uint64_t dev,
+                                         uint64_t ino)
+{
+    struct stale_file *sf, **bucket;
+
+    sf = stale_file_find(st, dev, ino);
+    if (sf) {
+        return sf;
+    }
+    sf = calloc(1, sizeof(*sf));
+    if (!sf) {
+        return NULL;
+    }
+    sf->dev = dev;
+    sf->ino = ino;
+    bucket = stale_bucket(st, dev, ino);
+    sf->hash_next = *bucket;
+    *bucket = sf;
+    return sf;
+}
+
+static void stale_file_free(struct kibosh_stale *st, struct stale_file *sf)
+{
+    struct stale_file **prev;
+
+    for (prev = stale_bucket(st, sf->dev, sf->ino); *prev != sf;
+            prev = &(*prev)->hash_next) {
+    }
+    *prev = sf->hash_next;
+    free(sf->ents);
+    free(sf);
+}
+
+/**
+ * Find the first entry of a file which starts after an offset.
+ *
+ * @return          The index of the entry, counting from start, or sf->num if there is
+ *                  none.
+ */
+static int stale_file_find_after(const struct stale_file *sf, off_t offset)
+{
+    int lo = 0, hi = sf->num, mid;
+
+    while (lo < hi) {
+        mid = lo + ((hi - lo) / 2);
+        if (sf->ents[sf->start + mid]->offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Add an entry to a file, after any others which start at the same offset.
+ *
+ * @return          0 on success; -ENOMEM on OOM.
+ */
+static int stale_file_insert(struct stale_file *sf, struct stale_entry *e)
+{
+    struct stale_entry **ents;
+    int idx, cap;
+
+    if (sf->start + sf->num == sf->cap) {
+        if (sf->start > 0) {
+            memmove(sf->ents, sf->ents + sf->start, sf->num * sizeof(*sf->ents));
+            sf->start = 0;
+        } else {
+            cap = sf->cap ? sf->cap * 2 : 8;
+            ents = realloc(sf->ents, cap * sizeof(*ents));
+            if (!ents) {
+                return -ENOMEM;
+            }
+            sf->ents = ents;
+            sf->cap = cap;
+        }
+    }
+    idx = sf->start + stale_file_find_after(sf, e->offset);
+    memmove(sf->ents + idx + 1, sf->ents + idx,
+            (sf->start + sf->num - idx) * sizeof(*sf->ents));
+    sf->ents[idx] = e;
+    sf->num++;
+    if (e->len > sf->max_len) {
+        sf->max_len = e->len;
+    }
+    e->file = sf;
+    return 0;
+}
+
+/**
+ * Remove an entry from its file, and free the file if it has no entries left.
+ */
+static void stale_file_remove(struct kibosh_stale *st, struct stale_entry *e)
+{
+    struct stale_file *sf = e->file;
+    int idx;
+
+    // Entries which start at the same offset are sorted by seq.
+    idx = sf->start + stale_file_find_after(sf, e->offset - 1);
+    while (sf->ents[idx] != e) {
+        idx++;
+    }
+    if (idx == sf->start) {
+        sf->start++;
+    } else {
+        memmove(sf->ents + idx, sf->ents + idx + 1,
+                (sf->start + sf->num - idx - 1) * sizeof(*sf->ents));
+    }
+    sf->num--;
+    if (sf->num == 0) {
+        stale_file_free(st, sf);
+    }
+}
+
+/**
+ * Free the entry which expires soonest.
+ */
+static void stale_pop(struct kibosh_stale *st)
+{
+    struct stale_entry *e = st->first;
+
+    stale_file_remove(st, e);
+    st->first = e->next;
+    if (st->first) {
+        st->first->prev = NULL;
+    } else {
+        st->last = NULL;
+    }
+    __atomic_store_n(&st->bytes, st->bytes - e->len, __ATOMIC_RELAXED);
+    free(e->data);
+    free(e);
+}
+
+/**
+ * Free the entries which have expired.
+ */
+static void stale_expire(struct kibosh_stale *st, uint64_t now_ms)
+{
+    while (st->first && (st->first->expires_ms <= now_ms)) {
+        stale_pop(st);
+    }
+}
+
+struct kibosh_stale *stale_alloc(uint64_t max_bytes)
+{
+    struct kibosh_stale *st;
+
+    st = calloc(1, sizeof(*st));
+    if (!st) {
+        return NULL;
+    }
+    if (pthread_mutex_init(&st->lock, NULL)) {
+        free(st);
+        return NULL;
+    }
+    st->max_bytes = max_bytes;
+    return st;
+}
+
+void stale_free(struct kibosh_stale *st)
+{
+    if (!st) {
+        return;
+    }
+    while (st->first) {
+        stale_pop(st);
+    }
+    free(st->scratch);
+    pthread_mutex_destroy(&st->lock);
+    free(st);
+}
+
+uint64_t stale_bytes(const struct kibosh_stale *st)
+{
+    return __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+}
+
+int stale_add(struct kibosh_stale *st, uint64_t dev, uint64_t ino, off_t offset,
+              char *data, size_t len, uint32_t window_ms)
+{
+    struct stale_entry *e, *prev;
+    struct stale_file *sf;
+    uint64_t now_ms;
+
+    if (len > st->max_bytes) {
+        // A pre-image which could never fit is not kept, so reads are fresh.
+        DEBUG("%s: dropping a pre-image of %zd bytes of inode %" PRIu64 ", which is larger "
+              "than the store.\n", __func__, len, ino);
+        free(data);
+        return 0;
+    }
+    if (len == 0) {
+        free(data);
+        return 0;
+    }
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        free(data);
+        return -ENOMEM;
+    }
+    e->offset = offset;
+    e->len = len;
+    now_ms = monotonic_coarse_ms();
+    e->expires_ms = now_ms + window_ms;
+    e->data = data;
+    pthread_mutex_lock(&st->lock);
+    stale_expire(st, now_ms);
+    while (st->first && (st->bytes + len > st->max_bytes)) {
+        DEBUG("%s: the store is full, so dropping a pre-image of inode %" PRIu64 ".\n",
+              __func__, st->first->file->ino);
+        stale_pop(st);
+    }
+    sf = stale_file_get(st, dev, ino);
+    if ((!sf) || (stale_file_insert(sf, e) < 0)) {
+        if (sf && (sf->num == 0)) {
+            stale_file_free(st, sf);
+        }
+        pthread_mutex_unlock(&st->lock);
+        free(data);
+        free(e);
+        return -ENOMEM;
+    }
+    e->seq = st->next_seq++;
+    // Most faults share a window, so the new entry usually goes at the end.
+    for (prev = st->last; prev && (prev->expires_ms > e->expires_ms); prev = prev->prev) {
+    }
+    e->prev = prev;
+    e->next = prev ? prev->next : st->first;
+    if (e->next) {
+        e->next->prev = e;
+    } else {
+        st->last = e;
+    }
+    if (prev) {
+        prev->next = e;
+    } else {
+        st->first = e;
+    }
+    __atomic_store_n(&st->bytes, st->bytes + len, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int stale_entry_compare_newest(const void *a, const void *b)
+{
+    const struct stale_entry *ea = *(struct stale_entry * const *)a;
+    const struct stale_entry *eb = *(struct stale_entry * const *)b;
+
+    return (ea->seq < eb->seq) ? 1 : ((ea->seq > eb->seq) ? -1 : 0);
+}
+
+void stale_read(struct kibosh_stale *st, uint64_t dev, uint64_t ino, char *buf,
+                size_t len, off_t offset)
+{
+    struct stale_file *sf;
+    struct stale_entry *e, **scratch;
+    off_t lo, hi, end = offset + len;
+    uint64_t now_ms;
+    int i, num = 0;
+
+    if (stale_bytes(st) == 0) {
+        return;
+    }
+    now_ms = monotonic_coarse_ms();
+    pthread_mutex_lock(&st->lock);
+    stale_expire(st, now_ms);
+    sf = stale_file_find(st, dev, ino);
+    if (!sf) {
+        goto done;
+    }
+    // Only visit the entries which overlap the range.
+    for (i = sf->start + stale_file_find_after(sf, offset - (off_t)sf->max_len);
+            (i < sf->start + sf->num) && (sf->ents[i]->offset < end); i++) {
+        e = sf->ents[i];
+        if (e->offset + (off_t)e->len <= offset) {
+            continue;
+        }
+        if (num == st->scratch_cap) {
+            scratch = realloc(st->scratch, (num ? num * 2 : 8) * sizeof(*scratch));
+            if (!scratch) {
+                DEBUG("%s: OOM while reading pre-images of inode %" PRIu64 ".\n",
+                      __func__, ino);
+                goto done;
+            }
+            st->scratch = scratch;
+            st->scratch_cap = num ? num * 2 : 8;
+        }
+        st->scratch[num++] = e;
+    }
+    // Where pre-images overlap, the oldest one is copied last and wins.
+    if (num > 1) {
+        qsort(st->scratch, num, sizeof(*st->scratch), stale_entry_compare_newest);
+    }
+    for (i = 0; i < num; i++) {
+        e = st->scratch[i];
+        lo = (e->offset > offset) ? e->offset : offset;
+        hi = e->offset + (off_t)e->len;
+        if (hi > end) {
+            hi = end;
+        }
+        memcpy(buf + (lo - offset), e->data + (lo - e->offset), hi - lo);
+    }
+done:
+    pthread_mutex_unlock(&st->lock);
+}
+
+// vim: ts=4:sw=4:tw=99:et
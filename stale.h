@@ -0,0 +1,101 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#ifndef KIBOSH_STALE_H
+#define KIBOSH_STALE_H
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+#include <sys/types.h> // for off_t
+
+/*
+ * The stale read store.
+ *
+ * Before a write which hits a stale_read fault, the old contents of the range it covers
+ * are kept here, as a pre-image.  Until the fault's window has passed, reads of that range
+ * return the pre-image rather than what was written, like a filesystem which does not
+ * promise read-your-writes.  When a range is written several times within the window,
+ * reads return the contents from before the oldest of those writes.
+ *
+ * Pre-images are kept in a list sorted by when they expire, and are freed from the head
+ * of it once their window has passed, even when faults have different windows.  The store
+ * holds at most a configured number of bytes.  When it is full, the pre-images which would
+ * expire soonest are dropped early, so that reads become fresh again.  Each file's
+ * pre-images are also kept sorted by offset, so that a read only visits the ones which
+ * overlap it.
+ */
+
+struct kibosh_stale;
+
+/**
+ * Allocate a new stale read store.
+ *
+ * @param max_bytes     The maximum number of bytes of pre-images to keep.
+ *
+ * @return              The store, or NULL on OOM.
+ */
+struct kibosh_stale *stale_alloc(uint64_t max_bytes);
+
+/**
+ * Free a stale read store, and every pre-image which it is keeping.
+ *
+ * @param st            The store.
+ */
+void stale_free(struct kibosh_stale *st);
+
+/**
+ * Get the number of bytes of pre-images kept in the store.  This includes pre-images
+ * which have expired, but have not been freed yet.
+ *
+ * @param st            The store.
+ *
+ * @return              The number of bytes.
+ */
+uint64_t stale_bytes(const struct kibosh_stale *st);
+
+/**
+ * Keep a pre-image of a range of a file.
+ *
+ * @param st            The store.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ * @param offset        The offset of the range.
+ * @param data          The old contents of the range.  This must have been malloced.  The
+ *                      store takes ownership of it, even on failure.
+ * @param len           The length of the range.
+ * @param window_ms     How long reads should return the pre-image for, in milliseconds.
+ *
+ * @return              0 on success; a negative error code otherwise.
+ */
+int stale_add(struct kibosh_stale *st, uint64_t dev, uint64_t ino, off_t offset,
+              char *data, size_t len, uint32_t window_ms);
+
+/**
+ * Copy any unexpired pre-images for a range of a file over data which was read.
+ *
+ * @param st            The store.
+ * @param dev           The device of the file.
+ * @param ino           The inode of the file.
+ * @param buf           The data which was read.
+ * @param len           The length of the data.
+ * @param offset        The offset it was read from.
+ */
+void stale_read(struct kibosh_stale *st, uint64_t dev, uint64_t ino, char *buf,
+                size_t len, off_t offset);
+
+#endif
+
+// vim: ts=4:sw=4:tw=99:et
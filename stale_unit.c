@@ -0,0 +1,172 @@
+/**
+ * Copyright 2020 Confluent Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **/
+
+#include "log.h"
+#include "stale.h"
+#include "test.h"
+#include "time.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static int add(struct kibosh_stale *st, uint64_t ino, const char *str, off_t offset,
+               uint32_t window_ms)
+{
+    char *data = strdup(str);
+
+    die_unless(data != NULL);
+    return stale_add(st, 1, ino, offset, data, strlen(str), window_ms);
+}
+
+/**
+ * Read ten bytes of a file whose current contents are "0123456789".
+ */
+static const char *read_file(struct kibosh_stale *st, uint64_t ino, char *buf)
+{
+    strcpy(buf, "0123456789");
+    stale_read(st, 1, ino, buf, strlen(buf), 0);
+    return buf;
+}
+
+static int test_stale_read(void)
+{
+    struct kibosh_stale *st;
+    char buf[16];
+
+    st = stale_alloc(1024 * 1024);
+    EXPECT_NONNULL(st);
+    EXPECT_STR_EQ("0123456789", read_file(st, 2, buf));
+    EXPECT_INT_ZERO(add(st, 2, "abc", 2, 60000));
+    EXPECT_INT_EQ(3, stale_bytes(st));
+    EXPECT_STR_EQ("01abc56789", read_file(st, 2, buf));
+    EXPECT_STR_EQ("0123456789", read_file(st, 3, buf));
+    // Where a range was written twice, reads see the contents from before the first write.
+    EXPECT_INT_ZERO(add(st, 2, "XYZW", 3, 60000));
+    EXPECT_STR_EQ("01abcZW789", read_file(st, 2, buf));
+    // Pre-images which go past the end of the read are clipped.
+    EXPECT_INT_ZERO(add(st, 3, "ABCD", 8, 60000));
+    EXPECT_STR_EQ("01234567AB", read_file(st, 3, buf));
+    // Empty pre-images are not kept.
+    EXPECT_INT_ZERO(add(st, 4, "", 0, 60000));
+    EXPECT_INT_EQ(11, stale_bytes(st));
+    stale_free(st);
+    return 0;
+}
+
+static int test_stale_expire(void)
+{
+    struct kibosh_stale *st;
+    uint64_t deadline;
+    char buf[16];
+
+    st = stale_alloc(1024 * 1024);
+    EXPECT_NONNULL(st);
+    EXPECT_INT_ZERO(add(st, 2, "abc", 0, 60000));
+    EXPECT_INT_ZERO(add(st, 3, "xyz", 0, 1));
+    EXPECT_INT_ZERO(add(st, 2, "def", 5, 1));
+    deadline = monotonic_coarse_ms() + 100;
+    while (monotonic_coarse_ms() < deadline) {
+        milli_sleep(10);
+    }
+    // Expired pre-images are ignored and freed, even behind one with a longer window.
+    EXPECT_STR_EQ("abc3456789", read_file(st, 2, buf));
+    EXPECT_STR_EQ("0123456789", read_file(st, 3, buf));
+    EXPECT_INT_EQ(3, stale_bytes(st));
+    stale_free(st);
+
+    st = stale_alloc(1024 * 1024);
+    EXPECT_NONNULL(st);
+    EXPECT_INT_ZERO(add(st, 2, "abc", 0, 1));
+    EXPECT_INT_ZERO(add(st, 2, "def", 5, 1));
+    deadline = monotonic_coarse_ms() + 100;
+    while (monotonic_coarse_ms() < deadline) {
+        milli_sleep(10);
+    }
+    EXPECT_STR_EQ("0123456789", read_file(st, 2, buf));
+    EXPECT_INT_ZERO(stale_bytes(st));
+    stale_free(st);
+    return 0;
+}
+
+static int test_stale_full(void)
+{
+    struct kibosh_stale *st;
+    char buf[16];
+
+    st = stale_alloc(8);
+    EXPECT_NONNULL(st);
+    EXPECT_INT_ZERO(add(st, 2, "abcde", 0, 60000));
+    // The store is full, so the oldest pre-image is dropped.
+    EXPECT_INT_ZERO(add(st, 3, "vwxyz", 0, 60000));
+    EXPECT_INT_EQ(5, stale_bytes(st));
+    EXPECT_STR_EQ("0123456789", read_file(st, 2, buf));
+    EXPECT_STR_EQ("vwxyz56789", read_file(st, 3, buf));
+    // A pre-image which could never fit is not kept at all.
+    EXPECT_INT_ZERO(add(st, 2, "ABCDEFGHI", 0, 60000));
+    EXPECT_INT_EQ(5, stale_bytes(st));
+    EXPECT_STR_EQ("0123456789", read_file(st, 2, buf));
+    stale_free(st);
+    return 0;
+}
+
+static int test_stale_many(void)
+{
+    struct kibosh_stale *st;
+    uint64_t deadline;
+    char buf[16];
+    int i;
+
+    st = stale_alloc(1024 * 1024);
+    EXPECT_NONNULL(st);
+    // A log which was appended to many times.  Some of the pre-images expire early.
+    for (i = 0; i < 1000; i++) {
+        EXPECT_INT_ZERO(add(st, 2, "abcdefghij", i * 10, (i % 3) ? 60000 : 1));
+    }
+    // A newer pre-image which overlaps two older ones loses to them.
+    EXPECT_INT_ZERO(add(st, 2, "KLMNOPQRST", 5005, 60000));
+    deadline = monotonic_coarse_ms() + 100;
+    while (monotonic_coarse_ms() < deadline) {
+        milli_sleep(10);
+    }
+    strcpy(buf, "0123456789");
+    stale_read(st, 1, 2, buf, strlen(buf), 5000);
+    EXPECT_STR_EQ("abcdefghij", buf);
+    strcpy(buf, "0123456789");
+    // The pre-image at 5010 expired, so the newer one shows through.
+    stale_read(st, 1, 2, buf, strlen(buf), 5005);
+    EXPECT_STR_EQ("fghijPQRST", buf);
+    strcpy(buf, "0123456789");
+    stale_read(st, 1, 2, buf, strlen(buf), 5010);
+    EXPECT_STR_EQ("PQRST56789", buf);
+    strcpy(buf, "0123456789");
+    stale_read(st, 1, 2, buf, strlen(buf), 10000);
+    EXPECT_STR_EQ("0123456789", buf);
+    EXPECT_INT_EQ(6670, stale_bytes(st));
+    stale_free(st);
+    return 0;
+}
+
+int main(void)
+{
+    kibosh_log_init(stdout, 0);
+    EXPECT_INT_ZERO(test_stale_read());
+    EXPECT_INT_ZERO(test_stale_expire());
+    EXPECT_INT_ZERO(test_stale_full());
+    EXPECT_INT_ZERO(test_stale_many());
+    return EXIT_SUCCESS;
+}
+
+// vim: ts=4:sw=4:tw=99:et
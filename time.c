@@ -65,4 +65,24 @@ uint64_t timespec_to_ms(const struct timespec *ts)
     return rval;
 }
 
+uint64_t monotonic_coarse_ms(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC_COARSE, &ts)) {
+        abort();
+    }
+    return timespec_to_ms(&ts);
+}
+
+void timespec_add_ms(struct timespec *ts, uint64_t ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
 // vim: ts=4:sw=4:tw=99:et
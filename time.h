@@ -38,6 +38,24 @@ extern void milli_sleep(uint32_t delay_ms);
  */
 extern uint64_t timespec_to_ms(const struct timespec *ts);
 
+/**
+ * Add a number of milliseconds to a timespec.
+ *
+ * @param ts            The timespec to modify.
+ * @param ms            The number of milliseconds to add.
+ */
+extern void timespec_add_ms(struct timespec *ts, uint64_t ms);
+
+/**
+ * Get the coarse monotonic time in milliseconds.
+ *
+ * This is much cheaper than reading CLOCK_MONOTONIC, but is only accurate to within a few
+ * milliseconds, depending on the kernel's tick rate.
+ *
+ * @return              The time in milliseconds.
+ */
+extern uint64_t monotonic_coarse_ms(void);
+
 #endif
 
 // vim: ts=4:sw=4:tw=99:et
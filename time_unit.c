@@ -40,10 +40,27 @@ static int test_sleep_1_ms(void)
     return 0;
 }
 
+static int test_timespec_add_ms(void)
+{
+    struct timespec ts = { .tv_sec = 1, .tv_nsec = 999000000 };
+
+    timespec_add_ms(&ts, 1);
+    EXPECT_INT_EQ(2, ts.tv_sec);
+    EXPECT_INT_EQ(0, ts.tv_nsec);
+    timespec_add_ms(&ts, 30500);
+    EXPECT_INT_EQ(32, ts.tv_sec);
+    EXPECT_INT_EQ(500000000, ts.tv_nsec);
+    timespec_add_ms(&ts, 600);
+    EXPECT_INT_EQ(33, ts.tv_sec);
+    EXPECT_INT_EQ(100000000, ts.tv_nsec);
+    return 0;
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(test_sleep_0_ms());
     EXPECT_INT_ZERO(test_sleep_1_ms());
+    EXPECT_INT_ZERO(test_timespec_add_ms());
     return EXIT_SUCCESS;
 }
 
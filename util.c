@@ -19,6 +19,7 @@
 #include "log.h"
 #include "util.h"
 
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -327,4 +328,48 @@ int memfd_create(const char *name, int mode)
 #endif
 }
 
+static int parse_cpu_number(const char **str, long *out)
+{
+    char *end;
+
+    if (!isdigit(**str)) {
+        return -EINVAL;
+    }
+    errno = 0;
+    *out = strtol(*str, &end, 10);
+    if (errno || *out >= CPU_SETSIZE) {
+        return -EINVAL;
+    }
+    *str = end;
+    return 0;
+}
+
+int parse_cpu_list(const char *str, cpu_set_t *set)
+{
+    long lo, hi, i;
+
+    CPU_ZERO(set);
+    while (1) {
+        if (parse_cpu_number(&str, &lo)) {
+            return -EINVAL;
+        }
+        hi = lo;
+        if (*str == '-') {
+            str++;
+            if (parse_cpu_number(&str, &hi) || hi < lo) {
+                return -EINVAL;
+            }
+        }
+        for (i = lo; i <= hi; i++) {
+            CPU_SET(i, set);
+        }
+        if (*str == '\0') {
+            return 0;
+        } else if (*str != ',') {
+            return -EINVAL;
+        }
+        str++;
+    }
+}
+
 // vim: ts=4:sw=4:tw=99:et
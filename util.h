@@ -18,6 +18,7 @@
 #define KIBOSH_UTIL_H
 
 #include "json.h" // for json_value
+#include <sched.h> // for cpu_set_t
 #include <unistd.h> // for size_t
 
 /**
@@ -112,6 +113,16 @@ int recursive_unlink(const char *name);
  */
 int memfd_create(const char *name, int mode);
 
+/**
+ * Parse a list of CPUs, such as "0-3,8,10-11".
+ *
+ * @param str           The string to parse.
+ * @param set           (out param) The CPU set.
+ *
+ * @return              0 on success; -EINVAL if the string could not be parsed.
+ */
+int parse_cpu_list(const char *str, cpu_set_t *set);
+
 #ifdef __GNUC__
 #define UNUSED __attribute__((__unused__))
 #else
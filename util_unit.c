@@ -50,9 +50,31 @@ static int test_snappend(void)
     return 0;
 }
 
+static int test_parse_cpu_list(void)
+{
+    cpu_set_t set;
+
+    EXPECT_INT_ZERO(parse_cpu_list("3", &set));
+    EXPECT_INT_EQ(1, CPU_COUNT(&set));
+    EXPECT_INT_NONZERO(CPU_ISSET(3, &set));
+    EXPECT_INT_ZERO(parse_cpu_list("0-3,8,10-11", &set));
+    EXPECT_INT_EQ(7, CPU_COUNT(&set));
+    EXPECT_INT_NONZERO(CPU_ISSET(2, &set));
+    EXPECT_INT_NONZERO(CPU_ISSET(8, &set));
+    EXPECT_INT_ZERO(CPU_ISSET(9, &set));
+    EXPECT_INT_NONZERO(CPU_ISSET(11, &set));
+    EXPECT_INT_EQ(-EINVAL, parse_cpu_list("", &set));
+    EXPECT_INT_EQ(-EINVAL, parse_cpu_list("1,", &set));
+    EXPECT_INT_EQ(-EINVAL, parse_cpu_list("4-2", &set));
+    EXPECT_INT_EQ(-EINVAL, parse_cpu_list("1;2", &set));
+    EXPECT_INT_EQ(-EINVAL, parse_cpu_list("99999", &set));
+    return 0;
+}
+
 int main(void)
 {
     EXPECT_INT_ZERO(test_snappend());
+    EXPECT_INT_ZERO(test_parse_cpu_list());
 
     return EXIT_SUCCESS;
 }